@@ -33,9 +33,13 @@ proc startstop {but} {
     }
     switch -glob -- [v4l2 state $dev] {
 	capture {
-	    v4l2 stop $dev
+	    v4l2 pause $dev
 	    $but configure -text "Start"
 	}
+	paused {
+	    v4l2 resume $dev
+	    $but configure -text "Stop"
+	}
 	* {
 	    v4l2 start $dev
 	    $but configure -text "Stop"
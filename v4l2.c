@@ -11,6 +11,7 @@
  */
 
 #include <tk.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <ctype.h>
@@ -18,12 +19,25 @@
 #include <sched.h>
 #include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/utsname.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef linux
+#include <sys/inotify.h>
+#endif
 #if defined(__OpenBSD__)
 #include <sys/videoio.h>
 #else
@@ -39,6 +53,9 @@
 #define V4L2_MJPEG_FAILED ((unsigned char *) -1)
 #endif
 
+/* Default quality of JPEG compression. */
+#define JPEG_QUALITY 85
+
 /*
  * Missing stuff, depending on linux/videodev2.h
  */
@@ -53,6 +70,15 @@
 #define V4L2_PIX_FMT_Y16 v4l2_fourcc('Y', '1', '6', ' ')
 #endif
 #endif
+#ifndef V4L2_PIX_FMT_H264
+#define V4L2_PIX_FMT_H264 v4l2_fourcc('H', '2', '6', '4')
+#endif
+#ifndef V4L2_BUF_FLAG_KEYFRAME
+#define V4L2_BUF_FLAG_KEYFRAME 0x00000008
+#endif
+#ifndef V4L2_FMT_FLAG_EMULATED
+#define V4L2_FMT_FLAG_EMULATED 0x0002
+#endif
 
 /*
  * V4L2 frame buffer.
@@ -71,15 +97,44 @@ typedef struct {
     struct v4l2_queryctrl qry;	/* Filled from ioctl(). */
     int useOld;			/* Use old ioctl()s if positive. */
     Tcl_DString ds;		/* For menu choices. */
+    int saved;			/* True when value set by user. */
+    Tcl_WideInt value;		/* Last value set, for reattach. */
 } VCTRL;
 
 /*
- * Control structure for camera capture.
+ * Per frame data from UVC metadata node, see struct uvc_meta_buf
+ * in linux/uvcvideo.h and the UVC payload header.
  */
 
 typedef struct {
+    int valid;			/* True when filled in. */
+    unsigned int sequence;	/* Frame sequence number. */
+    Tcl_WideInt ns;		/* Host time of first packet (monotonic). */
+    int sof;			/* USB frame number of first packet. */
+    int hasPts, hasScr;		/* Presence of PTS and SCR. */
+    unsigned int pts;		/* Device clock at start of exposure. */
+    unsigned int stc;		/* Device clock at SCR sampling. */
+    int scrSof;			/* USB frame number at SCR sampling. */
+} VMETA;
+
+typedef struct VPACE VPACE;
+typedef struct VKEY VKEY;
+typedef struct VOVL VOVL;
+typedef struct VREC VREC;
+typedef struct VY4MW VY4MW;
+typedef struct VAVIW VAVIW;
+typedef struct VVLZW VVLZW;
+typedef struct VHTTP VHTTP;
+struct VJPEG;
+
+/*
+ * Control structure for camera capture.
+ */
+
+typedef struct V4L2C {
     int running;		/* Greater than zero when acquiring. */
     int stalled;		/* True when stalled in file handler. */
+    int paused;			/* True when capture is paused. */
     int format;			/* Pixel format for capture. */
     int wantFormat;		/* Requested pixel format for capture. */
     int greyshift;		/* Bit shift for grey images. */
@@ -103,29 +158,565 @@ typedef struct {
     VCTRL fsize;		/* Special control: "frame-size". */
     VCTRL frate;		/* Special control: "frame-rate". */
     Tcl_WideInt counters[2];	/* Statistic counters. */
+    double idleTime;		/* Idle timeout in seconds or zero. */
+    int idleFps;		/* Frame rate when idle, zero: stream off. */
+    int idle;			/* True when suspended due to idle. */
+    int activeFps;		/* Frame rate to restore after idle. */
+    Tcl_Time lastFetch;		/* Time of last image retrieval. */
+    int waking;			/* True when resumed from idle and first
+				 * frame is still awaited. */
+    int snapshot;		/* True when asynchronous snapshot pending. */
+    int snapStop;		/* True when capture stops after snapshot. */
+    int snapPaused;		/* True when capture was paused. */
+    int snapWidth, snapHeight;	/* Frame size to restore after snapshot. */
+    int snapFormat;		/* Pixel format to restore after snapshot. */
+    int snapCount;		/* Frames received since snapshot start. */
+    unsigned int snapFirst;	/* Sequence number of first such frame. */
+    Tcl_Obj *snapCmd;		/* Snapshot callback or NULL. */
+    int reattach;		/* True when reopened after unplug. */
+    int detached;		/* True while device is unplugged. */
+    int wasRunning;		/* Capture state when unplugged,
+				 * 1: capturing, 2: paused. */
+    Tcl_DString devKey;		/* Persistent device identity. */
+    Tcl_TimerToken reattachTimer;	/* Polls for device to reappear. */
+    int reattachDelay;		/* Current polling interval in ms. */
+    int srcEvents;		/* True when source change events are
+				 * subscribed. */
+    Tcl_Obj *evCmd;		/* Source change callback or NULL. */
+    unsigned int rdySeq;	/* Sequence number of last ready frame. */
+    double rdyTime;		/* Kernel timestamp of that frame. */
+    int rdyUsed;		/* Bytes used in that frame's buffer. */
+    int rdyFlags;		/* Buffer flags of that frame. */
+    int bpl;			/* Bytes per line reported by driver. */
+    int metaFd;			/* Metadata node or -1. */
+    Tcl_DString metaName;	/* Name of metadata node. */
+    int metaRunning;		/* True when metadata is streaming. */
+    int metaNbufs;		/* Number of metadata buffers. */
+    VBUF metaBufs[4];		/* Metadata buffers. */
+    int metaHead;		/* Next slot in metaRing. */
+    VMETA metaRing[32];		/* Recent metadata. */
+    int loopStream;		/* Output to loopback device, 1: streaming
+				 * mmap()ed buffers, -1: using write(). */
+    int loopOn;			/* True when output queue streaming. */
+    int loopNbufs;		/* Number of output buffers. */
+    int loopFree;		/* Output buffers not yet queued. */
+    VBUF loopBufs[4];		/* Output buffers. */
+    int loopSpare;		/* Dequeued but unused output buffer,
+				 * index plus one or zero. */
+    VPACE *pace;		/* Paced writer or NULL. */
+    VKEY *key;			/* Chroma key for loopback or NULL. */
+    VOVL *ovl;			/* Overlays for loopback or NULL. */
+    unsigned char *stageBuf;	/* Frame copy for key and overlays. */
+    int stageLen;		/* Size of stageBuf. */
+    VREC *rec;			/* Pre-trigger ring recorder or NULL. */
+    VY4MW *y4m;			/* Y4M file writer or NULL. */
+    VAVIW *avi;			/* AVI file writer or NULL. */
+    VVLZW *vlz;			/* Lossless file writer or NULL. */
+    VHTTP *http;		/* MJPEG over HTTP server or NULL. */
+    struct V4L2C *fwdDst;	/* Loopback device fed from this one. */
+    struct V4L2C *fwdSrc;	/* Device feeding this loopback device. */
+    int fwdRotate;		/* Rotation when forwarding or -1. */
+    int fwdMirror;		/* Mirror flags when forwarding or -1. */
+    Tcl_WideInt fwdFrames;	/* Frames forwarded. */
+    Tcl_WideInt fwdErrors;	/* Frames failed to forward. */
+    struct VJPEG *jpegEnc;	/* JPEG compressor or NULL. */
     int nvbufs;			/* Number of buffers used. */
     VBUF vbufs[16];		/* Frame buffers. */
+    int dmaFds[16];		/* Exported DMABUF fds plus one, 0 when
+				 * not yet tried, -1 when failed. */
+    unsigned int dmaFormat;	/* Format dmaEmulated refers to. */
+    int dmaEmulated;		/* True when libv4l2 emulates format. */
 } V4L2C;
 
 /*
- * Per interpreter control structure.
+ * Paced writer for loopback device. A thread emits the frames
+ * submitted by "v4l2 write" at a fixed rate, repeating the last
+ * frame when none is pending and dropping the oldest one when
+ * the queue is full.
+ */
+
+#define PACE_MAXDEPTH 8
+
+struct VPACE {
+    V4L2C *v4l2c;		/* Loopback device. */
+    Tcl_ThreadId thread;	/* Writer thread. */
+    Tcl_Mutex mutex;		/* Protects following fields. */
+    int stop;			/* True when thread shall terminate. */
+    double fps;			/* Output frame rate. */
+    int size;			/* Size of frame slots. */
+    int depth;			/* Length of queue. */
+    int head, count;		/* Queue head and number of frames. */
+    unsigned char *ring[PACE_MAXDEPTH];	/* Queued frames. */
+    int ringLen[PACE_MAXDEPTH];	/* Lengths of queued frames. */
+    unsigned char *spare;	/* Frame being filled, owned by caller. */
+    unsigned char *last;	/* Frame emitted last, owned by thread. */
+    int lastLen;		/* Its length, zero when none yet. */
+    Tcl_WideInt emitted;	/* Frames written to device. */
+    Tcl_WideInt repeated;	/* Thereof repetitions of last frame. */
+    Tcl_WideInt dropped;	/* Frames dropped due to full queue. */
+    Tcl_WideInt late;		/* Ticks missed by the writer thread. */
+    Tcl_WideInt errors;		/* Failed writes. */
+};
+
+/*
+ * Chroma key of loopback device. Pixels whose chroma is near the
+ * key color are replaced by the background, which is a photo image
+ * converted once or the last frame of a capture device, both in
+ * the output format of the loopback device.
+ */
+
+struct VKEY {
+    int color;			/* Key color as 0xRRGGBB. */
+    int cb, cr;			/* Chroma of key color. */
+    int tol;			/* Chroma distance fully keyed. */
+    int soft;			/* Width of transition, at least 1. */
+    int gain;			/* 2048 / soft for alpha computation. */
+    Tcl_DString bgName;		/* Photo image or device id. */
+    V4L2C *bgSrc;		/* Background device or NULL. */
+    double bgTime;		/* Timestamp of its frame in bg. */
+    int bgValid;		/* True when bg is filled. */
+    unsigned char *bg;		/* Background frame. */
+    int bgLen;			/* Size of bg. */
+};
+
+#define KEY_TOLERANCE	40
+#define KEY_SOFTNESS	20
+
+/*
+ * Overlay of loopback device, e.g. a logo. The photo image is
+ * converted once to the output format with premultiplied alpha
+ * and kept as byte spans of the frame within its bounding box,
+ * so blending is the same for all formats. A span's bytes in
+ * the frame become pre + frame * inv / 255.
+ */
+
+struct VOVL {
+    VOVL *next;			/* Next overlay, drawn later. */
+    Tcl_DString name;		/* Photo image name. */
+    int x, y;			/* Position in frame. */
+    int format;			/* Frame format and size */
+    int width, height;		/* overlay was made for. */
+    int nspans;			/* Number of spans. */
+    int *spanOff;		/* Frame offsets of spans. */
+    int *spanLen;		/* Lengths of spans. */
+    unsigned char *pre;		/* Premultiplied values of all spans. */
+    unsigned char *inv;		/* Inverse alpha of all spans. */
+};
+
+/*
+ * Pre-trigger ring recorder keeping copies of the most recent
+ * frames in native format. Frames are stored back to back in a
+ * circular arena, the oldest ones are dropped when their age
+ * exceeds the time span or their room is needed.
+ */
+
+typedef struct {
+    size_t offset;		/* Offset in arena. */
+    int size;			/* Frame size. */
+    unsigned int sequence;	/* Driver sequence number. */
+    double time;		/* Kernel timestamp. */
+} VRECENT;
+
+struct VREC {
+    double seconds;		/* Time span to keep. */
+    int format;			/* Pixel format and size */
+    int width, height;		/* of recorded frames. */
+    unsigned char *arena;	/* Frame data or NULL. */
+    size_t arenaSize;		/* Allocated size of arena. */
+    size_t arenaMax;		/* Size arena may grow to. */
+    size_t wpos;		/* Next write position in arena. */
+    VRECENT *ents;		/* Circular list of frames. */
+    int maxEnts;		/* Size of ents. */
+    int first, count;		/* Oldest entry and number of entries. */
+    Tcl_WideInt frames;		/* Frames recorded. */
+    Tcl_WideInt dropped;	/* Frames too large for arena. */
+};
+
+#define REC_MAXFPS	120
+#define REC_MAXSIZE	((size_t) 1 << 30)
+
+/*
+ * Index file written by "v4l2 record dump": header followed by
+ * one record per frame, in host byte order, for mmap().
+ */
+
+#define REC_MAGIC	"V4L2IDX1"
+
+typedef struct {
+    char magic[8];		/* REC_MAGIC. */
+    unsigned int fourcc;	/* Pixel format. */
+    unsigned int width, height;	/* Frame size. */
+    unsigned int count;		/* Number of records. */
+} VRECHDR;
+
+typedef struct {
+    unsigned long long offset;	/* Offset in raw file. */
+    unsigned int size;		/* Frame size. */
+    unsigned int sequence;	/* Driver sequence number. */
+    double time;		/* Kernel timestamp. */
+} VRECIDX;
+
+/*
+ * Y4M (YUV4MPEG2) file writer. Frames are converted to planar
+ * YUV in the capture handler into a queue, a thread appends them
+ * to the file, one write per frame. When the queue is full, new
+ * frames are dropped.
+ */
+
+#define Y4M_DEPTH	8
+
+struct VY4MW {
+    int fd;			/* Output file. */
+    Tcl_DString path;		/* Its name. */
+    int format;			/* Pixel format and size */
+    int width, height;		/* of recorded frames. */
+    int chroma;			/* 420, 422, 444, or 0 for mono. */
+    int size;			/* Frame size with "FRAME\n". */
+    Tcl_ThreadId thread;	/* Writer thread. */
+    Tcl_Mutex mutex;		/* Protects following fields. */
+    Tcl_Condition cond;		/* Signalled on new frame or stop. */
+    int threaded;		/* True when thread runs. */
+    int stop;			/* True when thread shall terminate. */
+    int head, count;		/* Queue head and number of frames. */
+    unsigned char *ring[Y4M_DEPTH];	/* Queued frames. */
+    unsigned char *chroma2;	/* Interleaved chroma of YUYV frame. */
+    Tcl_WideInt written;	/* Frames written. */
+    Tcl_WideInt dropped;	/* Frames dropped. */
+    Tcl_WideInt errors;		/* Failed writes. */
+};
+
+/*
+ * Y4M file reader.
+ */
+
+typedef struct {
+    char y4mId[32];		/* Reader id. */
+    int fd;			/* Input file. */
+    int width, height;		/* Frame size. */
+    int chroma;			/* 420, 422, 444, or 0 for mono. */
+    int fpsNum, fpsDen;		/* Frame rate. */
+    off_t data;			/* Offset of first frame. */
+    off_t pos;			/* Offset of next frame. */
+    int size;			/* Frame size without "FRAME\n". */
+    Tcl_WideInt nframes;	/* Frames assuming plain frame headers. */
+    unsigned char *buf;		/* Frame buffer. */
+} VY4MR;
+
+/*
+ * AVI (OpenDML) file writer for MJPEG and H264 frames which are
+ * stored as captured. Like the Y4M writer, frames are copied
+ * into a queue by the capture handler and appended by a thread,
+ * here through a large write buffer. Each RIFF segment is kept
+ * below 1 GiB and gets a standard index (ix00) when it is closed,
+ * the first one an additional idx1 for older players, and then the
+ * header is brought up to date. The super index in the header has
+ * room for AVI_MAXRIFF segments.
+ */
+
+#define AVI_DEPTH	16
+#define AVI_MAXRIFF	1024
+#define AVI_RIFFSIZE	(1 << 30)
+#define AVI_BUFSIZE	(1 << 20)
+#define AVI_HDRSIZE	(244 + 16 * AVI_MAXRIFF + 268 + 12)
+
+typedef struct {
+    unsigned char *data;	/* Frame data. */
+    int size;			/* Its size. */
+    int avail;			/* Allocated size. */
+    int key;			/* True for key frame. */
+} VAVIQ;
+
+struct VAVIW {
+    int fd;			/* Output file. */
+    Tcl_DString path;		/* Its name. */
+    int format;			/* Pixel format and size */
+    int width, height;		/* of recorded frames. */
+    int fps;			/* Nominal frame rate. */
+    Tcl_ThreadId thread;	/* Writer thread. */
+    Tcl_Mutex mutex;		/* Protects following fields. */
+    Tcl_Condition cond;		/* Signalled on new frame or stop. */
+    int threaded;		/* True when thread runs. */
+    int stop;			/* True when thread shall terminate. */
+    int head, count;		/* Queue head and number of frames. */
+    VAVIQ queue[AVI_DEPTH];	/* Queued frames. */
+    Tcl_WideInt written;	/* Frames written. */
+    Tcl_WideInt dropped;	/* Frames dropped. */
+    Tcl_WideInt errors;		/* Failed writes. */
+    /* Following fields are used by the writing thread only. */
+    int broken;			/* True after a failed write. */
+    unsigned char *buf;		/* Write buffer. */
+    int bufLen;			/* Bytes in write buffer. */
+    Tcl_WideInt pos;		/* File position incl. write buffer. */
+    Tcl_WideInt riffPos;	/* Start of current RIFF segment. */
+    Tcl_WideInt moviPos;	/* Start of its "movi" list. */
+    unsigned int riff0Size;	/* Size of first RIFF segment. */
+    unsigned int movi0Size;	/* Size of its "movi" list. */
+    unsigned int *idx;		/* Offset, size pairs of segment. */
+    int nIdx, maxIdx;		/* Used and allocated pairs. */
+    int nRiff;			/* Closed RIFF segments. */
+    struct {
+	Tcl_WideInt offset;	/* Position of ix00 chunk, */
+	unsigned int size;	/* its size, */
+	unsigned int frames;	/* and number of frames. */
+    } super[AVI_MAXRIFF];
+    unsigned int frames0;	/* Frames in first RIFF segment. */
+    unsigned int frames;	/* Total frames. */
+    unsigned int maxSize;	/* Largest frame. */
+};
+
+/*
+ * Lossless (VLZ) file writer for raw frames. Each plane is coded
+ * with the median predictor of LOCO-I; the zigzag mapped residuals
+ * are bit packed in blocks of 16 as one width byte followed by
+ * that many 16 bit planes. The capture handler copies frames into
+ * a queue, worker threads code them in parallel, and the thread
+ * completing the oldest frame appends the frames in order.
+ *
+ * File layout, little endian: "V4L2VLZ1", fourcc, width, height,
+ * frame rate, 8 reserved bytes; then per frame "VLZF", payload
+ * length, sequence number, 4 reserved bytes, timestamp in
+ * microseconds (64 bit), and per plane its length and data.
+ */
+
+#define VLZ_DEPTH	8
+#define VLZ_MAXTHREADS	4
+#define VLZ_HDRSIZE	32
+#define VLZ_FRAMEHDR	24
+
+typedef struct {
+    unsigned char *raw;		/* Captured frame. */
+    unsigned char *tmp;		/* Planes of frame. */
+    unsigned char *enc;		/* Coded frame with header. */
+    int encLen;			/* Its length. */
+    unsigned int sequence;	/* Sequence number and */
+    double time;		/* timestamp of frame. */
+    int done;			/* True when coded. */
+} VVLZQ;
+
+struct VVLZW {
+    int fd;			/* Output file. */
+    Tcl_DString path;		/* Its name. */
+    int format;			/* Pixel format and size */
+    int width, height;		/* of recorded frames. */
+    int rawSize;		/* Size of captured frame. */
+    int nthreads;		/* Number of coding threads. */
+    Tcl_ThreadId threads[VLZ_MAXTHREADS];
+    Tcl_Mutex mutex;		/* Protects following fields. */
+    Tcl_Condition cond;		/* Signalled on new frame or stop. */
+    int stop;			/* True when threads shall terminate. */
+    int head, count;		/* Queue head and number of frames. */
+    int claimed;		/* Frames from head taken for coding. */
+    int writing;		/* True while a thread writes. */
+    int broken;			/* True after a failed write. */
+    VVLZQ queue[VLZ_DEPTH];	/* Queued frames. */
+    Tcl_WideInt written;	/* Frames written. */
+    Tcl_WideInt dropped;	/* Frames dropped. */
+    Tcl_WideInt errors;		/* Failed writes. */
+    Tcl_WideInt bytes;		/* Bytes written. */
+};
+
+/*
+ * Lossless (VLZ) file reader.
+ */
+
+typedef struct {
+    char vlzId[32];		/* Reader id. */
+    int fd;			/* Input file. */
+    int format;			/* Pixel format and size */
+    int width, height;		/* of frames. */
+    int fps;			/* Frame rate. */
+    int rawSize;		/* Size of decoded frame. */
+    int nframes;		/* Number of complete frames. */
+    Tcl_WideInt *offsets;	/* File offsets of frames. */
+    int pos;			/* Next frame to read. */
+    unsigned char *enc;		/* Buffer for coded frame. */
+    int encLen;			/* Its size. */
+    unsigned char *tmp;		/* Planes of frame. */
+} VVLZR;
+
+/*
+ * MJPEG over HTTP server of a capture device. Each frame is
+ * compressed once into a reference counted part shared by all
+ * clients. A client still sending an older part skips the frame,
+ * thus at most one part is pending per client.
+ */
+
+#define HTTP_MAXCLIENTS	32
+#define HTTP_REQSIZE	2048
+#define HTTP_BOUNDARY	"v4l2frame"
+
+typedef struct {
+    int refCount;		/* Clients sending this part. */
+    int length;			/* Size of data. */
+    unsigned char data[1];	/* Part header, JPEG data, and CRLF. */
+} VHTTPP;
+
+typedef struct {
+    VHTTP *http;		/* Server of client. */
+    int fd;			/* Client socket. */
+    int mask;			/* Events of its file handler. */
+    int streaming;		/* True after request was read. */
+    int reqLen;			/* Bytes of request read. */
+    char req[HTTP_REQSIZE];	/* Request. */
+    int hdrOff;			/* Bytes of response header sent. */
+    VHTTPP *part;		/* Part being sent or NULL. */
+    int partOff;		/* Bytes of part sent. */
+} VHTTPC;
+
+struct VHTTP {
+    V4L2C *v4l2c;		/* Capture device. */
+    int fd;			/* Listening socket. */
+    int port;			/* Its port number. */
+    int quality;		/* JPEG quality and */
+    int scale;			/* decimation of compressed frames. */
+    int maxClients;		/* Limit of clients. */
+    int nclients;		/* Number of clients. */
+    VHTTPC *clients[HTTP_MAXCLIENTS];
+    Tcl_WideInt frames;		/* Frames compressed. */
+    Tcl_WideInt sent;		/* Parts sent completely. */
+    Tcl_WideInt dropped;	/* Parts skipped for busy clients. */
+    Tcl_WideInt errors;		/* Failed compressions. */
+    Tcl_WideInt bytes;		/* Bytes sent. */
+};
+
+/*
+ * Control structure for memory-to-memory device, e.g. scaler,
+ * format converter, or codec. The OUTPUT queue is fed with
+ * source frames, the CAPTURE queue delivers the results.
+ */
+
+typedef struct {
+    int fd;			/* M2M file descriptor. */
+    char m2mId[32];		/* M2M id. */
+    Tcl_DString devName;	/* Device name. */
+    int inFormat;		/* Pixel format of source frames. */
+    int inWidth, inHeight;	/* Size of source frames. */
+    int outFormat;		/* Pixel format of results. */
+    int outWidth, outHeight;	/* Size of results. */
+    int inMemory;		/* V4L2_MEMORY_MMAP or _DMABUF, or zero
+				 * when not configured. */
+    int streaming;		/* True when queues are streaming. */
+    VBUF inBuf;			/* Source buffer when mmap()ed. */
+    VBUF outBuf;		/* Result buffer. */
+} V4L2M;
+
+/*
+ * Cached result of "v4l2 probe", valid while the device node
+ * is unchanged.
+ */
+
+typedef struct {
+    dev_t rdev;			/* Device number of node. */
+    time_t ctime;		/* Change time of node. */
+    Tcl_Obj *info;		/* Result list. */
+} VPROBE;
+
+/*
+ * Worker pool running a batch of jobs in parallel. The thread
+ * posting the batch takes part and waits for its completion.
+ */
+
+#define POOL_MAXTHREADS 8
+
+typedef struct {
+    Tcl_Mutex mutex;		/* Protects following fields. */
+    Tcl_Condition workCond;	/* Signalled when jobs are posted. */
+    Tcl_Condition doneCond;	/* Signalled when a batch is done. */
+    int stop;			/* True when threads shall terminate. */
+    int nthreads;		/* Number of worker threads. */
+    Tcl_ThreadId threads[POOL_MAXTHREADS];
+    void (*func)(ClientData);	/* Job function of current batch. */
+    ClientData *args;		/* Job arguments of current batch. */
+    int njobs;			/* Number of jobs in batch. */
+    int next;			/* Next job to take. */
+    int busy;			/* Number of jobs running. */
+} VPOOL;
+
+/*
+ * Tile of a mosaic: rectangle showing a scaled capture device.
  */
 
+struct VMOSAIC;
+
 typedef struct {
+    struct VMOSAIC *mosaic;	/* Mosaic of tile. */
+    char devId[32];		/* Device id. */
+    int x, y, width, height;	/* Rectangle in mosaic. */
+    V4L2C *dev;			/* Device while updating. */
+    double lastTime;		/* Timestamp of frame shown. */
+    int update;			/* True when to be redrawn. */
+    int wave;			/* Batch number when redrawing. */
+    int err;			/* Errno of last redraw or zero. */
+    int *xmap;			/* Source offsets per column. */
+    int xmapSrc;		/* Source width and pixel size */
+    int xmapPs;			/* xmap was made for. */
+} VTILE;
+
+/*
+ * Mosaic of several capture devices composed into a single
+ * frame for a photo image or loopback device.
+ */
+
+typedef struct VMOSAIC {
+    char mosaicId[32];		/* Mosaic id. */
+    int width, height;		/* Size of composed frame. */
+    unsigned char *canvas;	/* Composed RGB frame. */
+    Tcl_DString target;		/* Photo image or loopback device id. */
+    int ntiles;			/* Number of tiles. */
+    VTILE *tiles;		/* Tiles in drawing order. */
+} VMOSAIC;
+
+/*
+ * Per interpreter control structure.
+ */
+
+typedef struct V4L2I {
     int idCount;
     int checkedTk;			/* Non-zero when Tk availability
 					 * checked. */
     Tcl_HashTable v4l2c;		/* List of active V4L2C instances. */
-#ifdef HAVE_LIBUDEV
     Tcl_Interp *interp;			/* Interpreter for this object. */
-    Tcl_HashTable vdevs;		/* List of devices (udev). */
+    Tcl_HashTable vdevs;		/* List of devices (udev/inotify). */
+    Tcl_HashTable vcaps;		/* Cached device capabilities. */
+    Tcl_HashTable probes;		/* Cached results of "v4l2 probe". */
+    int m2mCount;			/* For making up M2M ids. */
+    Tcl_HashTable m2m;			/* List of active V4L2M instances. */
+    VPOOL *pool;			/* Worker pool or NULL. */
+    int mosaicCount;			/* For making up mosaic ids. */
+    Tcl_HashTable mosaics;		/* List of VMOSAIC instances. */
+    int y4mCount;			/* For making up Y4M reader ids. */
+    Tcl_HashTable y4m;			/* List of VY4MR instances. */
+    int vlzCount;			/* For making up VLZ reader ids. */
+    Tcl_HashTable vlz;			/* List of VVLZR instances. */
     int cbCmdLen;			/* Init. length of callback command. */
     Tcl_DString cbCmd;			/* Callback command prefix. */
+#ifdef HAVE_LIBUDEV
     struct udev *udev;			/* udev instance. */
     struct udev_monitor *udevMon;	/* udev monitor. */
 #endif
+#ifdef linux
+    int inotifyFd;			/* inotify instance or -1. */
+    struct VINOTIFY *inotify;		/* Shared inotify watch or NULL. */
+    int scanned;			/* True after scan of /dev. */
+#endif
 } V4L2I;
 
+#ifdef linux
+/*
+ * inotify watch on /dev and /dev/v4l/by-id, shared by all
+ * interpreters of a thread since file handlers are per thread.
+ */
+
+typedef struct VINOTIFY {
+    int fd;				/* inotify instance. */
+    int wdDev, wdById;			/* Watches on /dev, /dev/v4l/by-id. */
+    int nusers;				/* Number of interpreters and */
+    V4L2I **users;			/* the interpreters using it. */
+} VINOTIFY;
+
+static Tcl_ThreadDataKey inotifyKey;
+#endif
+
 /*
  * Mutex and flag used during initialization etc.
  */
@@ -206,6 +797,16 @@ static const int FormatsNormal[] = {
     V4L2_PIX_FMT_GREY
 };
 
+/*
+ * Compressed formats for capture, used only when requested by
+ * frame size and obtained by "v4l2 packet" without decoding.
+ */
+
+static const int FormatsCoded[] = {
+    V4L2_PIX_FMT_MJPEG,
+    V4L2_PIX_FMT_H264
+};
+
 /*
  * Supported formats for loopback video devices in test order.
  */
@@ -217,7 +818,12 @@ static const int FormatsLoop[] = {
     V4L2_PIX_FMT_BGR24,
     V4L2_PIX_FMT_YUYV,
     V4L2_PIX_FMT_YVYU,
-    V4L2_PIX_FMT_GREY
+    V4L2_PIX_FMT_GREY,
+    V4L2_PIX_FMT_NV12,
+    V4L2_PIX_FMT_YUV420,
+#ifdef USE_MJPEG
+    V4L2_PIX_FMT_MJPEG,
+#endif
 };
 
 #ifdef HAVE_LIBUDEV
@@ -302,8 +908,149 @@ static struct {
 #define udev_list_entry_get_next udev_dl.list_entry_get_next
 
 #endif
+
+/*
+ * Forward declarations.
+ */
+
+static int	ReconfigureCapture(V4L2C *v4l2c, int width, int height,
+				   int format, int fps);
+static int	SetFrameRate(V4L2C *v4l2c);
+static void	SnapshotReady(V4L2C *v4l2c, struct v4l2_buffer *vbuf);
+static int	DetachDevice(V4L2C *v4l2c, int err);
+static int	ReattachDevice(V4L2C *v4l2c);
+static void	DeviceCallback(V4L2C *v4l2c, const char *what);
+static int	SourceChange(V4L2C *v4l2c);
+static void	SourceCallback(V4L2C *v4l2c);
+static void	LoopRelease(V4L2C *v4l2c);
+static int	ForwardFrame(V4L2C *v4l2c);
+static void	RecordFrame(V4L2C *v4l2c);
+static void	Y4MFrame(V4L2C *v4l2c);
+static void	AviFrame(V4L2C *v4l2c);
+static void	VlzFrame(V4L2C *v4l2c);
+static void	HttpFrame(V4L2C *v4l2c);
+static unsigned char *LoopStages(V4L2C *v4l2c, unsigned char *data,
+				 int length, int inPlace);
+static void	OverlayFree(VOVL *ovl);
+#ifdef USE_MJPEG
+static int	EncodeJPEG(V4L2C *v4l2c, Tk_PhotoImageBlock *blk,
+			   unsigned char *out, int outLen);
+static void	EncodeJPEGFree(V4L2C *v4l2c);
+#endif
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ForgetDevice --
+ *
+ *	Drop cached capabilities and probe results of a device node,
+ *	e.g. after it has been plugged or unplugged.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+ForgetDevice(V4L2I *v4l2i, const char *devName)
+{
+    Tcl_HashEntry *hPtr;
+
+    hPtr = Tcl_FindHashEntry(&v4l2i->vcaps, devName);
+    if (hPtr != NULL) {
+	Tcl_DeleteHashEntry(hPtr);
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->probes, devName);
+    if (hPtr != NULL) {
+	VPROBE *vprobe = (VPROBE *) Tcl_GetHashValue(hPtr);
+
+	Tcl_DecrRefCount(vprobe->info);
+	ckfree((char *) vprobe);
+	Tcl_DeleteHashEntry(hPtr);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ListenCallback --
+ *
+ *	Invoke the listen callback command for a plug/unplug event.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+ListenCallback(V4L2I *v4l2i, const char *action, const char *devName)
+{
+    Tcl_Interp *interp = v4l2i->interp;
+    int ret;
 
+    if ((v4l2i->cbCmdLen <= 0) || (interp == NULL) ||
+	Tcl_InterpDeleted(interp)) {
+	return;
+    }
+    Tcl_DStringSetLength(&v4l2i->cbCmd, v4l2i->cbCmdLen);
+    Tcl_DStringAppendElement(&v4l2i->cbCmd, action);
+    Tcl_DStringAppendElement(&v4l2i->cbCmd, devName);
+    Tcl_Preserve((ClientData) interp);
+    ret = Tcl_EvalEx(interp, Tcl_DStringValue(&v4l2i->cbCmd),
+		     Tcl_DStringLength(&v4l2i->cbCmd), TCL_EVAL_GLOBAL);
+    if (ret != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (v4l2 device monitor)");
+	Tcl_BackgroundException(interp, ret);
+    }
+    Tcl_Release((ClientData) interp);
+}
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * CheckDetach, CheckReattach --
+ *
+ *	Apply the reattach policy of opened devices on plug/unplug
+ *	events from the device monitors. At most one device is
+ *	handled per call, since its callback may change the table
+ *	of devices.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+CheckDetach(V4L2I *v4l2i, const char *devName)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    V4L2C *v4l2c;
+
+    hPtr = Tcl_FirstHashEntry(&v4l2i->v4l2c, &search);
+    while (hPtr != NULL) {
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (!v4l2c->detached &&
+	    (strcmp(devName, Tcl_DStringValue(&v4l2c->devName)) == 0) &&
+	    DetachDevice(v4l2c, ENODEV)) {
+	    DeviceCallback(v4l2c, "detached");
+	    return;
+	}
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+}
+
+static void
+CheckReattach(V4L2I *v4l2i)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    V4L2C *v4l2c;
+
+    hPtr = Tcl_FirstHashEntry(&v4l2i->v4l2c, &search);
+    while (hPtr != NULL) {
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (v4l2c->detached && ReattachDevice(v4l2c)) {
+	    return;
+	}
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+}
+
 #ifdef HAVE_LIBUDEV
 /*
  *-------------------------------------------------------------------------
@@ -312,7 +1059,9 @@ static struct {
  *
  *	File handler for udev events. Depending on plug/unplug
  *	events, the table of devices is updated and the listen
- *	callback command is invoked.
+ *	callback command is invoked. Devices with the reattach
+ *	policy are detached on "remove" and checked for their
+ *	reappearance on "add".
  *
  *-------------------------------------------------------------------------
  */
@@ -325,7 +1074,7 @@ UdevMonitor(ClientData clientData, int mask)
     struct udev_device *dev;
     Tcl_HashEntry *hPtr;
     const char *action, *devName;
-    int isNew;
+    int isNew, isAdd;
 
     if (!(mask & TCL_READABLE)) {
 	return;
@@ -336,7 +1085,10 @@ UdevMonitor(ClientData clientData, int mask)
     }
     action = udev_device_get_action(dev);
     devName = udev_device_get_devnode(dev);
-    if (strcmp(action, "add") == 0) {
+    isAdd = (strcmp(action, "add") == 0);
+    /* node may be reused by another device */
+    ForgetDevice(v4l2i, devName);
+    if (isAdd) {
 	hPtr = Tcl_CreateHashEntry(&v4l2i->vdevs, (ClientData) devName, &isNew);
 	if (!isNew) {
 	    action = NULL;
@@ -353,21 +1105,15 @@ UdevMonitor(ClientData clientData, int mask)
     } else {
 	action = NULL;
     }
-    if ((v4l2i->cbCmdLen > 0) && (action != NULL) &&
-	(interp != NULL) && !Tcl_InterpDeleted(interp)) {
-	int ret;
-
-	Tcl_DStringSetLength(&v4l2i->cbCmd, v4l2i->cbCmdLen);
-	Tcl_DStringAppendElement(&v4l2i->cbCmd, action);
-	Tcl_DStringAppendElement(&v4l2i->cbCmd, devName);
-	Tcl_Preserve((ClientData) interp);
-	ret = Tcl_EvalEx(interp, Tcl_DStringValue(&v4l2i->cbCmd),
-			 Tcl_DStringLength(&v4l2i->cbCmd), TCL_EVAL_GLOBAL);
-	if (ret != TCL_OK) {
-	    Tcl_AddErrorInfo(interp, "\n    (v4l2 udev monitor)");
-	    Tcl_BackgroundException(interp, ret);
+    if (action != NULL) {
+	ListenCallback(v4l2i, action, devName);
+    }
+    if ((devName != NULL) && (interp != NULL) && !Tcl_InterpDeleted(interp)) {
+	if (isAdd) {
+	    CheckReattach(v4l2i);
+	} else if (action != NULL) {
+	    CheckDetach(v4l2i, devName);
 	}
-	Tcl_Release((ClientData) interp);
     }
     udev_device_unref(dev);
 }
@@ -438,1914 +1184,11427 @@ DoIoctl(int fd, unsigned long cmd, void *arg)
 /*
  *-------------------------------------------------------------------------
  *
- * StopCapture --
+ * QueryCaps --
  *
- *	Stop capture if running. Releases all frame buffers to
- *	allow to restart another capture. The file handler for
- *	the device is deleted, i.e. no further callbacks can
- *	be triggered.
+ *	Return the capabilities of the device node of an open file
+ *	descriptor, or -1 on error.
  *
  *-------------------------------------------------------------------------
  */
 
 static int
-StopCapture(V4L2C *v4l2c)
+QueryCaps(int fd, struct v4l2_capability *cap)
 {
-    int i, type;
-    struct v4l2_requestbuffers req;
-
-    if (v4l2c->running > 0) {
-	Tcl_DeleteFileHandler(v4l2c->fd);
-	/* stop capture */
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	DoIoctl(v4l2c->fd, VIDIOC_STREAMOFF, &type);
-	/* unmap buffers */
-	for (i = 0; i < v4l2c->nvbufs; i++) {
-	    v4l2_munmap(v4l2c->vbufs[i].start, v4l2c->vbufs[i].length);
-	}
-	/* release buffers */
-	memset(&req, 0, sizeof (req));
-	req.count = 0;
-	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_MMAP;
-	DoIoctl(v4l2c->fd, VIDIOC_REQBUFS, &req);
-	/* done */
-	v4l2c->running = 0;
-	v4l2c->stalled = 0;
-	v4l2c->bufrdy = -1;
-	v4l2c->bufdone = 0;
+    memset(cap, 0, sizeof (*cap));
+    if (DoIoctl(fd, VIDIOC_QUERYCAP, cap) < 0) {
+	return -1;
     }
-    return TCL_OK;
+    cap->bus_info[sizeof (cap->bus_info) - 1] = '\0';
+    if (cap->capabilities & V4L2_CAP_DEVICE_CAPS) {
+	return cap->device_caps & 0x7FFFFFFF;
+    }
+    return cap->capabilities & 0x7FFFFFFF;
 }
 
 /*
  *-------------------------------------------------------------------------
  *
- * BufferReady --
+ * ReleaseBuffers --
  *
- *	A frame buffer became ready as is indicated by readability
- *	of the device. This is the file handler procedure which
- *	reads out and remembers the frame buffer index. An already
- *	obtained older frame buffer is released before the Tcl
- *	callback is evaluated.
+ *	Unmap all frame buffers and release them in the driver.
+ *	Capture must have been stopped with VIDIOC_STREAMOFF before.
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-BufferReady(ClientData clientData, int mask)
+ReleaseBuffers(V4L2C *v4l2c)
 {
-    V4L2C *v4l2c = (V4L2C *) clientData;
-    Tcl_Interp *interp = v4l2c->interp;
-    char buffer[64];
-    struct v4l2_buffer vbuf;
-    int ret, sequence;
+    int i;
+    struct v4l2_requestbuffers req;
 
-    if (!(mask & TCL_READABLE)) {
-	return;
+    /* unmap buffers, close DMABUF exports */
+    for (i = 0; i < v4l2c->nvbufs; i++) {
+	v4l2_munmap(v4l2c->vbufs[i].start, v4l2c->vbufs[i].length);
+	if (v4l2c->dmaFds[i] > 0) {
+	    close(v4l2c->dmaFds[i] - 1);
+	}
+	v4l2c->dmaFds[i] = 0;
     }
-    memset(&vbuf, 0, sizeof (vbuf));
-    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vbuf.memory = V4L2_MEMORY_MMAP;
-    if (DoIoctl(v4l2c->fd, VIDIOC_DQBUF, &vbuf) < 0) {
-	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-	    const struct timespec ms10 = { 0, 10000000 };
+    v4l2c->nvbufs = 0;
+    v4l2c->dmaFormat = 0;
+    /* release buffers */
+    memset(&req, 0, sizeof (req));
+    req.count = 0;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    DoIoctl(v4l2c->fd, VIDIOC_REQBUFS, &req);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameSize, LoopFrameSize --
+ *
+ *	Return the size of a frame of given format and dimensions
+ *	without line padding, and of a frame in the output format
+ *	of a loopback device as converted from RGB. For compressed
+ *	formats this is a rough lower bound.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	    /*
-	     * Allow one more try through this file handler after
-	     * a very short delay.
-	     */
-	    if (v4l2c->stalled) {
-		goto captureError;
-	    }
-	    v4l2c->stalled = 1;
-	    nanosleep(&ms10, NULL);
-	    return;
-	}
-	goto captureError;
+static int
+FrameSize(int format, int width, int height)
+{
+    int size = width * height;
+
+    switch (format) {
+    case V4L2_PIX_FMT_RGB32:
+    case V4L2_PIX_FMT_BGR32:
+	return size * 4;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+	return size * 3;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	return ((width + 1) / 2) * 4 * height;
+    case V4L2_PIX_FMT_GREY:
+	return size;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+	return size + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+    case V4L2_PIX_FMT_MJPEG:
+    case V4L2_PIX_FMT_H264:
+	return size / 4;
     }
-    sequence = vbuf.sequence;
-    v4l2c->stalled = 0;
-    v4l2c->bufdone = 0;
-    v4l2c->counters[0] += 1;
-    if (v4l2c->bufrdy >= 0) {
-	int swap = vbuf.index;
+    return size * 2;
+}
 
-	vbuf.index = v4l2c->bufrdy;
-	v4l2c->bufrdy = swap;
-	if (DoIoctl(v4l2c->fd, VIDIOC_QBUF, &vbuf) < 0) {
-captureError:
-	    StopCapture(v4l2c);
-	    v4l2c->running = -1;
-	    v4l2c->stalled = 0;
-	    Tcl_DStringSetLength(&v4l2c->cbCmd, v4l2c->cbCmdLen);
-	    Tcl_DStringAppendElement(&v4l2c->cbCmd, v4l2c->devId);
-	    Tcl_DStringAppendElement(&v4l2c->cbCmd, "error");
-	    goto doCallback;
+static int
+LoopFrameSize(V4L2C *v4l2c)
+{
+    return FrameSize(v4l2c->loopFormat, v4l2c->loopWidth,
+		     v4l2c->loopHeight);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * LoopStart, LoopRelease --
+ *
+ *	Set up or release mmap()ed output buffers of a loopback
+ *	device. When the driver doesn't support streaming output,
+ *	frames are written using write() instead.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+LoopStart(V4L2C *v4l2c)
+{
+    int i;
+    struct v4l2_buffer buf;
+    struct v4l2_requestbuffers req;
+
+    v4l2c->loopStream = -1;
+    v4l2c->loopNbufs = 0;
+    memset(&req, 0, sizeof (req));
+    req.count = sizeof (v4l2c->loopBufs) / sizeof (v4l2c->loopBufs[0]);
+    req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    req.memory = V4L2_MEMORY_MMAP;
+    if ((DoIoctl(v4l2c->fd, VIDIOC_REQBUFS, &req) < 0) ||
+	(req.count < 2)) {
+	goto error;
+    }
+    if (req.count > sizeof (v4l2c->loopBufs) / sizeof (v4l2c->loopBufs[0])) {
+	req.count = sizeof (v4l2c->loopBufs) / sizeof (v4l2c->loopBufs[0]);
+    }
+    for (i = 0; i < req.count; i++) {
+	memset(&buf, 0, sizeof (buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = i;
+	if (DoIoctl(v4l2c->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+	    goto error;
 	}
-    } else {
-	v4l2c->bufrdy = vbuf.index;
+	/* must hold a converted frame */
+	if (buf.length < LoopFrameSize(v4l2c)) {
+	    goto error;
+	}
+	v4l2c->loopBufs[i].start = v4l2_mmap(NULL, buf.length,
+					     PROT_READ | PROT_WRITE,
+					     MAP_SHARED, v4l2c->fd,
+					     buf.m.offset);
+	if (v4l2c->loopBufs[i].start == MAP_FAILED) {
+	    goto error;
+	}
+	v4l2c->loopBufs[i].length = buf.length;
+	v4l2c->loopNbufs++;
     }
+    v4l2c->loopFree = v4l2c->loopNbufs;
+    v4l2c->loopOn = 0;
+    v4l2c->loopStream = 1;
+    return;
+
+error:
+    LoopRelease(v4l2c);
+    v4l2c->loopStream = -1;
+}
 
-    Tcl_DStringSetLength(&v4l2c->cbCmd, v4l2c->cbCmdLen);
-    Tcl_DStringAppendElement(&v4l2c->cbCmd, v4l2c->devId);
-    sprintf(buffer, "%d", sequence);
-    Tcl_DStringAppendElement(&v4l2c->cbCmd, buffer);
-doCallback:
-    Tcl_Preserve((ClientData) interp);
-    ret = Tcl_EvalEx(interp, Tcl_DStringValue(&v4l2c->cbCmd),
-		     Tcl_DStringLength(&v4l2c->cbCmd), TCL_EVAL_GLOBAL);
-    if (ret != TCL_OK) {
-	Tcl_AddErrorInfo(interp, "\n    (v4l2 event handler)");
-	Tcl_BackgroundException(interp, ret);
-	StopCapture(v4l2c);
+static void
+LoopRelease(V4L2C *v4l2c)
+{
+    int i;
+    struct v4l2_requestbuffers req;
+
+    if (v4l2c->loopOn) {
+	i = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	DoIoctl(v4l2c->fd, VIDIOC_STREAMOFF, &i);
+	v4l2c->loopOn = 0;
     }
-    Tcl_Release((ClientData) interp);
+    if (v4l2c->loopStream == 0) {
+	return;
+    }
+    for (i = 0; i < v4l2c->loopNbufs; i++) {
+	v4l2_munmap(v4l2c->loopBufs[i].start, v4l2c->loopBufs[i].length);
+    }
+    v4l2c->loopNbufs = 0;
+    v4l2c->loopFree = 0;
+    v4l2c->loopSpare = 0;
+    memset(&req, 0, sizeof (req));
+    req.count = 0;
+    req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    req.memory = V4L2_MEMORY_MMAP;
+    DoIoctl(v4l2c->fd, VIDIOC_REQBUFS, &req);
+    v4l2c->loopStream = 0;
 }
 
 /*
  *-------------------------------------------------------------------------
  *
- * StartCapture --
+ * LoopGetBuffer --
  *
- *	Setup image acquisition:
- *	  - set capture format and size
- *	  - request frame buffers
- *	  - mmap() frame buffers
- *	  - queue buffers and start capture
- *	  - add file handler for buffer indications
+ *	Obtain a free output buffer of a loopback device. Waits at
+ *	most one frame period for the consumer to release a buffer.
+ *	Returns 1 and the buffer index, 0 when write() must be used,
+ *	or -1 with errno set on error.
  *
  *-------------------------------------------------------------------------
  */
 
 static int
-StartCapture(V4L2C *v4l2c)
+LoopGetBuffer(V4L2C *v4l2c, int *indexPtr)
 {
-    Tcl_Interp *interp = v4l2c->interp;
-    int i, type;
-    struct v4l2_format fmt;
     struct v4l2_buffer buf;
-    struct v4l2_requestbuffers req;
-    struct v4l2_streamparm stp;
-    const int *tryFmts;
-    int maxFmt;
+    struct pollfd pfd;
+    int n;
 
-    if (v4l2c->running > 0) {
-	return TCL_OK;
+    if (v4l2c->loopStream == 0) {
+	LoopStart(v4l2c);
     }
-    if (v4l2c->isLoopDev) {
-	tryFmts = FormatsLoop;
-	maxFmt = sizeof (FormatsLoop) / sizeof (FormatsLoop[0]);
-    } else {
-	tryFmts = FormatsNormal;
-	maxFmt = sizeof (FormatsNormal) / sizeof (FormatsNormal[0]);
+    if (v4l2c->loopStream < 0) {
+	return 0;
     }
-
-    /* set format/size */
-    memset(&fmt, 0, sizeof (fmt));
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width = v4l2c->width;
-    fmt.fmt.pix.height = v4l2c->height;
-    fmt.fmt.pix.field = V4L2_FIELD_ANY;
-    if (v4l2c->wantFormat != 0) {
-	for (i = 0; i < maxFmt; i++) {
-	    if (v4l2c->wantFormat == tryFmts[i]) {
-		break;
-	    }
-	}
-	if (i < maxFmt) {
-	    fmt.fmt.pix.pixelformat = v4l2c->wantFormat;
-	    if (DoIoctl(v4l2c->fd, VIDIOC_S_FMT, &fmt) >= 0) {
-		goto gotFormat;
+    if (v4l2c->loopSpare > 0) {
+	*indexPtr = v4l2c->loopSpare - 1;
+	v4l2c->loopSpare = 0;
+	return 1;
+    }
+    if (v4l2c->loopFree > 0) {
+	*indexPtr = v4l2c->loopNbufs - v4l2c->loopFree;
+	v4l2c->loopFree--;
+	return 1;
+    }
+    memset(&buf, 0, sizeof (buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (DoIoctl(v4l2c->fd, VIDIOC_DQBUF, &buf) < 0) {
+	if (errno != EAGAIN) {
+	    return -1;
+	}
+	pfd.fd = v4l2c->fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	n = poll(&pfd, 1, 1000 / ((v4l2c->fps > 0) ? v4l2c->fps : 15));
+	if (n <= 0) {
+	    if (n == 0) {
+		errno = EAGAIN;
 	    }
+	    return -1;
 	}
-    }
-    for (i = 0; i < maxFmt; i++) {
-	fmt.fmt.pix.pixelformat = tryFmts[i];
-	if (DoIoctl(v4l2c->fd, VIDIOC_S_FMT, &fmt) >= 0) {
-	    break;
+	memset(&buf, 0, sizeof (buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf.memory = V4L2_MEMORY_MMAP;
+	if (DoIoctl(v4l2c->fd, VIDIOC_DQBUF, &buf) < 0) {
+	    return -1;
 	}
     }
-    if (i >= maxFmt) {
-	Tcl_SetObjResult(interp,
-			 Tcl_ObjPrintf("error setting format: %s",
-				       Tcl_PosixError(interp)));
-	v4l2c->running = -1;
-	v4l2c->stalled = 0;
-	return TCL_ERROR;
+    *indexPtr = buf.index;
+    return 1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * LoopQueue --
+ *
+ *	Queue a filled output buffer of a loopback device stamped
+ *	with the current monotonic time, and start streaming on the
+ *	first one. Returns -1 with errno set on error, in which case
+ *	the buffer is kept for the next LoopGetBuffer.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+LoopQueue(V4L2C *v4l2c, int index, int length)
+{
+    struct v4l2_buffer buf;
+    struct timespec now;
+    int type;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&buf, 0, sizeof (buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    buf.bytesused = length;
+    buf.field = V4L2_FIELD_NONE;
+    buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    buf.timestamp.tv_sec = now.tv_sec;
+    buf.timestamp.tv_usec = now.tv_nsec / 1000;
+    if (DoIoctl(v4l2c->fd, VIDIOC_QBUF, &buf) < 0) {
+	v4l2c->loopSpare = index + 1;
+	return -1;
     }
-    for (i = 0; i < maxFmt; i++) {
-	if (fmt.fmt.pix.pixelformat == tryFmts[i]) {
-	    break;
+    if (!v4l2c->loopOn) {
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	if (DoIoctl(v4l2c->fd, VIDIOC_STREAMON, &type) < 0) {
+	    return -1;
 	}
+	v4l2c->loopOn = 1;
     }
-    if (i >= maxFmt) {
-	Tcl_SetResult(interp, "unable to set supported pixel format",
-		      TCL_STATIC);
-	return TCL_ERROR;
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * PaceSlot, PacePost --
+ *
+ *	Submit a frame to the paced writer of a loopback device.
+ *	PaceSlot returns the spare frame to be filled, which the
+ *	writer thread doesn't touch, so no lock is held meanwhile.
+ *	PacePost commits it unless length is zero by swapping it
+ *	into the queue, dropping the oldest frame if the queue is
+ *	full.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static unsigned char *
+PaceSlot(VPACE *pace)
+{
+    return pace->spare;
+}
+
+static void
+PacePost(VPACE *pace, int length)
+{
+    unsigned char *p;
+    int slot;
+
+    if (length <= 0) {
+	return;
     }
-gotFormat:
-    v4l2c->format = fmt.fmt.pix.pixelformat;
-    if (v4l2c->wantFormat == 0) {
-	v4l2c->wantFormat = v4l2c->format;
+    Tcl_MutexLock(&pace->mutex);
+    if (pace->count >= pace->depth) {
+	pace->head = (pace->head + 1) % pace->depth;
+	pace->count--;
+	pace->dropped++;
     }
+    slot = (pace->head + pace->count) % pace->depth;
+    p = pace->ring[slot];
+    pace->ring[slot] = pace->spare;
+    pace->ringLen[slot] = length;
+    pace->spare = p;
+    pace->count++;
+    Tcl_MutexUnlock(&pace->mutex);
+}
 
-    /* try to set frame rate */
-    memset(&stp, 0, sizeof (stp));
-    stp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (DoIoctl(v4l2c->fd, VIDIOC_G_PARM, &stp) >= 0) {
-	int compFps = 0;
+#ifdef TCL_THREADS
+/*
+ *-------------------------------------------------------------------------
+ *
+ * PaceThread --
+ *
+ *	Writer thread of a paced loopback device. Ticks on absolute
+ *	deadlines of the monotonic clock and writes the next queued
+ *	frame or repeats the last one. While the thread runs, it is
+ *	the only user of the device's output path.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	if (stp.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) {
-	    stp.parm.capture.timeperframe.numerator = 100;
-	    stp.parm.capture.timeperframe.denominator = v4l2c->fps * 100;
-	    if (DoIoctl(v4l2c->fd, VIDIOC_S_PARM, &stp) >= 0) {
-		compFps = DoIoctl(v4l2c->fd, VIDIOC_G_PARM, &stp) != -1;
-	    }
+static Tcl_ThreadCreateType
+PaceThread(ClientData clientData)
+{
+    VPACE *pace = (VPACE *) clientData;
+    V4L2C *v4l2c = pace->v4l2c;
+    struct timespec ts;
+    Tcl_WideInt next, now, period;
+    unsigned char *p;
+    int n, index, length;
+
+    period = (Tcl_WideInt) (1.0e9 / pace->fps);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    next = (Tcl_WideInt) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    for (;;) {
+	next += period;
+	ts.tv_sec = next / 1000000000;
+	ts.tv_nsec = next % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR) {
+	    /* empty */
+	}
+	Tcl_MutexLock(&pace->mutex);
+	if (pace->stop) {
+	    Tcl_MutexUnlock(&pace->mutex);
+	    break;
 	}
-	if (compFps && (stp.parm.capture.timeperframe.numerator > 0)) {
-	    v4l2c->fps = stp.parm.capture.timeperframe.denominator /
-		stp.parm.capture.timeperframe.numerator;
-	    if (v4l2c->fps <= 0) {
-		v4l2c->fps = 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (Tcl_WideInt) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (now - next >= period) {
+	    /* fell behind, skip ticks rather than bursting */
+	    pace->late += (now - next) / period;
+	    next += ((now - next) / period) * period;
+	}
+	if (pace->count > 0) {
+	    p = pace->last;
+	    pace->last = pace->ring[pace->head];
+	    pace->lastLen = pace->ringLen[pace->head];
+	    pace->ring[pace->head] = p;
+	    pace->head = (pace->head + 1) % pace->depth;
+	    pace->count--;
+	} else if (pace->lastLen > 0) {
+	    pace->repeated++;
+	}
+	length = pace->lastLen;
+	Tcl_MutexUnlock(&pace->mutex);
+	if (length <= 0) {
+	    continue;
+	}
+	n = LoopGetBuffer(v4l2c, &index);
+	if (n > 0) {
+	    if (length > v4l2c->loopBufs[index].length) {
+		length = v4l2c->loopBufs[index].length;
 	    }
+	    memcpy(v4l2c->loopBufs[index].start, pace->last, length);
+	    n = LoopQueue(v4l2c, index, length);
+	} else if (n == 0) {
+	    n = write(v4l2c->fd, pace->last, length);
+	}
+	Tcl_MutexLock(&pace->mutex);
+	if (n < 0) {
+	    pace->errors++;
+	} else {
+	    pace->emitted++;
 	}
+	Tcl_MutexUnlock(&pace->mutex);
     }
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * PaceStart, PaceStop --
+ *
+ *	Start or stop the paced writer thread of a loopback device.
+ *	A frame rate of zero or less means the rate configured on
+ *	the loopback device.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-    /* request buffers */
-    memset(&req, 0, sizeof (req));
-    i = 2;
-    while (i < sizeof (v4l2c->vbufs) / sizeof (v4l2c->vbufs[0])) {
-	req.count = i;
-	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_MMAP;
-	if (DoIoctl(v4l2c->fd, VIDIOC_REQBUFS, &req) < 0) {
-	    Tcl_SetObjResult(interp,
-			     Tcl_ObjPrintf("error requesting buffers: %s",
-					   Tcl_PosixError(interp)));
-	    v4l2c->running = -1;
-	    v4l2c->stalled = 0;
-	    return TCL_ERROR;
+static int
+PaceStart(Tcl_Interp *interp, V4L2C *v4l2c, double fps, int depth)
+{
+#ifdef TCL_THREADS
+    VPACE *pace;
+    struct v4l2_streamparm stp;
+    int i;
+
+    if (fps <= 0) {
+	memset(&stp, 0, sizeof (stp));
+	stp.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	if ((DoIoctl(v4l2c->fd, VIDIOC_G_PARM, &stp) >= 0) &&
+	    (stp.parm.output.timeperframe.numerator > 0) &&
+	    (stp.parm.output.timeperframe.denominator > 0)) {
+	    fps = (double) stp.parm.output.timeperframe.denominator /
+		stp.parm.output.timeperframe.numerator;
+	    if (fps < 1.0) {
+		/* set as frames per second by "v4l2 loopback" */
+		fps = 1.0 / fps;
+	    }
+	} else {
+	    fps = (v4l2c->fps > 0) ? v4l2c->fps : 15;
 	}
-	if ((req.count <= 0) ||
-	    (req.count > sizeof (v4l2c->vbufs) / sizeof (v4l2c->vbufs[0]))) {
-	    i *= 2;
-	    continue;
-	}
-	break;
     }
-    if ((req.count <= 0) ||
-	(req.count > sizeof (v4l2c->vbufs) / sizeof (v4l2c->vbufs[0]))) {
-	Tcl_SetResult(interp, "unable to get buffers", TCL_STATIC);
-	v4l2c->running = -1;
-	v4l2c->stalled = 0;
+    if ((fps < 0.1) || (fps > 1000.0)) {
+	Tcl_SetResult(interp, "invalid frame rate", TCL_STATIC);
 	return TCL_ERROR;
     }
+    pace = (VPACE *) ckalloc(sizeof (VPACE));
+    memset(pace, 0, sizeof (VPACE));
+    pace->v4l2c = v4l2c;
+    pace->fps = fps;
+    pace->depth = depth;
+    pace->size = v4l2c->loopWidth * v4l2c->loopHeight * 4;
+    for (i = 0; i < depth; i++) {
+	pace->ring[i] = attemptckalloc(pace->size);
+	if (pace->ring[i] == NULL) {
+	    goto nomem;
+	}
+    }
+    pace->last = attemptckalloc(pace->size);
+    pace->spare = attemptckalloc(pace->size);
+    if ((pace->last == NULL) || (pace->spare == NULL)) {
+	goto nomem;
+    }
+    if (Tcl_CreateThread(&pace->thread, PaceThread, (ClientData) pace,
+			 TCL_THREAD_STACK_DEFAULT,
+			 TCL_THREAD_JOINABLE) != TCL_OK) {
+	Tcl_SetResult(interp, "can't create writer thread", TCL_STATIC);
+	goto error;
+    }
+    v4l2c->pace = pace;
+    return TCL_OK;
 
-    /* mmap() buffers */
-    for (i = 0; i < req.count; i++) {
-	memset(&buf, 0, sizeof (buf));
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
-	buf.index = i;
-	if (DoIoctl(v4l2c->fd, VIDIOC_QUERYBUF, &buf) < 0) {
-	    Tcl_SetObjResult(interp,
-			     Tcl_ObjPrintf("error querying buffer: %s",
-					   Tcl_PosixError(interp)));
-	    v4l2c->running = -1;
-	    v4l2c->stalled = 0;
-	    return TCL_ERROR;
+nomem:
+    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+error:
+    for (i = 0; i < depth; i++) {
+	if (pace->ring[i] != NULL) {
+	    ckfree(pace->ring[i]);
 	}
-	v4l2c->vbufs[i].start = v4l2_mmap(NULL, buf.length,
-					  PROT_READ | PROT_WRITE, MAP_SHARED,
-					  v4l2c->fd, buf.m.offset);
-	v4l2c->vbufs[i].length = buf.length;
-	if (v4l2c->vbufs[i].start == MAP_FAILED) {
-	    Tcl_SetObjResult(interp,
-			     Tcl_ObjPrintf("error mapping buffer: %s",
-					   Tcl_PosixError(interp)));
-	    while (--i >= 0) {
-		v4l2_munmap(v4l2c->vbufs[i].start, v4l2c->vbufs[i].length);
-	    }
-	    v4l2c->running = -1;
-	    v4l2c->stalled = 0;
-	    return TCL_ERROR;
+    }
+    if (pace->last != NULL) {
+	ckfree(pace->last);
+    }
+    if (pace->spare != NULL) {
+	ckfree(pace->spare);
+    }
+    ckfree((char *) pace);
+    return TCL_ERROR;
+#else
+    Tcl_SetResult(interp, "paced writing requires thread support",
+		  TCL_STATIC);
+    return TCL_ERROR;
+#endif
+}
+
+static void
+PaceStop(V4L2C *v4l2c)
+{
+#ifdef TCL_THREADS
+    VPACE *pace = v4l2c->pace;
+    int i, result;
+
+    if (pace == NULL) {
+	return;
+    }
+    Tcl_MutexLock(&pace->mutex);
+    pace->stop = 1;
+    Tcl_MutexUnlock(&pace->mutex);
+    Tcl_JoinThread(pace->thread, &result);
+    Tcl_MutexFinalize(&pace->mutex);
+    for (i = 0; i < pace->depth; i++) {
+	ckfree(pace->ring[i]);
+    }
+    ckfree(pace->last);
+    ckfree(pace->spare);
+    ckfree((char *) pace);
+    v4l2c->pace = NULL;
+#endif
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * PoolThread --
+ *
+ *	Worker thread of the pool: takes jobs of the current batch
+ *	until told to terminate.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifdef TCL_THREADS
+static Tcl_ThreadCreateType
+PoolThread(ClientData clientData)
+{
+    VPOOL *pool = (VPOOL *) clientData;
+    int i;
+
+    Tcl_MutexLock(&pool->mutex);
+    for (;;) {
+	while (!pool->stop && (pool->next >= pool->njobs)) {
+	    Tcl_ConditionWait(&pool->workCond, &pool->mutex, NULL);
+	}
+	if (pool->stop) {
+	    break;
+	}
+	i = pool->next++;
+	pool->busy++;
+	Tcl_MutexUnlock(&pool->mutex);
+	pool->func(pool->args[i]);
+	Tcl_MutexLock(&pool->mutex);
+	pool->busy--;
+	if ((pool->next >= pool->njobs) && (pool->busy == 0)) {
+	    Tcl_ConditionNotify(&pool->doneCond);
 	}
     }
+    Tcl_MutexUnlock(&pool->mutex);
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * PoolRun, PoolFree --
+ *
+ *	Run func on each of args in parallel using the worker pool
+ *	of the interpreter, which is created on first use with one
+ *	thread per additional processor. Without thread support or
+ *	for a single job, the jobs run in the calling thread.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-    /* queue buffers */
-    for (i = 0; i < req.count; i++) {
-	memset(&buf, 0, sizeof (buf));
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
-	buf.index = i;
-	if (DoIoctl(v4l2c->fd, VIDIOC_QBUF, &buf) < 0) {
-	    Tcl_SetObjResult(interp,
-			     Tcl_ObjPrintf("error querying buffer: %s",
-					   Tcl_PosixError(interp)));
-unmapAll:
-	    for (i = 0; i < req.count; i++) {
-		v4l2_munmap(v4l2c->vbufs[i].start, v4l2c->vbufs[i].length);
+static void
+PoolRun(V4L2I *v4l2i, void (*func)(ClientData), ClientData *args,
+	int njobs)
+{
+    int i;
+#ifdef TCL_THREADS
+    VPOOL *pool = v4l2i->pool;
+
+    if ((pool == NULL) && (njobs > 1)) {
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	pool = (VPOOL *) ckalloc(sizeof (VPOOL));
+	memset(pool, 0, sizeof (VPOOL));
+	ncpu = (ncpu > POOL_MAXTHREADS + 1) ? POOL_MAXTHREADS : ncpu - 1;
+	for (i = 0; i < ncpu; i++) {
+	    if (Tcl_CreateThread(&pool->threads[pool->nthreads], PoolThread,
+				 (ClientData) pool, TCL_THREAD_STACK_DEFAULT,
+				 TCL_THREAD_JOINABLE) == TCL_OK) {
+		pool->nthreads++;
 	    }
-	    v4l2c->running = -1;
-	    v4l2c->stalled = 0;
-	    return TCL_ERROR;
 	}
+	v4l2i->pool = pool;
+    }
+    if ((pool != NULL) && (pool->nthreads > 0) && (njobs > 1)) {
+	Tcl_MutexLock(&pool->mutex);
+	pool->func = func;
+	pool->args = args;
+	pool->next = 0;
+	pool->njobs = njobs;
+	Tcl_ConditionNotify(&pool->workCond);
+	while (pool->next < pool->njobs) {
+	    i = pool->next++;
+	    pool->busy++;
+	    Tcl_MutexUnlock(&pool->mutex);
+	    func(args[i]);
+	    Tcl_MutexLock(&pool->mutex);
+	    pool->busy--;
+	}
+	while (pool->busy > 0) {
+	    Tcl_ConditionWait(&pool->doneCond, &pool->mutex, NULL);
+	}
+	pool->njobs = 0;
+	pool->next = 0;
+	Tcl_MutexUnlock(&pool->mutex);
+	return;
     }
+#endif
+    for (i = 0; i < njobs; i++) {
+	func(args[i]);
+    }
+}
 
-    /* start capture */
-    v4l2c->nvbufs = req.count;
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (DoIoctl(v4l2c->fd, VIDIOC_STREAMON, &type) < 0) {
-	Tcl_SetObjResult(interp,
-			 Tcl_ObjPrintf("error starting capture: %s",
-				       Tcl_PosixError(interp)));
-	goto unmapAll;
+static void
+PoolFree(V4L2I *v4l2i)
+{
+#ifdef TCL_THREADS
+    VPOOL *pool = v4l2i->pool;
+    int i, result;
+
+    if (pool == NULL) {
+	return;
     }
+    Tcl_MutexLock(&pool->mutex);
+    pool->stop = 1;
+    Tcl_ConditionNotify(&pool->workCond);
+    Tcl_MutexUnlock(&pool->mutex);
+    for (i = 0; i < pool->nthreads; i++) {
+	Tcl_JoinThread(pool->threads[i], &result);
+    }
+    Tcl_ConditionFinalize(&pool->workCond);
+    Tcl_ConditionFinalize(&pool->doneCond);
+    Tcl_MutexFinalize(&pool->mutex);
+    ckfree((char *) pool);
+    v4l2i->pool = NULL;
+#endif
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * LoopBegin, LoopEnd --
+ *
+ *	Write a frame to a loopback device. LoopBegin provides the
+ *	buffer to fill, which is the paced writer's spare frame, a
+ *	mmap()ed output buffer, or NULL when write() is used. The
+ *	return value tells which, or is -1 with errno set on error.
+ *	LoopEnd copies data unless already in the buffer and submits
+ *	it. With data NULL the buffer is given back unused.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-    /* setup file handler */
-    Tcl_CreateFileHandler(v4l2c->fd, TCL_READABLE, BufferReady,
-			  (ClientData) v4l2c);
-    v4l2c->width = fmt.fmt.pix.width;
-    v4l2c->height = fmt.fmt.pix.height;
-    v4l2c->running = 1;
-    v4l2c->stalled = 0;
-    v4l2c->bufrdy = -1;
-    v4l2c->bufdone = 0;
-    v4l2c->counters[0] = v4l2c->counters[1] = 0;
-    return TCL_OK;
+static int
+LoopBegin(V4L2C *v4l2c, unsigned char **outPtr, int *lenPtr, int *indexPtr)
+{
+    int n;
+
+    *outPtr = NULL;
+    *lenPtr = 0;
+    if (v4l2c->pace != NULL) {
+	*outPtr = PaceSlot(v4l2c->pace);
+	*lenPtr = v4l2c->pace->size;
+	return 2;
+    }
+    n = LoopGetBuffer(v4l2c, indexPtr);
+    if (n > 0) {
+	*outPtr = (unsigned char *) v4l2c->loopBufs[*indexPtr].start;
+	*lenPtr = v4l2c->loopBufs[*indexPtr].length;
+    }
+    return n;
+}
+
+static int
+LoopEnd(V4L2C *v4l2c, int how, int index, unsigned char *out, int outLen,
+	unsigned char *data, int length)
+{
+    if (how == 0) {
+	if ((data != NULL) && ((v4l2c->key != NULL) ||
+			       (v4l2c->ovl != NULL))) {
+	    data = LoopStages(v4l2c, data, length, 0);
+	}
+	if ((data != NULL) && (write(v4l2c->fd, data, length) < 0)) {
+	    return -1;
+	}
+	return 0;
+    }
+    if ((data != NULL) && (data != out)) {
+	if (length > outLen) {
+	    length = outLen;
+	}
+	memcpy(out, data, length);
+    }
+    if ((data != NULL) && ((v4l2c->key != NULL) || (v4l2c->ovl != NULL))) {
+	LoopStages(v4l2c, out, length, 1);
+    }
+    if (how == 2) {
+	PacePost(v4l2c->pace, (data != NULL) ? length : 0);
+	return 0;
+    }
+    if (data == NULL) {
+	v4l2c->loopSpare = index + 1;
+	return 0;
+    }
+    return LoopQueue(v4l2c, index, length);
 }
 
 /*
  *-------------------------------------------------------------------------
  *
- * FixupName --
+ * ForwardUnlink --
  *
- *	Fixes control/parameter names using conventions from Android:
+ *	Dissolve forwarding from or to a device.
  *
- *	  - everything in lower case
- *	  - words separated by single dashes, e.g. "scene-mode"
+ *-------------------------------------------------------------------------
+ */
+
+static void
+ForwardUnlink(V4L2C *v4l2c)
+{
+    if (v4l2c->fwdDst != NULL) {
+	v4l2c->fwdDst->fwdSrc = NULL;
+	v4l2c->fwdDst = NULL;
+    }
+    if (v4l2c->fwdSrc != NULL) {
+	v4l2c->fwdSrc->fwdDst = NULL;
+	v4l2c->fwdSrc = NULL;
+    }
+}
+
+#ifdef V4L2_CAP_META_CAPTURE
+/*
+ *-------------------------------------------------------------------------
  *
- *	The string is modified in-place.
+ * MetaReady --
+ *
+ *	File handler of the UVC metadata node of a device. The
+ *	host timestamp, USB frame number, and the PTS/SCR fields
+ *	of the UVC payload header are recorded in a ring buffer
+ *	for lookup by frame sequence number.
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-FixupName(char *name, int length)
+MetaReady(ClientData clientData, int mask)
 {
-    char *p, *end;
+    V4L2C *v4l2c = (V4L2C *) clientData;
+    struct v4l2_buffer vbuf;
+    unsigned char *p;
+    VMETA *meta;
+    int hlen, flags;
 
-    p = name;
-    end = name + ((length < 0) ? strlen(name) : length);
-    while (p < end) {
-	if (p[0] >= '\0') {
-	    p[0] = tolower(p[0]);
-	}
-	if (p[0] > '\0') {
-	    if (strchr(" .,/_+(){}[]=&%$:;'#*~", p[0]) != NULL) {
-		p[0] = '-';
-	    }
-	}
-	++p;
+    if (!(mask & TCL_READABLE)) {
+	return;
     }
-    if (length > 0) {
-	name[length - 1] = '\0';
-    } else {
-	++end;
+    memset(&vbuf, 0, sizeof (vbuf));
+    vbuf.type = V4L2_BUF_TYPE_META_CAPTURE;
+    vbuf.memory = V4L2_MEMORY_MMAP;
+    if (DoIoctl(v4l2c->metaFd, VIDIOC_DQBUF, &vbuf) < 0) {
+	return;
     }
-    p = name;
-    while ((p = strchr(p, '-')) != NULL) {
-	if (p[1] == '-') {
-	    memmove(p, p + 1, end - p);
-	} else if (p[1] == '\0') {
-	    p[0] = '\0';
-	    break;
-	} else {
-	    ++p;
+    p = (unsigned char *) v4l2c->metaBufs[vbuf.index].start;
+    /* u64 ns, u16 sof, u8 length, u8 flags, u8 buf[] */
+    if (vbuf.bytesused >= 12) {
+	meta = &v4l2c->metaRing[v4l2c->metaHead];
+	v4l2c->metaHead = (v4l2c->metaHead + 1) %
+	    (sizeof (v4l2c->metaRing) / sizeof (v4l2c->metaRing[0]));
+	memset(meta, 0, sizeof (*meta));
+	meta->valid = 1;
+	meta->sequence = vbuf.sequence;
+	memcpy(&meta->ns, p, 8);
+	meta->sof = p[8] | (p[9] << 8);
+	hlen = p[10];
+	flags = p[11];
+	p += 12;
+	hlen -= 2;
+	if ((flags & 0x04) && (hlen >= 4) && (vbuf.bytesused >= 16)) {
+	    /* UVC_STREAM_PTS */
+	    meta->hasPts = 1;
+	    meta->pts = p[0] | (p[1] << 8) | (p[2] << 16) |
+		((unsigned int) p[3] << 24);
+	    p += 4;
+	    hlen -= 4;
+	}
+	if ((flags & 0x08) && (hlen >= 6) &&
+	    (p + 6 <= (unsigned char *)
+	     v4l2c->metaBufs[vbuf.index].start + vbuf.bytesused)) {
+	    /* UVC_STREAM_SCR */
+	    meta->hasScr = 1;
+	    meta->stc = p[0] | (p[1] << 8) | (p[2] << 16) |
+		((unsigned int) p[3] << 24);
+	    meta->scrSof = (p[4] | (p[5] << 8)) & 0x7FF;
 	}
     }
+    DoIoctl(v4l2c->metaFd, VIDIOC_QBUF, &vbuf);
 }
+#endif
 
 /*
  *-------------------------------------------------------------------------
  *
- * InitControls --
+ * MetaStart, MetaStop --
  *
- *	Fill (or release) V4L2C control structure with meta information
- *	about the device's controls.
+ *	Start or stop streaming of the metadata node paired with
+ *	a device. Failures are silently ignored, in which case no
+ *	metadata is available.
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-InitControls(V4L2C *v4l2c)
+MetaStop(V4L2C *v4l2c)
 {
-    long id;
-    int i, k, numFS, isNew;
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
-    struct v4l2_queryctrl qry;
-    struct v4l2_querymenu qmenu;
-    VCTRL *vctrl;
-    char buffer[128], fcbuf[8];
-#ifdef VIDIOC_ENUM_FRAMESIZES
-    const int *tryFmts;
-    int maxFmt;
-    Tcl_HashTable fmtTab;
-#endif
+#ifdef V4L2_CAP_META_CAPTURE
+    struct v4l2_requestbuffers req;
+    int i, type;
 
-    /* first, free up old stuff */
-    hPtr = Tcl_FirstHashEntry(&v4l2c->ctrl, &search);
-    while (hPtr != NULL) {
-	vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
-	Tcl_DStringFree(&vctrl->ds);
-	if ((vctrl != &v4l2c->fsize) && (vctrl != &v4l2c->frate)) {
-	    ckfree((char *) vctrl);
-	}
-	hPtr = Tcl_NextHashEntry(&search);
+    if (!v4l2c->metaRunning) {
+	return;
     }
-    Tcl_DeleteHashTable(&v4l2c->nctrl);
-    Tcl_InitHashTable(&v4l2c->nctrl, TCL_STRING_KEYS);
-    Tcl_DStringFree(&v4l2c->fsize.ds);
-    Tcl_DStringFree(&v4l2c->frate.ds);
+    Tcl_DeleteFileHandler(v4l2c->metaFd);
+    type = V4L2_BUF_TYPE_META_CAPTURE;
+    DoIoctl(v4l2c->metaFd, VIDIOC_STREAMOFF, &type);
+    for (i = 0; i < v4l2c->metaNbufs; i++) {
+	munmap(v4l2c->metaBufs[i].start, v4l2c->metaBufs[i].length);
+    }
+    v4l2c->metaNbufs = 0;
+    memset(&req, 0, sizeof (req));
+    req.type = V4L2_BUF_TYPE_META_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    DoIoctl(v4l2c->metaFd, VIDIOC_REQBUFS, &req);
+    v4l2c->metaRunning = 0;
+#endif
+}
 
-    /* done, when there's no opened device */
-    if (v4l2c->fd < 0) {
+static void
+MetaStart(V4L2C *v4l2c)
+{
+#ifdef V4L2_CAP_META_CAPTURE
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    int i, type;
+
+    if ((v4l2c->metaFd < 0) || v4l2c->metaRunning) {
+	return;
+    }
+    memset(v4l2c->metaRing, 0, sizeof (v4l2c->metaRing));
+    v4l2c->metaHead = 0;
+    memset(&req, 0, sizeof (req));
+    req.count = sizeof (v4l2c->metaBufs) / sizeof (v4l2c->metaBufs[0]);
+    req.type = V4L2_BUF_TYPE_META_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (DoIoctl(v4l2c->metaFd, VIDIOC_REQBUFS, &req) < 0) {
 	return;
     }
+    v4l2c->metaRunning = 1;
+    v4l2c->metaNbufs = 0;
+    for (i = 0; (i < (int) req.count) &&
+	     (i < (int) (sizeof (v4l2c->metaBufs) /
+			 sizeof (v4l2c->metaBufs[0]))); i++) {
+	memset(&buf, 0, sizeof (buf));
+	buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = i;
+	if (DoIoctl(v4l2c->metaFd, VIDIOC_QUERYBUF, &buf) < 0) {
+	    goto error;
+	}
+	v4l2c->metaBufs[i].length = buf.length;
+	v4l2c->metaBufs[i].start = mmap(NULL, buf.length, PROT_READ,
+					MAP_SHARED, v4l2c->metaFd,
+					buf.m.offset);
+	if (v4l2c->metaBufs[i].start == MAP_FAILED) {
+	    goto error;
+	}
+	v4l2c->metaNbufs++;
+	if (DoIoctl(v4l2c->metaFd, VIDIOC_QBUF, &buf) < 0) {
+	    goto error;
+	}
+    }
+    type = V4L2_BUF_TYPE_META_CAPTURE;
+    if (DoIoctl(v4l2c->metaFd, VIDIOC_STREAMON, &type) < 0) {
+	goto error;
+    }
+    Tcl_CreateFileHandler(v4l2c->metaFd, TCL_READABLE, MetaReady,
+			  (ClientData) v4l2c);
+    return;
 
-    /* fill in new information: base controls */
-    for (id = V4L2_CID_BASE; id < V4L2_CID_LASTP1; id++) {
-	memset(&qry, 0, sizeof (qry));
-	qry.id = id;
-	if ((DoIoctl(v4l2c->fd, VIDIOC_QUERYCTRL, &qry) != -1) &&
-	    ((qry.type == V4L2_CTRL_TYPE_INTEGER) ||
-	     (qry.type == V4L2_CTRL_TYPE_BOOLEAN) ||
-	     (qry.type == V4L2_CTRL_TYPE_MENU) ||
-	     (qry.type == V4L2_CTRL_TYPE_BUTTON) ||
-	     (qry.type == V4L2_CTRL_TYPE_INTEGER64)) &&
-	    !(qry.flags & V4L2_CTRL_FLAG_DISABLED)) {
-	    FixupName((char *) qry.name, sizeof (qry.name));
-	    if ((strcmp((char *) qry.name, "frame-size") == 0) ||
-		(strcmp((char *) qry.name, "frame-rate") == 0)) {
-		/* these names are reserved */
+error:
+    for (i = 0; i < v4l2c->metaNbufs; i++) {
+	munmap(v4l2c->metaBufs[i].start, v4l2c->metaBufs[i].length);
+    }
+    v4l2c->metaNbufs = 0;
+    req.count = 0;
+    DoIoctl(v4l2c->metaFd, VIDIOC_REQBUFS, &req);
+    v4l2c->metaRunning = 0;
+#endif
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MetaOpen --
+ *
+ *	Pair a device with a UVC metadata node, which is either
+ *	given by name or, for "auto", searched for as the metadata
+ *	capture node with the same bus information. An empty name
+ *	removes the pairing.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+MetaOpen(V4L2C *v4l2c, const char *devName)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+#ifdef V4L2_CAP_META_CAPTURE
+    struct v4l2_capability cap, cap2;
+    struct dirent *ent;
+    Tcl_DString ds;
+    DIR *dir;
+    int fd = -1, caps;
+#endif
+
+    MetaStop(v4l2c);
+    if (v4l2c->metaFd >= 0) {
+	close(v4l2c->metaFd);
+	v4l2c->metaFd = -1;
+    }
+    Tcl_DStringSetLength(&v4l2c->metaName, 0);
+    if (devName[0] == '\0') {
+	return TCL_OK;
+    }
+#ifdef V4L2_CAP_META_CAPTURE
+    Tcl_DStringInit(&ds);
+    if (strcmp(devName, "auto") == 0) {
+	if ((QueryCaps(v4l2c->fd, &cap) < 0) ||
+	    ((dir = opendir("/dev")) == NULL)) {
+	    goto notFound;
+	}
+	while ((fd < 0) && ((ent = readdir(dir)) != NULL)) {
+	    if (strncmp(ent->d_name, "video", 5) != 0) {
 		continue;
 	    }
-	    hPtr = Tcl_CreateHashEntry(&v4l2c->ctrl, (ClientData) id, &isNew);
-	    if (isNew) {
-		vctrl = (VCTRL *) ckalloc(sizeof (VCTRL));
-		Tcl_DStringInit(&vctrl->ds);
-		Tcl_SetHashValue(hPtr, (ClientData) vctrl);
-		vctrl->useOld = (qry.type != V4L2_CTRL_TYPE_INTEGER64) ? -1 : 0;
-	    } else {
-		vctrl = (VCTRL*) Tcl_GetHashValue(hPtr);
-		Tcl_DStringSetLength(&vctrl->ds, 0);
+	    Tcl_DStringSetLength(&ds, 0);
+	    Tcl_DStringAppend(&ds, "/dev/", -1);
+	    Tcl_DStringAppend(&ds, ent->d_name, -1);
+	    fd = open(Tcl_DStringValue(&ds), O_RDWR | O_NONBLOCK, 0);
+	    if (fd < 0) {
+		continue;
 	    }
-	    vctrl->qry = qry;
-	    if (qry.type == V4L2_CTRL_TYPE_MENU) {
-		for (i = qry.minimum; i <= qry.maximum; i++) {
-		    memset(&qmenu, 0, sizeof (qmenu));
-		    qmenu.id = qry.id;
-		    qmenu.index = i;
-		    if (DoIoctl(v4l2c->fd, VIDIOC_QUERYMENU, &qmenu) < 0) {
-			/* force empty menu entry */
-			strcpy((char *) qmenu.name, ",");
-		    } else {
-			FixupName((char *) qmenu.name, sizeof (qmenu.name));
-			if ((qmenu.name[0] == '\0') ||
-			    (strcmp((char *) qmenu.name, "-") == 0)) {
-			    sprintf((char *) qmenu.name, "%d", i);
-			}
-		    }
-		    Tcl_DStringAppend(&vctrl->ds, (char *) qmenu.name, -1);
-		    Tcl_DStringAppend(&vctrl->ds, "\0", 1);
-		}
+	    caps = QueryCaps(fd, &cap2);
+	    if ((caps < 0) || !(caps & V4L2_CAP_META_CAPTURE) ||
+		(strcmp((char *) cap.bus_info, (char *) cap2.bus_info) != 0)) {
+		close(fd);
+		fd = -1;
 	    }
 	}
+	closedir(dir);
+	if (fd < 0) {
+notFound:
+	    Tcl_DStringFree(&ds);
+	    Tcl_SetResult(interp, "no metadata node found", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+    } else {
+	Tcl_DStringAppend(&ds, devName, -1);
+	fd = open(devName, O_RDWR | O_NONBLOCK, 0);
+	if (fd < 0) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("error while opening \"%s\": %s",
+			      devName, Tcl_PosixError(interp)));
+	    Tcl_DStringFree(&ds);
+	    return TCL_ERROR;
+	}
+	caps = QueryCaps(fd, &cap2);
+	if ((caps < 0) || !(caps & V4L2_CAP_META_CAPTURE)) {
+	    close(fd);
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("\"%s\" is not a metadata device", devName));
+	    Tcl_DStringFree(&ds);
+	    return TCL_ERROR;
+	}
     }
-
-    /* older kernels lack this */
-#ifndef V4L2_CTRL_CLASS_CAMERA
-#define V4L2_CTRL_CLASS_CAMERA (V4L2_CTRL_CLASS_USER + 0x00020000)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    v4l2c->metaFd = fd;
+    Tcl_DStringAppend(&v4l2c->metaName, Tcl_DStringValue(&ds),
+		      Tcl_DStringLength(&ds));
+    Tcl_DStringFree(&ds);
+    if (v4l2c->running > 0) {
+	MetaStart(v4l2c);
+    }
+    return TCL_OK;
+#else
+    Tcl_SetResult(interp, "unsupported on this platform", TCL_STATIC);
+    return TCL_ERROR;
 #endif
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameTime --
+ *
+ *	Report timing information of the last ready frame. Besides
+ *	the kernel buffer timestamp, metadata with the same sequence
+ *	number is reported. When the payload header carries the
+ *	presentation time stamp, the device clock is estimated from
+ *	the SCR fields of recent frames and the start of exposure
+ *	is converted to host time.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-    /* fill in new information: camera controls */
-    for (id = V4L2_CTRL_CLASS_CAMERA | V4L2_CTRL_FLAG_NEXT_CTRL;;) {
-	memset(&qry, 0, sizeof (qry));
-	qry.id = id;
-	if (DoIoctl(v4l2c->fd, VIDIOC_QUERYCTRL, &qry) == -1) {
-	    break;
+static int
+FrameTime(V4L2C *v4l2c)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    Tcl_Obj *list;
+    VMETA *m, *meta = NULL, *first = NULL, *last = NULL;
+    int i, n;
+
+    if (v4l2c->bufrdy < 0) {
+	Tcl_SetResult(interp, "no frame available", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    list = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("sequence", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(v4l2c->rdySeq));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("time", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewDoubleObj(v4l2c->rdyTime));
+    n = sizeof (v4l2c->metaRing) / sizeof (v4l2c->metaRing[0]);
+    for (i = 0; v4l2c->metaRunning && (i < n); i++) {
+	m = &v4l2c->metaRing[i];
+	if (!m->valid) {
+	    continue;
 	}
-	if (V4L2_CTRL_ID2CLASS(qry.id) != V4L2_CTRL_CLASS_CAMERA) {
-	    break;
+	if (m->sequence == v4l2c->rdySeq) {
+	    meta = m;
 	}
-	if (((qry.type == V4L2_CTRL_TYPE_INTEGER) ||
-	     (qry.type == V4L2_CTRL_TYPE_BOOLEAN) ||
-	     (qry.type == V4L2_CTRL_TYPE_MENU) ||
-	     (qry.type == V4L2_CTRL_TYPE_BUTTON) ||
-	     (qry.type == V4L2_CTRL_TYPE_INTEGER64)) &&
-	    !(qry.flags & V4L2_CTRL_FLAG_DISABLED)) {
-	    FixupName((char *) qry.name, sizeof (qry.name));
-	    if ((strcmp((char *) qry.name, "frame-size") == 0) ||
-		(strcmp((char *) qry.name, "frame-rate") == 0)) {
-		/* these names are reserved */
-		continue;
+	if (m->hasScr) {
+	    if ((first == NULL) || (m->ns < first->ns)) {
+		first = m;
 	    }
-	    hPtr = Tcl_CreateHashEntry(&v4l2c->ctrl, (ClientData) id, &isNew);
-	    if (isNew) {
-		vctrl = (VCTRL *) ckalloc(sizeof (VCTRL));
-		Tcl_DStringInit(&vctrl->ds);
-		Tcl_SetHashValue(hPtr, (ClientData) vctrl);
-		vctrl->useOld = 0;
-	    } else {
-		vctrl = (VCTRL*) Tcl_GetHashValue(hPtr);
-		Tcl_DStringSetLength(&vctrl->ds, 0);
+	    if ((last == NULL) || (m->ns > last->ns)) {
+		last = m;
 	    }
-	    vctrl->qry = qry;
-	    if (qry.type == V4L2_CTRL_TYPE_MENU) {
-		for (i = qry.minimum; i <= qry.maximum; i++) {
-		    memset(&qmenu, 0, sizeof (qmenu));
-		    qmenu.id = qry.id;
-		    qmenu.index = i;
-		    if (DoIoctl(v4l2c->fd, VIDIOC_QUERYMENU, &qmenu) < 0) {
-			/* force empty menu entry */
-			strcpy((char *) qmenu.name, ",");
-		    } else {
-			FixupName((char *) qmenu.name, sizeof (qmenu.name));
-			if ((qmenu.name[0] == '\0') ||
-			    (strcmp((char *) qmenu.name, "-") == 0)) {
-			    sprintf((char *) qmenu.name, "%d", i);
-			}
-		    }
-		    Tcl_DStringAppend(&vctrl->ds, (char *) qmenu.name, -1);
-		    Tcl_DStringAppend(&vctrl->ds, "\0", 1);
-		}
+	}
+    }
+    if (meta != NULL) {
+	Tcl_ListObjAppendElement(NULL, list,
+				 Tcl_NewStringObj("host-time", -1));
+	Tcl_ListObjAppendElement(NULL, list,
+				 Tcl_NewDoubleObj(meta->ns / 1.0e9));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("sof", -1));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(meta->sof));
+	if (meta->hasPts) {
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewStringObj("pts", -1));
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewWideIntObj(meta->pts));
+	}
+	if (meta->hasScr) {
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewStringObj("stc", -1));
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewWideIntObj(meta->stc));
+	}
+	if (meta->hasPts && (first != NULL) && (last->ns > first->ns)) {
+	    VMETA *ref = meta->hasScr ? meta : last;
+	    double freq, t;
+
+	    freq = (double) (unsigned int) (last->stc - first->stc) *
+		1.0e9 / (double) (last->ns - first->ns);
+	    if (freq > 0) {
+		t = ref->ns / 1.0e9 - (int) (ref->stc - meta->pts) / freq;
+		Tcl_ListObjAppendElement(NULL, list,
+					 Tcl_NewStringObj("clock", -1));
+		Tcl_ListObjAppendElement(NULL, list, Tcl_NewDoubleObj(freq));
+		Tcl_ListObjAppendElement(NULL, list,
+					 Tcl_NewStringObj("capture-time", -1));
+		Tcl_ListObjAppendElement(NULL, list, Tcl_NewDoubleObj(t));
 	    }
 	}
-	id = qry.id | V4L2_CTRL_FLAG_NEXT_CTRL;
     }
+    Tcl_SetObjResult(interp, list);
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * StopCapture --
+ *
+ *	Stop capture if running. Releases all frame buffers to
+ *	allow to restart another capture. The file handler for
+ *	the device is deleted, i.e. no further callbacks can
+ *	be triggered.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-    /* fill string mapping */
-    hPtr = Tcl_FirstHashEntry(&v4l2c->ctrl, &search);
-    while (hPtr != NULL) {
-	Tcl_HashEntry *hPtr2;
+static int
+StopCapture(V4L2C *v4l2c)
+{
+    int type;
 
-	vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
-	hPtr2 = Tcl_CreateHashEntry(&v4l2c->nctrl, (char *) vctrl->qry.name,
-				    &isNew);
-	Tcl_SetHashValue(hPtr2, (ClientData) vctrl);
-	hPtr = Tcl_NextHashEntry(&search);
+    if (v4l2c->running > 0) {
+	Tcl_DeleteFileHandler(v4l2c->fd);
+	/* stop capture */
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	DoIoctl(v4l2c->fd, VIDIOC_STREAMOFF, &type);
+	ReleaseBuffers(v4l2c);
+	MetaStop(v4l2c);
+	/* done */
+	v4l2c->running = 0;
+	v4l2c->stalled = 0;
+	v4l2c->paused = 0;
+	v4l2c->bufrdy = -1;
+	v4l2c->bufdone = 0;
+    }
+    if (v4l2c->snapshot) {
+	v4l2c->snapshot = 0;
+	if (v4l2c->snapStop) {
+	    v4l2c->width = v4l2c->snapWidth;
+	    v4l2c->height = v4l2c->snapHeight;
+	    v4l2c->wantFormat = v4l2c->snapFormat;
+	}
     }
+    if (v4l2c->snapCmd != NULL) {
+	Tcl_DecrRefCount(v4l2c->snapCmd);
+	v4l2c->snapCmd = NULL;
+    }
+    if (v4l2c->idle && (v4l2c->activeFps > 0)) {
+	v4l2c->fps = v4l2c->activeFps;
+    }
+    v4l2c->idle = 0;
+    v4l2c->activeFps = 0;
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * PauseCapture --
+ *
+ *	Suspend a running capture. Only the stream is turned off,
+ *	all frame buffers stay mapped and the last ready buffer
+ *	can still be retrieved.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-    /* frame-size pseudo menu control */
-    v4l2c->fsize.qry.type = V4L2_CTRL_TYPE_MENU;
-    strcpy((char *) v4l2c->fsize.qry.name, "frame-size");
-    numFS = 0;
-#ifdef VIDIOC_ENUM_FRAMESIZES
-    Tcl_InitHashTable(&fmtTab, TCL_STRING_KEYS);
-    if (v4l2c->isLoopDev) {
-	tryFmts = FormatsLoop;
-	maxFmt = sizeof (FormatsLoop) / sizeof (FormatsLoop[0]);
-    } else {
-	tryFmts = FormatsNormal;
-	maxFmt = sizeof (FormatsNormal) / sizeof (FormatsNormal[0]);
+static int
+PauseCapture(V4L2C *v4l2c)
+{
+    int type;
+
+    if ((v4l2c->running > 0) && !v4l2c->paused) {
+	Tcl_DeleteFileHandler(v4l2c->fd);
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	DoIoctl(v4l2c->fd, VIDIOC_STREAMOFF, &type);
+	v4l2c->paused = 1;
+	v4l2c->stalled = 0;
     }
-    for (k = 0; k < maxFmt; k++) {
-	for (i = 0; i >= 0; i++) {
-	    struct v4l2_frmsizeenum qfsz;
+    return TCL_OK;
+}
+
+/*
+ * Number of frames to discard after switching to snapshot format.
+ */
 
-	    memset(&qfsz, 0, sizeof (qfsz));
-	    qfsz.index = i;
-	    qfsz.pixel_format = tryFmts[k];
-	    if (DoIoctl(v4l2c->fd, VIDIOC_ENUM_FRAMESIZES, &qfsz) < 0) {
-		break;
-	    }
-	    if (qfsz.pixel_format != tryFmts[k]) {
-		goto sizesDone;
-	    }
-	    switch (qfsz.type) {
-	    case V4L2_FRMSIZE_TYPE_DISCRETE:
-		sprintf(buffer, "%dx%d%s", qfsz.discrete.width,
-			qfsz.discrete.height,
-			fourcc_str(qfsz.pixel_format, fcbuf));
-		Tcl_CreateHashEntry(&fmtTab, buffer, &isNew);
-		if (isNew) {
-		    Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
-		    Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
-		    numFS++;
-		}
-		break;
-	    case V4L2_FRMSIZE_TYPE_STEPWISE:
-		while (1) {
-		    sprintf(buffer, "%dx%d%s", qfsz.stepwise.min_width,
-			    qfsz.stepwise.min_height,
-			    fourcc_str(qfsz.pixel_format, fcbuf));
-		    Tcl_CreateHashEntry(&fmtTab, buffer, &isNew);
-		    if (isNew) {
-			Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
-			Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
-			numFS++;
-		    }
-		    qfsz.stepwise.min_width += qfsz.stepwise.step_width;
-		    qfsz.stepwise.min_height += qfsz.stepwise.step_height;
-		    if ((qfsz.stepwise.min_width >= qfsz.stepwise.max_width) ||
-			(qfsz.stepwise.min_height >= qfsz.stepwise.max_height)) {
-			break;
-		    }
-		}
-		goto sizesDone;
-	    case V4L2_FRMSIZE_TYPE_CONTINUOUS:
-		sprintf(buffer, "+%dx%d%s", qfsz.stepwise.min_width,
-			qfsz.stepwise.min_height,
-			fourcc_str(qfsz.pixel_format, fcbuf));
-		Tcl_CreateHashEntry(&fmtTab, buffer, &isNew);
-		if (isNew) {
-		    Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
-		    Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
-		    sprintf(buffer, "+%dx%d%s", qfsz.stepwise.max_width,
-			    qfsz.stepwise.max_height,
-			    fourcc_str(qfsz.pixel_format, fcbuf));
-		    Tcl_CreateHashEntry(&fmtTab, buffer, &isNew);
-		    Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
-		    Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
-		    numFS += 2;
-		}
-		/* FALLTHROUGH */
-	    default:
-		goto sizesDone;
-	    }
-	}
-sizesDone:
-	;
-    }
-    Tcl_DeleteHashTable(&fmtTab);
-#endif
-    if (numFS == 0) {
-	/* fallback to last set format */
-	sprintf(buffer, "%dx%d%s", v4l2c->width, v4l2c->height,
-		fourcc_str(v4l2c->format, fcbuf));
-	Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
-	Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
-	numFS++;
-    }
-    v4l2c->fsize.qry.minimum = 0;
-    v4l2c->fsize.qry.maximum = numFS - 1;
-    id = v4l2c->fsize.qry.id;	/* special, is 0x00000000 */
-    hPtr = Tcl_CreateHashEntry(&v4l2c->ctrl, (ClientData) id, &isNew);
-    Tcl_SetHashValue(hPtr, (ClientData) &v4l2c->fsize);
-    hPtr = Tcl_CreateHashEntry(&v4l2c->nctrl, "frame-size", &isNew);
-    Tcl_SetHashValue(hPtr, (ClientData) &v4l2c->fsize);
+#define SNAPSHOT_WARMUP 2
 
-    /* frame-rate pseudo control */
-    v4l2c->frate.qry.type = V4L2_CTRL_TYPE_INTEGER;
-    v4l2c->frate.qry.id = 1;
-    strcpy((char *) v4l2c->frate.qry.name, "frame-rate");
-    v4l2c->frate.qry.minimum = 1;
-    v4l2c->frate.qry.maximum = 200;
-    v4l2c->frate.qry.default_value = 15;
-    v4l2c->frate.qry.step = 1;
-    id = v4l2c->frate.qry.id;	/* special, is 0x00000001 */
-    hPtr = Tcl_CreateHashEntry(&v4l2c->ctrl, (ClientData) id, &isNew);
-    Tcl_SetHashValue(hPtr, (ClientData) &v4l2c->frate);
-    hPtr = Tcl_CreateHashEntry(&v4l2c->nctrl, "frame-rate", &isNew);
-    Tcl_SetHashValue(hPtr, (ClientData) &v4l2c->frate);
-}
+/*
+ * Timeout in milliseconds waiting for a frame of a snapshot.
+ */
+
+#define SNAPSHOT_TIMEOUT 5000
+
+/*
+ * Interval in milliseconds polling for an unplugged device.
+ */
+
+#define REATTACH_INTERVAL 250
+
+/*
+ * Limit in milliseconds of the polling interval when searching by
+ * bus information, which opens every video node. The interval is
+ * doubled on each miss; plug events trigger an immediate search.
+ */
+
+#define REATTACH_MAXINTERVAL 16000
+
+/*
+ * Timeout in milliseconds waiting for a M2M conversion.
+ */
+
+#define M2M_TIMEOUT 2000
+
+/*
+ * Timeout in milliseconds waiting for a fresh frame after an
+ * idle device was woken up.
+ */
+
+#define IDLE_WAKEUP_TIMEOUT 1000
+
+/*
+ * Maximum number of frames of a burst.
+ */
+
+#define BURST_MAXCOUNT 256
 
 /*
  *-------------------------------------------------------------------------
  *
- * GetZZString --
+ * IdleSuspend --
  *
- *	Given index return corresponding string from a double zero
- *	terminated string list.
+ *	Idle policy of a device: when no image has been retrieved
+ *	for the configured time, the stream is turned off or the
+ *	frame rate is lowered. A device feeding a recorder or file
+ *	writer is never idle. The just dequeued buffer vbuf is
+ *	queued again in that case. Returns true when the capture
+ *	has been suspended.
  *
  *-------------------------------------------------------------------------
  */
 
-static char *
-GetZZString(char *string, int index)
+static int
+IdleSuspend(V4L2C *v4l2c, struct v4l2_buffer *vbuf)
 {
-    int i = 0;
+    Tcl_Time now;
+    double elapsed;
 
-    while (i < index) {
-	if (string[0] == '\0') {
-	    return string;
-	}
-	++i;
-	string += strlen(string) + 1;
+    if ((v4l2c->idleTime <= 0) || v4l2c->idle || (v4l2c->running <= 0) ||
+	v4l2c->paused) {
+	return 0;
     }
-    if (string[0] == ',') {
-	++string;
+    if ((v4l2c->rec != NULL) || (v4l2c->y4m != NULL) ||
+	(v4l2c->avi != NULL) || (v4l2c->vlz != NULL)) {
+	/* recording consumes every frame */
+	return 0;
     }
-    return string;
+    if ((v4l2c->idleFps > 0) && (v4l2c->idleFps >= v4l2c->fps)) {
+	/* would not lower the frame rate */
+	return 0;
+    }
+    Tcl_GetTime(&now);
+    elapsed = (now.sec - v4l2c->lastFetch.sec) +
+	(now.usec - v4l2c->lastFetch.usec) / 1000000.0;
+    if (elapsed < v4l2c->idleTime) {
+	return 0;
+    }
+    if (DoIoctl(v4l2c->fd, VIDIOC_QBUF, vbuf) < 0) {
+	return 0;
+    }
+    v4l2c->idle = 1;
+    if (v4l2c->idleFps <= 0) {
+	PauseCapture(v4l2c);
+    } else {
+	v4l2c->activeFps = v4l2c->fps;
+	ReconfigureCapture(v4l2c, v4l2c->width, v4l2c->height,
+			   v4l2c->format, v4l2c->idleFps);
+    }
+    return 1;
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
- * GetControls --
- *
- *	Read out current values of device controls and return
- *	these as list made up of key value pairs. Added meta
- *	information entries to support user interface:
+ * IdleCancel --
  *
- *	  <name>-values    comma separated list of menu choices
- *	  <name>-minimum   minimum value for bool/integer
- *	  <name>-maximum   minimum value for bool/integer
- *	  <name>-step      interval step value for integer
- *	  <name>-default   default value for bool/integer
+ *	Leave the idle state of a device without resuming the
+ *	capture, used when the device is paused explicitly. A
+ *	lowered frame rate is set back for the next resume.
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-GetControls(V4L2C *v4l2c, Tcl_Obj *list)
+IdleCancel(V4L2C *v4l2c)
 {
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
-
-    hPtr = Tcl_FirstHashEntry(&v4l2c->ctrl, &search);
-    while (hPtr != NULL) {
-	VCTRL *vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
-	struct v4l2_ext_controls xs;
-	struct v4l2_ext_control xc;
-	Tcl_Obj *obj;
-	char *p;
-	int i, k;
+    int idleFps;
 
-	Tcl_ListObjAppendElement(NULL, list,
-		Tcl_NewStringObj((char *) vctrl->qry.name, -1));
-	memset(&xs, 0, sizeof (xs));
-	xs.ctrl_class = V4L2_CTRL_ID2CLASS(vctrl->qry.id);
-	xs.count = 1;
-	xs.error_idx = 0;
-	xs.controls = &xc;
-	memset(&xc, 0, sizeof (xc));
-	xc.id = vctrl->qry.id;
-	if (vctrl == &v4l2c->fsize) {
-	    goto doVal;
-	}
-	if (vctrl == &v4l2c->frate) {
-	    xc.value = v4l2c->fps;
-	    goto doVal;
+    if (!v4l2c->idle) {
+	return;
+    }
+    v4l2c->idle = 0;
+    if (v4l2c->activeFps > 0) {
+	idleFps = v4l2c->fps;
+	v4l2c->fps = v4l2c->activeFps;
+	if (SetFrameRate(v4l2c) < 0) {
+	    v4l2c->fps = idleFps;
 	}
+    }
+    v4l2c->activeFps = 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * SnapshotWarmup --
+ *
+ *	Check if a frame dequeued after switching to snapshot format
+ *	is a warm-up frame, which is requeued at once. Warm-up is
+ *	decided by the sequence number relative to the first frame
+ *	received, with a limit on the frame count for drivers not
+ *	maintaining sequence numbers. Returns true for warm-up frames.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	/* older kernels lack this */
-#ifndef V4L2_CTRL_FLAG_WRITE_ONLY
-#define V4L2_CTRL_FLAG_WRITE_ONLY 0x0040
-#endif
+static int
+SnapshotWarmup(V4L2C *v4l2c, struct v4l2_buffer *vbuf)
+{
+    if (v4l2c->snapCount++ == 0) {
+	v4l2c->snapFirst = vbuf->sequence;
+    }
+    if (((vbuf->sequence - v4l2c->snapFirst) < SNAPSHOT_WARMUP) &&
+	(v4l2c->snapCount <= 2 * SNAPSHOT_WARMUP)) {
+	DoIoctl(v4l2c->fd, VIDIOC_QBUF, vbuf);
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * TakeBuffer --
+ *
+ *	Make a dequeued buffer the last ready buffer. An already
+ *	obtained older frame buffer is queued again.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	if (!(vctrl->qry.flags & V4L2_CTRL_FLAG_WRITE_ONLY)) {
-	    if (vctrl->useOld > 0) {
-		struct v4l2_control xd;
+static int
+TakeBuffer(V4L2C *v4l2c, struct v4l2_buffer *vbuf)
+{
+    v4l2c->rdyUsed = vbuf->bytesused;
+    v4l2c->rdyFlags = vbuf->flags;
+    if (v4l2c->bufrdy >= 0) {
+	int swap = vbuf->index;
 
-		xd.id = xc.id;
-		xd.value = 0;
-		if (DoIoctl(v4l2c->fd, VIDIOC_G_CTRL, &xd) != -1) {
-		    xc.value = xd.value;
-		}
-	    } else if (DoIoctl(v4l2c->fd, VIDIOC_G_EXT_CTRLS, &xs) < 0) {
-		if ((errno == EINVAL) && (vctrl->useOld < 0)) {
-		    struct v4l2_control xd;
+	vbuf->index = v4l2c->bufrdy;
+	v4l2c->bufrdy = swap;
+	if (DoIoctl(v4l2c->fd, VIDIOC_QBUF, vbuf) < 0) {
+	    return TCL_ERROR;
+	}
+    } else {
+	v4l2c->bufrdy = vbuf->index;
+    }
+    v4l2c->rdySeq = vbuf->sequence;
+    v4l2c->rdyTime = vbuf->timestamp.tv_sec +
+	vbuf->timestamp.tv_usec / 1000000.0;
+    v4l2c->bufdone = 0;
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * WaitBuffer --
+ *
+ *	Wait up to the given number of milliseconds for a frame and
+ *	dequeue it, bypassing the file handler. Used for synchronous
+ *	captures. Returns -1 with errno set on error or timeout.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-		    /* retry with old ioctl() command */
-		    xd.id = xc.id;
-		    xd.value = 0;
-		    if (DoIoctl(v4l2c->fd, VIDIOC_G_CTRL, &xd) != -1) {
-			xc.value = xd.value;
-			vctrl->useOld = 1;
-		    }
-		}
+static int
+WaitBuffer(V4L2C *v4l2c, struct v4l2_buffer *vbuf, int timeout)
+{
+    struct pollfd pfd;
+    int n;
+
+    for (;;) {
+	pfd.fd = v4l2c->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	n = poll(&pfd, 1, timeout);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
 	    }
+	    return -1;
 	}
-doVal:
-	switch (vctrl->qry.type) {
-	case V4L2_CTRL_TYPE_INTEGER:
-	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(xc.value));
-	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
-	    Tcl_AppendToObj(obj, "-minimum", -1);
-	    Tcl_ListObjAppendElement(NULL, list, obj);
-	    Tcl_ListObjAppendElement(NULL, list,
-				     Tcl_NewIntObj(vctrl->qry.minimum));
-	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
-	    Tcl_AppendToObj(obj, "-maximum", -1);
-	    Tcl_ListObjAppendElement(NULL, list, obj);
-	    Tcl_ListObjAppendElement(NULL, list,
-				     Tcl_NewIntObj(vctrl->qry.maximum));
-	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
-	    Tcl_AppendToObj(obj, "-default", -1);
-	    Tcl_ListObjAppendElement(NULL, list, obj);
-	    Tcl_ListObjAppendElement(NULL, list,
-				     Tcl_NewIntObj(vctrl->qry.default_value));
-	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
-	    Tcl_AppendToObj(obj, "-step", -1);
-	    Tcl_ListObjAppendElement(NULL, list, obj);
-	    Tcl_ListObjAppendElement(NULL, list,
-				     Tcl_NewIntObj(vctrl->qry.step));
-	    break;
-	case V4L2_CTRL_TYPE_BOOLEAN:
-	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(xc.value != 0));
-	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
-	    Tcl_AppendToObj(obj, "-minimum", -1);
-	    Tcl_ListObjAppendElement(NULL, list, obj);
-	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(0));
-	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
-	    Tcl_AppendToObj(obj, "-maximum", -1);
-	    Tcl_ListObjAppendElement(NULL, list, obj);
-	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(1));
-	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
-	    Tcl_AppendToObj(obj, "-default", -1);
-	    Tcl_ListObjAppendElement(NULL, list, obj);
-	    Tcl_ListObjAppendElement(NULL, list,
-				     Tcl_NewIntObj(vctrl->qry.default_value));
-	    break;
-	case V4L2_CTRL_TYPE_INTEGER64:
-	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(xc.value64));
-	    break;
-	case V4L2_CTRL_TYPE_BUTTON:
-	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewObj());
-	    break;
-	case V4L2_CTRL_TYPE_MENU:
-	    p = Tcl_DStringValue(&vctrl->ds);
-	    if (vctrl == &v4l2c->fsize) {
-		int format;
-		char buffer[128], fcbuf[8];
-
-		format = v4l2c->running ? v4l2c->format : v4l2c->wantFormat;
-		sprintf(buffer, "%dx%d%s", v4l2c->width, v4l2c->height,
-			fourcc_str(format, fcbuf));
-		Tcl_ListObjAppendElement(NULL, list,
-		    Tcl_NewStringObj(buffer, -1));
-	    } else {
-		Tcl_ListObjAppendElement(NULL, list,
-		    Tcl_NewStringObj(GetZZString(p, xc.value), -1));
-	    }
-	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
-	    Tcl_AppendToObj(obj, "-values", -1);
-	    Tcl_ListObjAppendElement(NULL, list, obj);
-	    obj = Tcl_NewStringObj("", 0);
-	    k = 0;
-	    for (i = 0; i <= vctrl->qry.maximum - vctrl->qry.minimum; i++) {
-		char *entry = GetZZString(p, i);
-
-		if (k > 0) {
-		    Tcl_AppendToObj(obj, ",", 1);
-		}
-		if (entry[0] != '\0') {
-		    Tcl_AppendToObj(obj, entry, -1);
-		    k++;
-		}
+	if (n == 0) {
+	    errno = ETIMEDOUT;
+	    return -1;
+	}
+	memset(vbuf, 0, sizeof (*vbuf));
+	vbuf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	vbuf->memory = V4L2_MEMORY_MMAP;
+	if (DoIoctl(v4l2c->fd, VIDIOC_DQBUF, vbuf) < 0) {
+	    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+		continue;
 	    }
-	    Tcl_ListObjAppendElement(NULL, list, obj);
-	    break;
-	default: /* V4L2_CTRL_TYPE_CTRL_CLASS, V4L2_CTRL_TYPE_STRING */
-	    /* should not happen */
-	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewObj());
-	    break;
+	    return -1;
 	}
-	hPtr = Tcl_NextHashEntry(&search);
+	return 0;
     }
 }
 
 /*
  *-------------------------------------------------------------------------
  *
- * SetControls --
+ * DeliverFrame --
  *
- *	Set device controls given list of key value pairs.
+ *	Hand the last ready frame of a capture device to recorders,
+ *	file writers, the HTTP server, and forwarding. Returns true
+ *	when the frame was forwarded, which replaces the per-frame
+ *	Tcl callback.
  *
  *-------------------------------------------------------------------------
  */
 
 static int
-SetControls(V4L2C *v4l2c, int objc, Tcl_Obj * const objv[])
+DeliverFrame(V4L2C *v4l2c)
 {
-    Tcl_Interp *interp = v4l2c->interp;
-    Tcl_HashEntry *hPtr;
-    int i, k;
-
-    for (i = 0; i < objc; i += 2) {
-	VCTRL *vctrl;
-	struct v4l2_ext_controls xs;
-	struct v4l2_ext_control xc;
-	int ival;
-	Tcl_WideInt wval;
-
-	hPtr = Tcl_FindHashEntry(&v4l2c->nctrl, Tcl_GetString(objv[i]));
-	if (hPtr == NULL) {
-	    continue;
-	}
-	vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
-	if ((vctrl->qry.flags & V4L2_CTRL_FLAG_READ_ONLY) ||
-	    (vctrl->qry.flags & V4L2_CTRL_FLAG_INACTIVE)) {
-	    continue;
-	}
-	if (vctrl == &v4l2c->fsize) {
-	    int w = -1, h = -1;
-	    const char *fmt = Tcl_GetString(objv[i + 1]);
-
-	    if ((sscanf(fmt, "%dx%d", &w, &h) == 2) &&
-		(w > 0) && (h > 0) && (v4l2c->running <= 0)) {
-		v4l2c->width = w;
-		v4l2c->height = h;
-		v4l2c->wantFormat = 0;
-		fmt = strchr(fmt, '@');
-		if ((fmt != NULL) && (strlen(fmt) > 1)) {
-		    char fcbuf[4];
-
-		    memset(fcbuf, ' ', 4);
-		    fmt++;
-		    k = 0;
-		    while ((k < 4) && (*fmt != '\0')) {
-			fcbuf[k] = *fmt++;
-			k++;
-		    }
-		    v4l2c->wantFormat =
-			v4l2_fourcc(fcbuf[0], fcbuf[1], fcbuf[2], fcbuf[3]);
-		}
-	    }
-	    continue;
-	}
-	if (vctrl == &v4l2c->frate) {
-	    int fps;
-
-	    if (Tcl_GetIntFromObj(NULL, objv[i + 1], &fps) != TCL_OK) {
-		/* ignored */
-		continue;
-	    }
-	    if ((fps > 0) && (fps < 200)) {
-		v4l2c->fps = fps;
-	    }
-	    continue;
-	}
-	memset(&xs, 0, sizeof (xs));
-	xs.ctrl_class = V4L2_CTRL_ID2CLASS(vctrl->qry.id);
-	xs.count = 1;
-	xs.error_idx = 0;
-	xs.controls = &xc;
-	memset(&xc, 0, sizeof (xc));
-	xc.id = vctrl->qry.id;
-	switch (vctrl->qry.type) {
-	case V4L2_CTRL_TYPE_INTEGER:
-	case V4L2_CTRL_TYPE_BOOLEAN:
-	    if (Tcl_GetIntFromObj(NULL, objv[i + 1], &ival) != TCL_OK) {
-		/* ignored */
-		continue;
-	    }
-	    xc.value = ival;
-	    break;
-	case V4L2_CTRL_TYPE_INTEGER64:
-	    if (Tcl_GetWideIntFromObj(NULL, objv[i + 1], &wval) != TCL_OK) {
-		/* ignored */
-		continue;
-	    }
-	    xc.value64 = wval;
-	    break;
-	case V4L2_CTRL_TYPE_BUTTON:
-	    /* value ignored */
-	    break;
-	case V4L2_CTRL_TYPE_MENU:
-	    for (k = 0; k <= vctrl->qry.maximum - vctrl->qry.minimum; k++) {
-		char *entry = GetZZString(Tcl_DStringValue(&vctrl->ds), k);
-
-		/* ignore empty entries */
-		if ((entry[0] != '\0') &&
-		    (strcmp(entry, Tcl_GetString(objv[i + 1])) == 0)) {
-		    xc.value = k + vctrl->qry.minimum;
-		    break;
-		}
-	    }
-	    if (k > vctrl->qry.maximum - vctrl->qry.minimum) {
-		/* ignored */
-		continue;
-	    }
-	    break;
-	default: /* V4L2_CTRL_TYPE_CTRL_CLASS, V4L2_CTRL_TYPE_STRING */
-	    /* should not happen, ignored */
-	    continue;
-	}
-	if (vctrl->useOld > 0) {
-	    struct v4l2_control xd;
-
-	    xd.id = xc.id;
-	    xd.value = xc.value;
-	    if (DoIoctl(v4l2c->fd, VIDIOC_S_CTRL, &xd) < 0) {
-		goto errorSet;
-	    }
-	} else if (DoIoctl(v4l2c->fd, VIDIOC_S_EXT_CTRLS, &xs) < 0) {
-	    if ((errno == EINVAL) && (vctrl->useOld < 0)) {
-		struct v4l2_control xd;
-
-		/* retry with old ioctl() command */
-		xd.id = xc.id;
-		xd.value = xc.value;
-		if (DoIoctl(v4l2c->fd, VIDIOC_S_CTRL, &xd) == 0) {
-		    vctrl->useOld = 1;
-		    continue;
-		}
-	    }
-errorSet:
-	    Tcl_SetErrno(errno);
-	    Tcl_SetObjResult(interp,
-			 Tcl_ObjPrintf("error setting \"%s\": %s",
-				       Tcl_GetString(objv[i]),
-				       Tcl_PosixError(interp)));
-	    return TCL_ERROR;
+    if (v4l2c->rec != NULL) {
+	RecordFrame(v4l2c);
+    }
+    if (v4l2c->y4m != NULL) {
+	Y4MFrame(v4l2c);
+    }
+    if (v4l2c->avi != NULL) {
+	AviFrame(v4l2c);
+    }
+    if (v4l2c->vlz != NULL) {
+	VlzFrame(v4l2c);
+    }
+    if (v4l2c->http != NULL) {
+	HttpFrame(v4l2c);
+    }
+    if (v4l2c->fwdDst != NULL) {
+	if (ForwardFrame(v4l2c) < 0) {
+	    v4l2c->fwdErrors++;
+	} else {
+	    v4l2c->fwdFrames++;
 	}
+	/* counts as consumed for the idle policy */
+	Tcl_GetTime(&v4l2c->lastFetch);
+	return 1;
     }
-    return TCL_OK;
+    return 0;
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
- * ConvertFromYUV, ConvertToYUV, ConvertToGREY --
+ * BufferReady --
  *
- *	Perform colorspace conversions between YUYV/YVYU and RGB etc.
+ *	A frame buffer became ready as is indicated by readability
+ *	of the device. This is the file handler procedure which
+ *	reads out and remembers the frame buffer index. An already
+ *	obtained older frame buffer is released before the Tcl
+ *	callback is evaluated. During an asynchronous snapshot,
+ *	frames are handed over to SnapshotReady instead. Pending
+ *	source change events renegotiate the capture format first.
  *
  *-------------------------------------------------------------------------
  */
 
-static inline unsigned char sat(int i)
-{
-    return (unsigned char) ((i >= 255) ? 255 : ((i < 0) ? 0 : i));
-}
-
-static unsigned char *
-ConvertFromYUV(unsigned char *in, int width, int height, int isvu)
+static void
+BufferReady(ClientData clientData, int mask)
 {
-    unsigned char *out, *beg, *end;
-    int r, g, b;
+    V4L2C *v4l2c = (V4L2C *) clientData;
+    Tcl_Interp *interp = v4l2c->interp;
+    char buffer[64];
+    struct v4l2_buffer vbuf;
+    int ret, sequence;
 
-    out = attemptckalloc(width * height * 3);
-    if (out == NULL) {
-	return NULL;
-    }
-    beg = out;
-    end = beg + width * height * 3;
-    if (isvu) {
-	while (beg < end) {
-	    r = (22987 * (in[1] - 128)) >> 14;
-	    g = (-5636 * (in[3] - 128) - 11698 * (in[1] - 128)) >> 14;
-	    b = (29049 * (in[3] - 128)) >> 14;
-	    beg[0] = sat(in[0] + r);
-	    beg[1] = sat(in[0] + g);
-	    beg[2] = sat(in[0] + b);
-	    beg[3] = sat(in[2] + r);
-	    beg[4] = sat(in[2] + g);
-	    beg[5] = sat(in[2] + b);
-	    beg += 6;
-	    in += 4;
-	}
-    } else {
-	while (beg < end) {
-	    r = (22987 * (in[3] - 128)) >> 14;
-	    g = (-5636 * (in[1] - 128) - 11698 * (in[3] - 128)) >> 14;
-	    b = (29049 * (in[1] - 128)) >> 14;
-	    beg[0] = sat(in[0] + r);
-	    beg[1] = sat(in[0] + g);
-	    beg[2] = sat(in[0] + b);
-	    beg[3] = sat(in[2] + r);
-	    beg[4] = sat(in[2] + g);
-	    beg[5] = sat(in[2] + b);
-	    beg += 6;
-	    in += 4;
+    if ((mask & TCL_EXCEPTION) && SourceChange(v4l2c)) {
+	if (v4l2c->running < 0) {
+	    goto captureError;
 	}
+	/* stream restarted with new format */
+	SourceCallback(v4l2c);
+	return;
     }
-    return out;
-}
-
-static unsigned char *
-ConvertToYUV(Tk_PhotoImageBlock *blk, int isvu, int *lenPtr)
-{
-    unsigned char *in, *out, *beg, *end;
-    int r1, g1, b1, r2, g2, b2;
+    if (!(mask & TCL_READABLE)) {
+	return;
+    }
+    memset(&vbuf, 0, sizeof (vbuf));
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.memory = V4L2_MEMORY_MMAP;
+    if (DoIoctl(v4l2c->fd, VIDIOC_DQBUF, &vbuf) < 0) {
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+	    const struct timespec ms10 = { 0, 10000000 };
 
-    if (blk->pitch != blk->width * blk->pixelSize) {
-	return NULL;
+	    /*
+	     * Allow one more try through this file handler after
+	     * a very short delay.
+	     */
+	    if (v4l2c->stalled) {
+		goto captureError;
+	    }
+	    v4l2c->stalled = 1;
+	    nanosleep(&ms10, NULL);
+	    return;
+	}
+	goto captureError;
     }
-    lenPtr[0] = blk->width * blk->height * 2;
-    out = attemptckalloc(lenPtr[0]);
-    if (out == NULL) {
-	return NULL;
+    if (v4l2c->snapshot) {
+	v4l2c->stalled = 0;
+	if (!SnapshotWarmup(v4l2c, &vbuf)) {
+	    SnapshotReady(v4l2c, &vbuf);
+	}
+	return;
     }
-    beg = out;
-    end = beg + lenPtr[0];
-    in = blk->pixelPtr;
-    while (beg < end) {
-	r1 = in[blk->offset[0]];
-	g1 = in[blk->offset[1]];
-	b1 = in[blk->offset[2]];
-	in += blk->pixelSize;
-	beg[0] = sat(((4224 * r1 + 8256 * g1 + 1600 * b1) >> 14) + 16);
-	r2 = in[blk->offset[0]];
-	g2 = in[blk->offset[1]];
-	b2 = in[blk->offset[2]];
-	in += blk->pixelSize;
-	beg[2] = sat(((4224 * r2 + 8256 * g2 + 1600 * b2) >> 14) + 16);
-	r1 += r2;
-	b1 += b2;
-	g1 += g2;
-	if (isvu) {
-	    beg[3] = sat(((-2432 * r1 - 4736 * g1 + 7168 * b1) >> 15) + 128);
-	    beg[1] = sat(((7168 * r1 - 6016 * g1 - 1152 * b1) >> 15) + 128);
-	} else {
-	    beg[1] = sat(((-2432 * r1 - 4736 * g1 + 7168 * b1) >> 15) + 128);
-	    beg[3] = sat(((7168 * r1 - 6016 * g1 - 1152 * b1) >> 15) + 128);
+    v4l2c->stalled = 0;
+    v4l2c->waking = 0;
+    if (IdleSuspend(v4l2c, &vbuf)) {
+	if (v4l2c->running < 0) {
+	    goto captureError;
 	}
-	beg += 4;
+	/* stream turned off or restarted with lower frame rate */
+	return;
     }
-    return out;
-}
-
-static unsigned char *
-ConvertToGREY(Tk_PhotoImageBlock *blk, int *lenPtr)
-{
-    unsigned char *in, *out, *beg, *end;
-    int r, g, b;
-
-    if (blk->pitch != blk->width * blk->pixelSize) {
-	return NULL;
+    sequence = vbuf.sequence;
+    v4l2c->counters[0] += 1;
+    if (TakeBuffer(v4l2c, &vbuf) != TCL_OK) {
+captureError:
+	if (DetachDevice(v4l2c, errno)) {
+	    Tcl_DStringSetLength(&v4l2c->cbCmd, v4l2c->cbCmdLen);
+	    Tcl_DStringAppendElement(&v4l2c->cbCmd, v4l2c->devId);
+	    Tcl_DStringAppendElement(&v4l2c->cbCmd, "detached");
+	    goto doCallback;
+	}
+	StopCapture(v4l2c);
+	v4l2c->running = -1;
+	v4l2c->stalled = 0;
+	Tcl_DStringSetLength(&v4l2c->cbCmd, v4l2c->cbCmdLen);
+	Tcl_DStringAppendElement(&v4l2c->cbCmd, v4l2c->devId);
+	Tcl_DStringAppendElement(&v4l2c->cbCmd, "error");
+	goto doCallback;
     }
-    lenPtr[0] = blk->width * blk->height;
-    out = attemptckalloc(lenPtr[0]);
-    if (out == NULL) {
-	return NULL;
+    if (DeliverFrame(v4l2c)) {
+	/* forwarded in C, no per-frame callback */
+	return;
     }
-    beg = out;
-    end = beg + lenPtr[0];
-    in = blk->pixelPtr;
-    while (beg < end) {
-	r = in[blk->offset[0]];
-	g = in[blk->offset[1]];
-	b = in[blk->offset[2]];
-	in += blk->pixelSize;
-	*beg++ = sat(((4224 * r + 8256 * g + 1600 * b) >> 14) + 16);
+
+    Tcl_DStringSetLength(&v4l2c->cbCmd, v4l2c->cbCmdLen);
+    Tcl_DStringAppendElement(&v4l2c->cbCmd, v4l2c->devId);
+    sprintf(buffer, "%d", sequence);
+    Tcl_DStringAppendElement(&v4l2c->cbCmd, buffer);
+doCallback:
+    Tcl_Preserve((ClientData) interp);
+    ret = Tcl_EvalEx(interp, Tcl_DStringValue(&v4l2c->cbCmd),
+		     Tcl_DStringLength(&v4l2c->cbCmd), TCL_EVAL_GLOBAL);
+    if (ret != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (v4l2 event handler)");
+	Tcl_BackgroundException(interp, ret);
+	StopCapture(v4l2c);
     }
-    return out;
+    Tcl_Release((ClientData) interp);
 }
 
-#ifdef USE_MJPEG
 /*
  *-------------------------------------------------------------------------
  *
- * ConvertFromMJPEG --
+ * IsCoded --
  *
- *	Make RGB from a (M)JPEG frame. Logic is borrowed from libuvc.
+ *	Return true for compressed capture formats.
  *
  *-------------------------------------------------------------------------
  */
 
-struct error_mgr {
-    struct jpeg_error_mgr super;
-    jmp_buf jmp;
-};
-
-static void
-j_out_msg(j_common_ptr info)
+static int
+IsCoded(int format)
 {
-}
+    int i;
 
-static void
-j_fmt_msg(j_common_ptr info, char *buffer)
-{
-    buffer[0] = '\0';
+    for (i = 0; i < sizeof (FormatsCoded) / sizeof (FormatsCoded[0]); i++) {
+	if (format == FormatsCoded[i]) {
+	    return 1;
+	}
+    }
+    return 0;
 }
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * SetFormat --
+ *
+ *	Negotiate capture format and size with the device. The
+ *	requested pixel format is tried first, then all supported
+ *	formats in test order.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-static void
-j_err_exit(j_common_ptr info)
+static int
+SetFormat(V4L2C *v4l2c)
 {
-    struct error_mgr *errmgr = (struct error_mgr *) info->err;
+    Tcl_Interp *interp = v4l2c->interp;
+    int i;
+    struct v4l2_format fmt;
+    const int *tryFmts;
+    int maxFmt;
 
-    (*info->err->output_message)(info);
-    longjmp(errmgr->jmp, 1);
-}
+    if (v4l2c->isLoopDev) {
+	tryFmts = FormatsLoop;
+	maxFmt = sizeof (FormatsLoop) / sizeof (FormatsLoop[0]);
+    } else {
+	tryFmts = FormatsNormal;
+	maxFmt = sizeof (FormatsNormal) / sizeof (FormatsNormal[0]);
+    }
 
+    memset(&fmt, 0, sizeof (fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = v4l2c->width;
+    fmt.fmt.pix.height = v4l2c->height;
+    fmt.fmt.pix.field = V4L2_FIELD_ANY;
+    if (v4l2c->wantFormat != 0) {
+	for (i = 0; i < maxFmt; i++) {
+	    if (v4l2c->wantFormat == tryFmts[i]) {
+		break;
+	    }
+	}
+	if ((i < maxFmt) ||
+	    (!v4l2c->isLoopDev && IsCoded(v4l2c->wantFormat))) {
+	    fmt.fmt.pix.pixelformat = v4l2c->wantFormat;
+	    if (DoIoctl(v4l2c->fd, VIDIOC_S_FMT, &fmt) >= 0) {
+		goto gotFormat;
+	    }
+	}
+    }
+    for (i = 0; i < maxFmt; i++) {
+	fmt.fmt.pix.pixelformat = tryFmts[i];
+	if (DoIoctl(v4l2c->fd, VIDIOC_S_FMT, &fmt) >= 0) {
+	    break;
+	}
+    }
+    if (i >= maxFmt) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error setting format: %s",
+				       Tcl_PosixError(interp)));
+	return TCL_ERROR;
+    }
+    for (i = 0; i < maxFmt; i++) {
+	if (fmt.fmt.pix.pixelformat == tryFmts[i]) {
+	    break;
+	}
+    }
+    if (i >= maxFmt) {
+	Tcl_SetResult(interp, "unable to set supported pixel format",
+		      TCL_STATIC);
+	return TCL_ERROR;
+    }
+gotFormat:
+    v4l2c->format = fmt.fmt.pix.pixelformat;
+    if (v4l2c->wantFormat == 0) {
+	v4l2c->wantFormat = v4l2c->format;
+    }
+    v4l2c->width = fmt.fmt.pix.width;
+    v4l2c->height = fmt.fmt.pix.height;
+    v4l2c->bpl = fmt.fmt.pix.bytesperline;
+    return TCL_OK;
+}
+
 /*
- * ISO/IEC 10918-1:1993(E) K.3.3.
- * Default Huffman tables used by MJPEG UVC devices
- * which don't specify a Huffman table in the JPEG stream.
+ *-------------------------------------------------------------------------
+ *
+ * SetFrameRate --
+ *
+ *	Try to set the frame rate of the device. On success the
+ *	frame rate is updated with the value reported by the driver
+ *	and 0 is returned, otherwise -1.
+ *
+ *-------------------------------------------------------------------------
  */
 
-static const unsigned char dc_lumi_len[] = {
-    0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
-};
-
-static const unsigned char dc_lumi_val[] = {
-    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
-};
+static int
+SetFrameRate(V4L2C *v4l2c)
+{
+    struct v4l2_streamparm stp;
 
-static const unsigned char dc_chromi_len[] = {
-    0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
-};
+    memset(&stp, 0, sizeof (stp));
+    stp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (DoIoctl(v4l2c->fd, VIDIOC_G_PARM, &stp) >= 0) {
+	int compFps = 0;
 
-static const unsigned char dc_chromi_val[] = {
-    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
-};
+	if (stp.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) {
+	    stp.parm.capture.timeperframe.numerator = 100;
+	    stp.parm.capture.timeperframe.denominator = v4l2c->fps * 100;
+	    if (DoIoctl(v4l2c->fd, VIDIOC_S_PARM, &stp) >= 0) {
+		compFps = DoIoctl(v4l2c->fd, VIDIOC_G_PARM, &stp) != -1;
+	    }
+	}
+	if (compFps && (stp.parm.capture.timeperframe.numerator > 0)) {
+	    v4l2c->fps = stp.parm.capture.timeperframe.denominator /
+		stp.parm.capture.timeperframe.numerator;
+	    if (v4l2c->fps <= 0) {
+		v4l2c->fps = 1;
+	    }
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MapBuffers --
+ *
+ *	Request frame buffers from the driver and mmap() them.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-static const unsigned char ac_lumi_len[] = {
-    0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
-};
+static int
+MapBuffers(V4L2C *v4l2c)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    int i;
+    struct v4l2_buffer buf;
+    struct v4l2_requestbuffers req;
 
-static const unsigned char ac_lumi_val[] = {
-    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21,
-    0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
-    0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1,
-    0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
-    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25,
-    0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
-    0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
-    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
-    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
-    0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
-    0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93,
-    0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
-    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3,
-    0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
-    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3,
-    0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
-    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1,
-    0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
-};
+    /* request buffers */
+    memset(&req, 0, sizeof (req));
+    i = 2;
+    while (i < sizeof (v4l2c->vbufs) / sizeof (v4l2c->vbufs[0])) {
+	req.count = i;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (DoIoctl(v4l2c->fd, VIDIOC_REQBUFS, &req) < 0) {
+	    Tcl_SetObjResult(interp,
+			     Tcl_ObjPrintf("error requesting buffers: %s",
+					   Tcl_PosixError(interp)));
+	    return TCL_ERROR;
+	}
+	if ((req.count <= 0) ||
+	    (req.count > sizeof (v4l2c->vbufs) / sizeof (v4l2c->vbufs[0]))) {
+	    i *= 2;
+	    continue;
+	}
+	break;
+    }
+    if ((req.count <= 0) ||
+	(req.count > sizeof (v4l2c->vbufs) / sizeof (v4l2c->vbufs[0]))) {
+	Tcl_SetResult(interp, "unable to get buffers", TCL_STATIC);
+	return TCL_ERROR;
+    }
 
-static const unsigned char ac_chromi_len[] = {
-    0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77
-};
+    /* mmap() buffers */
+    for (i = 0; i < req.count; i++) {
+	memset(&buf, 0, sizeof (buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = i;
+	if (DoIoctl(v4l2c->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+	    Tcl_SetObjResult(interp,
+			     Tcl_ObjPrintf("error querying buffer: %s",
+					   Tcl_PosixError(interp)));
+	    goto unmapSome;
+	}
+	v4l2c->vbufs[i].start = v4l2_mmap(NULL, buf.length,
+					  PROT_READ | PROT_WRITE, MAP_SHARED,
+					  v4l2c->fd, buf.m.offset);
+	v4l2c->vbufs[i].length = buf.length;
+	if (v4l2c->vbufs[i].start == MAP_FAILED) {
+	    Tcl_SetObjResult(interp,
+			     Tcl_ObjPrintf("error mapping buffer: %s",
+					   Tcl_PosixError(interp)));
+unmapSome:
+	    v4l2c->nvbufs = i;
+	    ReleaseBuffers(v4l2c);
+	    return TCL_ERROR;
+	}
+    }
+    v4l2c->nvbufs = req.count;
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * StreamOn --
+ *
+ *	Queue all frame buffers except the one given by "keep"
+ *	(which is still owned by the application), start capture,
+ *	and add the file handler for buffer indications.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-static const unsigned char ac_chromi_val[] = {
-    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31,
-    0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
-    0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1,
-    0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
-    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18,
-    0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
-    0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47,
-    0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
-    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
-    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
-    0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a,
-    0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
-    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa,
-    0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
-    0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca,
-    0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
-    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
-    0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
-};
+static int
+StreamOn(V4L2C *v4l2c, int keep)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    int i, type;
+    struct v4l2_buffer buf;
 
-#define COPY_HUFF_TBL(dinfo, tbl, name)					\
-do {									\
-    if (dinfo->tbl == NULL) {						\
-	dinfo->tbl = jpeg_alloc_huff_table((j_common_ptr) dinfo);	\
-    }									\
-    memcpy(dinfo->tbl->bits, name##_len, sizeof (name##_len));		\
-    memset(dinfo->tbl->huffval, 0, sizeof (dinfo->tbl->huffval));	\
-    memcpy(dinfo->tbl->huffval, name##_val, sizeof (name##_val));	\
-} while (0)
+    /* queue buffers */
+    for (i = 0; i < v4l2c->nvbufs; i++) {
+	if (i == keep) {
+	    continue;
+	}
+	memset(&buf, 0, sizeof (buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = i;
+	if (DoIoctl(v4l2c->fd, VIDIOC_QBUF, &buf) < 0) {
+	    Tcl_SetObjResult(interp,
+			     Tcl_ObjPrintf("error querying buffer: %s",
+					   Tcl_PosixError(interp)));
+	    return TCL_ERROR;
+	}
+    }
 
-static inline void
-j_ins_huff_tbls(j_decompress_ptr dinfo)
-{
-    COPY_HUFF_TBL(dinfo, dc_huff_tbl_ptrs[0], dc_lumi);
-    COPY_HUFF_TBL(dinfo, dc_huff_tbl_ptrs[1], dc_chromi);
-    COPY_HUFF_TBL(dinfo, ac_huff_tbl_ptrs[0], ac_lumi);
-    COPY_HUFF_TBL(dinfo, ac_huff_tbl_ptrs[1], ac_chromi);
-}
+    /* start capture */
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (DoIoctl(v4l2c->fd, VIDIOC_STREAMON, &type) < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error starting capture: %s",
+				       Tcl_PosixError(interp)));
+	return TCL_ERROR;
+    }
 
-#undef COPY_HUFF_TBL
+    /* setup file handler, events are indicated as exceptions */
+    Tcl_CreateFileHandler(v4l2c->fd, TCL_READABLE |
+			  (v4l2c->srcEvents ? TCL_EXCEPTION : 0),
+			  BufferReady, (ClientData) v4l2c);
+    v4l2c->stalled = 0;
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * StartCapture --
+ *
+ *	Setup image acquisition:
+ *	  - set capture format and size
+ *	  - request frame buffers
+ *	  - mmap() frame buffers
+ *	  - queue buffers and start capture
+ *	  - add file handler for buffer indications
+ *
+ *-------------------------------------------------------------------------
+ */
 
-static unsigned char *
-ConvertFromMJPEG(unsigned char *in, int inlen, int width, int height)
+static int
+StartCapture(V4L2C *v4l2c)
 {
-    struct jpeg_decompress_struct dinfo;
-    struct error_mgr jerr;
-    unsigned char *out;
-    size_t nlines;
-
-    out = attemptckalloc(width * height * 3);
-    if (out == NULL) {
-	return NULL;
+    if (v4l2c->running > 0) {
+	return TCL_OK;
     }
-    dinfo.err = jpeg_std_error(&jerr.super);
-    jerr.super.output_message = j_out_msg;
-    jerr.super.format_message = j_fmt_msg;
-    jerr.super.error_exit = j_err_exit;
-    if (setjmp(jerr.jmp)) {
-	goto failed;
+#ifdef V4L2_EVENT_SOURCE_CHANGE
+    if (!v4l2c->srcEvents) {
+	struct v4l2_event_subscription sub;
+
+	memset(&sub, 0, sizeof (sub));
+	sub.type = V4L2_EVENT_SOURCE_CHANGE;
+	v4l2c->srcEvents =
+	    (DoIoctl(v4l2c->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == 0);
     }
-
-    jpeg_create_decompress(&dinfo);
-    jpeg_mem_src(&dinfo, in, inlen);
-    jpeg_read_header(&dinfo, TRUE);
-    if (dinfo.dc_huff_tbl_ptrs[0] == NULL) {
-	j_ins_huff_tbls(&dinfo);
+#endif
+    if (SetFormat(v4l2c) != TCL_OK) {
+	goto error;
     }
-    dinfo.out_color_space = JCS_RGB;
-    dinfo.dct_method = JDCT_IFAST;
-    jpeg_start_decompress(&dinfo);
-    nlines = 0;
-    while ((dinfo.output_scanline < dinfo.output_height) &&
-	   (dinfo.output_scanline < height)) {
-	unsigned char *buf[1];
-	int n;
-
-	buf[0] = out + nlines * width * 3;
-	n = jpeg_read_scanlines(&dinfo, buf, 1);
-	nlines += n;
+    SetFrameRate(v4l2c);
+    if (MapBuffers(v4l2c) != TCL_OK) {
+	goto error;
     }
-    jpeg_finish_decompress(&dinfo);
-    jpeg_destroy_decompress(&dinfo);
-    return out;
+    if (StreamOn(v4l2c, -1) != TCL_OK) {
+	ReleaseBuffers(v4l2c);
+	goto error;
+    }
+    v4l2c->running = 1;
+    v4l2c->paused = 0;
+    v4l2c->bufrdy = -1;
+    v4l2c->bufdone = 0;
+    v4l2c->counters[0] = v4l2c->counters[1] = 0;
+    v4l2c->idle = 0;
+    Tcl_GetTime(&v4l2c->lastFetch);
+    MetaStart(v4l2c);
+    return TCL_OK;
 
-failed:
-    jpeg_destroy_decompress(&dinfo);
-    ckfree(out);
-    return V4L2_MJPEG_FAILED;
+error:
+    v4l2c->running = -1;
+    v4l2c->stalled = 0;
+    return TCL_ERROR;
 }
-#endif
 
 /*
  *-------------------------------------------------------------------------
  *
- * GetImage --
+ * ResumeCapture --
  *
- *	Retrieve last captured buffer as photo image or byte array.
+ *	Resume a capture suspended by PauseCapture. The already
+ *	mapped frame buffers are queued again and the stream is
+ *	turned on.
  *
  *-------------------------------------------------------------------------
  */
 
 static int
-GetImage(V4L2I *v4l2i, V4L2C *v4l2c, int flags, Tcl_Obj *arg)
+ResumeCapture(V4L2C *v4l2c)
 {
-    Tcl_Interp *interp = v4l2c->interp;
-    Tk_PhotoHandle photo = NULL;
-    int result = TCL_OK, done = 0;
-    char *name;
-    unsigned char *rgbToFree = NULL, *toFree = NULL;
+    int type;
 
-    if (arg != NULL) {
-	if (CheckForTk(v4l2i, interp) != TCL_OK) {
-	    return TCL_ERROR;
-	}
-	if (Tk_MainWindow(interp) == NULL) {
-	    Tcl_SetResult(interp, "application has been destroyed",
-			  TCL_STATIC);
-	    return TCL_ERROR;
-	}
-	name = Tcl_GetString(arg);
-	photo = Tk_FindPhoto(interp, name);
-	if (photo == NULL) {
-	    Tcl_SetObjResult(interp,
-		Tcl_ObjPrintf("can't use \"%s\": not a photo image", name));
+    if ((v4l2c->running > 0) && v4l2c->paused) {
+	if (StreamOn(v4l2c, v4l2c->bufrdy) != TCL_OK) {
+	    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	    DoIoctl(v4l2c->fd, VIDIOC_STREAMOFF, &type);
+	    ReleaseBuffers(v4l2c);
+	    v4l2c->running = -1;
+	    v4l2c->stalled = 0;
+	    v4l2c->paused = 0;
+	    v4l2c->bufrdy = -1;
 	    return TCL_ERROR;
 	}
+	v4l2c->paused = 0;
     }
-    if (v4l2c->bufrdy < 0) {
-	/* no image available */
-	if (photo != NULL) {
-	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-	} else {
-	    Tcl_SetResult(interp, "no image available", TCL_STATIC);
-	    result = TCL_ERROR;
-	}
-	goto done;
-    }
-    if (photo != NULL) {
-	Tk_PhotoImageBlock block;
-	int rot = v4l2c->rotate;
-	int width = v4l2c->width;
-	int height = v4l2c->height;
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ReconfigureCapture --
+ *
+ *	Change frame size, pixel format, and/or frame rate of a
+ *	running capture. The stream is turned off for the change,
+ *	but frame buffers are reallocated only if the new format
+ *	does not fit into the buffers already mapped or the driver
+ *	refuses the change while buffers are allocated.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	switch (v4l2c->format) {
-	case V4L2_PIX_FMT_YUYV:
-	case V4L2_PIX_FMT_YVYU:
-	    rgbToFree = ConvertFromYUV(v4l2c->vbufs[v4l2c->bufrdy].start,
-				       width, height,
-				       v4l2c->format == V4L2_PIX_FMT_YVYU);
-	    if (rgbToFree == NULL) {
-		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
-		result = TCL_ERROR;
-		goto done;
+static int
+ReconfigureCapture(V4L2C *v4l2c, int width, int height, int format, int fps)
+{
+    struct v4l2_format fmt;
+    int i, wasPaused, type;
+
+    if (v4l2c->running <= 0) {
+	return TCL_OK;
+    }
+    if (format == 0) {
+	format = v4l2c->format;
+    }
+    if ((width == v4l2c->width) && (height == v4l2c->height) &&
+	(format == v4l2c->format) && (fps == v4l2c->fps)) {
+	return TCL_OK;
+    }
+    wasPaused = v4l2c->paused;
+    PauseCapture(v4l2c);
+    if ((width != v4l2c->width) || (height != v4l2c->height) ||
+	(format != v4l2c->format)) {
+	int keep = 1;
+
+	/* the frame in the held buffer has the old format */
+	v4l2c->bufrdy = -1;
+	v4l2c->bufdone = 0;
+	memset(&fmt, 0, sizeof (fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = width;
+	fmt.fmt.pix.height = height;
+	fmt.fmt.pix.field = V4L2_FIELD_ANY;
+	fmt.fmt.pix.pixelformat = format;
+	if ((DoIoctl(v4l2c->fd, VIDIOC_TRY_FMT, &fmt) < 0) ||
+	    (fmt.fmt.pix.sizeimage == 0)) {
+	    keep = 0;
+	}
+	for (i = 0; keep && (i < v4l2c->nvbufs); i++) {
+	    if (fmt.fmt.pix.sizeimage > v4l2c->vbufs[i].length) {
+		keep = 0;
 	    }
-	    block.pixelSize = 3;
-	    block.offset[0] = 0;
-	    block.offset[1] = 1;
-	    block.offset[2] = 2;
-	    block.offset[3] = 4;
-	    block.pixelPtr = rgbToFree;
-	    break;
-	case V4L2_PIX_FMT_RGB32:
-	    block.pixelSize = 4;
-	    block.offset[0] = 0;
-	    block.offset[1] = 1;
-	    block.offset[2] = 2;
-	    block.offset[3] = 3;
-	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
-	    break;
-	case V4L2_PIX_FMT_BGR32:
-	    block.pixelSize = 4;
-	    block.offset[0] = 2;
-	    block.offset[1] = 1;
-	    block.offset[2] = 0;
-	    block.offset[3] = 3;
-	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
-	    break;
-	case V4L2_PIX_FMT_RGB24:
-	default:
-	    block.pixelSize = 3;
-	    block.offset[0] = 0;
-	    block.offset[1] = 1;
-	    block.offset[2] = 2;
-	    block.offset[3] = 4;
-	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
-	    break;
-	case V4L2_PIX_FMT_BGR24:
-	    block.pixelSize = 3;
-	    block.offset[0] = 2;
-	    block.offset[1] = 1;
-	    block.offset[2] = 0;
-	    block.offset[3] = 4;
-	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
-	    break;
-#ifdef USE_MJPEG
-	case V4L2_PIX_FMT_MJPEG:
-	    rgbToFree = ConvertFromMJPEG(v4l2c->vbufs[v4l2c->bufrdy].start,
-					 v4l2c->vbufs[v4l2c->bufrdy].length,
-					 width, height);
-	    if (rgbToFree == V4L2_MJPEG_FAILED) {
-		rgbToFree = NULL;
-		Tcl_SetResult(interp, "conversion from jpeg failed",
-			      TCL_STATIC);
-		result = TCL_ERROR;
-		goto done;
+	}
+	v4l2c->width = width;
+	v4l2c->height = height;
+	v4l2c->wantFormat = format;
+	if (keep) {
+	    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	    if ((DoIoctl(v4l2c->fd, VIDIOC_S_FMT, &fmt) >= 0) &&
+		(fmt.fmt.pix.pixelformat == format)) {
+		v4l2c->format = format;
+		v4l2c->width = fmt.fmt.pix.width;
+		v4l2c->height = fmt.fmt.pix.height;
+		v4l2c->bpl = fmt.fmt.pix.bytesperline;
+	    } else {
+		keep = 0;
 	    }
-	    if (rgbToFree == NULL) {
-		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
-		result = TCL_ERROR;
-		goto done;
+	}
+	if (!keep) {
+	    /* slow path: renegotiate with new buffers */
+	    ReleaseBuffers(v4l2c);
+	    if ((SetFormat(v4l2c) != TCL_OK) ||
+		(MapBuffers(v4l2c) != TCL_OK)) {
+		goto error;
 	    }
-	    block.pixelSize = 3;
-	    block.offset[0] = 0;
-	    block.offset[1] = 1;
-	    block.offset[2] = 2;
-	    block.offset[3] = 4;
-	    block.pixelPtr = rgbToFree;
+	}
+    }
+    if (fps != v4l2c->fps) {
+	int oldFps = v4l2c->fps;
+
+	v4l2c->fps = fps;
+	if (SetFrameRate(v4l2c) < 0) {
+	    /* not accepted by the driver */
+	    v4l2c->fps = oldFps;
+	}
+    }
+    if (!wasPaused && (ResumeCapture(v4l2c) != TCL_OK)) {
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+
+error:
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    DoIoctl(v4l2c->fd, VIDIOC_STREAMOFF, &type);
+    ReleaseBuffers(v4l2c);
+    v4l2c->running = -1;
+    v4l2c->stalled = 0;
+    v4l2c->paused = 0;
+    return TCL_ERROR;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * SourceChange --
+ *
+ *	Dequeue pending events of a device. On a resolution change
+ *	of the source, e.g. an HDMI receiver, new DV timings are
+ *	applied and the capture is reconfigured to the format now
+ *	reported by the driver. Returns true when the capture has
+ *	been restarted, or failed to restart with the running flag
+ *	set to -1.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+SourceChange(V4L2C *v4l2c)
+{
+#ifdef V4L2_EVENT_SOURCE_CHANGE
+    struct v4l2_event ev;
+    struct v4l2_format fmt;
+    int changed = 0, wasPaused, ret;
+
+    for (;;) {
+	memset(&ev, 0, sizeof (ev));
+	if (DoIoctl(v4l2c->fd, VIDIOC_DQEVENT, &ev) < 0) {
 	    break;
-#endif
-	case V4L2_PIX_FMT_GREY:
-	    block.pixelSize = 1;
-	    block.offset[0] = 0;
-	    block.offset[1] = 0;
-	    block.offset[2] = 0;
-	    block.offset[3] = 1;
-	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
+	}
+	if ((ev.type == V4L2_EVENT_SOURCE_CHANGE) &&
+	    (ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION)) {
+	    changed = 1;
+	}
+	if (ev.pending == 0) {
 	    break;
-#ifdef V4L2_PIX_FMT_Y10
-	case V4L2_PIX_FMT_Y10:
+	}
+    }
+    if (!changed || (v4l2c->running <= 0)) {
+	return 0;
+    }
+    /* must not be streaming while changing timings and format */
+    wasPaused = v4l2c->paused;
+    PauseCapture(v4l2c);
+#ifdef VIDIOC_QUERY_DV_TIMINGS
+    {
+	struct v4l2_dv_timings timings;
+
+	memset(&timings, 0, sizeof (timings));
+	if (DoIoctl(v4l2c->fd, VIDIOC_QUERY_DV_TIMINGS, &timings) == 0) {
+	    DoIoctl(v4l2c->fd, VIDIOC_S_DV_TIMINGS, &timings);
+	}
+    }
 #endif
-#ifdef V4L2_PIX_FMT_Y16
-	case V4L2_PIX_FMT_Y16:
+    memset(&fmt, 0, sizeof (fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (DoIoctl(v4l2c->fd, VIDIOC_G_FMT, &fmt) < 0) {
+	fmt.fmt.pix.width = v4l2c->width;
+	fmt.fmt.pix.height = v4l2c->height;
+    }
+    /* the held frame is from the old source */
+    v4l2c->bufrdy = -1;
+    v4l2c->bufdone = 0;
+    ret = TCL_OK;
+    if ((fmt.fmt.pix.width != v4l2c->width) ||
+	(fmt.fmt.pix.height != v4l2c->height)) {
+	ret = ReconfigureCapture(v4l2c, fmt.fmt.pix.width,
+				 fmt.fmt.pix.height, v4l2c->format,
+				 v4l2c->fps);
+    }
+    /* same size: a restart of the stream is sufficient */
+    if ((ret == TCL_OK) && !wasPaused) {
+	ret = ResumeCapture(v4l2c);
+    }
+    if (ret != TCL_OK) {
+	/* reported by the caller as capture error */
+	StopCapture(v4l2c);
+	v4l2c->running = -1;
+    }
+    return 1;
+#else
+    return 0;
 #endif
-#if defined(V4L2_PIX_FMT_Y16) || defined(V4L2_PIX_FMT_Y10)
-	    block.pixelSize = 1;
-	    block.offset[0] = 0;
-	    block.offset[1] = 0;
-	    block.offset[2] = 0;
-	    block.offset[3] = 1;
-	    block.pixelPtr = toFree = attemptckalloc(width * height);
-	    if (block.pixelPtr == NULL) {
-		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
-		result = TCL_ERROR;
-		goto done;
-	    } else {
-		int n, v, shift;
-		unsigned short *fromPtr;
-		unsigned char *toPtr;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * SourceCallback --
+ *
+ *	Invoke the source change callback of a device with the
+ *	device id and the new frame size appended.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-		fromPtr = (unsigned short *) v4l2c->vbufs[v4l2c->bufrdy].start;
-		toPtr = block.pixelPtr;
-		shift = v4l2c->greyshift;
-		if (shift > 0) {
-		    for (n = 0; n < width * height; n++) {
-			v = *fromPtr++;
-			v = v >> shift;
-			*toPtr++ = v;
-		    }
-		} else {
-		    shift = -shift;
-		    for (n = 0; n < width * height; n++) {
-			v = *fromPtr++;
-			v = v << shift;
-			*toPtr++ = v;
-		    }
-		}
-	    }
-	    break;
-#endif
-	}
-	block.width = width;
-	block.height = height;
-	block.pitch = block.pixelSize * block.width;
+static void
+SourceCallback(V4L2C *v4l2c)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    Tcl_Obj *cmdObj;
+    char buffer[64], fcbuf[8];
+    int ret;
 
-	if ((flags & 0x07) && (block.pixelSize >= 3)) {
-	    int x, y, w0, w1, w2;
-	    unsigned char *src0, *src1, *src2, *dst;
+    if (v4l2c->evCmd == NULL) {
+	return;
+    }
+    sprintf(buffer, "%dx%d%s", v4l2c->width, v4l2c->height,
+	    fourcc_str(v4l2c->format, fcbuf));
+    cmdObj = Tcl_DuplicateObj(v4l2c->evCmd);
+    Tcl_IncrRefCount(cmdObj);
+    Tcl_ListObjAppendElement(NULL, cmdObj,
+			     Tcl_NewStringObj(v4l2c->devId, -1));
+    Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewStringObj(buffer, -1));
+    Tcl_Preserve((ClientData) interp);
+    ret = Tcl_EvalObjEx(interp, cmdObj, TCL_EVAL_GLOBAL);
+    if (ret != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (v4l2 source change handler)");
+	Tcl_BackgroundException(interp, ret);
+    }
+    Tcl_DecrRefCount(cmdObj);
+    Tcl_Release((ClientData) interp);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * IdleResume --
+ *
+ *	Record retrieval of an image and bring a capture which
+ *	was suspended by IdleSuspend transparently back to normal.
+ *	The frame held from before the suspension is dropped, the
+ *	device is marked for IdleFinish to wait for a fresh one.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	    toFree = attemptckalloc(width * height);
-	    if (toFree == NULL) {
-		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
-		result = TCL_ERROR;
-		goto done;
-	    }
-	    dst = toFree;
-	    switch (flags & 0x07) {
-	    case 1:	/* blue */
-		src0 = block.pixelPtr + block.offset[2];
-		goto doOne;
-	    case 2:	/* green */
-		src0 = block.pixelPtr + block.offset[1];
-		goto doOne;
-	    case 4:	/* red */
-		src0 = block.pixelPtr + block.offset[0];
-	    doOne:
-		for (y = 0; y < height; y++) {
-		    unsigned char *src = src0 + block.pitch * y;
+static int
+IdleResume(V4L2C *v4l2c)
+{
+    int ret;
 
-		    for (x = 0; x < width; x++) {
-			*dst++ = *src;
-			src += block.pixelSize;
-		    }
-		}
-		break;
-	    case 3:	/* blue + green */
-		src0 = block.pixelPtr + block.offset[2];
-		src1 = block.pixelPtr + block.offset[1];
-		w0 = 162;
-		w1 = 837;
-		goto doTwo;
-	    case 5:	/* blue + red */
-		src0 = block.pixelPtr + block.offset[2];
-		src1 = block.pixelPtr + block.offset[0];
-		w0 = 276;
-		w1 = 723;
-		goto doTwo;
-	    case 6:	/* green + red */
-		src0 = block.pixelPtr + block.offset[1];
-		src1 = block.pixelPtr + block.offset[0];
-		w0 = 662;
-		w1 = 337;
-	    doTwo:
-		for (y = 0; y < height; y++) {
-		    unsigned char *srcA = src0 + block.pitch * y;
-		    unsigned char *srcB = src1 + block.pitch * y;
+    Tcl_GetTime(&v4l2c->lastFetch);
+    if (!v4l2c->idle) {
+	return TCL_OK;
+    }
+    if (v4l2c->running <= 0) {
+	v4l2c->idle = 0;
+	v4l2c->activeFps = 0;
+	return TCL_OK;
+    }
+    /* stream off, all buffers are queued again on resume */
+    PauseCapture(v4l2c);
+    v4l2c->bufrdy = -1;
+    v4l2c->bufdone = 0;
+    IdleCancel(v4l2c);
+    ret = ResumeCapture(v4l2c);
+    if (ret == TCL_OK) {
+	v4l2c->waking = 1;
+    }
+    return ret;
+}
 
-		    for (x = 0; x < width; x++) {
-			*dst++ = (w0 * srcA[0] + w1 * srcB[0]) / 1000;
-			srcA += block.pixelSize;
-			srcB += block.pixelSize;
-		    }
-		}
-		break;
-	    case 7:	/* all */
-		src0 = block.pixelPtr + block.offset[2];
-		src1 = block.pixelPtr + block.offset[1];
-		src2 = block.pixelPtr + block.offset[0];
-		w0 = 114;
-		w1 = 587;
-		w2 = 299;
-		for (y = 0; y < height; y++) {
-		    unsigned char *srcA = src0 + block.pitch * y;
-		    unsigned char *srcB = src1 + block.pitch * y;
-		    unsigned char *srcC = src2 + block.pitch * y;
+/*
+ *-------------------------------------------------------------------------
+ *
+ * IdleDeadline --
+ *
+ *	Compute the point in time until which IdleFinish waits
+ *	for the first frames of devices woken up together.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-		    for (x = 0; x < width; x++) {
-			*dst++ =
-			    (w0 * srcA[0] + w1 * srcB[0] + w2 * srcC[0]) / 1000;
-			srcA += block.pixelSize;
-			srcB += block.pixelSize;
-			srcC += block.pixelSize;
-		    }
-		}
-		break;
-	    }
-	    block.pitch = width;
-	    block.pixelSize = 1;
-	    block.offset[0] = 0;
-	    block.offset[1] = 0;
-	    block.offset[2] = 0;
-	    block.offset[3] = 1;
-	    block.pixelPtr = toFree;
+static void
+IdleDeadline(Tcl_Time *deadline)
+{
+    Tcl_GetTime(deadline);
+    deadline->sec += IDLE_WAKEUP_TIMEOUT / 1000;
+    deadline->usec += (IDLE_WAKEUP_TIMEOUT % 1000) * 1000;
+    if (deadline->usec >= 1000000) {
+	deadline->sec += 1;
+	deadline->usec -= 1000000;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * IdleFinish --
+ *
+ *	Wait until deadline for the first frame of a device woken
+ *	up by IdleResume. The frame is taken and passed to the
+ *	recorders and forwarding like any frame from BufferReady.
+ *	Running out of time is not an error, the device simply has
+ *	no image yet.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+IdleFinish(V4L2C *v4l2c, Tcl_Time *deadline)
+{
+    struct v4l2_buffer vbuf;
+    Tcl_Time now;
+    long timeout;
+    int ret = TCL_OK;
+
+    if (!v4l2c->waking) {
+	return TCL_OK;
+    }
+    v4l2c->waking = 0;
+    Tcl_GetTime(&now);
+    timeout = (deadline->sec - now.sec) * 1000 +
+	(deadline->usec - now.usec) / 1000;
+    if (timeout < 0) {
+	/* only poll, earlier devices used up the time */
+	timeout = 0;
+    }
+    if (WaitBuffer(v4l2c, &vbuf, (int) timeout) == 0) {
+	v4l2c->counters[0] += 1;
+	ret = TakeBuffer(v4l2c, &vbuf);
+	if (ret == TCL_OK) {
+	    DeliverFrame(v4l2c);
 	}
+    }
+    return ret;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * IdleWakeup --
+ *
+ *	Wake up a single device with IdleResume and wait for its
+ *	first fresh frame with IdleFinish.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+IdleWakeup(V4L2C *v4l2c)
+{
+    Tcl_Time deadline;
+
+    if (IdleResume(v4l2c) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    IdleDeadline(&deadline);
+    return IdleFinish(v4l2c, &deadline);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * BeginSnapshot --
+ *
+ *	Switch the device to the frame size and pixel format of a
+ *	snapshot. The current settings are saved for EndSnapshot.
+ *	A stopped device is started for the snapshot.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	if ((v4l2c->mirror & 3) == 3) {
-	    rot = (rot + 180) % 360;
+static int
+BeginSnapshot(V4L2C *v4l2c, int width, int height, int format)
+{
+    if (IdleWakeup(v4l2c) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    v4l2c->snapWidth = v4l2c->width;
+    v4l2c->snapHeight = v4l2c->height;
+    v4l2c->snapPaused = v4l2c->paused;
+    v4l2c->snapStop = (v4l2c->running <= 0);
+    v4l2c->snapCount = 0;
+    v4l2c->snapFirst = 0;
+    if (v4l2c->snapStop) {
+	v4l2c->snapFormat = v4l2c->wantFormat;
+	v4l2c->width = width;
+	v4l2c->height = height;
+	v4l2c->wantFormat = format;
+	if (StartCapture(v4l2c) != TCL_OK) {
+	    v4l2c->width = v4l2c->snapWidth;
+	    v4l2c->height = v4l2c->snapHeight;
+	    v4l2c->wantFormat = v4l2c->snapFormat;
+	    return TCL_ERROR;
 	}
-	switch (rot) {
-	case 270:	/* = 90 CW */
-	    block.pitch = block.pixelSize;
-	    block.pixelPtr += width * block.pixelSize * (height - 1);
-	    block.pixelSize *= -width;
-	    block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	    block.width = height;
-	    block.height = width;
-	    break;
-	case 180:	/* = 180 CW */
-	    block.pitch = -block.pitch;
-	    block.pixelPtr += (width * height - 1) * block.pixelSize;
-	    block.pixelSize = -block.pixelSize;
-	    block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	    break;
-	case 90:	/* = 270 CW */
-	    block.pitch = -block.pixelSize;
-	    block.pixelPtr += (width - 1) * block.pixelSize;
-	    block.pixelSize *= width;
-	    block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	    block.width = height;
-	    block.height = width;
-	    break;
+	return TCL_OK;
+    }
+    v4l2c->snapFormat = v4l2c->format;
+    if (ReconfigureCapture(v4l2c, width, height, format, v4l2c->fps)
+	!= TCL_OK) {
+	return TCL_ERROR;
+    }
+    return ResumeCapture(v4l2c);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * EndSnapshot --
+ *
+ *	Restore the settings saved by BeginSnapshot, where frame
+ *	buffers are reused if possible.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+EndSnapshot(V4L2C *v4l2c)
+{
+    v4l2c->snapshot = 0;
+    if (v4l2c->snapStop) {
+	StopCapture(v4l2c);
+	v4l2c->width = v4l2c->snapWidth;
+	v4l2c->height = v4l2c->snapHeight;
+	v4l2c->wantFormat = v4l2c->snapFormat;
+	return TCL_OK;
+    }
+    if (ReconfigureCapture(v4l2c, v4l2c->snapWidth, v4l2c->snapHeight,
+			   v4l2c->snapFormat, v4l2c->fps) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (v4l2c->snapPaused) {
+	return PauseCapture(v4l2c);
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * DeviceCallback --
+ *
+ *	Invoke the callback of a device with the device id and the
+ *	given word appended, e.g. "detached" or "attached".
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+DeviceCallback(V4L2C *v4l2c, const char *what)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    int ret;
+
+    Tcl_DStringSetLength(&v4l2c->cbCmd, v4l2c->cbCmdLen);
+    Tcl_DStringAppendElement(&v4l2c->cbCmd, v4l2c->devId);
+    Tcl_DStringAppendElement(&v4l2c->cbCmd, what);
+    Tcl_Preserve((ClientData) interp);
+    ret = Tcl_EvalEx(interp, Tcl_DStringValue(&v4l2c->cbCmd),
+		     Tcl_DStringLength(&v4l2c->cbCmd), TCL_EVAL_GLOBAL);
+    if (ret != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (v4l2 event handler)");
+	Tcl_BackgroundException(interp, ret);
+    }
+    Tcl_Release((ClientData) interp);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * DeviceKey --
+ *
+ *	Determine a persistent identity of the opened device which
+ *	survives unplug/replug: the matching /dev/v4l/by-id link,
+ *	or the bus information from the driver, or the device name
+ *	as last resort.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+DeviceKey(V4L2C *v4l2c)
+{
+    struct stat sb, sb2;
+    struct v4l2_capability cap;
+    struct dirent *ent;
+    DIR *dir;
+    Tcl_DString ds;
+
+    Tcl_DStringSetLength(&v4l2c->devKey, 0);
+    if ((fstat(v4l2c->fd, &sb) == 0) &&
+	((dir = opendir("/dev/v4l/by-id")) != NULL)) {
+	Tcl_DStringInit(&ds);
+	while ((ent = readdir(dir)) != NULL) {
+	    if (ent->d_name[0] == '.') {
+		continue;
+	    }
+	    Tcl_DStringSetLength(&ds, 0);
+	    Tcl_DStringAppend(&ds, "/dev/v4l/by-id/", -1);
+	    Tcl_DStringAppend(&ds, ent->d_name, -1);
+	    if ((stat(Tcl_DStringValue(&ds), &sb2) == 0) &&
+		S_ISCHR(sb2.st_mode) && (sb2.st_rdev == sb.st_rdev)) {
+		Tcl_DStringAppend(&v4l2c->devKey, Tcl_DStringValue(&ds),
+				  Tcl_DStringLength(&ds));
+		break;
+	    }
 	}
-	if ((v4l2c->mirror & 3) == 2) {
-	    /* mirror in X */
-	    block.pixelPtr += (block.width - 1) * block.pixelSize;
-	    block.pixelSize = -block.pixelSize;
-	    block.offset[3] = block.pixelSize + 1;      /* no alpha */
+	Tcl_DStringFree(&ds);
+	closedir(dir);
+    }
+    if (Tcl_DStringLength(&v4l2c->devKey) == 0) {
+	if ((QueryCaps(v4l2c->fd, &cap) >= 0) &&
+	    (cap.bus_info[0] != '\0') && (cap.bus_info[0] != '/')) {
+	    Tcl_DStringAppend(&v4l2c->devKey, (char *) cap.bus_info, -1);
+	} else {
+	    Tcl_DStringAppend(&v4l2c->devKey,
+			      Tcl_DStringValue(&v4l2c->devName), -1);
+	}
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FindDevice --
+ *
+ *	Look up the device node for the persistent identity of a
+ *	device. Path names are checked for accessibility, bus
+ *	information is matched against all capture devices in /dev.
+ *	Returns true and leaves the node in dsPtr when found.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+FindDevice(V4L2C *v4l2c, Tcl_DString *dsPtr)
+{
+    const char *key = Tcl_DStringValue(&v4l2c->devKey);
+    struct v4l2_capability cap;
+    struct dirent *ent;
+    DIR *dir;
+    int fd, caps, found = 0;
+
+    if (key[0] == '/') {
+	if (access(key, R_OK | W_OK) == 0) {
+	    Tcl_DStringAppend(dsPtr, key, -1);
+	    return 1;
+	}
+	return 0;
+    }
+    dir = opendir("/dev");
+    if (dir == NULL) {
+	return 0;
+    }
+    while (!found && ((ent = readdir(dir)) != NULL)) {
+	if (strncmp(ent->d_name, "video", 5) != 0) {
+	    continue;
 	}
-	if ((v4l2c->mirror & 3) == 1) {
-	    /* mirror in Y */
-	    block.pixelPtr += block.pitch * (block.height - 1);
-	    block.pitch = -block.pitch;
+	Tcl_DStringSetLength(dsPtr, 0);
+	Tcl_DStringAppend(dsPtr, "/dev/", -1);
+	Tcl_DStringAppend(dsPtr, ent->d_name, -1);
+	fd = open(Tcl_DStringValue(dsPtr), O_RDWR | O_NONBLOCK, 0);
+	if (fd < 0) {
+	    continue;
 	}
+	caps = QueryCaps(fd, &cap);
+	found = (caps > 0) && (caps & V4L2_CAP_VIDEO_CAPTURE) &&
+	    (strcmp((char *) cap.bus_info, key) == 0);
+	close(fd);
+    }
+    closedir(dir);
+    if (!found) {
+	Tcl_DStringSetLength(dsPtr, 0);
+    }
+    return found;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RestoreControls --
+ *
+ *	Apply the control values recorded by SetControls to a
+ *	reopened device. All values are set with a single ioctl()
+ *	if the driver allows for it, otherwise one by one.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	if (Tk_PhotoExpand(interp, photo, block.width, block.height)
-	    != TCL_OK) {
-	    result = TCL_ERROR;
-	    goto done;
+static void
+RestoreControls(V4L2C *v4l2c)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    struct v4l2_ext_controls xs;
+    struct v4l2_ext_control *xc;
+    struct v4l2_control xd;
+    VCTRL *vctrl;
+    int i, n;
+
+    n = 0;
+    hPtr = Tcl_FirstHashEntry(&v4l2c->ctrl, &search);
+    while (hPtr != NULL) {
+	vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
+	n += vctrl->saved ? 1 : 0;
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    if (n == 0) {
+	return;
+    }
+    xc = (struct v4l2_ext_control *) ckalloc(n * sizeof (*xc));
+    memset(xc, 0, n * sizeof (*xc));
+    i = 0;
+    hPtr = Tcl_FirstHashEntry(&v4l2c->ctrl, &search);
+    while (hPtr != NULL) {
+	vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
+	hPtr = Tcl_NextHashEntry(&search);
+	if (!vctrl->saved) {
+	    continue;
 	}
-	if (Tk_PhotoPutBlock(interp, photo, &block, 0, 0,
-			     block.width, block.height,
-			     TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
-	    result = TCL_ERROR;
+	if (vctrl->useOld > 0) {
+	    xd.id = vctrl->qry.id;
+	    xd.value = vctrl->value;
+	    DoIoctl(v4l2c->fd, VIDIOC_S_CTRL, &xd);
+	    continue;
+	}
+	xc[i].id = vctrl->qry.id;
+	if (vctrl->qry.type == V4L2_CTRL_TYPE_INTEGER64) {
+	    xc[i].value64 = vctrl->value;
 	} else {
-	    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-	    done = 1;
+	    xc[i].value = vctrl->value;
 	}
+	i++;
+    }
+    memset(&xs, 0, sizeof (xs));
+    /* zero: controls of any class, as of Linux 2.6.34 */
+    xs.ctrl_class = 0;
+    xs.count = i;
+    xs.controls = xc;
+    if ((i > 0) && (DoIoctl(v4l2c->fd, VIDIOC_S_EXT_CTRLS, &xs) < 0)) {
+	for (n = 0; n < i; n++) {
+	    xs.ctrl_class = V4L2_CTRL_ID2CLASS(xc[n].id);
+	    xs.count = 1;
+	    xs.controls = xc + n;
+	    if (DoIoctl(v4l2c->fd, VIDIOC_S_EXT_CTRLS, &xs) < 0) {
+		xd.id = xc[n].id;
+		xd.value = xc[n].value;
+		DoIoctl(v4l2c->fd, VIDIOC_S_CTRL, &xd);
+	    }
+	}
+    }
+    ckfree((char *) xc);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * DetachDevice, ReattachTimer, ReattachDevice --
+ *
+ *	Reattach policy: when a device with this policy is
+ *	unplugged, its file descriptor is closed but the control
+ *	tables and the capture settings are kept. The device is
+ *	polled for by its persistent identity (and checked on udev
+ *	"add" events). When it reappears, it is reopened under the
+ *	same device id, the recorded controls are applied in one
+ *	batch, and the capture is resumed in its former state.
+ *	The callback is invoked with "detached" and "attached".
+ *	Polling by bus information backs off exponentially.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+ReattachTimer(ClientData clientData)
+{
+    V4L2C *v4l2c = (V4L2C *) clientData;
+
+    v4l2c->reattachTimer = NULL;
+    if (!ReattachDevice(v4l2c) && v4l2c->detached) {
+	if ((Tcl_DStringValue(&v4l2c->devKey)[0] != '/') &&
+	    (v4l2c->reattachDelay < REATTACH_MAXINTERVAL)) {
+	    v4l2c->reattachDelay *= 2;
+	}
+	v4l2c->reattachTimer =
+	    Tcl_CreateTimerHandler(v4l2c->reattachDelay, ReattachTimer,
+				   (ClientData) v4l2c);
+    }
+}
+
+static int
+DetachDevice(V4L2C *v4l2c, int err)
+{
+    if (!v4l2c->reattach || v4l2c->detached ||
+	((err != ENODEV) && (err != ENXIO) && (err != EIO))) {
+	return 0;
+    }
+    v4l2c->wasRunning = (v4l2c->running > 0) ? (v4l2c->paused ? 2 : 1) : 0;
+    StopCapture(v4l2c);
+    PaceStop(v4l2c);
+    LoopRelease(v4l2c);
+    v4l2_close(v4l2c->fd);
+    v4l2c->fd = -1;
+    if (v4l2c->metaFd >= 0) {
+	/* name kept to find the node again on reattach */
+	close(v4l2c->metaFd);
+	v4l2c->metaFd = -1;
+    }
+    v4l2c->detached = 1;
+    v4l2c->reattachDelay = REATTACH_INTERVAL;
+    if (v4l2c->reattachTimer == NULL) {
+	v4l2c->reattachTimer =
+	    Tcl_CreateTimerHandler(REATTACH_INTERVAL, ReattachTimer,
+				   (ClientData) v4l2c);
+    }
+    return 1;
+}
+
+static int
+ReattachDevice(V4L2C *v4l2c)
+{
+    Tcl_DString ds;
+    char path[PATH_MAX];
+    int fd, ok = 1;
+
+    if (!v4l2c->detached) {
+	return 0;
+    }
+    Tcl_DStringInit(&ds);
+    if (!FindDevice(v4l2c, &ds)) {
+	Tcl_DStringFree(&ds);
+	return 0;
+    }
+    fd = v4l2_open(Tcl_DStringValue(&ds), O_RDWR | O_NONBLOCK, 0);
+    if (fd < 0) {
+	Tcl_DStringFree(&ds);
+	return 0;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (realpath(Tcl_DStringValue(&ds), path) != NULL) {
+	Tcl_DStringSetLength(&v4l2c->devName, 0);
+	Tcl_DStringAppend(&v4l2c->devName, path, -1);
+    }
+    Tcl_DStringFree(&ds);
+    if (v4l2c->reattachTimer != NULL) {
+	Tcl_DeleteTimerHandler(v4l2c->reattachTimer);
+	v4l2c->reattachTimer = NULL;
+    }
+    v4l2c->fd = fd;
+    v4l2c->detached = 0;
+    v4l2c->srcEvents = 0;
+    if (Tcl_DStringLength(&v4l2c->metaName) > 0) {
+	/* node number may have changed */
+	MetaOpen(v4l2c, "auto");
+	Tcl_ResetResult(v4l2c->interp);
+    }
+    RestoreControls(v4l2c);
+    if (v4l2c->wasRunning) {
+	ok = (StartCapture(v4l2c) == TCL_OK);
+	if (ok && (v4l2c->wasRunning > 1)) {
+	    ok = (PauseCapture(v4l2c) == TCL_OK);
+	}
+	Tcl_ResetResult(v4l2c->interp);
+    }
+    v4l2c->wasRunning = 0;
+    DeviceCallback(v4l2c, ok ? "attached" : "error");
+    return 1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FixupName --
+ *
+ *	Fixes control/parameter names using conventions from Android:
+ *
+ *	  - everything in lower case
+ *	  - words separated by single dashes, e.g. "scene-mode"
+ *
+ *	The string is modified in-place.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+FixupName(char *name, int length)
+{
+    char *p, *end;
+
+    p = name;
+    end = name + ((length < 0) ? strlen(name) : length);
+    while (p < end) {
+	if (p[0] >= '\0') {
+	    p[0] = tolower(p[0]);
+	}
+	if (p[0] > '\0') {
+	    if (strchr(" .,/_+(){}[]=&%$:;'#*~", p[0]) != NULL) {
+		p[0] = '-';
+	    }
+	}
+	++p;
+    }
+    if (length > 0) {
+	name[length - 1] = '\0';
+    } else {
+	++end;
+    }
+    p = name;
+    while ((p = strchr(p, '-')) != NULL) {
+	if (p[1] == '-') {
+	    memmove(p, p + 1, end - p);
+	} else if (p[1] == '\0') {
+	    p[0] = '\0';
+	    break;
+	} else {
+	    ++p;
+	}
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * InitControls --
+ *
+ *	Fill (or release) V4L2C control structure with meta information
+ *	about the device's controls.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+InitControls(V4L2C *v4l2c)
+{
+    long id;
+    int i, k, numFS, isNew;
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    struct v4l2_queryctrl qry;
+    struct v4l2_querymenu qmenu;
+    VCTRL *vctrl;
+    char buffer[128], fcbuf[8];
+#ifdef VIDIOC_ENUM_FRAMESIZES
+    const int *tryFmts;
+    int maxFmt;
+    int allFmts[sizeof (FormatsNormal) / sizeof (FormatsNormal[0]) +
+		sizeof (FormatsCoded) / sizeof (FormatsCoded[0])];
+    Tcl_HashTable fmtTab;
+#endif
+
+    /* first, free up old stuff */
+    hPtr = Tcl_FirstHashEntry(&v4l2c->ctrl, &search);
+    while (hPtr != NULL) {
+	vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
+	Tcl_DStringFree(&vctrl->ds);
+	if ((vctrl != &v4l2c->fsize) && (vctrl != &v4l2c->frate)) {
+	    ckfree((char *) vctrl);
+	}
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&v4l2c->nctrl);
+    Tcl_InitHashTable(&v4l2c->nctrl, TCL_STRING_KEYS);
+    Tcl_DStringFree(&v4l2c->fsize.ds);
+    Tcl_DStringFree(&v4l2c->frate.ds);
+
+    /* done, when there's no opened device */
+    if (v4l2c->fd < 0) {
+	return;
+    }
+
+    /* fill in new information: base controls */
+    for (id = V4L2_CID_BASE; id < V4L2_CID_LASTP1; id++) {
+	memset(&qry, 0, sizeof (qry));
+	qry.id = id;
+	if ((DoIoctl(v4l2c->fd, VIDIOC_QUERYCTRL, &qry) != -1) &&
+	    ((qry.type == V4L2_CTRL_TYPE_INTEGER) ||
+	     (qry.type == V4L2_CTRL_TYPE_BOOLEAN) ||
+	     (qry.type == V4L2_CTRL_TYPE_MENU) ||
+	     (qry.type == V4L2_CTRL_TYPE_BUTTON) ||
+	     (qry.type == V4L2_CTRL_TYPE_INTEGER64)) &&
+	    !(qry.flags & V4L2_CTRL_FLAG_DISABLED)) {
+	    FixupName((char *) qry.name, sizeof (qry.name));
+	    if ((strcmp((char *) qry.name, "frame-size") == 0) ||
+		(strcmp((char *) qry.name, "frame-rate") == 0)) {
+		/* these names are reserved */
+		continue;
+	    }
+	    hPtr = Tcl_CreateHashEntry(&v4l2c->ctrl, (ClientData) id, &isNew);
+	    if (isNew) {
+		vctrl = (VCTRL *) ckalloc(sizeof (VCTRL));
+		Tcl_DStringInit(&vctrl->ds);
+		vctrl->saved = 0;
+		Tcl_SetHashValue(hPtr, (ClientData) vctrl);
+		vctrl->useOld = (qry.type != V4L2_CTRL_TYPE_INTEGER64) ? -1 : 0;
+	    } else {
+		vctrl = (VCTRL*) Tcl_GetHashValue(hPtr);
+		Tcl_DStringSetLength(&vctrl->ds, 0);
+	    }
+	    vctrl->qry = qry;
+	    if (qry.type == V4L2_CTRL_TYPE_MENU) {
+		for (i = qry.minimum; i <= qry.maximum; i++) {
+		    memset(&qmenu, 0, sizeof (qmenu));
+		    qmenu.id = qry.id;
+		    qmenu.index = i;
+		    if (DoIoctl(v4l2c->fd, VIDIOC_QUERYMENU, &qmenu) < 0) {
+			/* force empty menu entry */
+			strcpy((char *) qmenu.name, ",");
+		    } else {
+			FixupName((char *) qmenu.name, sizeof (qmenu.name));
+			if ((qmenu.name[0] == '\0') ||
+			    (strcmp((char *) qmenu.name, "-") == 0)) {
+			    sprintf((char *) qmenu.name, "%d", i);
+			}
+		    }
+		    Tcl_DStringAppend(&vctrl->ds, (char *) qmenu.name, -1);
+		    Tcl_DStringAppend(&vctrl->ds, "\0", 1);
+		}
+	    }
+	}
+    }
+
+    /* older kernels lack this */
+#ifndef V4L2_CTRL_CLASS_CAMERA
+#define V4L2_CTRL_CLASS_CAMERA (V4L2_CTRL_CLASS_USER + 0x00020000)
+#endif
+
+    /* fill in new information: camera controls */
+    for (id = V4L2_CTRL_CLASS_CAMERA | V4L2_CTRL_FLAG_NEXT_CTRL;;) {
+	memset(&qry, 0, sizeof (qry));
+	qry.id = id;
+	if (DoIoctl(v4l2c->fd, VIDIOC_QUERYCTRL, &qry) == -1) {
+	    break;
+	}
+	if (V4L2_CTRL_ID2CLASS(qry.id) != V4L2_CTRL_CLASS_CAMERA) {
+	    break;
+	}
+	if (((qry.type == V4L2_CTRL_TYPE_INTEGER) ||
+	     (qry.type == V4L2_CTRL_TYPE_BOOLEAN) ||
+	     (qry.type == V4L2_CTRL_TYPE_MENU) ||
+	     (qry.type == V4L2_CTRL_TYPE_BUTTON) ||
+	     (qry.type == V4L2_CTRL_TYPE_INTEGER64)) &&
+	    !(qry.flags & V4L2_CTRL_FLAG_DISABLED)) {
+	    FixupName((char *) qry.name, sizeof (qry.name));
+	    if ((strcmp((char *) qry.name, "frame-size") == 0) ||
+		(strcmp((char *) qry.name, "frame-rate") == 0)) {
+		/* these names are reserved */
+		continue;
+	    }
+	    hPtr = Tcl_CreateHashEntry(&v4l2c->ctrl, (ClientData) id, &isNew);
+	    if (isNew) {
+		vctrl = (VCTRL *) ckalloc(sizeof (VCTRL));
+		Tcl_DStringInit(&vctrl->ds);
+		vctrl->saved = 0;
+		Tcl_SetHashValue(hPtr, (ClientData) vctrl);
+		vctrl->useOld = 0;
+	    } else {
+		vctrl = (VCTRL*) Tcl_GetHashValue(hPtr);
+		Tcl_DStringSetLength(&vctrl->ds, 0);
+	    }
+	    vctrl->qry = qry;
+	    if (qry.type == V4L2_CTRL_TYPE_MENU) {
+		for (i = qry.minimum; i <= qry.maximum; i++) {
+		    memset(&qmenu, 0, sizeof (qmenu));
+		    qmenu.id = qry.id;
+		    qmenu.index = i;
+		    if (DoIoctl(v4l2c->fd, VIDIOC_QUERYMENU, &qmenu) < 0) {
+			/* force empty menu entry */
+			strcpy((char *) qmenu.name, ",");
+		    } else {
+			FixupName((char *) qmenu.name, sizeof (qmenu.name));
+			if ((qmenu.name[0] == '\0') ||
+			    (strcmp((char *) qmenu.name, "-") == 0)) {
+			    sprintf((char *) qmenu.name, "%d", i);
+			}
+		    }
+		    Tcl_DStringAppend(&vctrl->ds, (char *) qmenu.name, -1);
+		    Tcl_DStringAppend(&vctrl->ds, "\0", 1);
+		}
+	    }
+	}
+	id = qry.id | V4L2_CTRL_FLAG_NEXT_CTRL;
+    }
+
+    /* fill string mapping */
+    hPtr = Tcl_FirstHashEntry(&v4l2c->ctrl, &search);
+    while (hPtr != NULL) {
+	Tcl_HashEntry *hPtr2;
+
+	vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
+	hPtr2 = Tcl_CreateHashEntry(&v4l2c->nctrl, (char *) vctrl->qry.name,
+				    &isNew);
+	Tcl_SetHashValue(hPtr2, (ClientData) vctrl);
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+
+    /* frame-size pseudo menu control */
+    v4l2c->fsize.qry.type = V4L2_CTRL_TYPE_MENU;
+    strcpy((char *) v4l2c->fsize.qry.name, "frame-size");
+    numFS = 0;
+#ifdef VIDIOC_ENUM_FRAMESIZES
+    Tcl_InitHashTable(&fmtTab, TCL_STRING_KEYS);
+    if (v4l2c->isLoopDev) {
+	tryFmts = FormatsLoop;
+	maxFmt = sizeof (FormatsLoop) / sizeof (FormatsLoop[0]);
+    } else {
+	/* compressed formats are offered, too */
+	maxFmt = sizeof (FormatsNormal) / sizeof (FormatsNormal[0]);
+	memcpy(allFmts, FormatsNormal, sizeof (FormatsNormal));
+	memcpy(allFmts + maxFmt, FormatsCoded, sizeof (FormatsCoded));
+	maxFmt += sizeof (FormatsCoded) / sizeof (FormatsCoded[0]);
+	tryFmts = allFmts;
+    }
+    for (k = 0; k < maxFmt; k++) {
+	for (i = 0; i >= 0; i++) {
+	    struct v4l2_frmsizeenum qfsz;
+
+	    memset(&qfsz, 0, sizeof (qfsz));
+	    qfsz.index = i;
+	    qfsz.pixel_format = tryFmts[k];
+	    if (DoIoctl(v4l2c->fd, VIDIOC_ENUM_FRAMESIZES, &qfsz) < 0) {
+		break;
+	    }
+	    if (qfsz.pixel_format != tryFmts[k]) {
+		goto sizesDone;
+	    }
+	    switch (qfsz.type) {
+	    case V4L2_FRMSIZE_TYPE_DISCRETE:
+		sprintf(buffer, "%dx%d%s", qfsz.discrete.width,
+			qfsz.discrete.height,
+			fourcc_str(qfsz.pixel_format, fcbuf));
+		Tcl_CreateHashEntry(&fmtTab, buffer, &isNew);
+		if (isNew) {
+		    Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
+		    Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
+		    numFS++;
+		}
+		break;
+	    case V4L2_FRMSIZE_TYPE_STEPWISE:
+		while (1) {
+		    sprintf(buffer, "%dx%d%s", qfsz.stepwise.min_width,
+			    qfsz.stepwise.min_height,
+			    fourcc_str(qfsz.pixel_format, fcbuf));
+		    Tcl_CreateHashEntry(&fmtTab, buffer, &isNew);
+		    if (isNew) {
+			Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
+			Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
+			numFS++;
+		    }
+		    qfsz.stepwise.min_width += qfsz.stepwise.step_width;
+		    qfsz.stepwise.min_height += qfsz.stepwise.step_height;
+		    if ((qfsz.stepwise.min_width >= qfsz.stepwise.max_width) ||
+			(qfsz.stepwise.min_height >= qfsz.stepwise.max_height)) {
+			break;
+		    }
+		}
+		goto sizesDone;
+	    case V4L2_FRMSIZE_TYPE_CONTINUOUS:
+		sprintf(buffer, "+%dx%d%s", qfsz.stepwise.min_width,
+			qfsz.stepwise.min_height,
+			fourcc_str(qfsz.pixel_format, fcbuf));
+		Tcl_CreateHashEntry(&fmtTab, buffer, &isNew);
+		if (isNew) {
+		    Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
+		    Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
+		    sprintf(buffer, "+%dx%d%s", qfsz.stepwise.max_width,
+			    qfsz.stepwise.max_height,
+			    fourcc_str(qfsz.pixel_format, fcbuf));
+		    Tcl_CreateHashEntry(&fmtTab, buffer, &isNew);
+		    Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
+		    Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
+		    numFS += 2;
+		}
+		/* FALLTHROUGH */
+	    default:
+		goto sizesDone;
+	    }
+	}
+sizesDone:
+	;
+    }
+    Tcl_DeleteHashTable(&fmtTab);
+#endif
+    if (numFS == 0) {
+	/* fallback to last set format */
+	sprintf(buffer, "%dx%d%s", v4l2c->width, v4l2c->height,
+		fourcc_str(v4l2c->format, fcbuf));
+	Tcl_DStringAppend(&v4l2c->fsize.ds, buffer, -1);
+	Tcl_DStringAppend(&v4l2c->fsize.ds, "\0", 1);
+	numFS++;
+    }
+    v4l2c->fsize.qry.minimum = 0;
+    v4l2c->fsize.qry.maximum = numFS - 1;
+    id = v4l2c->fsize.qry.id;	/* special, is 0x00000000 */
+    hPtr = Tcl_CreateHashEntry(&v4l2c->ctrl, (ClientData) id, &isNew);
+    Tcl_SetHashValue(hPtr, (ClientData) &v4l2c->fsize);
+    hPtr = Tcl_CreateHashEntry(&v4l2c->nctrl, "frame-size", &isNew);
+    Tcl_SetHashValue(hPtr, (ClientData) &v4l2c->fsize);
+
+    /* frame-rate pseudo control */
+    v4l2c->frate.qry.type = V4L2_CTRL_TYPE_INTEGER;
+    v4l2c->frate.qry.id = 1;
+    strcpy((char *) v4l2c->frate.qry.name, "frame-rate");
+    v4l2c->frate.qry.minimum = 1;
+    v4l2c->frate.qry.maximum = 200;
+    v4l2c->frate.qry.default_value = 15;
+    v4l2c->frate.qry.step = 1;
+    id = v4l2c->frate.qry.id;	/* special, is 0x00000001 */
+    hPtr = Tcl_CreateHashEntry(&v4l2c->ctrl, (ClientData) id, &isNew);
+    Tcl_SetHashValue(hPtr, (ClientData) &v4l2c->frate);
+    hPtr = Tcl_CreateHashEntry(&v4l2c->nctrl, "frame-rate", &isNew);
+    Tcl_SetHashValue(hPtr, (ClientData) &v4l2c->frate);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GetZZString --
+ *
+ *	Given index return corresponding string from a double zero
+ *	terminated string list.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static char *
+GetZZString(char *string, int index)
+{
+    int i = 0;
+
+    while (i < index) {
+	if (string[0] == '\0') {
+	    return string;
+	}
+	++i;
+	string += strlen(string) + 1;
+    }
+    if (string[0] == ',') {
+	++string;
+    }
+    return string;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GetControls --
+ *
+ *	Read out current values of device controls and return
+ *	these as list made up of key value pairs. Added meta
+ *	information entries to support user interface:
+ *
+ *	  <name>-values    comma separated list of menu choices
+ *	  <name>-minimum   minimum value for bool/integer
+ *	  <name>-maximum   minimum value for bool/integer
+ *	  <name>-step      interval step value for integer
+ *	  <name>-default   default value for bool/integer
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+GetControls(V4L2C *v4l2c, Tcl_Obj *list)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    hPtr = Tcl_FirstHashEntry(&v4l2c->ctrl, &search);
+    while (hPtr != NULL) {
+	VCTRL *vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
+	struct v4l2_ext_controls xs;
+	struct v4l2_ext_control xc;
+	Tcl_Obj *obj;
+	char *p;
+	int i, k;
+
+	Tcl_ListObjAppendElement(NULL, list,
+		Tcl_NewStringObj((char *) vctrl->qry.name, -1));
+	memset(&xs, 0, sizeof (xs));
+	xs.ctrl_class = V4L2_CTRL_ID2CLASS(vctrl->qry.id);
+	xs.count = 1;
+	xs.error_idx = 0;
+	xs.controls = &xc;
+	memset(&xc, 0, sizeof (xc));
+	xc.id = vctrl->qry.id;
+	if (vctrl == &v4l2c->fsize) {
+	    goto doVal;
+	}
+	if (vctrl == &v4l2c->frate) {
+	    xc.value = v4l2c->fps;
+	    goto doVal;
+	}
+
+	/* older kernels lack this */
+#ifndef V4L2_CTRL_FLAG_WRITE_ONLY
+#define V4L2_CTRL_FLAG_WRITE_ONLY 0x0040
+#endif
+
+	if (!(vctrl->qry.flags & V4L2_CTRL_FLAG_WRITE_ONLY)) {
+	    if (vctrl->useOld > 0) {
+		struct v4l2_control xd;
+
+		xd.id = xc.id;
+		xd.value = 0;
+		if (DoIoctl(v4l2c->fd, VIDIOC_G_CTRL, &xd) != -1) {
+		    xc.value = xd.value;
+		}
+	    } else if (DoIoctl(v4l2c->fd, VIDIOC_G_EXT_CTRLS, &xs) < 0) {
+		if ((errno == EINVAL) && (vctrl->useOld < 0)) {
+		    struct v4l2_control xd;
+
+		    /* retry with old ioctl() command */
+		    xd.id = xc.id;
+		    xd.value = 0;
+		    if (DoIoctl(v4l2c->fd, VIDIOC_G_CTRL, &xd) != -1) {
+			xc.value = xd.value;
+			vctrl->useOld = 1;
+		    }
+		}
+	    }
+	}
+doVal:
+	switch (vctrl->qry.type) {
+	case V4L2_CTRL_TYPE_INTEGER:
+	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(xc.value));
+	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
+	    Tcl_AppendToObj(obj, "-minimum", -1);
+	    Tcl_ListObjAppendElement(NULL, list, obj);
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewIntObj(vctrl->qry.minimum));
+	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
+	    Tcl_AppendToObj(obj, "-maximum", -1);
+	    Tcl_ListObjAppendElement(NULL, list, obj);
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewIntObj(vctrl->qry.maximum));
+	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
+	    Tcl_AppendToObj(obj, "-default", -1);
+	    Tcl_ListObjAppendElement(NULL, list, obj);
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewIntObj(vctrl->qry.default_value));
+	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
+	    Tcl_AppendToObj(obj, "-step", -1);
+	    Tcl_ListObjAppendElement(NULL, list, obj);
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewIntObj(vctrl->qry.step));
+	    break;
+	case V4L2_CTRL_TYPE_BOOLEAN:
+	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(xc.value != 0));
+	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
+	    Tcl_AppendToObj(obj, "-minimum", -1);
+	    Tcl_ListObjAppendElement(NULL, list, obj);
+	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(0));
+	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
+	    Tcl_AppendToObj(obj, "-maximum", -1);
+	    Tcl_ListObjAppendElement(NULL, list, obj);
+	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(1));
+	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
+	    Tcl_AppendToObj(obj, "-default", -1);
+	    Tcl_ListObjAppendElement(NULL, list, obj);
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewIntObj(vctrl->qry.default_value));
+	    break;
+	case V4L2_CTRL_TYPE_INTEGER64:
+	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(xc.value64));
+	    break;
+	case V4L2_CTRL_TYPE_BUTTON:
+	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewObj());
+	    break;
+	case V4L2_CTRL_TYPE_MENU:
+	    p = Tcl_DStringValue(&vctrl->ds);
+	    if (vctrl == &v4l2c->fsize) {
+		int format;
+		char buffer[128], fcbuf[8];
+
+		format = v4l2c->running ? v4l2c->format : v4l2c->wantFormat;
+		sprintf(buffer, "%dx%d%s", v4l2c->width, v4l2c->height,
+			fourcc_str(format, fcbuf));
+		Tcl_ListObjAppendElement(NULL, list,
+		    Tcl_NewStringObj(buffer, -1));
+	    } else {
+		Tcl_ListObjAppendElement(NULL, list,
+		    Tcl_NewStringObj(GetZZString(p, xc.value), -1));
+	    }
+	    obj = Tcl_NewStringObj((char *) vctrl->qry.name, -1);
+	    Tcl_AppendToObj(obj, "-values", -1);
+	    Tcl_ListObjAppendElement(NULL, list, obj);
+	    obj = Tcl_NewStringObj("", 0);
+	    k = 0;
+	    for (i = 0; i <= vctrl->qry.maximum - vctrl->qry.minimum; i++) {
+		char *entry = GetZZString(p, i);
+
+		if (k > 0) {
+		    Tcl_AppendToObj(obj, ",", 1);
+		}
+		if (entry[0] != '\0') {
+		    Tcl_AppendToObj(obj, entry, -1);
+		    k++;
+		}
+	    }
+	    Tcl_ListObjAppendElement(NULL, list, obj);
+	    break;
+	default: /* V4L2_CTRL_TYPE_CTRL_CLASS, V4L2_CTRL_TYPE_STRING */
+	    /* should not happen */
+	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewObj());
+	    break;
+	}
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ParseFrameSize --
+ *
+ *	Parse a frame size specification "width"x"height" with
+ *	an optional "@"fourcc suffix. Returns true on success.
+ *	The pixel format is zero when no fourcc is given.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+ParseFrameSize(const char *str, int *wPtr, int *hPtr, int *fmtPtr)
+{
+    int w = -1, h = -1, k;
+    char fcbuf[4];
+
+    if ((sscanf(str, "%dx%d", &w, &h) != 2) || (w <= 0) || (h <= 0)) {
+	return 0;
+    }
+    *wPtr = w;
+    *hPtr = h;
+    *fmtPtr = 0;
+    str = strchr(str, '@');
+    if ((str != NULL) && (strlen(str) > 1)) {
+	memset(fcbuf, ' ', 4);
+	str++;
+	k = 0;
+	while ((k < 4) && (*str != '\0')) {
+	    fcbuf[k] = *str++;
+	    k++;
+	}
+	*fmtPtr = v4l2_fourcc(fcbuf[0], fcbuf[1], fcbuf[2], fcbuf[3]);
+    }
+    return 1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * SetControls --
+ *
+ *	Set device controls given list of key value pairs. Changes
+ *	of frame size or frame rate during capture are carried out
+ *	by ReconfigureCapture after all other controls are set.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+SetControls(V4L2C *v4l2c, int objc, Tcl_Obj * const objv[])
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    Tcl_HashEntry *hPtr;
+    int i, k, reconf = 0;
+    int newWidth = v4l2c->width, newHeight = v4l2c->height;
+    int newFormat, newFps;
+
+    if ((objc > 0) && (IdleWakeup(v4l2c) != TCL_OK)) {
+	return TCL_ERROR;
+    }
+    newFormat = v4l2c->format;
+    newFps = v4l2c->fps;
+    for (i = 0; i < objc; i += 2) {
+	VCTRL *vctrl;
+	struct v4l2_ext_controls xs;
+	struct v4l2_ext_control xc;
+	int ival;
+	Tcl_WideInt wval;
+
+	hPtr = Tcl_FindHashEntry(&v4l2c->nctrl, Tcl_GetString(objv[i]));
+	if (hPtr == NULL) {
+	    continue;
+	}
+	vctrl = (VCTRL *) Tcl_GetHashValue(hPtr);
+	if ((vctrl->qry.flags & V4L2_CTRL_FLAG_READ_ONLY) ||
+	    (vctrl->qry.flags & V4L2_CTRL_FLAG_INACTIVE)) {
+	    continue;
+	}
+	if (vctrl == &v4l2c->fsize) {
+	    int w, h, fcc;
+
+	    if (!ParseFrameSize(Tcl_GetString(objv[i + 1]), &w, &h, &fcc)) {
+		/* ignored */
+		continue;
+	    }
+	    if (v4l2c->running > 0) {
+		/* applied below without stopping the capture */
+		newWidth = w;
+		newHeight = h;
+		newFormat = fcc;
+		reconf = 1;
+	    } else {
+		v4l2c->width = w;
+		v4l2c->height = h;
+		v4l2c->wantFormat = fcc;
+	    }
+	    continue;
+	}
+	if (vctrl == &v4l2c->frate) {
+	    int fps;
+
+	    if (Tcl_GetIntFromObj(NULL, objv[i + 1], &fps) != TCL_OK) {
+		/* ignored */
+		continue;
+	    }
+	    if ((fps > 0) && (fps < 200)) {
+		if (v4l2c->running > 0) {
+		    newFps = fps;
+		    reconf = 1;
+		} else {
+		    v4l2c->fps = fps;
+		}
+	    }
+	    continue;
+	}
+	memset(&xs, 0, sizeof (xs));
+	xs.ctrl_class = V4L2_CTRL_ID2CLASS(vctrl->qry.id);
+	xs.count = 1;
+	xs.error_idx = 0;
+	xs.controls = &xc;
+	memset(&xc, 0, sizeof (xc));
+	xc.id = vctrl->qry.id;
+	switch (vctrl->qry.type) {
+	case V4L2_CTRL_TYPE_INTEGER:
+	case V4L2_CTRL_TYPE_BOOLEAN:
+	    if (Tcl_GetIntFromObj(NULL, objv[i + 1], &ival) != TCL_OK) {
+		/* ignored */
+		continue;
+	    }
+	    xc.value = ival;
+	    break;
+	case V4L2_CTRL_TYPE_INTEGER64:
+	    if (Tcl_GetWideIntFromObj(NULL, objv[i + 1], &wval) != TCL_OK) {
+		/* ignored */
+		continue;
+	    }
+	    xc.value64 = wval;
+	    break;
+	case V4L2_CTRL_TYPE_BUTTON:
+	    /* value ignored */
+	    break;
+	case V4L2_CTRL_TYPE_MENU:
+	    for (k = 0; k <= vctrl->qry.maximum - vctrl->qry.minimum; k++) {
+		char *entry = GetZZString(Tcl_DStringValue(&vctrl->ds), k);
+
+		/* ignore empty entries */
+		if ((entry[0] != '\0') &&
+		    (strcmp(entry, Tcl_GetString(objv[i + 1])) == 0)) {
+		    xc.value = k + vctrl->qry.minimum;
+		    break;
+		}
+	    }
+	    if (k > vctrl->qry.maximum - vctrl->qry.minimum) {
+		/* ignored */
+		continue;
+	    }
+	    break;
+	default: /* V4L2_CTRL_TYPE_CTRL_CLASS, V4L2_CTRL_TYPE_STRING */
+	    /* should not happen, ignored */
+	    continue;
+	}
+	if (vctrl->useOld > 0) {
+	    struct v4l2_control xd;
+
+	    xd.id = xc.id;
+	    xd.value = xc.value;
+	    if (DoIoctl(v4l2c->fd, VIDIOC_S_CTRL, &xd) < 0) {
+		goto errorSet;
+	    }
+	} else if (DoIoctl(v4l2c->fd, VIDIOC_S_EXT_CTRLS, &xs) < 0) {
+	    if ((errno == EINVAL) && (vctrl->useOld < 0)) {
+		struct v4l2_control xd;
+
+		/* retry with old ioctl() command */
+		xd.id = xc.id;
+		xd.value = xc.value;
+		if (DoIoctl(v4l2c->fd, VIDIOC_S_CTRL, &xd) == 0) {
+		    vctrl->useOld = 1;
+		    goto saveValue;
+		}
+	    }
+errorSet:
+	    Tcl_SetErrno(errno);
+	    Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error setting \"%s\": %s",
+				       Tcl_GetString(objv[i]),
+				       Tcl_PosixError(interp)));
+	    return TCL_ERROR;
+	}
+saveValue:
+	/* remember for reattach */
+	if (vctrl->qry.type != V4L2_CTRL_TYPE_BUTTON) {
+	    vctrl->saved = 1;
+	    vctrl->value = (vctrl->qry.type == V4L2_CTRL_TYPE_INTEGER64) ?
+		xc.value64 : xc.value;
+	}
+    }
+    if (reconf) {
+	return ReconfigureCapture(v4l2c, newWidth, newHeight, newFormat,
+				  newFps);
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ConvertFromYUV, ConvertToYUV, ConvertToGREY --
+ *
+ *	Perform colorspace conversions between YUYV/YVYU and RGB etc.
+ *	ConvertToYUV and ConvertToGREY write into the given buffer,
+ *	or allocate one when NULL.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static inline unsigned char sat(int i)
+{
+    return (unsigned char) ((i >= 255) ? 255 : ((i < 0) ? 0 : i));
+}
+
+static unsigned char *
+ConvertFromYUV(unsigned char *in, int width, int height, int isvu)
+{
+    unsigned char *out, *beg, *end;
+    int r, g, b;
+
+    out = attemptckalloc(width * height * 3);
+    if (out == NULL) {
+	return NULL;
+    }
+    beg = out;
+    end = beg + width * height * 3;
+    if (isvu) {
+	while (beg < end) {
+	    r = (22987 * (in[1] - 128)) >> 14;
+	    g = (-5636 * (in[3] - 128) - 11698 * (in[1] - 128)) >> 14;
+	    b = (29049 * (in[3] - 128)) >> 14;
+	    beg[0] = sat(in[0] + r);
+	    beg[1] = sat(in[0] + g);
+	    beg[2] = sat(in[0] + b);
+	    beg[3] = sat(in[2] + r);
+	    beg[4] = sat(in[2] + g);
+	    beg[5] = sat(in[2] + b);
+	    beg += 6;
+	    in += 4;
+	}
+    } else {
+	while (beg < end) {
+	    r = (22987 * (in[3] - 128)) >> 14;
+	    g = (-5636 * (in[1] - 128) - 11698 * (in[3] - 128)) >> 14;
+	    b = (29049 * (in[1] - 128)) >> 14;
+	    beg[0] = sat(in[0] + r);
+	    beg[1] = sat(in[0] + g);
+	    beg[2] = sat(in[0] + b);
+	    beg[3] = sat(in[2] + r);
+	    beg[4] = sat(in[2] + g);
+	    beg[5] = sat(in[2] + b);
+	    beg += 6;
+	    in += 4;
+	}
+    }
+    return out;
+}
+
+static unsigned char *
+ConvertToYUV(Tk_PhotoImageBlock *blk, int isvu, unsigned char *out,
+	     int *lenPtr)
+{
+    unsigned char *in, *beg, *end;
+    int r1, g1, b1, r2, g2, b2;
+
+    if (blk->pitch != blk->width * blk->pixelSize) {
+	return NULL;
+    }
+    lenPtr[0] = blk->width * blk->height * 2;
+    if (out == NULL) {
+	out = attemptckalloc(lenPtr[0]);
+    }
+    if (out == NULL) {
+	return NULL;
+    }
+    beg = out;
+    end = beg + lenPtr[0];
+    in = blk->pixelPtr;
+    while (beg < end) {
+	r1 = in[blk->offset[0]];
+	g1 = in[blk->offset[1]];
+	b1 = in[blk->offset[2]];
+	in += blk->pixelSize;
+	beg[0] = sat(((4224 * r1 + 8256 * g1 + 1600 * b1) >> 14) + 16);
+	r2 = in[blk->offset[0]];
+	g2 = in[blk->offset[1]];
+	b2 = in[blk->offset[2]];
+	in += blk->pixelSize;
+	beg[2] = sat(((4224 * r2 + 8256 * g2 + 1600 * b2) >> 14) + 16);
+	r1 += r2;
+	b1 += b2;
+	g1 += g2;
+	if (isvu) {
+	    beg[3] = sat(((-2432 * r1 - 4736 * g1 + 7168 * b1) >> 15) + 128);
+	    beg[1] = sat(((7168 * r1 - 6016 * g1 - 1152 * b1) >> 15) + 128);
+	} else {
+	    beg[1] = sat(((-2432 * r1 - 4736 * g1 + 7168 * b1) >> 15) + 128);
+	    beg[3] = sat(((7168 * r1 - 6016 * g1 - 1152 * b1) >> 15) + 128);
+	}
+	beg += 4;
+    }
+    return out;
+}
+
+static unsigned char *
+ConvertToGREY(Tk_PhotoImageBlock *blk, unsigned char *out, int *lenPtr)
+{
+    unsigned char *in, *beg, *end;
+    int r, g, b;
+
+    if (blk->pitch != blk->width * blk->pixelSize) {
+	return NULL;
+    }
+    lenPtr[0] = blk->width * blk->height;
+    if (out == NULL) {
+	out = attemptckalloc(lenPtr[0]);
+    }
+    if (out == NULL) {
+	return NULL;
+    }
+    beg = out;
+    end = beg + lenPtr[0];
+    in = blk->pixelPtr;
+    while (beg < end) {
+	r = in[blk->offset[0]];
+	g = in[blk->offset[1]];
+	b = in[blk->offset[2]];
+	in += blk->pixelSize;
+	*beg++ = sat(((4224 * r + 8256 * g + 1600 * b) >> 14) + 16);
+    }
+    return out;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ConvertBlock --
+ *
+ *	Convert a RGB or grey image block to the output format of a
+ *	loopback device. The block may use negative pitch and pixel
+ *	size for rotated or mirrored images. Returns the number of
+ *	bytes written to out, which has room for outLen bytes, or
+ *	zero with errno set for unsupported formats and errors.
+ *	With SSE2 eight pixels are converted to YUV at once, see
+ *	Gather8 and Luma8 below.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static inline unsigned char
+LumaOf(unsigned char *p, int *offset)
+{
+    return sat(((4224 * p[offset[0]] + 8256 * p[offset[1]] +
+		 1600 * p[offset[2]]) >> 14) + 16);
+}
+
+#ifdef __SSE2__
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Gather8, Luma8, Chroma4 --
+ *
+ *	SSE2 helpers of ConvertBlock. Gather8 loads one component of
+ *	eight pixels of a block as 16 bit values, using plain loads
+ *	for unrotated four byte pixels. Luma8 computes their Y, and
+ *	Chroma4 the U (low half) and V (high half) of four pixel pairs
+ *	whose components are summed in adjacent values, plus the sums
+ *	of further rows as given by shift. The coefficients are those
+ *	of the scalar code divided by 64, which gives identical results.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static inline __m128i
+Gather8(Tk_PhotoImageBlock *blk, unsigned char *in, int c)
+{
+    int s = blk->pixelSize, o = blk->offset[c];
+    __m128i n, mask;
+
+    if ((s == 4) && (o >= 0) && (o < 4)) {
+	n = _mm_cvtsi32_si128(8 * o);
+	mask = _mm_set1_epi32(0xff);
+	return _mm_packs_epi32(
+	    _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128((__m128i *) in), n),
+			  mask),
+	    _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128((__m128i *) (in + 16)),
+					n), mask));
+    }
+    in += o;
+    return _mm_setr_epi16(in[0], in[s], in[2 * s], in[3 * s],
+			  in[4 * s], in[5 * s], in[6 * s], in[7 * s]);
+}
+
+static inline __m128i
+Luma8(__m128i r, __m128i g, __m128i b)
+{
+    /* sum stays below 65536, use unsigned 16 bit arithmetic */
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+			      _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(25)));
+    return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+static inline __m128i
+Chroma4(__m128i r, __m128i g, __m128i b, int shift)
+{
+    __m128i n = _mm_cvtsi32_si128(shift), c128 = _mm_set1_epi32(128);
+    __m128i u, v;
+
+    u = _mm_add_epi32(_mm_madd_epi16(r, _mm_set1_epi16(-38)),
+		      _mm_madd_epi16(g, _mm_set1_epi16(-74)));
+    u = _mm_add_epi32(u, _mm_madd_epi16(b, _mm_set1_epi16(112)));
+    v = _mm_add_epi32(_mm_madd_epi16(r, _mm_set1_epi16(112)),
+		      _mm_madd_epi16(g, _mm_set1_epi16(-94)));
+    v = _mm_add_epi32(v, _mm_madd_epi16(b, _mm_set1_epi16(-18)));
+    u = _mm_add_epi32(_mm_sra_epi32(u, n), c128);
+    v = _mm_add_epi32(_mm_sra_epi32(v, n), c128);
+    return _mm_packs_epi32(u, v);
+}
+#endif
+
+static int
+ConvertBlock(V4L2C *v4l2c, Tk_PhotoImageBlock *blk, unsigned char *out,
+	     int outLen)
+{
+    unsigned char *in, *row = blk->pixelPtr;
+    int x, y, r1, g1, b1, r2, g2, b2, bpp, o0, o1, o2, isvu;
+    int width = blk->width, height = blk->height;
+    int format = v4l2c->loopFormat;
+#ifdef __SSE2__
+    __m128i r, g, b, yv, uv, zero = _mm_setzero_si128();
+#endif
+
+    if (outLen < LoopFrameSize(v4l2c)) {
+	errno = ENOSPC;
+	return 0;
+    }
+    switch (format) {
+    case V4L2_PIX_FMT_RGB32:
+    case V4L2_PIX_FMT_BGR32:
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+	bpp = ((format == V4L2_PIX_FMT_RGB32) ||
+	       (format == V4L2_PIX_FMT_BGR32)) ? 4 : 3;
+	if ((format == V4L2_PIX_FMT_RGB32) ||
+	    (format == V4L2_PIX_FMT_RGB24)) {
+	    o0 = 0;
+	    o2 = 2;
+	} else {
+	    o0 = 2;
+	    o2 = 0;
+	}
+	o1 = 1;
+	for (y = 0; y < height; y++) {
+	    in = row;
+	    for (x = 0; x < width; x++) {
+		out[o0] = in[blk->offset[0]];
+		out[o1] = in[blk->offset[1]];
+		out[o2] = in[blk->offset[2]];
+		if (bpp > 3) {
+		    out[3] = 0xff;
+		}
+		out += bpp;
+		in += blk->pixelSize;
+	    }
+	    row += blk->pitch;
+	}
+	return width * height * bpp;
+    case V4L2_PIX_FMT_GREY:
+	for (y = 0; y < height; y++) {
+	    in = row;
+	    x = 0;
+#ifdef __SSE2__
+	    for (; x + 8 <= width; x += 8) {
+		r = Gather8(blk, in, 0);
+		g = Gather8(blk, in, 1);
+		b = Gather8(blk, in, 2);
+		_mm_storel_epi64((__m128i *) out,
+				 _mm_packus_epi16(Luma8(r, g, b), zero));
+		out += 8;
+		in += 8 * blk->pixelSize;
+	    }
+#endif
+	    for (; x < width; x++) {
+		r1 = in[blk->offset[0]];
+		g1 = in[blk->offset[1]];
+		b1 = in[blk->offset[2]];
+		*out++ = sat(((4224 * r1 + 8256 * g1 + 1600 * b1) >> 14) + 16);
+		in += blk->pixelSize;
+	    }
+	    row += blk->pitch;
+	}
+	return width * height;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	isvu = format == V4L2_PIX_FMT_YVYU;
+	for (y = 0; y < height; y++) {
+	    in = row;
+	    x = 0;
+#ifdef __SSE2__
+	    for (; x + 8 <= width; x += 8) {
+		r = Gather8(blk, in, 0);
+		g = Gather8(blk, in, 1);
+		b = Gather8(blk, in, 2);
+		yv = _mm_packus_epi16(Luma8(r, g, b), zero);
+		/* U0..U3 V0..V3, then interleaved to U0 V0 U1 V1 ... */
+		uv = _mm_packus_epi16(Chroma4(r, g, b, 9), zero);
+		uv = isvu ? _mm_unpacklo_epi8(_mm_srli_si128(uv, 4), uv) :
+		    _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 4));
+		_mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi8(yv, uv));
+		out += 16;
+		in += 8 * blk->pixelSize;
+	    }
+#endif
+	    for (; x < width; x += 2) {
+		r1 = in[blk->offset[0]];
+		g1 = in[blk->offset[1]];
+		b1 = in[blk->offset[2]];
+		if (x + 1 < width) {
+		    in += blk->pixelSize;
+		}
+		r2 = in[blk->offset[0]];
+		g2 = in[blk->offset[1]];
+		b2 = in[blk->offset[2]];
+		in += blk->pixelSize;
+		out[0] = sat(((4224 * r1 + 8256 * g1 + 1600 * b1) >> 14) + 16);
+		out[2] = sat(((4224 * r2 + 8256 * g2 + 1600 * b2) >> 14) + 16);
+		r1 += r2;
+		g1 += g2;
+		b1 += b2;
+		out[isvu ? 3 : 1] =
+		    sat(((-2432 * r1 - 4736 * g1 + 7168 * b1) >> 15) + 128);
+		out[isvu ? 1 : 3] =
+		    sat(((7168 * r1 - 6016 * g1 - 1152 * b1) >> 15) + 128);
+		out += 4;
+	    }
+	    row += blk->pitch;
+	}
+	return ((width + 1) / 2) * height * 4;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420: {
+	unsigned char *yp, *up, *vp, *p00, *p01, *p10, *p11;
+	int cw = (width + 1) / 2, ch = (height + 1) / 2, ustep;
+#ifdef __SSE2__
+	__m128i rb, gb, bb;
+	int word;
+#endif
+
+	/* 2x2 pixels per chroma sample, rows are independent */
+	up = out + width * height;
+	if (format == V4L2_PIX_FMT_NV12) {
+	    vp = up + 1;
+	    ustep = 2;
+	} else {
+	    vp = up + cw * ch;
+	    ustep = 1;
+	}
+	for (y = 0; y < height; y += 2) {
+	    yp = out + y * width;
+	    p00 = row;
+	    p10 = (y + 1 < height) ? row + blk->pitch : row;
+	    x = 0;
+#ifdef __SSE2__
+	    for (; (y + 1 < height) && (x + 8 <= width); x += 8) {
+		r = Gather8(blk, p00, 0);
+		g = Gather8(blk, p00, 1);
+		b = Gather8(blk, p00, 2);
+		rb = Gather8(blk, p10, 0);
+		gb = Gather8(blk, p10, 1);
+		bb = Gather8(blk, p10, 2);
+		_mm_storel_epi64((__m128i *) yp,
+				 _mm_packus_epi16(Luma8(r, g, b), zero));
+		_mm_storel_epi64((__m128i *) (yp + width),
+				 _mm_packus_epi16(Luma8(rb, gb, bb), zero));
+		/* U0..U3 V0..V3 of the 2x2 sums */
+		uv = _mm_packus_epi16(Chroma4(_mm_add_epi16(r, rb),
+					      _mm_add_epi16(g, gb),
+					      _mm_add_epi16(b, bb), 10), zero);
+		if (ustep == 2) {
+		    _mm_storel_epi64((__m128i *) up,
+				     _mm_unpacklo_epi8(uv,
+						       _mm_srli_si128(uv, 4)));
+		} else {
+		    word = _mm_cvtsi128_si32(uv);
+		    memcpy(up, &word, 4);
+		    word = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+		    memcpy(vp, &word, 4);
+		}
+		up += 4 * ustep;
+		vp += 4 * ustep;
+		yp += 8;
+		p00 += 8 * blk->pixelSize;
+		p10 += 8 * blk->pixelSize;
+	    }
+#endif
+	    for (; x < width; x += 2) {
+		p01 = (x + 1 < width) ? p00 + blk->pixelSize : p00;
+		p11 = (x + 1 < width) ? p10 + blk->pixelSize : p10;
+		yp[0] = LumaOf(p00, blk->offset);
+		if (x + 1 < width) {
+		    yp[1] = LumaOf(p01, blk->offset);
+		}
+		if (y + 1 < height) {
+		    yp[width] = LumaOf(p10, blk->offset);
+		    if (x + 1 < width) {
+			yp[width + 1] = LumaOf(p11, blk->offset);
+		    }
+		}
+		r1 = p00[blk->offset[0]] + p01[blk->offset[0]] +
+		    p10[blk->offset[0]] + p11[blk->offset[0]];
+		g1 = p00[blk->offset[1]] + p01[blk->offset[1]] +
+		    p10[blk->offset[1]] + p11[blk->offset[1]];
+		b1 = p00[blk->offset[2]] + p01[blk->offset[2]] +
+		    p10[blk->offset[2]] + p11[blk->offset[2]];
+		*up = sat(((-2432 * r1 - 4736 * g1 + 7168 * b1) >> 16) + 128);
+		*vp = sat(((7168 * r1 - 6016 * g1 - 1152 * b1) >> 16) + 128);
+		up += ustep;
+		vp += ustep;
+		yp += 2;
+		p00 += 2 * blk->pixelSize;
+		p10 += 2 * blk->pixelSize;
+	    }
+	    row += 2 * blk->pitch;
+	}
+	return width * height + 2 * cw * ch;
+    }
+#ifdef USE_MJPEG
+    case V4L2_PIX_FMT_MJPEG:
+	return EncodeJPEG(v4l2c, blk, out, outLen);
+#endif
+    }
+    errno = EINVAL;
+    return 0;
+}
+
+#ifdef USE_MJPEG
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ConvertFromMJPEG --
+ *
+ *	Make RGB from a (M)JPEG frame. Logic is borrowed from libuvc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+struct error_mgr {
+    struct jpeg_error_mgr super;
+    jmp_buf jmp;
+};
+
+static void
+j_out_msg(j_common_ptr info)
+{
+}
+
+static void
+j_fmt_msg(j_common_ptr info, char *buffer)
+{
+    buffer[0] = '\0';
+}
+
+static void
+j_err_exit(j_common_ptr info)
+{
+    struct error_mgr *errmgr = (struct error_mgr *) info->err;
+
+    (*info->err->output_message)(info);
+    longjmp(errmgr->jmp, 1);
+}
+
+/*
+ * ISO/IEC 10918-1:1993(E) K.3.3.
+ * Default Huffman tables used by MJPEG UVC devices
+ * which don't specify a Huffman table in the JPEG stream.
+ */
+
+static const unsigned char dc_lumi_len[] = {
+    0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+
+static const unsigned char dc_lumi_val[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const unsigned char dc_chromi_len[] = {
+    0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+
+static const unsigned char dc_chromi_val[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+static const unsigned char ac_lumi_len[] = {
+    0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
+};
+
+static const unsigned char ac_lumi_val[] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21,
+    0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
+    0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1,
+    0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25,
+    0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+    0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93,
+    0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3,
+    0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3,
+    0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1,
+    0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+static const unsigned char ac_chromi_len[] = {
+    0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77
+};
+
+static const unsigned char ac_chromi_val[] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31,
+    0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+    0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1,
+    0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18,
+    0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+    0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a,
+    0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa,
+    0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+    0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca,
+    0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+#define COPY_HUFF_TBL(dinfo, tbl, name)					\
+do {									\
+    if (dinfo->tbl == NULL) {						\
+	dinfo->tbl = jpeg_alloc_huff_table((j_common_ptr) dinfo);	\
+    }									\
+    memcpy(dinfo->tbl->bits, name##_len, sizeof (name##_len));		\
+    memset(dinfo->tbl->huffval, 0, sizeof (dinfo->tbl->huffval));	\
+    memcpy(dinfo->tbl->huffval, name##_val, sizeof (name##_val));	\
+} while (0)
+
+static inline void
+j_ins_huff_tbls(j_decompress_ptr dinfo)
+{
+    COPY_HUFF_TBL(dinfo, dc_huff_tbl_ptrs[0], dc_lumi);
+    COPY_HUFF_TBL(dinfo, dc_huff_tbl_ptrs[1], dc_chromi);
+    COPY_HUFF_TBL(dinfo, ac_huff_tbl_ptrs[0], ac_lumi);
+    COPY_HUFF_TBL(dinfo, ac_huff_tbl_ptrs[1], ac_chromi);
+}
+
+#undef COPY_HUFF_TBL
+
+static unsigned char *
+ConvertFromMJPEG(unsigned char *in, int inlen, int width, int height)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct error_mgr jerr;
+    unsigned char *out;
+    size_t nlines;
+
+    out = attemptckalloc(width * height * 3);
+    if (out == NULL) {
+	return NULL;
+    }
+    dinfo.err = jpeg_std_error(&jerr.super);
+    jerr.super.output_message = j_out_msg;
+    jerr.super.format_message = j_fmt_msg;
+    jerr.super.error_exit = j_err_exit;
+    if (setjmp(jerr.jmp)) {
+	goto failed;
+    }
+
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, in, inlen);
+    jpeg_read_header(&dinfo, TRUE);
+    if (dinfo.dc_huff_tbl_ptrs[0] == NULL) {
+	j_ins_huff_tbls(&dinfo);
+    }
+    dinfo.out_color_space = JCS_RGB;
+    dinfo.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&dinfo);
+    nlines = 0;
+    while ((dinfo.output_scanline < dinfo.output_height) &&
+	   (dinfo.output_scanline < height)) {
+	unsigned char *buf[1];
+	int n;
+
+	buf[0] = out + nlines * width * 3;
+	n = jpeg_read_scanlines(&dinfo, buf, 1);
+	nlines += n;
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+    return out;
+
+failed:
+    jpeg_destroy_decompress(&dinfo);
+    ckfree(out);
+    return V4L2_MJPEG_FAILED;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * JpegSetup --
+ *
+ *	Return the JPEG compressor of a device, created on first use
+ *	and kept for subsequent frames. Compression parameters are
+ *	only set up again when color space or quality change. With
+ *	JCS_YCbCr the compressor takes raw 4:2:2 data. Returns NULL
+ *	on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+struct VJPEG {
+    struct jpeg_compress_struct cinfo;
+    struct error_mgr jerr;
+    int space;			/* Configured color space. */
+    int quality;		/* Configured quality. */
+    unsigned char *line;	/* Line buffer. */
+    int lineLen;		/* Size of line buffer. */
+    unsigned char *out;		/* Output buffer or NULL. */
+    unsigned long outLen;	/* Size of output buffer. */
+};
+
+static struct VJPEG *
+JpegSetup(V4L2C *v4l2c, int space, int quality)
+{
+    /* volatile as live across setjmp() */
+    struct VJPEG *volatile enc = v4l2c->jpegEnc;
+
+    if (enc == NULL) {
+	enc = (struct VJPEG *) attemptckalloc(sizeof (struct VJPEG));
+	if (enc == NULL) {
+	    return NULL;
+	}
+	memset(enc, 0, sizeof (struct VJPEG));
+	enc->cinfo.err = jpeg_std_error(&enc->jerr.super);
+	enc->jerr.super.output_message = j_out_msg;
+	enc->jerr.super.format_message = j_fmt_msg;
+	enc->jerr.super.error_exit = j_err_exit;
+	if (setjmp(enc->jerr.jmp)) {
+	    jpeg_destroy_compress(&enc->cinfo);
+	    ckfree((char *) enc);
+	    return NULL;
+	}
+	jpeg_create_compress(&enc->cinfo);
+	v4l2c->jpegEnc = enc;
+    }
+    if ((enc->space == space) && (enc->quality == quality)) {
+	return enc;
+    }
+    enc->space = JCS_UNKNOWN;
+    if (setjmp(enc->jerr.jmp)) {
+	return NULL;
+    }
+    enc->cinfo.in_color_space = space;
+    enc->cinfo.input_components = (space == JCS_GRAYSCALE) ? 1 : 3;
+    jpeg_set_defaults(&enc->cinfo);
+    jpeg_set_quality(&enc->cinfo, quality, TRUE);
+    enc->cinfo.dct_method = JDCT_IFAST;
+    if (space == JCS_YCbCr) {
+	/* raw data, luma 2x1, chroma 1x1 */
+	enc->cinfo.raw_data_in = TRUE;
+	enc->cinfo.comp_info[0].h_samp_factor = 2;
+	enc->cinfo.comp_info[0].v_samp_factor = 1;
+	enc->cinfo.comp_info[1].h_samp_factor = 1;
+	enc->cinfo.comp_info[1].v_samp_factor = 1;
+	enc->cinfo.comp_info[2].h_samp_factor = 1;
+	enc->cinfo.comp_info[2].v_samp_factor = 1;
+    }
+    enc->space = space;
+    enc->quality = quality;
+    return enc;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * JpegLine --
+ *
+ *	Make the line buffer of a JPEG compressor at least size bytes
+ *	large. Returns -1 when out of memory.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+JpegLine(struct VJPEG *enc, int size)
+{
+    if (enc->lineLen < size) {
+	if (enc->line != NULL) {
+	    ckfree(enc->line);
+	}
+	enc->lineLen = 0;
+	enc->line = attemptckalloc(size);
+	if (enc->line == NULL) {
+	    return -1;
+	}
+	enc->lineLen = size;
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * EncodeJPEG, EncodeJPEGFree --
+ *
+ *	Compress an image block to JPEG for a loopback device using
+ *	the compressor of the device. Returns the size of the JPEG
+ *	data or zero with errno set on error, ENOSPC when the data
+ *	doesn't fit into out.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+EncodeJPEG(V4L2C *v4l2c, Tk_PhotoImageBlock *blk, unsigned char *out,
+	   int outLen)
+{
+    struct VJPEG *enc;
+    unsigned char *mem, *in, *row, *dst;
+    unsigned long memLen;
+    JSAMPROW rows[1];
+    int x, y;
+
+    enc = JpegSetup(v4l2c, JCS_RGB, JPEG_QUALITY);
+    if ((enc == NULL) || (JpegLine(enc, blk->width * 3) < 0)) {
+	errno = ENOMEM;
+	return 0;
+    }
+    mem = out;
+    memLen = outLen;
+    if (setjmp(enc->jerr.jmp)) {
+	jpeg_abort_compress(&enc->cinfo);
+	if (mem != out) {
+	    free(mem);
+	}
+	errno = EIO;
+	return 0;
+    }
+    enc->cinfo.image_width = blk->width;
+    enc->cinfo.image_height = blk->height;
+    jpeg_mem_dest(&enc->cinfo, &mem, &memLen);
+    jpeg_start_compress(&enc->cinfo, TRUE);
+    row = blk->pixelPtr;
+    rows[0] = enc->line;
+    for (y = 0; y < blk->height; y++) {
+	in = row;
+	dst = enc->line;
+	for (x = 0; x < blk->width; x++) {
+	    dst[0] = in[blk->offset[0]];
+	    dst[1] = in[blk->offset[1]];
+	    dst[2] = in[blk->offset[2]];
+	    dst += 3;
+	    in += blk->pixelSize;
+	}
+	jpeg_write_scanlines(&enc->cinfo, rows, 1);
+	row += blk->pitch;
+    }
+    jpeg_finish_compress(&enc->cinfo);
+    if (mem != out) {
+	/* didn't fit, libjpeg switched to its own buffer */
+	free(mem);
+	errno = ENOSPC;
+	return 0;
+    }
+    return memLen;
+}
+
+static void
+EncodeJPEGFree(V4L2C *v4l2c)
+{
+    struct VJPEG *enc = v4l2c->jpegEnc;
+
+    if (enc != NULL) {
+	jpeg_destroy_compress(&enc->cinfo);
+	if (enc->line != NULL) {
+	    ckfree(enc->line);
+	}
+	if (enc->out != NULL) {
+	    ckfree(enc->out);
+	}
+	ckfree((char *) enc);
+	v4l2c->jpegEnc = NULL;
+    }
+}
+#endif
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * OrientBlock --
+ *
+ *	Adjust an image block for rotation in degrees and mirroring
+ *	by means of negative pitch and pixel size.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+OrientBlock(Tk_PhotoImageBlock *blk, int rot, int mirror)
+{
+    int w = blk->width, h = blk->height, pitch = blk->pitch;
+
+    if ((mirror & 3) == 3) {
+	rot = (rot + 180) % 360;
+    }
+    switch (rot) {
+    case 270:	/* = 90 CW */
+	blk->pitch = blk->pixelSize;
+	blk->pixelPtr += pitch * (h - 1);
+	blk->pixelSize = -pitch;
+	blk->offset[3] = blk->pixelSize + 1;	/* no alpha */
+	blk->width = h;
+	blk->height = w;
+	break;
+    case 180:	/* = 180 CW */
+	blk->pitch = -pitch;
+	blk->pixelPtr += pitch * (h - 1) + (w - 1) * blk->pixelSize;
+	blk->pixelSize = -blk->pixelSize;
+	blk->offset[3] = blk->pixelSize + 1;	/* no alpha */
+	break;
+    case 90:	/* = 270 CW */
+	blk->pitch = -blk->pixelSize;
+	blk->pixelPtr += (w - 1) * blk->pixelSize;
+	blk->pixelSize = pitch;
+	blk->offset[3] = blk->pixelSize + 1;	/* no alpha */
+	blk->width = h;
+	blk->height = w;
+	break;
+    }
+    if ((mirror & 3) == 2) {
+	/* mirror in X */
+	blk->pixelPtr += (blk->width - 1) * blk->pixelSize;
+	blk->pixelSize = -blk->pixelSize;
+	blk->offset[3] = blk->pixelSize + 1;	/* no alpha */
+    }
+    if ((mirror & 3) == 1) {
+	/* mirror in Y */
+	blk->pixelPtr += blk->pitch * (blk->height - 1);
+	blk->pitch = -blk->pitch;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GetImage --
+ *
+ *	Retrieve last captured buffer as photo image or byte array.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+GetImage(V4L2I *v4l2i, V4L2C *v4l2c, int flags, Tcl_Obj *arg)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    Tk_PhotoHandle photo = NULL;
+    int result = TCL_OK, done = 0;
+    char *name;
+    unsigned char *rgbToFree = NULL, *toFree = NULL;
+
+    if (IdleWakeup(v4l2c) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (arg != NULL) {
+	if (CheckForTk(v4l2i, interp) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (Tk_MainWindow(interp) == NULL) {
+	    Tcl_SetResult(interp, "application has been destroyed",
+			  TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	name = Tcl_GetString(arg);
+	photo = Tk_FindPhoto(interp, name);
+	if (photo == NULL) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("can't use \"%s\": not a photo image", name));
+	    return TCL_ERROR;
+	}
+    }
+    if (v4l2c->bufrdy < 0) {
+	/* no image available */
+	if (photo != NULL) {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	} else {
+	    Tcl_SetResult(interp, "no image available", TCL_STATIC);
+	    result = TCL_ERROR;
+	}
+	goto done;
+    }
+    if (IsCoded(v4l2c->format)
+#ifdef USE_MJPEG
+	&& (v4l2c->format != V4L2_PIX_FMT_MJPEG)
+#endif
+	) {
+	Tcl_SetResult(interp, "compressed format, use \"v4l2 packet\"",
+		      TCL_STATIC);
+	result = TCL_ERROR;
+	goto done;
+    }
+    if (photo != NULL) {
+	Tk_PhotoImageBlock block;
+	int width = v4l2c->width;
+	int height = v4l2c->height;
+
+	switch (v4l2c->format) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+	    rgbToFree = ConvertFromYUV(v4l2c->vbufs[v4l2c->bufrdy].start,
+				       width, height,
+				       v4l2c->format == V4L2_PIX_FMT_YVYU);
+	    if (rgbToFree == NULL) {
+		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+		result = TCL_ERROR;
+		goto done;
+	    }
+	    block.pixelSize = 3;
+	    block.offset[0] = 0;
+	    block.offset[1] = 1;
+	    block.offset[2] = 2;
+	    block.offset[3] = 4;
+	    block.pixelPtr = rgbToFree;
+	    break;
+	case V4L2_PIX_FMT_RGB32:
+	    block.pixelSize = 4;
+	    block.offset[0] = 0;
+	    block.offset[1] = 1;
+	    block.offset[2] = 2;
+	    block.offset[3] = 3;
+	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
+	    break;
+	case V4L2_PIX_FMT_BGR32:
+	    block.pixelSize = 4;
+	    block.offset[0] = 2;
+	    block.offset[1] = 1;
+	    block.offset[2] = 0;
+	    block.offset[3] = 3;
+	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
+	    break;
+	case V4L2_PIX_FMT_RGB24:
+	default:
+	    block.pixelSize = 3;
+	    block.offset[0] = 0;
+	    block.offset[1] = 1;
+	    block.offset[2] = 2;
+	    block.offset[3] = 4;
+	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
+	    break;
+	case V4L2_PIX_FMT_BGR24:
+	    block.pixelSize = 3;
+	    block.offset[0] = 2;
+	    block.offset[1] = 1;
+	    block.offset[2] = 0;
+	    block.offset[3] = 4;
+	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
+	    break;
+#ifdef USE_MJPEG
+	case V4L2_PIX_FMT_MJPEG:
+	    rgbToFree = ConvertFromMJPEG(v4l2c->vbufs[v4l2c->bufrdy].start,
+					 v4l2c->vbufs[v4l2c->bufrdy].length,
+					 width, height);
+	    if (rgbToFree == V4L2_MJPEG_FAILED) {
+		rgbToFree = NULL;
+		Tcl_SetResult(interp, "conversion from jpeg failed",
+			      TCL_STATIC);
+		result = TCL_ERROR;
+		goto done;
+	    }
+	    if (rgbToFree == NULL) {
+		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+		result = TCL_ERROR;
+		goto done;
+	    }
+	    block.pixelSize = 3;
+	    block.offset[0] = 0;
+	    block.offset[1] = 1;
+	    block.offset[2] = 2;
+	    block.offset[3] = 4;
+	    block.pixelPtr = rgbToFree;
+	    break;
+#endif
+	case V4L2_PIX_FMT_GREY:
+	    block.pixelSize = 1;
+	    block.offset[0] = 0;
+	    block.offset[1] = 0;
+	    block.offset[2] = 0;
+	    block.offset[3] = 1;
+	    block.pixelPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
+	    break;
+#ifdef V4L2_PIX_FMT_Y10
+	case V4L2_PIX_FMT_Y10:
+#endif
+#ifdef V4L2_PIX_FMT_Y16
+	case V4L2_PIX_FMT_Y16:
+#endif
+#if defined(V4L2_PIX_FMT_Y16) || defined(V4L2_PIX_FMT_Y10)
+	    block.pixelSize = 1;
+	    block.offset[0] = 0;
+	    block.offset[1] = 0;
+	    block.offset[2] = 0;
+	    block.offset[3] = 1;
+	    block.pixelPtr = toFree = attemptckalloc(width * height);
+	    if (block.pixelPtr == NULL) {
+		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+		result = TCL_ERROR;
+		goto done;
+	    } else {
+		int n, v, shift;
+		unsigned short *fromPtr;
+		unsigned char *toPtr;
+
+		fromPtr = (unsigned short *) v4l2c->vbufs[v4l2c->bufrdy].start;
+		toPtr = block.pixelPtr;
+		shift = v4l2c->greyshift;
+		if (shift > 0) {
+		    for (n = 0; n < width * height; n++) {
+			v = *fromPtr++;
+			v = v >> shift;
+			*toPtr++ = v;
+		    }
+		} else {
+		    shift = -shift;
+		    for (n = 0; n < width * height; n++) {
+			v = *fromPtr++;
+			v = v << shift;
+			*toPtr++ = v;
+		    }
+		}
+	    }
+	    break;
+#endif
+	}
+	block.width = width;
+	block.height = height;
+	block.pitch = block.pixelSize * block.width;
+
+	if ((flags & 0x07) && (block.pixelSize >= 3)) {
+	    int x, y, w0, w1, w2;
+	    unsigned char *src0, *src1, *src2, *dst;
+
+	    toFree = attemptckalloc(width * height);
+	    if (toFree == NULL) {
+		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+		result = TCL_ERROR;
+		goto done;
+	    }
+	    dst = toFree;
+	    switch (flags & 0x07) {
+	    case 1:	/* blue */
+		src0 = block.pixelPtr + block.offset[2];
+		goto doOne;
+	    case 2:	/* green */
+		src0 = block.pixelPtr + block.offset[1];
+		goto doOne;
+	    case 4:	/* red */
+		src0 = block.pixelPtr + block.offset[0];
+	    doOne:
+		for (y = 0; y < height; y++) {
+		    unsigned char *src = src0 + block.pitch * y;
+
+		    for (x = 0; x < width; x++) {
+			*dst++ = *src;
+			src += block.pixelSize;
+		    }
+		}
+		break;
+	    case 3:	/* blue + green */
+		src0 = block.pixelPtr + block.offset[2];
+		src1 = block.pixelPtr + block.offset[1];
+		w0 = 162;
+		w1 = 837;
+		goto doTwo;
+	    case 5:	/* blue + red */
+		src0 = block.pixelPtr + block.offset[2];
+		src1 = block.pixelPtr + block.offset[0];
+		w0 = 276;
+		w1 = 723;
+		goto doTwo;
+	    case 6:	/* green + red */
+		src0 = block.pixelPtr + block.offset[1];
+		src1 = block.pixelPtr + block.offset[0];
+		w0 = 662;
+		w1 = 337;
+	    doTwo:
+		for (y = 0; y < height; y++) {
+		    unsigned char *srcA = src0 + block.pitch * y;
+		    unsigned char *srcB = src1 + block.pitch * y;
+
+		    for (x = 0; x < width; x++) {
+			*dst++ = (w0 * srcA[0] + w1 * srcB[0]) / 1000;
+			srcA += block.pixelSize;
+			srcB += block.pixelSize;
+		    }
+		}
+		break;
+	    case 7:	/* all */
+		src0 = block.pixelPtr + block.offset[2];
+		src1 = block.pixelPtr + block.offset[1];
+		src2 = block.pixelPtr + block.offset[0];
+		w0 = 114;
+		w1 = 587;
+		w2 = 299;
+		for (y = 0; y < height; y++) {
+		    unsigned char *srcA = src0 + block.pitch * y;
+		    unsigned char *srcB = src1 + block.pitch * y;
+		    unsigned char *srcC = src2 + block.pitch * y;
+
+		    for (x = 0; x < width; x++) {
+			*dst++ =
+			    (w0 * srcA[0] + w1 * srcB[0] + w2 * srcC[0]) / 1000;
+			srcA += block.pixelSize;
+			srcB += block.pixelSize;
+			srcC += block.pixelSize;
+		    }
+		}
+		break;
+	    }
+	    block.pitch = width;
+	    block.pixelSize = 1;
+	    block.offset[0] = 0;
+	    block.offset[1] = 0;
+	    block.offset[2] = 0;
+	    block.offset[3] = 1;
+	    block.pixelPtr = toFree;
+	}
+
+	OrientBlock(&block, v4l2c->rotate, v4l2c->mirror);
+
+	if (Tk_PhotoExpand(interp, photo, block.width, block.height)
+	    != TCL_OK) {
+	    result = TCL_ERROR;
+	    goto done;
+	}
+	if (Tk_PhotoPutBlock(interp, photo, &block, 0, 0,
+			     block.width, block.height,
+			     TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
+	    result = TCL_ERROR;
+	} else {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+	    done = 1;
+	}
+    } else {
+	unsigned char *rawPtr = NULL;
+	int rawSize, pixelSize;
+	Tcl_Obj *list[4];
+
+	switch (v4l2c->format) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+	    rgbToFree = ConvertFromYUV(v4l2c->vbufs[v4l2c->bufrdy].start,
+				       v4l2c->width, v4l2c->height,
+				       v4l2c->format == V4L2_PIX_FMT_YVYU);
+	    if (rgbToFree == NULL) {
+		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+		result = TCL_ERROR;
+		goto done;
+	    }
+	    rawSize = v4l2c->width * v4l2c->height * 3;
+	    pixelSize = 3;
+	    rawPtr = rgbToFree;
+	    break;
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_BGR32:
+	    rawSize = v4l2c->width * v4l2c->height * 4;
+	    pixelSize = 4;
+	    break;
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+	default:
+	    rawSize = v4l2c->width * v4l2c->height * 3;
+	    pixelSize = 3;
+	    break;
+#ifdef USE_MJPEG
+	case V4L2_PIX_FMT_MJPEG:
+	    rgbToFree = ConvertFromMJPEG(v4l2c->vbufs[v4l2c->bufrdy].start,
+					 v4l2c->vbufs[v4l2c->bufrdy].length,
+					 v4l2c->width, v4l2c->height);
+	    if (rgbToFree == V4L2_MJPEG_FAILED) {
+		rgbToFree = NULL;
+		Tcl_SetResult(interp, "conversion from jpeg failed",
+			      TCL_STATIC);
+		result = TCL_ERROR;
+		goto done;
+	    }
+	    if (rgbToFree == NULL) {
+		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+		result = TCL_ERROR;
+		goto done;
+	    }
+	    rawSize = v4l2c->width * v4l2c->height * 3;
+	    pixelSize = 3;
+	    rawPtr = rgbToFree;
+	    break;
+#endif
+	case V4L2_PIX_FMT_GREY:
+	    rawSize = v4l2c->width * v4l2c->height;
+	    pixelSize = 1;
+	    break;
+#ifdef V4L2_PIX_FMT_Y10
+	case V4L2_PIX_FMT_Y10:
+	    rawSize = v4l2c->width * v4l2c->height * 2;
+	    pixelSize = 2;
+	    break;
+#endif
+#ifdef V4L2_PIX_FMT_Y16
+	case V4L2_PIX_FMT_Y16:
+	    rawSize = v4l2c->width * v4l2c->height * 2;
+	    pixelSize = 2;
+	    break;
+#endif
+	}
+	if (rawPtr == NULL) {
+	    rawPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
+	}
+
+	if ((flags & 0x07) && (pixelSize >= 3)) {
+	    int x, y, w0, w1, w2;
+	    unsigned char *src0, *src1, *src2, *dst;
+
+	    toFree = attemptckalloc(v4l2c->width * v4l2c->height);
+	    if (toFree == NULL) {
+		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+		result = TCL_ERROR;
+		goto done;
+	    }
+	    dst = toFree;
+	    switch (flags & 0x07) {
+	    case 1:	/* blue */
+		switch (v4l2c->format) {
+		case V4L2_PIX_FMT_RGB32:
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		default:
+		    src0 = rawPtr + 2;
+		    break;
+		case V4L2_PIX_FMT_BGR32:
+		case V4L2_PIX_FMT_BGR24:
+		    src0 = rawPtr + 0;
+		    break;
+		}
+		goto rawOne;
+	    case 2:	/* green */
+		src0 = rawPtr + 1;
+		goto rawOne;
+	    case 4:	/* red */
+		switch (v4l2c->format) {
+		case V4L2_PIX_FMT_RGB32:
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		default:
+		    src0 = rawPtr + 0;
+		    break;
+		case V4L2_PIX_FMT_BGR32:
+		case V4L2_PIX_FMT_BGR24:
+		    src0 = rawPtr + 2;
+		    break;
+		}
+	    rawOne:
+		for (y = 0; y < v4l2c->height; y++) {
+		    unsigned char *src = src0 + v4l2c->width * y;
+
+		    for (x = 0; x < v4l2c->width; x++) {
+			*dst++ = *src;
+			src += pixelSize;
+		    }
+		}
+		break;
+	    case 3:	/* blue + green */
+		switch (v4l2c->format) {
+		case V4L2_PIX_FMT_RGB32:
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		default:
+		    src0 = rawPtr + 2;
+		    src1 = rawPtr + 1;
+		    break;
+		case V4L2_PIX_FMT_BGR32:
+		case V4L2_PIX_FMT_BGR24:
+		    src0 = rawPtr + 0;
+		    src1 = rawPtr + 1;
+		    break;
+		}
+		w0 = 162;
+		w1 = 837;
+		goto rawTwo;
+	    case 5:	/* blue + red */
+		switch (v4l2c->format) {
+		case V4L2_PIX_FMT_RGB32:
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		default:
+		    src0 = rawPtr + 2;
+		    src1 = rawPtr + 0;
+		    break;
+		case V4L2_PIX_FMT_BGR32:
+		case V4L2_PIX_FMT_BGR24:
+		    src0 = rawPtr + 0;
+		    src1 = rawPtr + 2;
+		    break;
+		}
+		w0 = 276;
+		w1 = 723;
+		goto rawTwo;
+	    case 6:	/* green + red */
+		switch (v4l2c->format) {
+		case V4L2_PIX_FMT_RGB32:
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		default:
+		    src0 = rawPtr + 1;
+		    src1 = rawPtr + 0;
+		    break;
+		case V4L2_PIX_FMT_BGR32:
+		case V4L2_PIX_FMT_BGR24:
+		    src0 = rawPtr + 1;
+		    src1 = rawPtr + 2;
+		    break;
+		}
+		w0 = 662;
+		w1 = 337;
+	    rawTwo:
+		for (y = 0; y < v4l2c->height; y++) {
+		    unsigned char *srcA = src0 + v4l2c->width * y;
+		    unsigned char *srcB = src1 + v4l2c->width * y;
+
+		    for (x = 0; x < v4l2c->width; x++) {
+			*dst++ = (w0 * srcA[0] + w1 * srcB[0]) / 1000;
+			srcA += pixelSize;
+			srcB += pixelSize;
+		    }
+		}
+		break;
+	    case 7:	/* all */
+		switch (v4l2c->format) {
+		case V4L2_PIX_FMT_RGB32:
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		default:
+		    src0 = rawPtr + 2;
+		    src1 = rawPtr + 1;
+		    src2 = rawPtr + 0;
+		    break;
+		case V4L2_PIX_FMT_BGR32:
+		case V4L2_PIX_FMT_BGR24:
+		    src0 = rawPtr + 0;
+		    src1 = rawPtr + 1;
+		    src2 = rawPtr + 2;
+		    break;
+		}
+		w0 = 114;
+		w1 = 587;
+		w2 = 299;
+		for (y = 0; y < v4l2c->height; y++) {
+		    unsigned char *srcA = src0 + v4l2c->width * y;
+		    unsigned char *srcB = src1 + v4l2c->width * y;
+		    unsigned char *srcC = src2 + v4l2c->width * y;
+
+		    for (x = 0; x < v4l2c->width; x++) {
+			*dst++ =
+			    (w0 * srcA[0] + w1 * srcB[0] + w2 * srcC[0]) / 1000;
+			srcA += pixelSize;
+			srcB += pixelSize;
+			srcC += pixelSize;
+		    }
+		}
+		break;
+	    }
+	    rawPtr = toFree;
+	    rawSize = v4l2c->width * v4l2c->height;
+	    pixelSize = 1;
+	}
+
+	list[0] = Tcl_NewIntObj(v4l2c->width);
+	list[1] = Tcl_NewIntObj(v4l2c->height);
+	list[2] = Tcl_NewIntObj(pixelSize);
+	list[3] = Tcl_NewByteArrayObj(rawPtr, rawSize);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(4, list));
+	done = 1;
+    }
+done:
+    if (toFree != NULL) {
+	ckfree(toFree);
+    }
+    if (rgbToFree != NULL) {
+	ckfree(rgbToFree);
+    }
+    if (done && !v4l2c->bufdone) {
+	v4l2c->bufdone = 1;
+	v4l2c->counters[1] += 1;
+    }
+    return result;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameCopy --
+ *
+ *	Copy the last ready frame of a capture device to dst with
+ *	lines packed, i.e. row by row when the driver pads lines to
+ *	a larger stride. Returns the number of bytes copied, or -1
+ *	when dst is too small for the packed frame.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+FrameCopy(V4L2C *v4l2c, unsigned char *dst, int dstLen)
+{
+    unsigned char *src = (unsigned char *) v4l2c->vbufs[v4l2c->bufrdy].start;
+    int length, i, y, np = 1, need = 0, size = 0;
+    int w = v4l2c->width, h = v4l2c->height, bpl = v4l2c->bpl;
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    int rowLen[3], rows[3], stride[3];
+
+    length = v4l2c->rdyUsed;
+    if ((length <= 0) || (length > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	length = v4l2c->vbufs[v4l2c->bufrdy].length;
+    }
+    rows[0] = h;
+    stride[0] = bpl;
+    switch (v4l2c->format) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	rowLen[0] = cw * 4;
+	break;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+	rowLen[0] = w * 3;
+	break;
+    case V4L2_PIX_FMT_RGB32:
+    case V4L2_PIX_FMT_BGR32:
+	rowLen[0] = w * 4;
+	break;
+    case V4L2_PIX_FMT_GREY:
+	rowLen[0] = w;
+	break;
+    case V4L2_PIX_FMT_NV12:
+	rowLen[0] = w;
+	rowLen[1] = cw * 2;
+	rows[1] = ch;
+	stride[1] = bpl;
+	np = 2;
+	break;
+    case V4L2_PIX_FMT_YUV420:
+	rowLen[0] = w;
+	rowLen[1] = rowLen[2] = cw;
+	rows[1] = rows[2] = ch;
+	stride[1] = stride[2] = bpl / 2;
+	np = 3;
+	break;
+    default:
+	/* compressed */
+	rowLen[0] = bpl = 0;
+	break;
+    }
+    for (i = 0; i < np; i++) {
+	if (stride[i] < rowLen[i]) {
+	    bpl = 0;
+	}
+	need += stride[i] * rows[i];
+	size += rowLen[i] * rows[i];
+    }
+    if ((bpl <= rowLen[0]) || (need > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	/* no padding or unusable stride */
+	if (length > dstLen) {
+	    return -1;
+	}
+	memcpy(dst, src, length);
+	return length;
+    }
+    if (size > dstLen) {
+	return -1;
+    }
+    for (i = 0; i < np; i++) {
+	for (y = 0; y < rows[i]; y++) {
+	    memcpy(dst, src, rowLen[i]);
+	    dst += rowLen[i];
+	    src += stride[i];
+	}
+    }
+    return size;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameStride --
+ *
+ *	Return the distance of lines in the last ready frame of a
+ *	capture device whose packed lines take rowLen bytes: the
+ *	bytes per line reported by the driver when lines are padded
+ *	and the frame fits into the buffer, otherwise rowLen. Chroma
+ *	planes of NV12 have the same, of I420 half the distance.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+FrameStride(V4L2C *v4l2c, int rowLen)
+{
+    int bpl = v4l2c->bpl, rows = v4l2c->height;
+
+    if ((v4l2c->format == V4L2_PIX_FMT_NV12) ||
+	(v4l2c->format == V4L2_PIX_FMT_YUV420)) {
+	rows += (v4l2c->height + 1) / 2;
+    }
+    if ((bpl <= rowLen) ||
+	((Tcl_WideInt) bpl * rows > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	return rowLen;
+    }
+    return bpl;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameBlock --
+ *
+ *	Describe the last ready frame of a capture device as RGB or
+ *	grey image block. Formats other than RGB and grey are
+ *	converted into a buffer returned in freePtr, which the caller
+ *	must release. Returns -1 with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+FrameBlock(V4L2C *v4l2c, Tk_PhotoImageBlock *blk, unsigned char **freePtr)
+{
+    unsigned char *src, *packed;
+    int length, size;
+
+    *freePtr = NULL;
+    if (v4l2c->bufrdy < 0) {
+	errno = EAGAIN;
+	return -1;
+    }
+    src = (unsigned char *) v4l2c->vbufs[v4l2c->bufrdy].start;
+    length = v4l2c->rdyUsed;
+    if ((length <= 0) || (length > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	length = v4l2c->vbufs[v4l2c->bufrdy].length;
+    }
+    blk->offset[0] = 0;
+    blk->offset[1] = 1;
+    blk->offset[2] = 2;
+    blk->offset[3] = 4;
+    blk->pixelSize = 3;
+    blk->pixelPtr = src;
+    switch (v4l2c->format) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	packed = NULL;
+	if (v4l2c->bpl > ((v4l2c->width + 1) / 2) * 4) {
+	    /* padded lines, pack them first */
+	    size = ((v4l2c->width + 1) / 2) * 4 * v4l2c->height;
+	    packed = attemptckalloc(size);
+	    if (packed == NULL) {
+		errno = ENOMEM;
+		return -1;
+	    }
+	    if (FrameCopy(v4l2c, packed, size) < 0) {
+		ckfree(packed);
+		errno = EINVAL;
+		return -1;
+	    }
+	    src = packed;
+	}
+	*freePtr = ConvertFromYUV(src, v4l2c->width, v4l2c->height,
+				  v4l2c->format == V4L2_PIX_FMT_YVYU);
+	if (packed != NULL) {
+	    ckfree(packed);
+	}
+	if (*freePtr == NULL) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	blk->pixelPtr = *freePtr;
+	break;
+    case V4L2_PIX_FMT_RGB32:
+	blk->pixelSize = 4;
+	blk->offset[3] = 3;
+	break;
+    case V4L2_PIX_FMT_BGR32:
+	blk->pixelSize = 4;
+	blk->offset[0] = 2;
+	blk->offset[2] = 0;
+	blk->offset[3] = 3;
+	break;
+    case V4L2_PIX_FMT_RGB24:
+	break;
+    case V4L2_PIX_FMT_BGR24:
+	blk->offset[0] = 2;
+	blk->offset[2] = 0;
+	break;
+#ifdef USE_MJPEG
+    case V4L2_PIX_FMT_MJPEG:
+	*freePtr = ConvertFromMJPEG(src, length, v4l2c->width, v4l2c->height);
+	if ((*freePtr == NULL) || (*freePtr == V4L2_MJPEG_FAILED)) {
+	    errno = (*freePtr == NULL) ? ENOMEM : EINVAL;
+	    *freePtr = NULL;
+	    return -1;
+	}
+	blk->pixelPtr = *freePtr;
+	break;
+#endif
+    case V4L2_PIX_FMT_GREY:
+	blk->pixelSize = 1;
+	blk->offset[1] = 0;
+	blk->offset[2] = 0;
+	blk->offset[3] = 1;
+	break;
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+    blk->width = v4l2c->width;
+    blk->height = v4l2c->height;
+    blk->pitch = blk->pixelSize * blk->width;
+    if ((blk->pixelPtr == src) && (v4l2c->bpl > blk->pitch) &&
+	(v4l2c->bpl * blk->height <= v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	/* padded lines of RGB or grey frame */
+	blk->pitch = v4l2c->bpl;
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * LoopWriteBlock --
+ *
+ *	Convert an image block to the output format of a loopback
+ *	device and write it. Returns -1 with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+LoopWriteBlock(V4L2C *dst, Tk_PhotoImageBlock *blk)
+{
+    unsigned char *out, *toFree = NULL;
+    int length, how, index, outLen, tmpLen, n;
+
+    if ((blk->width != dst->loopWidth) || (blk->height != dst->loopHeight)) {
+	errno = EINVAL;
+	return -1;
+    }
+    how = LoopBegin(dst, &out, &outLen, &index);
+    if (how < 0) {
+	return -1;
+    }
+    if ((out == NULL) || (outLen < LoopFrameSize(dst))) {
+	tmpLen = blk->width * blk->height * 4;
+	toFree = attemptckalloc(tmpLen);
+	if (toFree == NULL) {
+	    LoopEnd(dst, how, index, out, outLen, NULL, 0);
+	    errno = ENOMEM;
+	    return -1;
+	}
+	length = ConvertBlock(dst, blk, toFree, tmpLen);
+    } else {
+	length = ConvertBlock(dst, blk, out, outLen);
+    }
+    if (length <= 0) {
+	n = errno;
+	LoopEnd(dst, how, index, out, outLen, NULL, 0);
+	errno = n;
+	n = -1;
+    } else {
+	n = LoopEnd(dst, how, index, out, outLen,
+		    (toFree != NULL) ? toFree : out, length);
+    }
+    if (toFree != NULL) {
+	ckfree(toFree);
+    }
+    return n;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ForwardFrame --
+ *
+ *	Write the last ready frame of a capture device to the
+ *	loopback device it is forwarded to. Rotation and mirroring
+ *	are applied while converting to the loopback format; when
+ *	neither is needed and formats agree, the frame is copied.
+ *	Returns -1 with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+ForwardFrame(V4L2C *v4l2c)
+{
+    V4L2C *dst = v4l2c->fwdDst;
+    Tk_PhotoImageBlock block;
+    unsigned char *out, *rgbToFree, *tmp;
+    int rot, mirror, length, how, index, outLen, n;
+
+    if (v4l2c->bufrdy < 0) {
+	return 0;
+    }
+    rot = (v4l2c->fwdRotate >= 0) ? v4l2c->fwdRotate : v4l2c->rotate;
+    mirror = (v4l2c->fwdMirror >= 0) ? v4l2c->fwdMirror : v4l2c->mirror;
+    if ((rot == 0) && ((mirror & 3) == 0) &&
+	(v4l2c->format == dst->loopFormat) &&
+	(v4l2c->width == dst->loopWidth) &&
+	(v4l2c->height == dst->loopHeight)) {
+	/* raw copy */
+	how = LoopBegin(dst, &out, &outLen, &index);
+	if (how < 0) {
+	    return -1;
+	}
+	if (out != NULL) {
+	    length = FrameCopy(v4l2c, out, outLen);
+	    if (length < 0) {
+		LoopEnd(dst, how, index, out, outLen, NULL, 0);
+		errno = EINVAL;
+		return -1;
+	    }
+	    return LoopEnd(dst, how, index, out, outLen, out, length);
+	}
+	/* write() path */
+	outLen = v4l2c->vbufs[v4l2c->bufrdy].length;
+	tmp = attemptckalloc(outLen);
+	if (tmp == NULL) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	length = FrameCopy(v4l2c, tmp, outLen);
+	if (length < 0) {
+	    LoopEnd(dst, how, index, NULL, 0, NULL, 0);
+	    ckfree(tmp);
+	    errno = EINVAL;
+	    return -1;
+	}
+	n = LoopEnd(dst, how, index, NULL, 0, tmp, length);
+	ckfree(tmp);
+	return n;
+    }
+    if (FrameBlock(v4l2c, &block, &rgbToFree) < 0) {
+	return -1;
+    }
+    OrientBlock(&block, rot, mirror);
+    n = LoopWriteBlock(dst, &block);
+    if (rgbToFree != NULL) {
+	ckfree(rgbToFree);
+    }
+    return n;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * KeyAlpha, KeyMix --
+ *
+ *	Foreground weight (0 to 128) of a pixel with given chroma,
+ *	rising from 0 at the tolerance distance to the key color to
+ *	128 at tolerance plus softness, and blending of a component.
+ *	The distance is the sum of the absolute Cb and Cr differences.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static inline int
+KeyAlpha(VKEY *key, int cb, int cr)
+{
+    int t = abs(cb - key->cb) + abs(cr - key->cr) - key->tol;
+
+    if (t <= 0) {
+	return 0;
+    }
+    if (t >= key->soft) {
+	return 128;
+    }
+    return (t * key->gain) >> 4;
+}
+
+static inline unsigned char
+KeyMix(int fg, int bg, int alpha)
+{
+    return bg + (((fg - bg) * alpha) >> 7);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * KeyPacked --
+ *
+ *	Chroma key a YUYV or YVYU frame in place, two pixels sharing
+ *	one weight. With SSE2 four pixel pairs are done at once.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+KeyPacked(VKEY *key, unsigned char *fg, unsigned char *bg, int npairs,
+	  int isvu)
+{
+    int i, alpha, k1 = isvu ? key->cr : key->cb, k3 = isvu ? key->cb : key->cr;
+
+#ifdef __SSE2__
+    __m128i kv = _mm_set1_epi32((k3 << 24) | (k1 << 8));
+    __m128i cmask = _mm_set1_epi32(0xff00ff00);
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i zero = _mm_setzero_si128();
+    __m128i tol = _mm_set1_epi16(key->tol);
+    __m128i soft = _mm_set1_epi16(key->soft);
+    __m128i gain = _mm_set1_epi16(key->gain);
+    __m128i full = _mm_set1_epi16(128);
+    __m128i f, b, d, t, a, lo, hi;
+
+    for (; npairs >= 4; npairs -= 4) {
+	f = _mm_loadu_si128((__m128i *) fg);
+	b = _mm_loadu_si128((__m128i *) bg);
+	/* |U - Ku| + |V - Kv| per pair */
+	d = _mm_or_si128(_mm_subs_epu8(f, kv), _mm_subs_epu8(kv, f));
+	d = _mm_srli_epi16(_mm_and_si128(d, cmask), 8);
+	d = _mm_madd_epi16(d, ones);
+	d = _mm_packs_epi32(d, d);
+	t = _mm_min_epi16(_mm_subs_epu16(d, tol), soft);
+	a = _mm_srli_epi16(_mm_mullo_epi16(t, gain), 4);
+	a = _mm_max_epi16(a, _mm_and_si128(_mm_cmpeq_epi16(t, soft), full));
+	a = _mm_unpacklo_epi16(a, a);
+	/* bg + (((fg - bg) * alpha) >> 7) on 16 bit lanes */
+	lo = _mm_sub_epi16(_mm_unpacklo_epi8(f, zero),
+			   _mm_unpacklo_epi8(b, zero));
+	hi = _mm_sub_epi16(_mm_unpackhi_epi8(f, zero),
+			   _mm_unpackhi_epi8(b, zero));
+	lo = _mm_srai_epi16(_mm_mullo_epi16(lo, _mm_unpacklo_epi32(a, a)), 7);
+	hi = _mm_srai_epi16(_mm_mullo_epi16(hi, _mm_unpackhi_epi32(a, a)), 7);
+	lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(b, zero));
+	hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(b, zero));
+	_mm_storeu_si128((__m128i *) fg, _mm_packus_epi16(lo, hi));
+	fg += 16;
+	bg += 16;
+    }
+#endif
+    for (; npairs > 0; npairs--) {
+	/* distance is symmetric, order of U and V doesn't matter */
+	alpha = abs(fg[1] - k1) + abs(fg[3] - k3) - key->tol;
+	alpha = (alpha <= 0) ? 0 : (alpha >= key->soft) ? 128 :
+	    (alpha * key->gain) >> 4;
+	for (i = 0; i < 4; i++) {
+	    fg[i] = KeyMix(fg[i], bg[i], alpha);
+	}
+	fg += 4;
+	bg += 4;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * KeyFrame --
+ *
+ *	Chroma key a frame in the output format of a loopback device
+ *	in place. Packed YUV and the planar formats are keyed on
+ *	their chroma samples directly, RGB pixels get their chroma
+ *	computed.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+KeyFrame(V4L2C *v4l2c, unsigned char *fg, unsigned char *bg)
+{
+    VKEY *key = v4l2c->key;
+    int x, y, i, r, g, b, alpha, bpp, o0, o2;
+    int width = v4l2c->loopWidth, height = v4l2c->loopHeight;
+
+    switch (v4l2c->loopFormat) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	KeyPacked(key, fg, bg, ((width + 1) / 2) * height,
+		  v4l2c->loopFormat == V4L2_PIX_FMT_YVYU);
+	break;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420: {
+	int cw = (width + 1) / 2, ch = (height + 1) / 2, coff, ustep, voff;
+	unsigned char *yf, *yb;
+
+	coff = width * height;
+	if (v4l2c->loopFormat == V4L2_PIX_FMT_NV12) {
+	    ustep = 2;
+	    voff = 1;
+	} else {
+	    ustep = 1;
+	    voff = cw * ch;
+	}
+	for (y = 0; y < ch; y++) {
+	    for (x = 0; x < cw; x++) {
+		i = coff + (y * cw + x) * ustep;
+		alpha = KeyAlpha(key, fg[i], fg[i + voff]);
+		fg[i] = KeyMix(fg[i], bg[i], alpha);
+		fg[i + voff] = KeyMix(fg[i + voff], bg[i + voff], alpha);
+		yf = fg + 2 * (y * width + x);
+		yb = bg + 2 * (y * width + x);
+		yf[0] = KeyMix(yf[0], yb[0], alpha);
+		if (2 * x + 1 < width) {
+		    yf[1] = KeyMix(yf[1], yb[1], alpha);
+		}
+		if (2 * y + 1 < height) {
+		    yf[width] = KeyMix(yf[width], yb[width], alpha);
+		    if (2 * x + 1 < width) {
+			yf[width + 1] = KeyMix(yf[width + 1], yb[width + 1],
+					       alpha);
+		    }
+		}
+	    }
+	}
+	break;
+    }
+    case V4L2_PIX_FMT_RGB32:
+    case V4L2_PIX_FMT_BGR32:
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+	bpp = ((v4l2c->loopFormat == V4L2_PIX_FMT_RGB32) ||
+	       (v4l2c->loopFormat == V4L2_PIX_FMT_BGR32)) ? 4 : 3;
+	if ((v4l2c->loopFormat == V4L2_PIX_FMT_RGB32) ||
+	    (v4l2c->loopFormat == V4L2_PIX_FMT_RGB24)) {
+	    o0 = 0;
+	    o2 = 2;
+	} else {
+	    o0 = 2;
+	    o2 = 0;
+	}
+	for (i = width * height; i > 0; i--) {
+	    r = fg[o0];
+	    g = fg[1];
+	    b = fg[o2];
+	    alpha = KeyAlpha(key,
+		((-2432 * r - 4736 * g + 7168 * b) >> 14) + 128,
+		((7168 * r - 6016 * g - 1152 * b) >> 14) + 128);
+	    fg[0] = KeyMix(fg[0], bg[0], alpha);
+	    fg[1] = KeyMix(fg[1], bg[1], alpha);
+	    fg[2] = KeyMix(fg[2], bg[2], alpha);
+	    fg += bpp;
+	    bg += bpp;
+	}
+	break;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * KeyApply --
+ *
+ *	Chroma key a frame about to be written to a loopback device
+ *	in place. A background device's new frame is taken over into
+ *	the background first, as raw copy when formats agree. Nothing
+ *	is done while no background is available.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+KeyApply(V4L2C *v4l2c, unsigned char *data, int length)
+{
+    VKEY *key = v4l2c->key;
+    V4L2C *src = key->bgSrc;
+    Tk_PhotoImageBlock block;
+    unsigned char *toFree;
+
+    if (length != key->bgLen) {
+	return;
+    }
+    if ((src != NULL) && (src->bufrdy >= 0) &&
+	(!key->bgValid || (src->rdyTime != key->bgTime))) {
+	if ((src->format == v4l2c->loopFormat) &&
+	    (src->width == v4l2c->loopWidth) &&
+	    (src->height == v4l2c->loopHeight)) {
+	    key->bgValid = FrameCopy(src, key->bg, length) == length;
+	} else if ((src->width == v4l2c->loopWidth) &&
+		   (src->height == v4l2c->loopHeight) &&
+		   (FrameBlock(src, &block, &toFree) == 0)) {
+	    key->bgValid =
+		ConvertBlock(v4l2c, &block, key->bg, length) == length;
+	    if (toFree != NULL) {
+		ckfree(toFree);
+	    }
+	}
+	key->bgTime = src->rdyTime;
+    }
+    if (key->bgValid) {
+	KeyFrame(v4l2c, data, key->bg);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * KeyFree, KeyUnlink --
+ *
+ *	Release the chroma key of a loopback device, and before
+ *	closing a device, drop it as background of all chroma keys.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+KeyFree(V4L2C *v4l2c)
+{
+    VKEY *key = v4l2c->key;
+
+    if (key == NULL) {
+	return;
+    }
+    Tcl_DStringFree(&key->bgName);
+    if (key->bg != NULL) {
+	ckfree(key->bg);
+    }
+    ckfree((char *) key);
+    v4l2c->key = NULL;
+}
+
+static void
+KeyUnlink(V4L2I *v4l2i, V4L2C *v4l2c)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    V4L2C *other;
+
+    hPtr = Tcl_FirstHashEntry(&v4l2i->v4l2c, &search);
+    while (hPtr != NULL) {
+	other = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if ((other->key != NULL) && (other->key->bgSrc == v4l2c)) {
+	    other->key->bgSrc = NULL;
+	}
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    KeyFree(v4l2c);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * KeyCmd --
+ *
+ *	Implements "v4l2 chromakey": set up, query, or remove the
+ *	chroma key of a loopback device, applied to all frames
+ *	written or forwarded to it.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+KeyCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    Tcl_HashEntry *hPtr;
+    V4L2C *v4l2c, *src = NULL;
+    VKEY *key;
+    Tk_PhotoHandle photo = NULL;
+    Tk_PhotoImageBlock block;
+    char *bgName = NULL;
+    int i, n, color, r, g, b, tol = KEY_TOLERANCE, soft = KEY_SOFTNESS;
+
+    if ((objc < 3) || ((objc > 4) && (objc % 2 == 1))) {
+	Tcl_WrongNumArgs(interp, 2, objv,
+			 "loopdevid ?color -background photo|devid "
+			 "?-tolerance t? ?-softness s??");
+	return TCL_ERROR;
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+    if (hPtr == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("device \"%s\" not found", Tcl_GetString(objv[2])));
+	return TCL_ERROR;
+    }
+    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+    if (!v4l2c->isLoopDev) {
+	Tcl_SetResult(interp, "not a loop device", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (objc == 3) {
+	Tcl_Obj *list[8];
+
+	key = v4l2c->key;
+	if (key != NULL) {
+	    list[0] = Tcl_NewStringObj("color", -1);
+	    list[1] = Tcl_ObjPrintf("0x%06x", key->color);
+	    list[2] = Tcl_NewStringObj("background", -1);
+	    list[3] = Tcl_NewStringObj(Tcl_DStringValue(&key->bgName), -1);
+	    list[4] = Tcl_NewStringObj("tolerance", -1);
+	    list[5] = Tcl_NewIntObj(key->tol);
+	    list[6] = Tcl_NewStringObj("softness", -1);
+	    list[7] = Tcl_NewIntObj(key->soft);
+	    Tcl_SetObjResult(interp, Tcl_NewListObj(8, list));
+	}
+	return TCL_OK;
+    }
+    if (Tcl_GetString(objv[3])[0] == '\0') {
+	KeyFree(v4l2c);
+	return TCL_OK;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[3], &color) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    for (i = 4; i < objc; i += 2) {
+	char *opt = Tcl_GetString(objv[i]);
+
+	if (strcmp(opt, "-background") == 0) {
+	    bgName = Tcl_GetString(objv[i + 1]);
+	} else if (strcmp(opt, "-tolerance") == 0) {
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &tol) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(opt, "-softness") == 0) {
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &soft) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("bad option \"%s\": must be -background, "
+			      "-softness, or -tolerance", opt));
+	    return TCL_ERROR;
+	}
+    }
+    if ((tol < 0) || (tol > 510) || (soft < 0) || (soft > 510)) {
+	Tcl_SetResult(interp, "tolerance and softness must be in 0..510",
+		      TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (bgName == NULL) {
+	Tcl_SetResult(interp, "no background given", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    switch (v4l2c->loopFormat) {
+    case V4L2_PIX_FMT_GREY:
+#ifdef USE_MJPEG
+    case V4L2_PIX_FMT_MJPEG:
+#endif
+	Tcl_SetResult(interp, "unsupported loop device format", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, bgName);
+    if (hPtr != NULL) {
+	src = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (src->isLoopDev) {
+	    Tcl_SetResult(interp, "background can't be a loop device",
+			  TCL_STATIC);
+	    return TCL_ERROR;
+	}
+    } else {
+	if (CheckForTk(v4l2i, interp) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	photo = Tk_FindPhoto(interp, bgName);
+	if (photo == NULL) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("can't use \"%s\": not a photo image or "
+			      "device", bgName));
+	    return TCL_ERROR;
+	}
+	Tk_PhotoGetImage(photo, &block);
+	if ((block.width != v4l2c->loopWidth) ||
+	    (block.height != v4l2c->loopHeight)) {
+	    Tcl_SetResult(interp, "background size differs from loop device",
+			  TCL_STATIC);
+	    return TCL_ERROR;
+	}
+    }
+    key = (VKEY *) ckalloc(sizeof (VKEY));
+    memset(key, 0, sizeof (VKEY));
+    key->bgLen = LoopFrameSize(v4l2c);
+    key->bg = attemptckalloc(key->bgLen);
+    if (key->bg == NULL) {
+	ckfree((char *) key);
+	Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (photo != NULL) {
+	n = ConvertBlock(v4l2c, &block, key->bg, key->bgLen);
+	if (n <= 0) {
+	    ckfree(key->bg);
+	    ckfree((char *) key);
+	    Tcl_SetResult(interp, "conversion failed", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	/* frames are keyed when of the converted size */
+	key->bgLen = n;
+    }
+    key->bgValid = (photo != NULL);
+    key->bgSrc = src;
+    Tcl_DStringInit(&key->bgName);
+    Tcl_DStringAppend(&key->bgName, bgName, -1);
+    key->color = color & 0xffffff;
+    r = (color >> 16) & 0xff;
+    g = (color >> 8) & 0xff;
+    b = color & 0xff;
+    key->cb = sat(((-2432 * r - 4736 * g + 7168 * b) >> 14) + 128);
+    key->cr = sat(((7168 * r - 6016 * g - 1152 * b) >> 14) + 128);
+    key->tol = tol;
+    key->soft = (soft < 1) ? 1 : soft;
+    key->gain = 2048 / key->soft;
+    KeyFree(v4l2c);
+    v4l2c->key = key;
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * OverlayBuild --
+ *
+ *	Convert a photo image block placed at x, y into an overlay for
+ *	the output format of a loopback device. The bounding box is
+ *	clipped to the frame and aligned to chroma subsampling; the
+ *	colors are premultiplied before conversion, which for YUV
+ *	leaves the offsets of Y, U, and V to be scaled by alpha.
+ *	Returns NULL with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static VOVL *
+OverlayBuild(V4L2C *v4l2c, Tk_PhotoImageBlock *blk, int x, int y)
+{
+    V4L2C *box = NULL;
+    VOVL *ovl;
+    Tk_PhotoImageBlock block;
+    unsigned char *rgb = NULL, *alpha, *conv, *ab, *ob, *p, *q;
+    int W = v4l2c->loopWidth, H = v4l2c->loopHeight, fmt = v4l2c->loopFormat;
+    int xs = 1, ys = 1, bx, by, ex, ey, bw, bh, px, py, a, i, j, k, n;
+    int bpp = 0, size, fstride, cwF, chF, cw, ch;
+
+    switch (fmt) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	xs = 2;
+	break;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+	xs = ys = 2;
+	break;
+#ifdef USE_MJPEG
+    case V4L2_PIX_FMT_MJPEG:
+	errno = EINVAL;
+	return NULL;
+#endif
+    }
+    bx = (x < 0) ? 0 : x - (x % xs);
+    by = (y < 0) ? 0 : y - (y % ys);
+    ex = x + blk->width;
+    ey = y + blk->height;
+    ex = (ex < 0) ? 0 : (ex > W) ? W : ex;
+    ey = (ey < 0) ? 0 : (ey > H) ? H : ey;
+    ex += (xs - ex % xs) % xs;
+    ey += (ys - ey % ys) % ys;
+    if (ex > W) {
+	ex -= xs;
+    }
+    if (ey > H) {
+	ey -= ys;
+    }
+    bw = (ex > bx) ? ex - bx : 0;
+    bh = (ey > by) ? ey - by : 0;
+    ovl = (VOVL *) ckalloc(sizeof (VOVL));
+    memset(ovl, 0, sizeof (VOVL));
+    Tcl_DStringInit(&ovl->name);
+    ovl->x = x;
+    ovl->y = y;
+    ovl->format = fmt;
+    ovl->width = W;
+    ovl->height = H;
+    if ((bw == 0) || (bh == 0)) {
+	return ovl;
+    }
+
+    /* premultiplied RGB and alpha of bounding box */
+    rgb = attemptckalloc(bw * bh * 4);
+    box = (V4L2C *) attemptckalloc(sizeof (V4L2C));
+    if ((rgb == NULL) || (box == NULL)) {
+	goto nomem;
+    }
+    alpha = rgb + bw * bh * 3;
+    memset(rgb, 0, bw * bh * 4);
+    for (py = 0; py < bh; py++) {
+	i = by + py - y;
+	if ((i < 0) || (i >= blk->height)) {
+	    continue;
+	}
+	for (px = 0; px < bw; px++) {
+	    j = bx + px - x;
+	    if ((j < 0) || (j >= blk->width)) {
+		continue;
+	    }
+	    p = blk->pixelPtr + i * blk->pitch + j * blk->pixelSize;
+	    q = rgb + (py * bw + px) * 3;
+	    a = (blk->offset[3] < blk->pixelSize) ? p[blk->offset[3]] : 255;
+	    q[0] = (p[blk->offset[0]] * a + 127) / 255;
+	    q[1] = (p[blk->offset[1]] * a + 127) / 255;
+	    q[2] = (p[blk->offset[2]] * a + 127) / 255;
+	    alpha[py * bw + px] = a;
+	}
+    }
+    memset(box, 0, sizeof (V4L2C));
+    box->loopFormat = fmt;
+    box->loopWidth = bw;
+    box->loopHeight = bh;
+    size = LoopFrameSize(box);
+    conv = attemptckalloc(size * 4);
+    ovl->pre = conv;
+    if (conv == NULL) {
+	goto nomem;
+    }
+    ab = conv + size;
+    ob = ab + size;
+    block.pixelPtr = rgb;
+    block.width = bw;
+    block.height = bh;
+    block.pixelSize = 3;
+    block.pitch = bw * 3;
+    block.offset[0] = 0;
+    block.offset[1] = 1;
+    block.offset[2] = 2;
+    block.offset[3] = 4;
+
+    /* per byte alpha and offset, and spans in bounding box order */
+    ovl->spanOff = (int *) attemptckalloc(2 * (bh + bh) * sizeof (int));
+    if (ovl->spanOff == NULL) {
+	goto nomem;
+    }
+    ovl->spanLen = ovl->spanOff + (bh + bh);
+    memset(ob, 0, size);
+    n = 0;
+    switch (fmt) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+	cw = bw / 2;
+	ch = bh / 2;
+	cwF = (W + 1) / 2;
+	chF = (H + 1) / 2;
+	memcpy(ab, alpha, bw * bh);
+	memset(ob, 16, bw * bh);
+	for (py = 0; py < bh; py++) {
+	    ovl->spanOff[n] = (by + py) * W + bx;
+	    ovl->spanLen[n++] = bw;
+	}
+	for (py = 0; py < ch; py++) {
+	    for (px = 0; px < cw; px++) {
+		a = alpha[2 * py * bw + 2 * px] +
+		    alpha[2 * py * bw + 2 * px + 1] +
+		    alpha[(2 * py + 1) * bw + 2 * px] +
+		    alpha[(2 * py + 1) * bw + 2 * px + 1];
+		a = (a + 2) / 4;
+		if (fmt == V4L2_PIX_FMT_NV12) {
+		    ab[bw * bh + py * bw + 2 * px] = a;
+		    ab[bw * bh + py * bw + 2 * px + 1] = a;
+		} else {
+		    ab[bw * bh + py * cw + px] = a;
+		    ab[bw * bh + cw * ch + py * cw + px] = a;
+		}
+	    }
+	}
+	memset(ob + bw * bh, 128, 2 * cw * ch);
+	if (fmt == V4L2_PIX_FMT_NV12) {
+	    for (py = 0; py < ch; py++) {
+		ovl->spanOff[n] = W * H + (by / 2 + py) * cwF * 2 + bx;
+		ovl->spanLen[n++] = bw;
+	    }
+	} else {
+	    for (k = 0; k < 2; k++) {
+		for (py = 0; py < ch; py++) {
+		    ovl->spanOff[n] = W * H + k * cwF * chF +
+			(by / 2 + py) * cwF + bx / 2;
+		    ovl->spanLen[n++] = cw;
+		}
+	    }
+	}
+	break;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	bpp = 2;
+	for (i = 0; i < bw * bh; i += 2) {
+	    a = (alpha[i] + alpha[i + 1] + 1) / 2;
+	    ab[2 * i] = alpha[i];
+	    ab[2 * i + 1] = a;
+	    ab[2 * i + 2] = alpha[i + 1];
+	    ab[2 * i + 3] = a;
+	    ob[2 * i] = 16;
+	    ob[2 * i + 1] = 128;
+	    ob[2 * i + 2] = 16;
+	    ob[2 * i + 3] = 128;
+	}
+	break;
+    case V4L2_PIX_FMT_GREY:
+	memset(ob, 16, size);
+	/* FALLTHRU */
+    default:
+	bpp = size / (bw * bh);
+	for (i = 0; i < size; i++) {
+	    ab[i] = alpha[i / bpp];
+	}
+	break;
+    }
+    if (bpp > 0) {
+	fstride = (bpp == 2) ? ((W + 1) / 2) * 4 : W * bpp;
+	for (py = 0; py < bh; py++) {
+	    ovl->spanOff[n] = (by + py) * fstride + bx * bpp;
+	    ovl->spanLen[n++] = bw * bpp;
+	}
+    }
+    ovl->nspans = n;
+    if (ConvertBlock(box, &block, conv, size) <= 0) {
+	ovl->nspans = 0;
+    }
+    ovl->inv = conv + 3 * size;
+    for (i = 0; i < size; i++) {
+	conv[i] = sat(conv[i] - ob[i] + (ob[i] * ab[i] + 127) / 255);
+	ovl->inv[i] = 255 - ab[i];
+    }
+    ckfree((char *) box);
+    ckfree(rgb);
+    return ovl;
+
+nomem:
+    if (rgb != NULL) {
+	ckfree(rgb);
+    }
+    if (box != NULL) {
+	ckfree((char *) box);
+    }
+    OverlayFree(ovl);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * OverlayFree, OverlayBlend --
+ *
+ *	Release an overlay, and blend it into a frame in place. The
+ *	division by 255 is done exactly with shifts.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+OverlayFree(VOVL *ovl)
+{
+    Tcl_DStringFree(&ovl->name);
+    if (ovl->spanOff != NULL) {
+	ckfree((char *) ovl->spanOff);
+    }
+    if (ovl->pre != NULL) {
+	ckfree(ovl->pre);
+    }
+    ckfree((char *) ovl);
+}
+
+static void
+OverlayBlend(VOVL *ovl, unsigned char *frame)
+{
+    unsigned char *p, *pre = ovl->pre, *inv = ovl->inv;
+    int i, k, n, t;
+
+    for (i = 0; i < ovl->nspans; i++) {
+	p = frame + ovl->spanOff[i];
+	n = ovl->spanLen[i];
+	for (k = 0; k < n; k++) {
+	    t = p[k] * inv[k] + 128;
+	    t = pre[k] + ((t + (t >> 8)) >> 8);
+	    p[k] = (t > 255) ? 255 : t;
+	}
+	pre += n;
+	inv += n;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * LoopStages, StagesFree --
+ *
+ *	Apply chroma key and overlays to a frame about to be written
+ *	to a loopback device. Unless inPlace, the frame is copied
+ *	first. Returns the frame to write. StagesFree releases key,
+ *	overlays, and the copy buffer of a device.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static unsigned char *
+LoopStages(V4L2C *v4l2c, unsigned char *data, int length, int inPlace)
+{
+    VOVL *ovl;
+
+    if (length != LoopFrameSize(v4l2c)) {
+	return data;
+    }
+    if (!inPlace) {
+	if (v4l2c->stageLen < length) {
+	    if (v4l2c->stageBuf != NULL) {
+		ckfree(v4l2c->stageBuf);
+	    }
+	    v4l2c->stageLen = 0;
+	    v4l2c->stageBuf = attemptckalloc(length);
+	    if (v4l2c->stageBuf == NULL) {
+		return data;
+	    }
+	    v4l2c->stageLen = length;
+	}
+	memcpy(v4l2c->stageBuf, data, length);
+	data = v4l2c->stageBuf;
+    }
+    if (v4l2c->key != NULL) {
+	KeyApply(v4l2c, data, length);
+    }
+    for (ovl = v4l2c->ovl; ovl != NULL; ovl = ovl->next) {
+	if ((ovl->format == v4l2c->loopFormat) &&
+	    (ovl->width == v4l2c->loopWidth) &&
+	    (ovl->height == v4l2c->loopHeight)) {
+	    OverlayBlend(ovl, data);
+	}
+    }
+    return data;
+}
+
+static void
+StagesFree(V4L2C *v4l2c)
+{
+    VOVL *ovl;
+
+    KeyFree(v4l2c);
+    while (v4l2c->ovl != NULL) {
+	ovl = v4l2c->ovl;
+	v4l2c->ovl = ovl->next;
+	OverlayFree(ovl);
+    }
+    if (v4l2c->stageBuf != NULL) {
+	ckfree(v4l2c->stageBuf);
+	v4l2c->stageBuf = NULL;
+    }
+    v4l2c->stageLen = 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * OverlayCmd --
+ *
+ *	Implements "v4l2 overlay": list, add or replace, and remove
+ *	the overlays of a loopback device. Overlays are identified by
+ *	their photo image and drawn in the order they were added.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+OverlayCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    Tcl_HashEntry *hPtr;
+    V4L2C *v4l2c;
+    VOVL *ovl, *newOvl, **pp;
+    Tk_PhotoHandle photo;
+    Tk_PhotoImageBlock block;
+    char *name;
+    int x, y;
+
+    if ((objc != 3) && (objc != 4) && (objc != 6)) {
+	Tcl_WrongNumArgs(interp, 2, objv, "loopdevid ?photo ?x y??");
+	return TCL_ERROR;
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+    if (hPtr == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("device \"%s\" not found", Tcl_GetString(objv[2])));
+	return TCL_ERROR;
+    }
+    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+    if (!v4l2c->isLoopDev) {
+	Tcl_SetResult(interp, "not a loop device", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (objc == 3) {
+	Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+
+	for (ovl = v4l2c->ovl; ovl != NULL; ovl = ovl->next) {
+	    Tcl_ListObjAppendElement(NULL, list,
+		Tcl_NewStringObj(Tcl_DStringValue(&ovl->name), -1));
+	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(ovl->x));
+	    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(ovl->y));
+	}
+	Tcl_SetObjResult(interp, list);
+	return TCL_OK;
+    }
+    name = Tcl_GetString(objv[3]);
+    for (pp = &v4l2c->ovl; *pp != NULL; pp = &(*pp)->next) {
+	if (strcmp(Tcl_DStringValue(&(*pp)->name), name) == 0) {
+	    break;
+	}
+    }
+    if (objc == 4) {
+	if (*pp != NULL) {
+	    ovl = *pp;
+	    *pp = ovl->next;
+	    OverlayFree(ovl);
+	}
+	return TCL_OK;
+    }
+    if ((Tcl_GetIntFromObj(interp, objv[4], &x) != TCL_OK) ||
+	(Tcl_GetIntFromObj(interp, objv[5], &y) != TCL_OK)) {
+	return TCL_ERROR;
+    }
+    if (CheckForTk(v4l2i, interp) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    photo = Tk_FindPhoto(interp, name);
+    if (photo == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("can't use \"%s\": not a photo image", name));
+	return TCL_ERROR;
+    }
+    if ((v4l2c->loopWidth <= 0) || (v4l2c->loopHeight <= 0)) {
+	Tcl_SetResult(interp, "loop device not configured", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    Tk_PhotoGetImage(photo, &block);
+    newOvl = OverlayBuild(v4l2c, &block, x, y);
+    if (newOvl == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("can't make overlay: %s", Tcl_PosixError(interp)));
+	return TCL_ERROR;
+    }
+    Tcl_DStringAppend(&newOvl->name, name, -1);
+    if (*pp != NULL) {
+	ovl = *pp;
+	newOvl->next = ovl->next;
+	OverlayFree(ovl);
+    }
+    *pp = newOvl;
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * StereoCompose --
+ *
+ *	Combine the image blocks of a stereo pair of equal size into
+ *	a RGB frame. Red-cyan anaglyphs are made by channel selection
+ *	or with the least squares matrices by E. Dubois (applied to
+ *	gamma encoded values), or the images are placed side by side
+ *	or top and bottom.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+enum stereoMode {
+    STEREO_ANAGLYPH, STEREO_DUBOIS, STEREO_SIDE_BY_SIDE, STEREO_TOP_BOTTOM
+};
+
+/* Dubois red-cyan matrices, scaled by 1024 */
+
+static const int DuboisLeft[9] = {
+    467, 512, 180,
+    -41, -39, -16,
+    -15, -22, -5
+};
+
+static const int DuboisRight[9] = {
+    -44, -90, -2,
+    387, 752, -18,
+    -74, -116, 1255
+};
+
+#ifdef __SSE2__
+/*
+ * SSE2 helpers: StoreRGB8 writes eight pixels given as 16 bit
+ * components as packed RGB, saturated like sat(). DuboisChannel
+ * is one output channel of eight pixels, the six components
+ * taken pairwise against the matrix coefficients in k.
+ */
+
+static inline void
+StoreRGB8(unsigned char *out, __m128i r, __m128i g, __m128i b)
+{
+    unsigned char px[32];
+    __m128i zero = _mm_setzero_si128(), rg, bz;
+    int i;
+
+    rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, zero),
+			   _mm_packus_epi16(g, zero));
+    bz = _mm_unpacklo_epi8(_mm_packus_epi16(b, zero), zero);
+    _mm_storeu_si128((__m128i *) px, _mm_unpacklo_epi16(rg, bz));
+    _mm_storeu_si128((__m128i *) (px + 16), _mm_unpackhi_epi16(rg, bz));
+    for (i = 0; i < 8; i++) {
+	out[0] = px[4 * i];
+	out[1] = px[4 * i + 1];
+	out[2] = px[4 * i + 2];
+	out += 3;
+    }
+}
+
+static inline __m128i
+DuboisChannel(__m128i *l, __m128i *r, __m128i *k)
+{
+    __m128i lo, hi;
+
+    lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(l[0], l[1]), k[0]),
+		       _mm_madd_epi16(_mm_unpacklo_epi16(l[2], r[0]), k[1]));
+    lo = _mm_add_epi32(lo,
+		       _mm_madd_epi16(_mm_unpacklo_epi16(r[1], r[2]), k[2]));
+    hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(l[0], l[1]), k[0]),
+		       _mm_madd_epi16(_mm_unpackhi_epi16(l[2], r[0]), k[1]));
+    hi = _mm_add_epi32(hi,
+		       _mm_madd_epi16(_mm_unpackhi_epi16(r[1], r[2]), k[2]));
+    return _mm_packs_epi32(_mm_srai_epi32(lo, 10), _mm_srai_epi32(hi, 10));
+}
+#endif
+
+static unsigned char *
+StereoRow(Tk_PhotoImageBlock *blk, int y, unsigned char *out)
+{
+    unsigned char *in = blk->pixelPtr + y * blk->pitch;
+    int x;
+
+    for (x = 0; x < blk->width; x++) {
+	out[0] = in[blk->offset[0]];
+	out[1] = in[blk->offset[1]];
+	out[2] = in[blk->offset[2]];
+	out += 3;
+	in += blk->pixelSize;
+    }
+    return out;
+}
+
+static void
+StereoCompose(Tk_PhotoImageBlock *left, Tk_PhotoImageBlock *right,
+	      int mode, unsigned char *out)
+{
+    unsigned char *lp, *rp;
+    int x, y, r, g, b, lr, lg, lb, rr, rg, rb;
+    const int *ml = DuboisLeft, *mr = DuboisRight;
+#ifdef __SSE2__
+    __m128i vl[3], vr[3], k[9], mask[3], va, vb;
+    int i, packed;
+
+    /* coefficient pairs in the order taken by DuboisChannel */
+    for (i = 0; i < 3; i++) {
+	k[3 * i] = _mm_setr_epi16(ml[3 * i], ml[3 * i + 1],
+				  ml[3 * i], ml[3 * i + 1],
+				  ml[3 * i], ml[3 * i + 1],
+				  ml[3 * i], ml[3 * i + 1]);
+	k[3 * i + 1] = _mm_setr_epi16(ml[3 * i + 2], mr[3 * i],
+				      ml[3 * i + 2], mr[3 * i],
+				      ml[3 * i + 2], mr[3 * i],
+				      ml[3 * i + 2], mr[3 * i]);
+	k[3 * i + 2] = _mm_setr_epi16(mr[3 * i + 1], mr[3 * i + 2],
+				      mr[3 * i + 1], mr[3 * i + 2],
+				      mr[3 * i + 1], mr[3 * i + 2],
+				      mr[3 * i + 1], mr[3 * i + 2]);
+    }
+    /* red of left in every third byte of 48 bytes */
+    mask[0] = _mm_setr_epi8(-1, 0, 0, -1, 0, 0, -1, 0,
+			    0, -1, 0, 0, -1, 0, 0, -1);
+    mask[1] = _mm_setr_epi8(0, 0, -1, 0, 0, -1, 0, 0,
+			    -1, 0, 0, -1, 0, 0, -1, 0);
+    mask[2] = _mm_setr_epi8(0, -1, 0, 0, -1, 0, 0, -1,
+			    0, 0, -1, 0, 0, -1, 0, 0);
+    packed = (left->pixelSize == 3) && (right->pixelSize == 3) &&
+	(left->offset[0] == 0) && (left->offset[1] == 1) &&
+	(left->offset[2] == 2) && (right->offset[0] == 0) &&
+	(right->offset[1] == 1) && (right->offset[2] == 2);
+#endif
+
+    switch (mode) {
+    case STEREO_SIDE_BY_SIDE:
+	for (y = 0; y < left->height; y++) {
+	    out = StereoRow(left, y, out);
+	    out = StereoRow(right, y, out);
+	}
+	return;
+    case STEREO_TOP_BOTTOM:
+	for (y = 0; y < left->height; y++) {
+	    out = StereoRow(left, y, out);
+	}
+	for (y = 0; y < right->height; y++) {
+	    out = StereoRow(right, y, out);
+	}
+	return;
+    }
+    for (y = 0; y < left->height; y++) {
+	lp = left->pixelPtr + y * left->pitch;
+	rp = right->pixelPtr + y * right->pitch;
+	x = 0;
+	if (mode == STEREO_ANAGLYPH) {
+#ifdef __SSE2__
+	    for (; packed && (x + 16 <= left->width); x += 16) {
+		for (i = 0; i < 3; i++) {
+		    va = _mm_loadu_si128((__m128i *) (lp + 16 * i));
+		    vb = _mm_loadu_si128((__m128i *) (rp + 16 * i));
+		    _mm_storeu_si128((__m128i *) (out + 16 * i),
+				     _mm_or_si128(_mm_and_si128(mask[i], va),
+						  _mm_andnot_si128(mask[i],
+								   vb)));
+		}
+		out += 48;
+		lp += 48;
+		rp += 48;
+	    }
+	    for (; x + 8 <= left->width; x += 8) {
+		StoreRGB8(out, Gather8(left, lp, 0), Gather8(right, rp, 1),
+			  Gather8(right, rp, 2));
+		out += 24;
+		lp += 8 * left->pixelSize;
+		rp += 8 * right->pixelSize;
+	    }
+#endif
+	    for (; x < left->width; x++) {
+		out[0] = lp[left->offset[0]];
+		out[1] = rp[right->offset[1]];
+		out[2] = rp[right->offset[2]];
+		out += 3;
+		lp += left->pixelSize;
+		rp += right->pixelSize;
+	    }
+	    continue;
+	}
+#ifdef __SSE2__
+	for (; x + 8 <= left->width; x += 8) {
+	    for (i = 0; i < 3; i++) {
+		vl[i] = Gather8(left, lp, i);
+		vr[i] = Gather8(right, rp, i);
+	    }
+	    StoreRGB8(out, DuboisChannel(vl, vr, k),
+		      DuboisChannel(vl, vr, k + 3),
+		      DuboisChannel(vl, vr, k + 6));
+	    out += 24;
+	    lp += 8 * left->pixelSize;
+	    rp += 8 * right->pixelSize;
+	}
+#endif
+	for (; x < left->width; x++) {
+	    lr = lp[left->offset[0]];
+	    lg = lp[left->offset[1]];
+	    lb = lp[left->offset[2]];
+	    rr = rp[right->offset[0]];
+	    rg = rp[right->offset[1]];
+	    rb = rp[right->offset[2]];
+	    r = ml[0] * lr + ml[1] * lg + ml[2] * lb +
+		mr[0] * rr + mr[1] * rg + mr[2] * rb;
+	    g = ml[3] * lr + ml[4] * lg + ml[5] * lb +
+		mr[3] * rr + mr[4] * rg + mr[5] * rb;
+	    b = ml[6] * lr + ml[7] * lg + ml[8] * lb +
+		mr[6] * rr + mr[7] * rg + mr[8] * rb;
+	    out[0] = sat(r >> 10);
+	    out[1] = sat(g >> 10);
+	    out[2] = sat(b >> 10);
+	    out += 3;
+	    lp += left->pixelSize;
+	    rp += right->pixelSize;
+	}
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * StereoCmd --
+ *
+ *	Implements "v4l2 stereo": combine the last ready frames of
+ *	two capture devices and deliver the result as byte array,
+ *	into a photo image, or to a loopback device.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+StereoCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    V4L2C *dev[2], *loop = NULL;
+    Tcl_HashEntry *hPtr;
+    Tk_PhotoHandle photo = NULL;
+    Tk_PhotoImageBlock blk[2], block;
+    Tcl_Time deadline;
+    unsigned char *toFree[2] = { NULL, NULL }, *out, *rgbToFree = NULL;
+    int i, mode = STEREO_ANAGLYPH, width, height, result = TCL_ERROR;
+    Tcl_Obj *data = NULL;
+
+    static const char *modeNames[] = {
+	"anaglyph-redcyan", "dubois", "side-by-side", "top-bottom", NULL
+    };
+
+    if ((objc < 4) || (objc % 2)) {
+	Tcl_WrongNumArgs(interp, 2, objv,
+			 "leftdevid rightdevid ?-mode mode? ?-target target?");
+	return TCL_ERROR;
+    }
+    for (i = 0; i < 2; i++) {
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2 + i]));
+	if (hPtr == NULL) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("device \"%s\" not found",
+			      Tcl_GetString(objv[2 + i])));
+	    return TCL_ERROR;
+	}
+	dev[i] = (V4L2C *) Tcl_GetHashValue(hPtr);
+    }
+    for (i = 4; i < objc; i += 2) {
+	char *opt = Tcl_GetString(objv[i]);
+
+	if (strcmp(opt, "-mode") == 0) {
+	    if (Tcl_GetIndexFromObj(interp, objv[i + 1], modeNames, "mode", 0,
+				    &mode) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(opt, "-target") == 0) {
+	    char *name = Tcl_GetString(objv[i + 1]);
+
+	    loop = NULL;
+	    photo = NULL;
+	    hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, name);
+	    if (hPtr != NULL) {
+		loop = (V4L2C *) Tcl_GetHashValue(hPtr);
+		if (!loop->isLoopDev) {
+		    Tcl_SetResult(interp, "not a loop device", TCL_STATIC);
+		    return TCL_ERROR;
+		}
+		continue;
+	    }
+	    if (CheckForTk(v4l2i, interp) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    photo = Tk_FindPhoto(interp, name);
+	    if (photo == NULL) {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("can't use \"%s\": not a photo image or "
+				  "loop device", name));
+		return TCL_ERROR;
+	    }
+	} else {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("bad option \"%s\": must be -mode or -target",
+			      opt));
+	    return TCL_ERROR;
+	}
+    }
+    /* wake up both devices first to wait for them only once */
+    for (i = 0; i < 2; i++) {
+	if (IdleResume(dev[i]) != TCL_OK) {
+	    goto done;
+	}
+    }
+    IdleDeadline(&deadline);
+    for (i = 0; i < 2; i++) {
+	if (IdleFinish(dev[i], &deadline) != TCL_OK) {
+	    goto done;
+	}
+	if (FrameBlock(dev[i], &blk[i], &toFree[i]) < 0) {
+	    if (errno == EAGAIN) {
+		Tcl_SetResult(interp, "no image available", TCL_STATIC);
+	    } else {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("error getting frame: %s",
+				  Tcl_PosixError(interp)));
+	    }
+	    goto done;
+	}
+    }
+    if ((blk[0].width != blk[1].width) || (blk[0].height != blk[1].height)) {
+	Tcl_SetResult(interp, "frame sizes differ", TCL_STATIC);
+	goto done;
+    }
+    width = blk[0].width;
+    height = blk[0].height;
+    if (mode == STEREO_SIDE_BY_SIDE) {
+	width *= 2;
+    } else if (mode == STEREO_TOP_BOTTOM) {
+	height *= 2;
+    }
+    if ((loop == NULL) && (photo == NULL)) {
+	data = Tcl_NewByteArrayObj(NULL, 0);
+	out = Tcl_SetByteArrayLength(data, width * height * 3);
+    } else {
+	out = rgbToFree = attemptckalloc(width * height * 3);
+	if (out == NULL) {
+	    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    goto done;
+	}
+    }
+    StereoCompose(&blk[0], &blk[1], mode, out);
+    block.pixelPtr = out;
+    block.width = width;
+    block.height = height;
+    block.pixelSize = 3;
+    block.pitch = width * 3;
+    block.offset[0] = 0;
+    block.offset[1] = 1;
+    block.offset[2] = 2;
+    block.offset[3] = 4;
+    if (loop != NULL) {
+	if (LoopWriteBlock(loop, &block) < 0) {
+	    Tcl_SetObjResult(interp,
+			     Tcl_ObjPrintf("write error: %s",
+					   Tcl_PosixError(interp)));
+	    goto done;
+	}
+    } else if (photo != NULL) {
+	if ((Tk_PhotoExpand(interp, photo, width, height) != TCL_OK) ||
+	    (Tk_PhotoPutBlock(interp, photo, &block, 0, 0, width, height,
+			      TK_PHOTO_COMPOSITE_SET) != TCL_OK)) {
+	    goto done;
+	}
+    } else {
+	Tcl_Obj *list[4];
+
+	list[0] = Tcl_NewIntObj(width);
+	list[1] = Tcl_NewIntObj(height);
+	list[2] = Tcl_NewIntObj(3);
+	list[3] = data;
+	data = NULL;
+	Tcl_SetObjResult(interp, Tcl_NewListObj(4, list));
+    }
+    result = TCL_OK;
+done:
+    if (data != NULL) {
+	Tcl_DecrRefCount(data);
+    }
+    if (rgbToFree != NULL) {
+	ckfree(rgbToFree);
+    }
+    for (i = 0; i < 2; i++) {
+	if (toFree[i] != NULL) {
+	    ckfree(toFree[i]);
+	}
+    }
+    return result;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MosaicTile --
+ *
+ *	Pool job drawing one tile of a mosaic: the last ready frame
+ *	of the tile's device is scaled to the tile's rectangle
+ *	using nearest neighbour sampling.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+MosaicTile(ClientData clientData)
+{
+    VTILE *tile = (VTILE *) clientData;
+    VMOSAIC *mosaic = tile->mosaic;
+    Tk_PhotoImageBlock blk;
+    unsigned char *toFree, *src, *dst, *p;
+    int x, y;
+
+    tile->err = 0;
+    if (FrameBlock(tile->dev, &blk, &toFree) < 0) {
+	tile->err = errno;
+	return;
+    }
+    if ((tile->xmap == NULL) || (tile->xmapSrc != blk.width) ||
+	(tile->xmapPs != blk.pixelSize)) {
+	if (tile->xmap == NULL) {
+	    tile->xmap = (int *) attemptckalloc(tile->width * sizeof (int));
+	    if (tile->xmap == NULL) {
+		tile->err = ENOMEM;
+		goto done;
+	    }
+	}
+	for (x = 0; x < tile->width; x++) {
+	    tile->xmap[x] = (x * blk.width / tile->width) * blk.pixelSize;
+	}
+	tile->xmapSrc = blk.width;
+	tile->xmapPs = blk.pixelSize;
+    }
+    for (y = 0; y < tile->height; y++) {
+	src = blk.pixelPtr + (y * blk.height / tile->height) * blk.pitch;
+	dst = mosaic->canvas + ((tile->y + y) * mosaic->width + tile->x) * 3;
+	for (x = 0; x < tile->width; x++) {
+	    p = src + tile->xmap[x];
+	    dst[0] = p[blk.offset[0]];
+	    dst[1] = p[blk.offset[1]];
+	    dst[2] = p[blk.offset[2]];
+	    dst += 3;
+	}
+    }
+done:
+    if (toFree != NULL) {
+	ckfree(toFree);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MosaicUpdate --
+ *
+ *	Redraw the tiles of a mosaic whose device delivered a new
+ *	frame, and the tiles overlapping those on top of them, then
+ *	output the result. Tiles are drawn in parallel in batches
+ *	of mutually non-overlapping tiles. Tiles failing to draw keep
+ *	their old content and are retried on the next update, an
+ *	error is left when no tile could be drawn. Leaves the number
+ *	of redrawn tiles in the interpreter.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#define TILES_OVERLAP(a, b) \
+    (((a)->x < (b)->x + (b)->width) && ((b)->x < (a)->x + (a)->width) && \
+     ((a)->y < (b)->y + (b)->height) && ((b)->y < (a)->y + (a)->height))
+
+static int
+MosaicUpdate(V4L2I *v4l2i, Tcl_Interp *interp, VMOSAIC *mosaic)
+{
+    Tcl_HashEntry *hPtr;
+    VTILE *tile, *other;
+    ClientData *jobs;
+    Tk_PhotoHandle photo = NULL;
+    Tk_PhotoImageBlock block;
+    V4L2C *loop = NULL;
+    Tcl_Time deadline;
+    int i, k, n, wave, nwaves = 0, count = 0, drawn = 0, err = 0;
+
+    hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c,
+			     Tcl_DStringValue(&mosaic->target));
+    if (hPtr != NULL) {
+	loop = (V4L2C *) Tcl_GetHashValue(hPtr);
+    } else {
+	if (CheckForTk(v4l2i, interp) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	photo = Tk_FindPhoto(interp, Tcl_DStringValue(&mosaic->target));
+	if (photo == NULL) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("can't use \"%s\": not a photo image or "
+			      "loop device", Tcl_DStringValue(&mosaic->target)));
+	    return TCL_ERROR;
+	}
+    }
+    for (i = 0; i < mosaic->ntiles; i++) {
+	tile = &mosaic->tiles[i];
+	tile->update = 0;
+	tile->wave = 0;
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, tile->devId);
+	tile->dev = (hPtr != NULL) ? (V4L2C *) Tcl_GetHashValue(hPtr) : NULL;
+	if ((tile->dev != NULL) && (IdleResume(tile->dev) != TCL_OK)) {
+	    return TCL_ERROR;
+	}
+    }
+    /* all devices woken up above share a single wait */
+    IdleDeadline(&deadline);
+    for (i = 0; i < mosaic->ntiles; i++) {
+	tile = &mosaic->tiles[i];
+	if (tile->dev == NULL) {
+	    continue;
+	}
+	if (IdleFinish(tile->dev, &deadline) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if ((tile->dev->bufrdy >= 0) &&
+	    (tile->dev->rdyTime != tile->lastTime)) {
+	    tile->update = 1;
+	}
+    }
+    /* tiles on top of redrawn ones are redrawn, too */
+    for (i = 0; i < mosaic->ntiles; i++) {
+	tile = &mosaic->tiles[i];
+	for (k = 0; k < i; k++) {
+	    other = &mosaic->tiles[k];
+	    if (!other->update || !TILES_OVERLAP(tile, other)) {
+		continue;
+	    }
+	    if ((tile->dev != NULL) && (tile->dev->bufrdy >= 0)) {
+		tile->update = 1;
+	    }
+	    if (tile->update && (tile->wave <= other->wave)) {
+		tile->wave = other->wave + 1;
+	    }
+	}
+	if (tile->update) {
+	    count++;
+	    if (tile->wave + 1 > nwaves) {
+		nwaves = tile->wave + 1;
+	    }
+	}
+    }
+    if (count > 0) {
+	jobs = (ClientData *) ckalloc(count * sizeof (ClientData));
+	for (wave = 0; wave < nwaves; wave++) {
+	    n = 0;
+	    for (i = 0; i < mosaic->ntiles; i++) {
+		tile = &mosaic->tiles[i];
+		if (tile->update && (tile->wave == wave)) {
+		    jobs[n++] = (ClientData) tile;
+		}
+	    }
+	    PoolRun(v4l2i, MosaicTile, jobs, n);
+	    for (i = 0; i < n; i++) {
+		tile = (VTILE *) jobs[i];
+		if (tile->err != 0) {
+		    /* keep old frame time, retried on next update */
+		    tile->update = 0;
+		    if (err == 0) {
+			err = tile->err;
+		    }
+		    continue;
+		}
+		tile->lastTime = tile->dev->rdyTime;
+		drawn++;
+	    }
+	}
+	ckfree((char *) jobs);
+	if (drawn == 0) {
+	    errno = err;
+	    Tcl_SetObjResult(interp,
+			     Tcl_ObjPrintf("error drawing tiles: %s",
+					   Tcl_PosixError(interp)));
+	    return TCL_ERROR;
+	}
+	block.pixelSize = 3;
+	block.pitch = mosaic->width * 3;
+	block.offset[0] = 0;
+	block.offset[1] = 1;
+	block.offset[2] = 2;
+	block.offset[3] = 4;
+	if (loop != NULL) {
+	    block.pixelPtr = mosaic->canvas;
+	    block.width = mosaic->width;
+	    block.height = mosaic->height;
+	    if (LoopWriteBlock(loop, &block) < 0) {
+		Tcl_SetObjResult(interp,
+				 Tcl_ObjPrintf("write error: %s",
+					       Tcl_PosixError(interp)));
+		return TCL_ERROR;
+	    }
+	} else {
+	    if (Tk_PhotoExpand(interp, photo, mosaic->width,
+			       mosaic->height) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    for (i = 0; i < mosaic->ntiles; i++) {
+		tile = &mosaic->tiles[i];
+		if (!tile->update) {
+		    continue;
+		}
+		block.pixelPtr = mosaic->canvas +
+		    (tile->y * mosaic->width + tile->x) * 3;
+		block.width = tile->width;
+		block.height = tile->height;
+		if (Tk_PhotoPutBlock(interp, photo, &block, tile->x, tile->y,
+				     tile->width, tile->height,
+				     TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+	    }
+	}
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(drawn));
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MosaicFree --
+ *
+ *	Release a mosaic and its tiles.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+MosaicFree(VMOSAIC *mosaic)
+{
+    int i;
+
+    for (i = 0; i < mosaic->ntiles; i++) {
+	if (mosaic->tiles[i].xmap != NULL) {
+	    ckfree((char *) mosaic->tiles[i].xmap);
+	}
+    }
+    if (mosaic->tiles != NULL) {
+	ckfree((char *) mosaic->tiles);
+    }
+    mosaic->tiles = NULL;
+    mosaic->ntiles = 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MosaicCmd --
+ *
+ *	Subcommands of "v4l2 mosaic": create, layout, update, delete.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+MosaicCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    VMOSAIC *mosaic;
+    Tcl_HashEntry *hPtr;
+    int command, isNew, i;
+
+    static const char *mosaicNames[] = {
+	"create", "delete", "layout", "update", NULL
+    };
+    enum mosaicCode {
+	MOSAIC_create, MOSAIC_delete, MOSAIC_layout, MOSAIC_update
+    };
+
+    if (objc < 4) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option arg ...");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], mosaicNames, "option", 0,
+			    &command) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (command == MOSAIC_create) {
+	int width, height;
+
+	if (objc != 6) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "width height target");
+	    return TCL_ERROR;
+	}
+	if ((Tcl_GetIntFromObj(interp, objv[3], &width) != TCL_OK) ||
+	    (Tcl_GetIntFromObj(interp, objv[4], &height) != TCL_OK)) {
+	    return TCL_ERROR;
+	}
+	if ((width <= 0) || (height <= 0) || (width > 16384) ||
+	    (height > 16384)) {
+	    Tcl_SetResult(interp, "invalid width or height", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	mosaic = (VMOSAIC *) ckalloc(sizeof (VMOSAIC));
+	memset(mosaic, 0, sizeof (VMOSAIC));
+	mosaic->canvas = attemptckalloc(width * height * 3);
+	if (mosaic->canvas == NULL) {
+	    ckfree((char *) mosaic);
+	    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	memset(mosaic->canvas, 0, width * height * 3);
+	mosaic->width = width;
+	mosaic->height = height;
+	Tcl_DStringInit(&mosaic->target);
+	Tcl_DStringAppend(&mosaic->target, Tcl_GetString(objv[5]), -1);
+	sprintf(mosaic->mosaicId, "mosaic%d", v4l2i->mosaicCount++);
+	hPtr = Tcl_CreateHashEntry(&v4l2i->mosaics, mosaic->mosaicId, &isNew);
+	Tcl_SetHashValue(hPtr, (ClientData) mosaic);
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(mosaic->mosaicId, -1));
+	return TCL_OK;
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->mosaics, Tcl_GetString(objv[3]));
+    if (hPtr == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("mosaic \"%s\" not found", Tcl_GetString(objv[3])));
+	return TCL_ERROR;
+    }
+    mosaic = (VMOSAIC *) Tcl_GetHashValue(hPtr);
+    switch ((enum mosaicCode) command) {
+    case MOSAIC_delete:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "mosaicid");
+	    return TCL_ERROR;
+	}
+	Tcl_DeleteHashEntry(hPtr);
+	MosaicFree(mosaic);
+	Tcl_DStringFree(&mosaic->target);
+	ckfree(mosaic->canvas);
+	ckfree((char *) mosaic);
+	break;
+    case MOSAIC_layout: {
+	Tcl_Obj **elems, **rect;
+	int nelems, nrect, r[4];
+	VTILE *tiles;
+
+	if (objc != 5) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "mosaicid {devid {x y w h} ...}");
+	    return TCL_ERROR;
+	}
+	if (Tcl_ListObjGetElements(interp, objv[4], &nelems, &elems)
+	    != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (nelems % 2) {
+	    Tcl_SetResult(interp, "layout must be list of device ids and "
+			  "rectangles", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	tiles = (VTILE *) ckalloc((nelems / 2 + 1) * sizeof (VTILE));
+	memset(tiles, 0, (nelems / 2 + 1) * sizeof (VTILE));
+	for (i = 0; i < nelems / 2; i++) {
+	    if ((Tcl_ListObjGetElements(interp, elems[2 * i + 1], &nrect,
+					&rect) != TCL_OK) ||
+		(nrect != 4) ||
+		(Tcl_GetIntFromObj(interp, rect[0], &r[0]) != TCL_OK) ||
+		(Tcl_GetIntFromObj(interp, rect[1], &r[1]) != TCL_OK) ||
+		(Tcl_GetIntFromObj(interp, rect[2], &r[2]) != TCL_OK) ||
+		(Tcl_GetIntFromObj(interp, rect[3], &r[3]) != TCL_OK) ||
+		(r[0] < 0) || (r[1] < 0) || (r[2] <= 0) || (r[3] <= 0) ||
+		(r[0] + r[2] > mosaic->width) ||
+		(r[1] + r[3] > mosaic->height) ||
+		(strlen(Tcl_GetString(elems[2 * i])) >=
+		 sizeof (tiles[i].devId))) {
+		ckfree((char *) tiles);
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("invalid tile \"%s\"",
+				  Tcl_GetString(elems[2 * i + 1])));
+		return TCL_ERROR;
+	    }
+	    tiles[i].mosaic = mosaic;
+	    strcpy(tiles[i].devId, Tcl_GetString(elems[2 * i]));
+	    tiles[i].x = r[0];
+	    tiles[i].y = r[1];
+	    tiles[i].width = r[2];
+	    tiles[i].height = r[3];
+	    tiles[i].lastTime = -1;
+	}
+	MosaicFree(mosaic);
+	mosaic->tiles = tiles;
+	mosaic->ntiles = nelems / 2;
+	memset(mosaic->canvas, 0, mosaic->width * mosaic->height * 3);
+	break;
+    }
+    case MOSAIC_update:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "mosaicid");
+	    return TCL_ERROR;
+	}
+	return MosaicUpdate(v4l2i, interp, mosaic);
+    default:
+	break;
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RecordFree, RecordFrame --
+ *
+ *	Release the ring recorder of a device, and copy the last
+ *	ready frame into it. Frames older than the time span are
+ *	dropped, then the oldest frames occupying the room for the
+ *	new one. A change of format empties the ring.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+RecordFree(V4L2C *v4l2c)
+{
+    VREC *rec = v4l2c->rec;
+
+    if (rec == NULL) {
+	return;
+    }
+    if (rec->arena != NULL) {
+	ckfree(rec->arena);
+    }
+    ckfree((char *) rec->ents);
+    ckfree((char *) rec);
+    v4l2c->rec = NULL;
+}
+
+static void
+RecordFrame(V4L2C *v4l2c)
+{
+    VREC *rec = v4l2c->rec;
+    VRECENT *ent;
+    unsigned char *arena;
+    size_t pos, newSize;
+    int size;
+
+    if (v4l2c->bufrdy < 0) {
+	return;
+    }
+    if ((rec->format != v4l2c->format) || (rec->width != v4l2c->width) ||
+	(rec->height != v4l2c->height)) {
+	rec->format = v4l2c->format;
+	rec->width = v4l2c->width;
+	rec->height = v4l2c->height;
+	rec->first = rec->count = 0;
+	rec->wpos = 0;
+    }
+    size = v4l2c->rdyUsed;
+    if ((size <= 0) || (size > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	size = v4l2c->vbufs[v4l2c->bufrdy].length;
+    }
+    if ((size_t) size > rec->arenaMax) {
+	rec->dropped++;
+	return;
+    }
+    while ((rec->count > 0) &&
+	   (rec->ents[rec->first].time < v4l2c->rdyTime - rec->seconds)) {
+	rec->first = (rec->first + 1) % rec->maxEnts;
+	rec->count--;
+    }
+    pos = rec->wpos;
+    if ((pos + size > rec->arenaSize) && (rec->arenaSize < rec->arenaMax)) {
+	/* grow towards the limit rather than wrapping */
+	newSize = rec->arenaSize * 2;
+	if (newSize < pos + size) {
+	    newSize = pos + size;
+	}
+	if (newSize > rec->arenaMax) {
+	    newSize = rec->arenaMax;
+	}
+	arena = (rec->arena == NULL) ? attemptckalloc(newSize) :
+	    attemptckrealloc(rec->arena, newSize);
+	if (arena != NULL) {
+	    rec->arena = arena;
+	    rec->arenaSize = newSize;
+	}
+    }
+    if ((size_t) size > rec->arenaSize) {
+	rec->dropped++;
+	return;
+    }
+    if (pos + size > rec->arenaSize) {
+	/* frames behind the write position go before wrapping */
+	while ((rec->count > 0) && (rec->ents[rec->first].offset >= pos)) {
+	    rec->first = (rec->first + 1) % rec->maxEnts;
+	    rec->count--;
+	}
+	pos = 0;
+    }
+    /* allocation is sequential, so the oldest frame is next in the way */
+    while (rec->count > 0) {
+	ent = &rec->ents[rec->first];
+	if ((rec->count < rec->maxEnts) &&
+	    ((ent->offset >= pos + size) || (ent->offset + ent->size <= pos))) {
+	    break;
+	}
+	rec->first = (rec->first + 1) % rec->maxEnts;
+	rec->count--;
+    }
+    if (rec->count == 0) {
+	rec->first = 0;
+    }
+    ent = &rec->ents[(rec->first + rec->count) % rec->maxEnts];
+    rec->count++;
+    memcpy(rec->arena + pos, v4l2c->vbufs[v4l2c->bufrdy].start, size);
+    ent->offset = pos;
+    ent->size = size;
+    ent->sequence = v4l2c->rdySeq;
+    ent->time = v4l2c->rdyTime;
+    rec->wpos = pos + size;
+    rec->frames++;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RecordDump --
+ *
+ *	Write the frames of the ring recorder from oldest to newest
+ *	to a raw file, and an index of fixed size records to the same
+ *	name with ".idx" appended. Returns the number of frames, or
+ *	-1 with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+RecordDump(VREC *rec, const char *path)
+{
+    Tcl_DString ds;
+    VRECHDR hdr;
+    VRECIDX *idx;
+    VRECENT *ent;
+    unsigned long long off = 0;
+    int i, n, fd = -1, ifd = -1, err;
+
+    idx = (VRECIDX *) attemptckalloc((rec->count + 1) * sizeof (VRECIDX));
+    if (idx == NULL) {
+	errno = ENOMEM;
+	return -1;
+    }
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, path, -1);
+    Tcl_DStringAppend(&ds, ".idx", -1);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+	goto error;
+    }
+    ifd = open(Tcl_DStringValue(&ds), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (ifd < 0) {
+	goto error;
+    }
+    for (i = 0; i < rec->count; i++) {
+	ent = &rec->ents[(rec->first + i) % rec->maxEnts];
+	n = write(fd, rec->arena + ent->offset, ent->size);
+	if (n != ent->size) {
+	    if (n >= 0) {
+		errno = ENOSPC;
+	    }
+	    goto error;
+	}
+	idx[i].offset = off;
+	idx[i].size = ent->size;
+	idx[i].sequence = ent->sequence;
+	idx[i].time = ent->time;
+	off += ent->size;
+    }
+    memset(&hdr, 0, sizeof (hdr));
+    memcpy(hdr.magic, REC_MAGIC, sizeof (hdr.magic));
+    hdr.fourcc = rec->format;
+    hdr.width = rec->width;
+    hdr.height = rec->height;
+    hdr.count = rec->count;
+    n = rec->count * sizeof (VRECIDX);
+    errno = ENOSPC;
+    if ((write(ifd, &hdr, sizeof (hdr)) != sizeof (hdr)) ||
+	(write(ifd, idx, n) != n)) {
+	goto error;
+    }
+    n = close(fd);
+    fd = -1;
+    if ((close(ifd) < 0) || (n < 0)) {
+	ifd = -1;
+	goto error;
+    }
+    ckfree((char *) idx);
+    Tcl_DStringFree(&ds);
+    return rec->count;
+
+error:
+    err = errno;
+    if (fd >= 0) {
+	close(fd);
+    }
+    if (ifd >= 0) {
+	close(ifd);
+    }
+    ckfree((char *) idx);
+    Tcl_DStringFree(&ds);
+    errno = err;
+    return -1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Deinterleave --
+ *
+ *	Split n byte pairs into two planes, e.g. Y and chroma of
+ *	YUYV, or U and V of NV12. With SSE2 sixteen pairs are done
+ *	at once.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+Deinterleave(const unsigned char *in, unsigned char *even,
+	     unsigned char *odd, int n)
+{
+#ifdef __SSE2__
+    __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i a, b;
+
+    for (; n >= 16; n -= 16) {
+	a = _mm_loadu_si128((__m128i *) in);
+	b = _mm_loadu_si128((__m128i *) (in + 16));
+	_mm_storeu_si128((__m128i *) even,
+			 _mm_packus_epi16(_mm_and_si128(a, mask),
+					  _mm_and_si128(b, mask)));
+	_mm_storeu_si128((__m128i *) odd,
+			 _mm_packus_epi16(_mm_srli_epi16(a, 8),
+					  _mm_srli_epi16(b, 8)));
+	in += 32;
+	even += 16;
+	odd += 16;
+    }
+#endif
+    for (; n > 0; n--) {
+	*even++ = in[0];
+	*odd++ = in[1];
+	in += 2;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Y4MConvert --
+ *
+ *	Convert the last ready frame of a device to a Y4M frame with
+ *	header. Packed YUV becomes planar 4:2:2, NV12 planar 4:2:0,
+ *	grey mono, and other formats are converted via RGB to 4:4:4.
+ *	Returns -1 with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+Y4MConvert(V4L2C *v4l2c, VY4MW *y4m, unsigned char *out)
+{
+    unsigned char *src = (unsigned char *) v4l2c->vbufs[v4l2c->bufrdy].start;
+    unsigned char *yp, *up, *vp, *toFree, *p;
+    int w = y4m->width, h = y4m->height, n = w * h, cw = (w + 1) / 2;
+    int ch = (h + 1) / 2, x, y, r, g, b, stride;
+    Tk_PhotoImageBlock block;
+
+    if (v4l2c->vbufs[v4l2c->bufrdy].length < n) {
+	errno = EINVAL;
+	return -1;
+    }
+    memcpy(out, "FRAME\n", 6);
+    yp = out + 6;
+    /* lines are copied one by one as the driver may pad them */
+    switch (y4m->format) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	if (v4l2c->vbufs[v4l2c->bufrdy].length < n * 2) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	stride = FrameStride(v4l2c, w * 2);
+	up = yp + n;
+	vp = up + n / 2;
+	for (y = 0; y < h; y++) {
+	    Deinterleave(src + y * stride, yp + y * w, y4m->chroma2 + y * w,
+			 w);
+	}
+	if (y4m->format == V4L2_PIX_FMT_YVYU) {
+	    Deinterleave(y4m->chroma2, vp, up, n / 2);
+	} else {
+	    Deinterleave(y4m->chroma2, up, vp, n / 2);
+	}
+	return 0;
+    case V4L2_PIX_FMT_GREY:
+	stride = FrameStride(v4l2c, w);
+	for (y = 0; y < h; y++) {
+	    memcpy(yp + y * w, src + y * stride, w);
+	}
+	return 0;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+	if (v4l2c->vbufs[v4l2c->bufrdy].length < n + 2 * cw * ch) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	stride = FrameStride(v4l2c, w);
+	for (y = 0; y < h; y++) {
+	    memcpy(yp + y * w, src + y * stride, w);
+	}
+	src += stride * h;
+	up = yp + n;
+	vp = up + cw * ch;
+	if (y4m->format == V4L2_PIX_FMT_NV12) {
+	    if (stride == w) {
+		/* packed chroma rows take 2 * cw bytes */
+		stride = 2 * cw;
+	    }
+	    for (y = 0; y < ch; y++) {
+		Deinterleave(src + y * stride, up + y * cw, vp + y * cw, cw);
+	    }
+	} else {
+	    stride = (stride == w) ? cw : stride / 2;
+	    for (y = 0; y < ch; y++) {
+		memcpy(up + y * cw, src + y * stride, cw);
+		memcpy(vp + y * cw, src + (ch + y) * stride, cw);
+	    }
+	}
+	return 0;
+    }
+    if (FrameBlock(v4l2c, &block, &toFree) < 0) {
+	return -1;
+    }
+    up = yp + n;
+    vp = up + n;
+    for (y = 0; y < block.height; y++) {
+	p = block.pixelPtr + y * block.pitch;
+	for (x = 0; x < block.width; x++) {
+	    r = p[block.offset[0]];
+	    g = p[block.offset[1]];
+	    b = p[block.offset[2]];
+	    *yp++ = sat(((4224 * r + 8256 * g + 1600 * b) >> 14) + 16);
+	    *up++ = sat(((-2432 * r - 4736 * g + 7168 * b) >> 14) + 128);
+	    *vp++ = sat(((7168 * r - 6016 * g - 1152 * b) >> 14) + 128);
+	    p += block.pixelSize;
+	}
+    }
+    if (toFree != NULL) {
+	ckfree(toFree);
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Y4MWrite --
+ *
+ *	Write a buffer completely. Returns -1 with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+Y4MWrite(int fd, const unsigned char *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+	n = write(fd, buf, len);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+#ifdef TCL_THREADS
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Y4MThread --
+ *
+ *	Writer thread of a Y4M file: appends queued frames until
+ *	told to terminate, after the queue is drained.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType
+Y4MThread(ClientData clientData)
+{
+    VY4MW *y4m = (VY4MW *) clientData;
+    unsigned char *frame;
+    int n;
+
+    Tcl_MutexLock(&y4m->mutex);
+    for (;;) {
+	while ((y4m->count == 0) && !y4m->stop) {
+	    Tcl_ConditionWait(&y4m->cond, &y4m->mutex, NULL);
+	}
+	if (y4m->count == 0) {
+	    break;
+	}
+	frame = y4m->ring[y4m->head];
+	Tcl_MutexUnlock(&y4m->mutex);
+	n = Y4MWrite(y4m->fd, frame, y4m->size);
+	Tcl_MutexLock(&y4m->mutex);
+	y4m->head = (y4m->head + 1) % Y4M_DEPTH;
+	y4m->count--;
+	if (n < 0) {
+	    y4m->errors++;
+	} else {
+	    y4m->written++;
+	}
+    }
+    Tcl_MutexUnlock(&y4m->mutex);
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Y4MFrame --
+ *
+ *	Queue the last ready frame of a device for the Y4M writer,
+ *	or write it directly without thread support. The conversion
+ *	fills a free queue slot outside of the lock.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+Y4MFrame(V4L2C *v4l2c)
+{
+    VY4MW *y4m = v4l2c->y4m;
+    unsigned char *slot;
+
+    if (v4l2c->bufrdy < 0) {
+	return;
+    }
+    Tcl_MutexLock(&y4m->mutex);
+    if ((y4m->count >= Y4M_DEPTH) || (v4l2c->format != y4m->format) ||
+	(v4l2c->width != y4m->width) || (v4l2c->height != y4m->height)) {
+	y4m->dropped++;
+	Tcl_MutexUnlock(&y4m->mutex);
+	return;
+    }
+    slot = y4m->ring[(y4m->head + y4m->count) % Y4M_DEPTH];
+    Tcl_MutexUnlock(&y4m->mutex);
+    if (Y4MConvert(v4l2c, y4m, slot) < 0) {
+	Tcl_MutexLock(&y4m->mutex);
+	y4m->errors++;
+	Tcl_MutexUnlock(&y4m->mutex);
+	return;
+    }
+    if (!y4m->threaded) {
+	if (Y4MWrite(y4m->fd, slot, y4m->size) < 0) {
+	    y4m->errors++;
+	} else {
+	    y4m->written++;
+	}
+	return;
+    }
+    Tcl_MutexLock(&y4m->mutex);
+    y4m->count++;
+    Tcl_ConditionNotify(&y4m->cond);
+    Tcl_MutexUnlock(&y4m->mutex);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Y4MStart, Y4MStop --
+ *
+ *	Start writing the frames of a capture device to a Y4M file,
+ *	or stop it after pending frames are written.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+Y4MStop(V4L2C *v4l2c)
+{
+    VY4MW *y4m = v4l2c->y4m;
+    int i;
+
+    if (y4m == NULL) {
+	return;
+    }
+#ifdef TCL_THREADS
+    if (y4m->threaded) {
+	int result;
+
+	Tcl_MutexLock(&y4m->mutex);
+	y4m->stop = 1;
+	Tcl_ConditionNotify(&y4m->cond);
+	Tcl_MutexUnlock(&y4m->mutex);
+	Tcl_JoinThread(y4m->thread, &result);
+    }
+    Tcl_ConditionFinalize(&y4m->cond);
+#endif
+    Tcl_MutexFinalize(&y4m->mutex);
+    close(y4m->fd);
+    for (i = 0; i < Y4M_DEPTH; i++) {
+	if (y4m->ring[i] != NULL) {
+	    ckfree(y4m->ring[i]);
+	}
+    }
+    if (y4m->chroma2 != NULL) {
+	ckfree(y4m->chroma2);
+    }
+    Tcl_DStringFree(&y4m->path);
+    ckfree((char *) y4m);
+    v4l2c->y4m = NULL;
+}
+
+static int
+Y4MStart(Tcl_Interp *interp, V4L2C *v4l2c, const char *path)
+{
+    VY4MW *y4m;
+    char header[128];
+    int i, n, cw, ch;
+
+    if ((v4l2c->width <= 0) || (v4l2c->height <= 0)) {
+	Tcl_SetResult(interp, "unknown frame size", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    Y4MStop(v4l2c);
+    y4m = (VY4MW *) ckalloc(sizeof (VY4MW));
+    memset(y4m, 0, sizeof (VY4MW));
+    Tcl_DStringInit(&y4m->path);
+    Tcl_DStringAppend(&y4m->path, path, -1);
+    y4m->format = v4l2c->format;
+    y4m->width = v4l2c->width;
+    y4m->height = v4l2c->height;
+    n = y4m->width * y4m->height;
+    cw = (y4m->width + 1) / 2;
+    ch = (y4m->height + 1) / 2;
+    switch (y4m->format) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	if (y4m->width % 2) {
+	    goto badFormat;
+	}
+	y4m->chroma = 422;
+	y4m->size = n * 2;
+	y4m->chroma2 = attemptckalloc(n);
+	if (y4m->chroma2 == NULL) {
+	    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    goto error;
+	}
+	break;
+    case V4L2_PIX_FMT_GREY:
+	y4m->chroma = 0;
+	y4m->size = n;
+	break;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+	y4m->chroma = 420;
+	y4m->size = n + 2 * cw * ch;
+	break;
+    default:
+	y4m->chroma = 444;
+	y4m->size = n * 3;
+	break;
+    }
+    y4m->size += 6;
+    for (i = 0; i < Y4M_DEPTH; i++) {
+	y4m->ring[i] = attemptckalloc(y4m->size);
+	if (y4m->ring[i] == NULL) {
+	    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    goto error;
+	}
+    }
+    y4m->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (y4m->fd < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error opening \"%s\": %s", path,
+				       Tcl_PosixError(interp)));
+	goto error;
+    }
+    n = sprintf(header, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C%s\n",
+		y4m->width, y4m->height, (v4l2c->fps > 0) ? v4l2c->fps : 15,
+		(y4m->chroma == 420) ? "420jpeg" :
+		(y4m->chroma == 422) ? "422" :
+		(y4m->chroma == 444) ? "444" : "mono");
+    if (Y4MWrite(y4m->fd, (unsigned char *) header, n) < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error writing \"%s\": %s", path,
+				       Tcl_PosixError(interp)));
+	close(y4m->fd);
+	goto error;
+    }
+#ifdef TCL_THREADS
+    if (Tcl_CreateThread(&y4m->thread, Y4MThread, (ClientData) y4m,
+			 TCL_THREAD_STACK_DEFAULT,
+			 TCL_THREAD_JOINABLE) == TCL_OK) {
+	y4m->threaded = 1;
+    }
+#endif
+    v4l2c->y4m = y4m;
+    return TCL_OK;
+
+badFormat:
+    Tcl_SetResult(interp, "unsupported frame size", TCL_STATIC);
+error:
+    for (i = 0; i < Y4M_DEPTH; i++) {
+	if (y4m->ring[i] != NULL) {
+	    ckfree(y4m->ring[i]);
+	}
+    }
+    if (y4m->chroma2 != NULL) {
+	ckfree(y4m->chroma2);
+    }
+    Tcl_DStringFree(&y4m->path);
+    ckfree((char *) y4m);
+    return TCL_ERROR;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Y4MOpen --
+ *
+ *	Open a Y4M file for reading and parse its stream header.
+ *	Only 8 bit 4:2:0, 4:2:2, 4:4:4, and mono are supported.
+ *	Returns NULL with a message in the interpreter on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static VY4MR *
+Y4MOpen(Tcl_Interp *interp, const char *path)
+{
+    VY4MR *y4r;
+    char header[1024], *p, *end, *tok;
+    struct stat st;
+    int n, fd, cw, ch;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error opening \"%s\": %s", path,
+				       Tcl_PosixError(interp)));
+	return NULL;
+    }
+    n = read(fd, header, sizeof (header) - 1);
+    if (n < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error reading \"%s\": %s", path,
+				       Tcl_PosixError(interp)));
+	close(fd);
+	return NULL;
+    }
+    header[n] = '\0';
+    end = strchr(header, '\n');
+    if ((strncmp(header, "YUV4MPEG2 ", 10) != 0) || (end == NULL)) {
+	goto badHeader;
+    }
+    *end = '\0';
+    y4r = (VY4MR *) ckalloc(sizeof (VY4MR));
+    memset(y4r, 0, sizeof (VY4MR));
+    y4r->fd = fd;
+    y4r->chroma = 420;
+    y4r->fpsNum = 25;
+    y4r->fpsDen = 1;
+    y4r->data = end + 1 - header;
+    for (tok = strtok_r(header + 10, " ", &p); tok != NULL;
+	 tok = strtok_r(NULL, " ", &p)) {
+	switch (tok[0]) {
+	case 'W':
+	    y4r->width = atoi(tok + 1);
+	    break;
+	case 'H':
+	    y4r->height = atoi(tok + 1);
+	    break;
+	case 'F':
+	    if ((sscanf(tok + 1, "%d:%d", &y4r->fpsNum, &y4r->fpsDen) != 2) ||
+		(y4r->fpsNum <= 0) || (y4r->fpsDen <= 0)) {
+		y4r->fpsNum = 25;
+		y4r->fpsDen = 1;
+	    }
+	    break;
+	case 'C':
+	    if (strncmp(tok + 1, "420", 3) == 0) {
+		y4r->chroma = 420;
+		n = strlen(tok);
+		if ((n > 4) && ((tok[4] == 'p') && isdigit((unsigned char) tok[5]))) {
+		    goto badFormat;
+		}
+	    } else if (strcmp(tok + 1, "422") == 0) {
+		y4r->chroma = 422;
+	    } else if (strcmp(tok + 1, "444") == 0) {
+		y4r->chroma = 444;
+	    } else if (strcmp(tok + 1, "mono") == 0) {
+		y4r->chroma = 0;
+	    } else {
+		goto badFormat;
+	    }
+	    break;
+	}
+    }
+    if ((y4r->width <= 0) || (y4r->height <= 0) ||
+	(y4r->width > 16384) || (y4r->height > 16384)) {
+	goto badFormat;
+    }
+    n = y4r->width * y4r->height;
+    cw = (y4r->width + 1) / 2;
+    ch = (y4r->height + 1) / 2;
+    switch (y4r->chroma) {
+    case 420:
+	y4r->size = n + 2 * cw * ch;
+	break;
+    case 422:
+	y4r->size = n + 2 * cw * y4r->height;
+	break;
+    case 444:
+	y4r->size = n * 3;
+	break;
+    default:
+	y4r->size = n;
+	break;
+    }
+    y4r->buf = attemptckalloc(y4r->size);
+    if (y4r->buf == NULL) {
+	Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	goto error;
+    }
+    y4r->pos = y4r->data;
+    if (fstat(fd, &st) == 0) {
+	y4r->nframes = (st.st_size - y4r->data) / (y4r->size + 6);
+    }
+    return y4r;
+
+badFormat:
+    Tcl_SetObjResult(interp,
+		     Tcl_ObjPrintf("unsupported Y4M format in \"%s\"", path));
+error:
+    ckfree((char *) y4r);
+    close(fd);
+    return NULL;
+
+badHeader:
+    Tcl_SetObjResult(interp,
+		     Tcl_ObjPrintf("\"%s\" is not a Y4M file", path));
+    close(fd);
+    return NULL;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Y4MRead --
+ *
+ *	Read the next frame of a Y4M file and convert it to RGB.
+ *	Returns 1 on success, 0 at end of file, or -1 with errno
+ *	set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+Y4MRead(VY4MR *y4r, unsigned char *rgb)
+{
+    char line[256], *end;
+    unsigned char *yp, *up, *vp;
+    int n, x, y, hs, vs, cw, ch, u, v, r, g, b;
+
+    n = pread(y4r->fd, line, sizeof (line) - 1, y4r->pos);
+    if (n <= 0) {
+	return n;
+    }
+    line[n] = '\0';
+    end = memchr(line, '\n', n);
+    if ((strncmp(line, "FRAME", 5) != 0) || (end == NULL)) {
+	errno = EINVAL;
+	return -1;
+    }
+    n = pread(y4r->fd, y4r->buf, y4r->size, y4r->pos + (end + 1 - line));
+    if (n < 0) {
+	return -1;
+    }
+    if (n < y4r->size) {
+	return 0;
+    }
+    y4r->pos += (end + 1 - line) + y4r->size;
+    yp = y4r->buf;
+    if (y4r->chroma == 0) {
+	for (n = y4r->width * y4r->height; n > 0; n--) {
+	    rgb[0] = rgb[1] = rgb[2] = *yp++;
+	    rgb += 3;
+	}
+	return 1;
+    }
+    hs = (y4r->chroma != 444);
+    vs = (y4r->chroma == 420);
+    cw = hs ? (y4r->width + 1) / 2 : y4r->width;
+    ch = vs ? (y4r->height + 1) / 2 : y4r->height;
+    up = yp + y4r->width * y4r->height;
+    vp = up + cw * ch;
+    for (y = 0; y < y4r->height; y++) {
+	for (x = 0; x < y4r->width; x++) {
+	    u = up[(y >> vs) * cw + (x >> hs)] - 128;
+	    v = vp[(y >> vs) * cw + (x >> hs)] - 128;
+	    r = (22987 * v) >> 14;
+	    g = (-5636 * u - 11698 * v) >> 14;
+	    b = (29049 * u) >> 14;
+	    rgb[0] = sat(*yp + r);
+	    rgb[1] = sat(*yp + g);
+	    rgb[2] = sat(*yp + b);
+	    rgb += 3;
+	    yp++;
+	}
+    }
+    return 1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Y4MCmd --
+ *
+ *	Implements "v4l2 y4m": open, info, read, seek, and close of
+ *	Y4M files for reading.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+Y4MCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    Tcl_HashEntry *hPtr;
+    VY4MR *y4r;
+    int command, isNew, n;
+    Tcl_WideInt frame;
+
+    static const char *y4mNames[] = {
+	"close", "info", "open", "read", "seek", NULL
+    };
+    enum y4mCode {
+	Y4M_close, Y4M_info, Y4M_open, Y4M_read, Y4M_seek
+    };
+
+    if (objc < 4) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option arg ...");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], y4mNames, "option", 0,
+			    &command) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (command == Y4M_open) {
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "file");
+	    return TCL_ERROR;
+	}
+	y4r = Y4MOpen(interp, Tcl_GetString(objv[3]));
+	if (y4r == NULL) {
+	    return TCL_ERROR;
+	}
+	sprintf(y4r->y4mId, "y4m%d", v4l2i->y4mCount++);
+	hPtr = Tcl_CreateHashEntry(&v4l2i->y4m, y4r->y4mId, &isNew);
+	Tcl_SetHashValue(hPtr, (ClientData) y4r);
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(y4r->y4mId, -1));
+	return TCL_OK;
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->y4m, Tcl_GetString(objv[3]));
+    if (hPtr == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("Y4M reader \"%s\" not found",
+			  Tcl_GetString(objv[3])));
+	return TCL_ERROR;
+    }
+    y4r = (VY4MR *) Tcl_GetHashValue(hPtr);
+    switch ((enum y4mCode) command) {
+    case Y4M_close:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "y4mid");
+	    return TCL_ERROR;
+	}
+	Tcl_DeleteHashEntry(hPtr);
+	close(y4r->fd);
+	ckfree(y4r->buf);
+	ckfree((char *) y4r);
+	break;
+    case Y4M_info: {
+	Tcl_Obj *list[10];
+
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "y4mid");
+	    return TCL_ERROR;
+	}
+	list[0] = Tcl_NewStringObj("width", -1);
+	list[1] = Tcl_NewIntObj(y4r->width);
+	list[2] = Tcl_NewStringObj("height", -1);
+	list[3] = Tcl_NewIntObj(y4r->height);
+	list[4] = Tcl_NewStringObj("fps", -1);
+	list[5] = Tcl_NewDoubleObj((double) y4r->fpsNum / y4r->fpsDen);
+	list[6] = Tcl_NewStringObj("chroma", -1);
+	list[7] = (y4r->chroma > 0) ? Tcl_NewIntObj(y4r->chroma) :
+	    Tcl_NewStringObj("mono", -1);
+	list[8] = Tcl_NewStringObj("frames", -1);
+	list[9] = Tcl_NewWideIntObj(y4r->nframes);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(10, list));
+	break;
+    }
+    case Y4M_seek:
+	if (objc != 5) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "y4mid frame");
+	    return TCL_ERROR;
+	}
+	if (Tcl_GetWideIntFromObj(interp, objv[4], &frame) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if ((frame < 0) || (frame > y4r->nframes)) {
+	    Tcl_SetResult(interp, "frame out of range", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	/* plain frame headers as written by "v4l2 record" */
+	y4r->pos = y4r->data + frame * (y4r->size + 6);
+	break;
+    case Y4M_read: {
+	Tcl_Obj *list[4];
+	unsigned char *rgb;
+	Tk_PhotoHandle photo = NULL;
+	Tk_PhotoImageBlock block;
+
+	if ((objc != 4) && (objc != 5)) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "y4mid ?photo?");
+	    return TCL_ERROR;
+	}
+	if (objc > 4) {
+	    if (CheckForTk(v4l2i, interp) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    photo = Tk_FindPhoto(interp, Tcl_GetString(objv[4]));
+	    if (photo == NULL) {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("can't use \"%s\": not a photo image",
+				  Tcl_GetString(objv[4])));
+		return TCL_ERROR;
+	    }
+	}
+	list[3] = Tcl_NewByteArrayObj(NULL, 0);
+	Tcl_IncrRefCount(list[3]);
+	rgb = Tcl_SetByteArrayLength(list[3], y4r->width * y4r->height * 3);
+	n = Y4MRead(y4r, rgb);
+	if (n <= 0) {
+	    Tcl_DecrRefCount(list[3]);
+	    if (n < 0) {
+		Tcl_SetObjResult(interp,
+				 Tcl_ObjPrintf("error reading frame: %s",
+					       Tcl_PosixError(interp)));
+		return TCL_ERROR;
+	    }
+	    break;
+	}
+	if (photo != NULL) {
+	    block.pixelPtr = rgb;
+	    block.width = y4r->width;
+	    block.height = y4r->height;
+	    block.pixelSize = 3;
+	    block.pitch = block.width * 3;
+	    block.offset[0] = 0;
+	    block.offset[1] = 1;
+	    block.offset[2] = 2;
+	    block.offset[3] = 4;
+	    n = Tk_PhotoExpand(interp, photo, block.width, block.height);
+	    if (n == TCL_OK) {
+		n = Tk_PhotoPutBlock(interp, photo, &block, 0, 0,
+				     block.width, block.height,
+				     TK_PHOTO_COMPOSITE_SET);
+	    }
+	    Tcl_DecrRefCount(list[3]);
+	    if (n != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+	    break;
+	}
+	list[0] = Tcl_NewIntObj(y4r->width);
+	list[1] = Tcl_NewIntObj(y4r->height);
+	list[2] = Tcl_NewIntObj(3);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(4, list));
+	Tcl_DecrRefCount(list[3]);
+	break;
+    }
+    default:
+	break;
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AviPut16, AviPut32, AviPut64, AviFcc --
+ *
+ *	Store little endian values or a four character code.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static unsigned char *
+AviPut16(unsigned char *p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static unsigned char *
+AviPut32(unsigned char *p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static unsigned char *
+AviPut64(unsigned char *p, Tcl_WideInt v)
+{
+    p = AviPut32(p, (unsigned int) v);
+    return AviPut32(p, (unsigned int) (v >> 32));
+}
+
+static unsigned char *
+AviFcc(unsigned char *p, const char *fcc)
+{
+    memcpy(p, fcc, 4);
+    return p + 4;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AviHeader --
+ *
+ *	Build the AVI header up to and including the first "movi"
+ *	list header, AVI_HDRSIZE bytes, from the current counts.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+AviHeader(VAVIW *avi, unsigned char *hdr)
+{
+    unsigned char *p = hdr;
+    int i;
+
+    memset(hdr, 0, AVI_HDRSIZE);
+    p = AviFcc(p, "RIFF");
+    p = AviPut32(p, avi->riff0Size);
+    p = AviFcc(p, "AVI ");
+    p = AviFcc(p, "LIST");
+    p = AviPut32(p, AVI_HDRSIZE - 12 - 20);
+    p = AviFcc(p, "hdrl");
+    /* main header */
+    p = AviFcc(p, "avih");
+    p = AviPut32(p, 56);
+    p = AviPut32(p, 1000000 / avi->fps);
+    p = AviPut32(p, avi->maxSize * avi->fps);
+    p = AviPut32(p, 0);
+    p = AviPut32(p, 0x10);			/* AVIF_HASINDEX */
+    p = AviPut32(p, avi->frames0);
+    p = AviPut32(p, 0);
+    p = AviPut32(p, 1);
+    p = AviPut32(p, avi->maxSize);
+    p = AviPut32(p, avi->width);
+    p = AviPut32(p, avi->height);
+    p += 16;
+    /* stream list */
+    p = AviFcc(p, "LIST");
+    p = AviPut32(p, AVI_HDRSIZE - 12 - 268 - 96);
+    p = AviFcc(p, "strl");
+    p = AviFcc(p, "strh");
+    p = AviPut32(p, 56);
+    p = AviFcc(p, "vids");
+    p = AviFcc(p, (avi->format == V4L2_PIX_FMT_H264) ? "H264" : "MJPG");
+    p += 12;
+    p = AviPut32(p, 1);
+    p = AviPut32(p, avi->fps);
+    p = AviPut32(p, 0);
+    p = AviPut32(p, avi->frames);
+    p = AviPut32(p, avi->maxSize);
+    p = AviPut32(p, 0xFFFFFFFF);
+    p = AviPut32(p, 0);
+    p = AviPut16(p, 0);
+    p = AviPut16(p, 0);
+    p = AviPut16(p, avi->width);
+    p = AviPut16(p, avi->height);
+    p = AviFcc(p, "strf");
+    p = AviPut32(p, 40);
+    p = AviPut32(p, 40);
+    p = AviPut32(p, avi->width);
+    p = AviPut32(p, avi->height);
+    p = AviPut16(p, 1);
+    p = AviPut16(p, 24);
+    p = AviFcc(p, (avi->format == V4L2_PIX_FMT_H264) ? "H264" : "MJPG");
+    p = AviPut32(p, avi->width * avi->height * 3);
+    p += 16;
+    /* super index */
+    p = AviFcc(p, "indx");
+    p = AviPut32(p, 24 + 16 * AVI_MAXRIFF);
+    p = AviPut16(p, 4);
+    p += 2;					/* AVI_INDEX_OF_INDEXES */
+    p = AviPut32(p, avi->nRiff);
+    p = AviFcc(p, "00dc");
+    p += 12;
+    for (i = 0; i < AVI_MAXRIFF; i++) {
+	if (i < avi->nRiff) {
+	    AviPut64(p, avi->super[i].offset);
+	    AviPut32(p + 8, avi->super[i].size);
+	    AviPut32(p + 12, avi->super[i].frames);
+	}
+	p += 16;
+    }
+    /* OpenDML header */
+    p = AviFcc(p, "LIST");
+    p = AviPut32(p, 260);
+    p = AviFcc(p, "odml");
+    p = AviFcc(p, "dmlh");
+    p = AviPut32(p, 248);
+    p = AviPut32(p, avi->frames);
+    p += 244;
+    p = AviFcc(p, "LIST");
+    p = AviPut32(p, avi->movi0Size);
+    AviFcc(p, "movi");
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AviFlush, AviWrite, AviPatch --
+ *
+ *	Buffered output of the AVI writer. AviPatch overwrites a
+ *	32 bit value in the file after flushing the buffer. All
+ *	return -1 with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+AviFlush(VAVIW *avi)
+{
+    int n = avi->bufLen;
+
+    avi->bufLen = 0;
+    return Y4MWrite(avi->fd, avi->buf, n);
+}
+
+static int
+AviWrite(VAVIW *avi, const unsigned char *data, int len)
+{
+    avi->pos += len;
+    if (avi->bufLen + len > AVI_BUFSIZE) {
+	if (AviFlush(avi) < 0) {
+	    return -1;
+	}
+	if (len >= AVI_BUFSIZE) {
+	    return Y4MWrite(avi->fd, data, len);
+	}
+    }
+    memcpy(avi->buf + avi->bufLen, data, len);
+    avi->bufLen += len;
+    return 0;
+}
+
+static int
+AviPatch(VAVIW *avi, Tcl_WideInt pos, unsigned int value)
+{
+    unsigned char b[4];
+
+    if (AviFlush(avi) < 0) {
+	return -1;
+    }
+    AviPut32(b, value);
+    if (pwrite(avi->fd, b, 4, (off_t) pos) != 4) {
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AviSegment --
+ *
+ *	Close the current RIFF segment: append its standard index
+ *	and, for the first segment, the idx1 chunk, then fix up
+ *	the sizes and rewrite the header with the super index and
+ *	frame counts so far, which keeps the file usable up to this
+ *	segment should recording not end properly. Unless last is
+ *	set, a new AVIX segment is begun. Returns -1 with errno set
+ *	on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+AviSegment(VAVIW *avi, int last)
+{
+    unsigned char b[32], *p;
+    Tcl_WideInt ixPos = avi->pos;
+    int i, n;
+
+    p = AviFcc(b, "ix00");
+    p = AviPut32(p, 24 + 8 * avi->nIdx);
+    p = AviPut16(p, 2);
+    *p++ = 0;
+    *p++ = 1;					/* AVI_INDEX_OF_CHUNKS */
+    p = AviPut32(p, avi->nIdx);
+    p = AviFcc(p, "00dc");
+    p = AviPut64(p, avi->moviPos + 8);
+    AviPut32(p, 0);
+    if (AviWrite(avi, b, 32) < 0) {
+	return -1;
+    }
+    for (i = 0; i < avi->nIdx; i++) {
+	/* offsets refer to the chunk data */
+	AviPut32(b, avi->idx[2 * i] + 8);
+	AviPut32(b + 4, avi->idx[2 * i + 1]);
+	if (AviWrite(avi, b, 8) < 0) {
+	    return -1;
+	}
+    }
+    avi->super[avi->nRiff].offset = ixPos;
+    avi->super[avi->nRiff].size = avi->pos - ixPos;
+    avi->super[avi->nRiff].frames = avi->nIdx;
+    if (avi->nRiff == 0) {
+	avi->movi0Size = avi->pos - avi->moviPos - 8;
+	p = AviFcc(b, "idx1");
+	AviPut32(p, 16 * avi->nIdx);
+	if (AviWrite(avi, b, 8) < 0) {
+	    return -1;
+	}
+	for (i = 0; i < avi->nIdx; i++) {
+	    p = AviFcc(b, "00dc");
+	    p = AviPut32(p, (avi->idx[2 * i + 1] & 0x80000000) ? 0 : 0x10);
+	    p = AviPut32(p, avi->idx[2 * i]);
+	    AviPut32(p, avi->idx[2 * i + 1] & 0x7FFFFFFF);
+	    if (AviWrite(avi, b, 16) < 0) {
+		return -1;
+	    }
+	}
+	avi->riff0Size = avi->pos - avi->riffPos - 8;
+	avi->frames0 = avi->nIdx;
+    } else if ((AviPatch(avi, avi->moviPos + 4,
+			 avi->pos - avi->moviPos - 8) < 0) ||
+	       (AviPatch(avi, avi->riffPos + 4,
+			 avi->pos - avi->riffPos - 8) < 0)) {
+	return -1;
+    }
+    avi->nRiff++;
+    avi->nIdx = 0;
+    if (AviFlush(avi) < 0) {
+	return -1;
+    }
+    /* the emptied write buffer is large enough for the header */
+    AviHeader(avi, avi->buf);
+    n = pwrite(avi->fd, avi->buf, AVI_HDRSIZE, 0);
+    if (n != AVI_HDRSIZE) {
+	if (n >= 0) {
+	    errno = EIO;
+	}
+	return -1;
+    }
+    if (last) {
+	return 0;
+    }
+    avi->riffPos = avi->pos;
+    avi->moviPos = avi->pos + 12;
+    p = AviFcc(b, "RIFF");
+    p = AviPut32(p, 0);
+    p = AviFcc(p, "AVIX");
+    p = AviFcc(p, "LIST");
+    p = AviPut32(p, 0);
+    AviFcc(p, "movi");
+    return AviWrite(avi, b, 24);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AviChunk --
+ *
+ *	Append a frame to the "movi" list and remember it for the
+ *	index, starting a new RIFF segment when the current one
+ *	would grow too large. Returns -1 with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+AviChunk(VAVIW *avi, VAVIQ *frame)
+{
+    unsigned char b[8];
+    Tcl_WideInt need;
+    int pad = frame->size & 1;
+
+    need = avi->pos - avi->riffPos + 8 + frame->size + pad +
+	32 + 8 * (avi->nIdx + 1);
+    if (avi->nRiff == 0) {
+	need += 8 + 16 * (avi->nIdx + 1);
+    }
+    if ((need > AVI_RIFFSIZE) && (avi->nIdx > 0)) {
+	if (avi->nRiff + 1 >= AVI_MAXRIFF) {
+	    errno = EFBIG;
+	    return -1;
+	}
+	if (AviSegment(avi, 0) < 0) {
+	    return -1;
+	}
+    }
+    if (avi->nIdx >= avi->maxIdx) {
+	unsigned int *idx;
+	int n = (avi->maxIdx > 0) ? avi->maxIdx * 2 : 4096;
+
+	idx = (unsigned int *) attemptckrealloc((char *) avi->idx,
+						n * 2 * sizeof (int));
+	if (idx == NULL) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	avi->idx = idx;
+	avi->maxIdx = n;
+    }
+    avi->idx[2 * avi->nIdx] = avi->pos - avi->moviPos - 8;
+    avi->idx[2 * avi->nIdx + 1] = frame->size |
+	(frame->key ? 0 : 0x80000000);
+    AviFcc(b, "00dc");
+    AviPut32(b + 4, frame->size);
+    if ((AviWrite(avi, b, 8) < 0) ||
+	(AviWrite(avi, frame->data, frame->size) < 0) ||
+	(pad && (AviWrite(avi, (unsigned char *) "", 1) < 0))) {
+	return -1;
+    }
+    avi->nIdx++;
+    avi->frames++;
+    if (frame->size > avi->maxSize) {
+	avi->maxSize = frame->size;
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AviAppend --
+ *
+ *	Write a queued frame and count it. After a failed write,
+ *	the file is left alone and further frames are counted as
+ *	errors.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+AviAppend(VAVIW *avi, VAVIQ *frame)
+{
+    int n = -1;
+
+    if (!avi->broken) {
+	n = AviChunk(avi, frame);
+	if (n < 0) {
+	    avi->broken = 1;
+	}
+    }
+    Tcl_MutexLock(&avi->mutex);
+    if (n < 0) {
+	avi->errors++;
+    } else {
+	avi->written++;
+    }
+    Tcl_MutexUnlock(&avi->mutex);
+}
+
+#ifdef TCL_THREADS
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AviThread --
+ *
+ *	Writer thread of an AVI file: appends queued frames until
+ *	told to terminate, after the queue is drained.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType
+AviThread(ClientData clientData)
+{
+    VAVIW *avi = (VAVIW *) clientData;
+    VAVIQ *frame;
+
+    Tcl_MutexLock(&avi->mutex);
+    for (;;) {
+	while ((avi->count == 0) && !avi->stop) {
+	    Tcl_ConditionWait(&avi->cond, &avi->mutex, NULL);
+	}
+	if (avi->count == 0) {
+	    break;
+	}
+	frame = &avi->queue[avi->head];
+	Tcl_MutexUnlock(&avi->mutex);
+	AviAppend(avi, frame);
+	Tcl_MutexLock(&avi->mutex);
+	avi->head = (avi->head + 1) % AVI_DEPTH;
+	avi->count--;
+    }
+    Tcl_MutexUnlock(&avi->mutex);
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AviFrame --
+ *
+ *	Queue the last ready frame of a device for the AVI writer,
+ *	or write it directly without thread support. Only the bytes
+ *	used by the driver are copied.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+AviFrame(V4L2C *v4l2c)
+{
+    VAVIW *avi = v4l2c->avi;
+    VAVIQ *slot;
+    int length;
+
+    if (v4l2c->bufrdy < 0) {
+	return;
+    }
+    Tcl_MutexLock(&avi->mutex);
+    if ((avi->count >= AVI_DEPTH) || (v4l2c->format != avi->format) ||
+	(v4l2c->width != avi->width) || (v4l2c->height != avi->height)) {
+	avi->dropped++;
+	Tcl_MutexUnlock(&avi->mutex);
+	return;
+    }
+    slot = &avi->queue[(avi->head + avi->count) % AVI_DEPTH];
+    Tcl_MutexUnlock(&avi->mutex);
+    length = v4l2c->rdyUsed;
+    if ((length <= 0) || (length > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	length = v4l2c->vbufs[v4l2c->bufrdy].length;
+    }
+    if (length > slot->avail) {
+	unsigned char *data = attemptckrealloc((char *) slot->data, length);
+
+	if (data == NULL) {
+	    Tcl_MutexLock(&avi->mutex);
+	    avi->errors++;
+	    Tcl_MutexUnlock(&avi->mutex);
+	    return;
+	}
+	slot->data = data;
+	slot->avail = length;
+    }
+    memcpy(slot->data, v4l2c->vbufs[v4l2c->bufrdy].start, length);
+    slot->size = length;
+    slot->key = (avi->format != V4L2_PIX_FMT_H264) ||
+	(v4l2c->rdyFlags & V4L2_BUF_FLAG_KEYFRAME);
+    if (!avi->threaded) {
+	AviAppend(avi, slot);
+	return;
+    }
+    Tcl_MutexLock(&avi->mutex);
+    avi->count++;
+    Tcl_ConditionNotify(&avi->cond);
+    Tcl_MutexUnlock(&avi->mutex);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AviStart, AviStop --
+ *
+ *	Start writing the compressed frames of a capture device to
+ *	an AVI file, or stop it after pending frames are written and
+ *	the indices and header are completed.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+AviStop(V4L2C *v4l2c)
+{
+    VAVIW *avi = v4l2c->avi;
+    int i;
+
+    if (avi == NULL) {
+	return;
+    }
+#ifdef TCL_THREADS
+    if (avi->threaded) {
+	int result;
+
+	Tcl_MutexLock(&avi->mutex);
+	avi->stop = 1;
+	Tcl_ConditionNotify(&avi->cond);
+	Tcl_MutexUnlock(&avi->mutex);
+	Tcl_JoinThread(avi->thread, &result);
+    }
+    Tcl_ConditionFinalize(&avi->cond);
+#endif
+    Tcl_MutexFinalize(&avi->mutex);
+    if (!avi->broken && (AviSegment(avi, 1) < 0)) {
+	avi->errors++;
+    }
+    close(avi->fd);
+    for (i = 0; i < AVI_DEPTH; i++) {
+	if (avi->queue[i].data != NULL) {
+	    ckfree((char *) avi->queue[i].data);
+	}
+    }
+    if (avi->idx != NULL) {
+	ckfree((char *) avi->idx);
+    }
+    ckfree((char *) avi->buf);
+    Tcl_DStringFree(&avi->path);
+    ckfree((char *) avi);
+    v4l2c->avi = NULL;
+}
+
+static int
+AviStart(Tcl_Interp *interp, V4L2C *v4l2c, const char *path)
+{
+    VAVIW *avi;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    if ((v4l2c->format != V4L2_PIX_FMT_MJPEG) &&
+	(v4l2c->format != V4L2_PIX_FMT_H264)) {
+	Tcl_SetResult(interp, "need MJPEG or H264 format", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if ((v4l2c->width <= 0) || (v4l2c->height <= 0)) {
+	Tcl_SetResult(interp, "unknown frame size", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    AviStop(v4l2c);
+    avi = (VAVIW *) attemptckalloc(sizeof (VAVIW));
+    if (avi != NULL) {
+	memset(avi, 0, sizeof (VAVIW));
+	avi->buf = attemptckalloc(AVI_BUFSIZE);
+	if (avi->buf == NULL) {
+	    ckfree((char *) avi);
+	    avi = NULL;
+	}
+    }
+    if (avi == NULL) {
+	Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    Tcl_DStringInit(&avi->path);
+    Tcl_DStringAppend(&avi->path, path, -1);
+    avi->format = v4l2c->format;
+    avi->width = v4l2c->width;
+    avi->height = v4l2c->height;
+    avi->fps = (v4l2c->fps > 0) ? v4l2c->fps : 15;
+#ifdef O_LARGEFILE
+    flags |= O_LARGEFILE;
+#endif
+    avi->fd = open(path, flags, 0666);
+    if (avi->fd < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error opening \"%s\": %s", path,
+				       Tcl_PosixError(interp)));
+	goto error;
+    }
+    /* placeholder header, rewritten by AviStop */
+    AviHeader(avi, avi->buf);
+    avi->bufLen = AVI_HDRSIZE;
+    avi->pos = AVI_HDRSIZE;
+    avi->riffPos = 0;
+    avi->moviPos = AVI_HDRSIZE - 12;
+#ifdef TCL_THREADS
+    if (Tcl_CreateThread(&avi->thread, AviThread, (ClientData) avi,
+			 TCL_THREAD_STACK_DEFAULT,
+			 TCL_THREAD_JOINABLE) == TCL_OK) {
+	avi->threaded = 1;
+    }
+#endif
+    v4l2c->avi = avi;
+    return TCL_OK;
+
+error:
+    ckfree((char *) avi->buf);
+    Tcl_DStringFree(&avi->path);
+    ckfree((char *) avi);
+    return TCL_ERROR;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzPlanes --
+ *
+ *	Return the number of planes a frame format is coded as, or
+ *	zero when not supported. The widths of the planes are stored
+ *	in pw, all have the frame's height. wide is set to one when
+ *	samples are 16 bit, rawSize to the size of the frame.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+VlzPlanes(int format, int width, int height, int *pw, int *wide,
+	  int *rawSize)
+{
+    *wide = 0;
+    pw[0] = pw[1] = pw[2] = width;
+    switch (format) {
+    case V4L2_PIX_FMT_GREY:
+	*rawSize = width * height;
+	return 1;
+#ifdef V4L2_PIX_FMT_Y16
+    case V4L2_PIX_FMT_Y16:
+#endif
+#ifdef V4L2_PIX_FMT_Y10
+    case V4L2_PIX_FMT_Y10:
+#endif
+	*wide = 1;
+	*rawSize = width * height * 2;
+	return 1;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	if (width % 2) {
+	    return 0;
+	}
+	pw[1] = pw[2] = width / 2;
+	*rawSize = width * height * 2;
+	return 3;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+	*rawSize = width * height * 3;
+	return 3;
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzPack8, VlzPack16, VlzUnpack --
+ *
+ *	Bit pack a block of 16 residuals: a byte giving the number
+ *	of bits b, then b 16 bit masks holding bit b-1, ..., 1, 0
+ *	of all residuals. With SSE2, the masks are gathered with
+ *	movemask from the most significant bit on, so leading zero
+ *	bits cost nothing. VlzUnpack spreads the masks to bytes by
+ *	multiplication; it returns NULL on truncated or invalid input.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static unsigned char *
+VlzPack8(const unsigned char *z, unsigned char *out)
+{
+    int k, m;
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((__m128i *) z);
+
+    for (k = 8; k > 0; k--) {
+	if (_mm_movemask_epi8(v)) {
+	    break;
+	}
+	v = _mm_add_epi8(v, v);
+    }
+    *out++ = k;
+    for (; k > 0; k--) {
+	m = _mm_movemask_epi8(v);
+	*out++ = m;
+	*out++ = m >> 8;
+	v = _mm_add_epi8(v, v);
+    }
+#else
+    int j, or = 0;
+
+    for (j = 0; j < 16; j++) {
+	or |= z[j];
+    }
+    for (k = 0; or >> k; k++) {
+	/* empty */
+    }
+    *out++ = k;
+    while (--k >= 0) {
+	for (j = m = 0; j < 16; j++) {
+	    m |= ((z[j] >> k) & 1) << j;
+	}
+	*out++ = m;
+	*out++ = m >> 8;
+    }
+#endif
+    return out;
+}
+
+static unsigned char *
+VlzPack16(const unsigned short *z, unsigned char *out)
+{
+    int k, m;
+#ifdef __SSE2__
+    __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i v0 = _mm_loadu_si128((__m128i *) z);
+    __m128i v1 = _mm_loadu_si128((__m128i *) (z + 8));
+    __m128i v[2];
+
+    v[0] = _mm_packus_epi16(_mm_and_si128(v0, mask),
+			    _mm_and_si128(v1, mask));
+    v[1] = _mm_packus_epi16(_mm_srli_epi16(v0, 8), _mm_srli_epi16(v1, 8));
+    for (k = 16; k > 0; k--) {
+	if (_mm_movemask_epi8(v[(k - 1) >> 3])) {
+	    break;
+	}
+	v[(k - 1) >> 3] = _mm_add_epi8(v[(k - 1) >> 3], v[(k - 1) >> 3]);
+    }
+    *out++ = k;
+    for (; k > 0; k--) {
+	m = _mm_movemask_epi8(v[(k - 1) >> 3]);
+	*out++ = m;
+	*out++ = m >> 8;
+	v[(k - 1) >> 3] = _mm_add_epi8(v[(k - 1) >> 3], v[(k - 1) >> 3]);
+    }
+#else
+    int j, or = 0;
+
+    for (j = 0; j < 16; j++) {
+	or |= z[j];
+    }
+    for (k = 0; or >> k; k++) {
+	/* empty */
+    }
+    *out++ = k;
+    while (--k >= 0) {
+	for (j = m = 0; j < 16; j++) {
+	    m |= ((z[j] >> k) & 1) << j;
+	}
+	*out++ = m;
+	*out++ = m >> 8;
+    }
+#endif
+    return out;
+}
+
+/* bit j of the 8 bit value m to bit 0 of byte j */
+#define VLZ_SPREAD(m)						\
+    (((((Tcl_WideUInt) ((m) & 0x7f)) * 0x0002040810204081ULL) &	\
+      0x0101010101010101ULL) | (((Tcl_WideUInt) ((m) & 0x80)) << 49))
+
+static const unsigned char *
+VlzUnpack(const unsigned char *in, const unsigned char *end, int maxBits,
+	  unsigned short *z)
+{
+    Tcl_WideUInt acc[4] = { 0, 0, 0, 0 };
+    int b, j, k;
+
+    if (in >= end) {
+	return NULL;
+    }
+    b = *in++;
+    if ((b > maxBits) || (end - in < 2 * b)) {
+	return NULL;
+    }
+    for (k = b - 1; k >= 0; k--) {
+	/* acc[0], acc[1]: bits 0..7 of residuals 0..7, 8..15 */
+	acc[(k >> 2) & 2] |= VLZ_SPREAD(in[0]) << (k & 7);
+	acc[((k >> 2) & 2) + 1] |= VLZ_SPREAD(in[1]) << (k & 7);
+	in += 2;
+    }
+    for (j = 0; j < 8; j++) {
+	z[j] = ((acc[0] >> (8 * j)) & 0xff) |
+	    (((acc[2] >> (8 * j)) & 0xff) << 8);
+	z[j + 8] = ((acc[1] >> (8 * j)) & 0xff) |
+	    (((acc[3] >> (8 * j)) & 0xff) << 8);
+    }
+    return in;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzMed --
+ *
+ *	Median predictor of LOCO-I from left, upper, and upper left
+ *	neighbors. Rows start with the upper neighbor as prediction,
+ *	the first row with the left one, and the first sample with 0.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static inline int
+VlzMed(int a, int b, int c)
+{
+    int mn = (a < b) ? a : b, mx = a ^ b ^ mn, p = a + b - c;
+
+    /* same as clamping the gradient, without branches */
+    p = (p < mn) ? mn : p;
+    return (p > mx) ? mx : p;
+}
+
+#define VLZ_PREDICT(cur, prev, x, y)				\
+    (((y) == 0) ? (((x) > 0) ? (cur)[(x) - 1] : 0) :		\
+     ((x) == 0) ? (prev)[0] :					\
+     VlzMed((cur)[(x) - 1], (prev)[x], (prev)[(x) - 1]))
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzCode8, VlzCode16 --
+ *
+ *	Code a plane of 8 or 16 bit samples row by row in blocks of
+ *	16 residuals, the last block of a row padded with zeros.
+ *	Returns the end of the output. With SSE2, 8 bit blocks with
+ *	all neighbors available are predicted 16 at a time.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static unsigned char *
+VlzCode8(const unsigned char *src, int w, int h, unsigned char *out)
+{
+    const unsigned char *cur, *prev;
+    unsigned char z[16];
+    int x, y, j, r;
+
+    for (y = 0; y < h; y++) {
+	cur = src + y * w;
+	prev = (y > 0) ? cur - w : cur;
+	for (x = 0; x < w; x += 16) {
+#ifdef __SSE2__
+	    if ((y > 0) && (x > 0) && (x + 16 <= w)) {
+		__m128i va, vb, vc, mn, mx, vr;
+
+		va = _mm_loadu_si128((__m128i *) (cur + x - 1));
+		vb = _mm_loadu_si128((__m128i *) (prev + x));
+		vc = _mm_loadu_si128((__m128i *) (prev + x - 1));
+		mn = _mm_min_epu8(va, vb);
+		mx = _mm_max_epu8(va, vb);
+		/* clamp(a + b - c, mn, mx) == clamp(mn + mx - c, ...) */
+		vr = _mm_min_epu8(_mm_adds_epu8(mn, _mm_subs_epu8(mx, vc)),
+				  mx);
+		vr = _mm_sub_epi8(_mm_loadu_si128((__m128i *) (cur + x)), vr);
+		vr = _mm_xor_si128(_mm_add_epi8(vr, vr),
+				   _mm_cmplt_epi8(vr, _mm_setzero_si128()));
+		_mm_storeu_si128((__m128i *) z, vr);
+		out = VlzPack8(z, out);
+		continue;
+	    }
+#endif
+	    for (j = 0; j < 16; j++) {
+		if (x + j >= w) {
+		    z[j] = 0;
+		    continue;
+		}
+		r = (cur[x + j] - VLZ_PREDICT(cur, prev, x + j, y)) & 0xff;
+		z[j] = (r << 1) ^ ((r & 0x80) ? 0xff : 0);
+	    }
+	    out = VlzPack8(z, out);
+	}
+    }
+    return out;
+}
+
+static unsigned char *
+VlzCode16(const unsigned short *src, int w, int h, unsigned char *out)
+{
+    const unsigned short *cur, *prev;
+    unsigned short z[16];
+    int x, y, j, r;
+
+    for (y = 0; y < h; y++) {
+	cur = src + y * w;
+	prev = (y > 0) ? cur - w : cur;
+	for (x = 0; x < w; x += 16) {
+	    for (j = 0; j < 16; j++) {
+		if (x + j >= w) {
+		    z[j] = 0;
+		    continue;
+		}
+		r = (cur[x + j] - VLZ_PREDICT(cur, prev, x + j, y)) & 0xffff;
+		z[j] = (r << 1) ^ ((r & 0x8000) ? 0xffff : 0);
+	    }
+	    out = VlzPack16(z, out);
+	}
+    }
+    return out;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzDecode8, VlzDecode16 --
+ *
+ *	Decode a plane coded by VlzCode8 or VlzCode16 from len bytes.
+ *	Returns -1 with errno set when the data is invalid.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+VlzDecode8(const unsigned char *in, int len, int w, int h,
+	   unsigned char *dst)
+{
+    const unsigned char *end = in + len;
+    unsigned char *cur, *prev;
+    unsigned short z[16];
+    int x, y, j, n;
+
+    for (y = 0; y < h; y++) {
+	cur = dst + y * w;
+	prev = (y > 0) ? cur - w : cur;
+	for (x = 0; x < w; x += 16) {
+	    in = VlzUnpack(in, end, 8, z);
+	    if (in == NULL) {
+		errno = EINVAL;
+		return -1;
+	    }
+	    n = (w - x < 16) ? w - x : 16;
+	    j = 0;
+	    if (x == 0) {
+		cur[0] = ((y > 0) ? prev[0] : 0) + ((z[0] >> 1) ^ -(z[0] & 1));
+		j = 1;
+	    }
+	    for (; j < n; j++) {
+		cur[x + j] = ((y > 0) ? VlzMed(cur[x + j - 1], prev[x + j],
+					       prev[x + j - 1]) :
+			      cur[x + j - 1]) + ((z[j] >> 1) ^ -(z[j] & 1));
+	    }
+	}
+    }
+    return 0;
+}
+
+static int
+VlzDecode16(const unsigned char *in, int len, int w, int h,
+	    unsigned short *dst)
+{
+    const unsigned char *end = in + len;
+    unsigned short *cur, *prev;
+    unsigned short z[16];
+    int x, y, j, n;
+
+    for (y = 0; y < h; y++) {
+	cur = dst + y * w;
+	prev = (y > 0) ? cur - w : cur;
+	for (x = 0; x < w; x += 16) {
+	    in = VlzUnpack(in, end, 16, z);
+	    if (in == NULL) {
+		errno = EINVAL;
+		return -1;
+	    }
+	    n = (w - x < 16) ? w - x : 16;
+	    j = 0;
+	    if (x == 0) {
+		cur[0] = ((y > 0) ? prev[0] : 0) + ((z[0] >> 1) ^ -(z[0] & 1));
+		j = 1;
+	    }
+	    for (; j < n; j++) {
+		cur[x + j] = ((y > 0) ? VlzMed(cur[x + j - 1], prev[x + j],
+					       prev[x + j - 1]) :
+			      cur[x + j - 1]) + ((z[j] >> 1) ^ -(z[j] & 1));
+	    }
+	}
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzGet32 --
+ *
+ *	Fetch a little endian value.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static unsigned int
+VlzGet32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzEncode --
+ *
+ *	Code a queued frame including its frame header. Packed YUV
+ *	is split into Y, U, and V planes, RGB into G, R-G, and B-G.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+VlzEncode(VVLZW *vlz, VVLZQ *q)
+{
+    unsigned char *p, *end, *planes[3], *raw = q->raw, *tmp = q->tmp;
+    int pw[3], wide, np, i, n = vlz->width * vlz->height;
+    Tcl_WideInt usecs;
+
+    np = VlzPlanes(vlz->format, vlz->width, vlz->height, pw, &wide, &i);
+    planes[0] = raw;
+    switch (vlz->format) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	planes[0] = tmp;
+	planes[1] = tmp + n;
+	planes[2] = tmp + n + n / 2;
+	Deinterleave(raw, tmp, tmp + 2 * n, n);
+	Deinterleave(tmp + 2 * n, planes[1], planes[2], n / 2);
+	break;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+	planes[0] = tmp;
+	planes[1] = tmp + n;
+	planes[2] = tmp + 2 * n;
+	for (i = 0; i < n; i++) {
+	    tmp[i] = raw[1];
+	    tmp[n + i] = raw[0] - raw[1];
+	    tmp[2 * n + i] = raw[2] - raw[1];
+	    raw += 3;
+	}
+	break;
+    }
+    p = q->enc + VLZ_FRAMEHDR;
+    for (i = 0; i < np; i++) {
+	if (wide) {
+	    end = VlzCode16((unsigned short *) planes[i], pw[i], vlz->height,
+			    p + 4);
+	} else {
+	    end = VlzCode8(planes[i], pw[i], vlz->height, p + 4);
+	}
+	AviPut32(p, end - p - 4);
+	p = end;
+    }
+    q->encLen = p - q->enc;
+    usecs = (Tcl_WideInt) (q->time * 1000000.0);
+    p = AviFcc(q->enc, "VLZF");
+    p = AviPut32(p, q->encLen - VLZ_FRAMEHDR);
+    p = AviPut32(p, q->sequence);
+    p = AviPut32(p, 0);
+    AviPut64(p, usecs);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzFlush --
+ *
+ *	Append coded frames from the head of the queue in order.
+ *	Called with the mutex held; only one thread writes at a
+ *	time, which continues as long as the next frame is ready.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+VlzFlush(VVLZW *vlz)
+{
+    VVLZQ *q;
+    int n = -1;
+
+    while (!vlz->writing && (vlz->count > 0) && vlz->queue[vlz->head].done) {
+	q = &vlz->queue[vlz->head];
+	vlz->writing = 1;
+	Tcl_MutexUnlock(&vlz->mutex);
+	if (!vlz->broken) {
+	    n = Y4MWrite(vlz->fd, q->enc, q->encLen);
+	}
+	Tcl_MutexLock(&vlz->mutex);
+	vlz->writing = 0;
+	if (vlz->broken || (n < 0)) {
+	    /* a partly written frame ends the usable file */
+	    vlz->broken = 1;
+	    vlz->errors++;
+	} else {
+	    vlz->written++;
+	    vlz->bytes += q->encLen;
+	}
+	q->done = 0;
+	vlz->head = (vlz->head + 1) % VLZ_DEPTH;
+	vlz->count--;
+	vlz->claimed--;
+    }
+}
+
+#ifdef TCL_THREADS
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzThread --
+ *
+ *	Coding thread of a VLZ file: takes the next queued frame,
+ *	codes it, and writes the frames which are ready, until told
+ *	to terminate, after the queue is drained.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType
+VlzThread(ClientData clientData)
+{
+    VVLZW *vlz = (VVLZW *) clientData;
+    VVLZQ *q;
+
+    Tcl_MutexLock(&vlz->mutex);
+    for (;;) {
+	while ((vlz->claimed >= vlz->count) && !vlz->stop) {
+	    Tcl_ConditionWait(&vlz->cond, &vlz->mutex, NULL);
+	}
+	if (vlz->claimed >= vlz->count) {
+	    break;
+	}
+	q = &vlz->queue[(vlz->head + vlz->claimed) % VLZ_DEPTH];
+	vlz->claimed++;
+	Tcl_MutexUnlock(&vlz->mutex);
+	VlzEncode(vlz, q);
+	Tcl_MutexLock(&vlz->mutex);
+	q->done = 1;
+	VlzFlush(vlz);
+    }
+    Tcl_MutexUnlock(&vlz->mutex);
+    TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzFrame --
+ *
+ *	Queue a copy of the last ready frame of a device for the
+ *	coding threads, or code and write it directly without them.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+VlzFrame(V4L2C *v4l2c)
+{
+    VVLZW *vlz = v4l2c->vlz;
+    VVLZQ *q;
+    unsigned char *src;
+    int y, rowLen, stride;
+
+    if (v4l2c->bufrdy < 0) {
+	return;
+    }
+    Tcl_MutexLock(&vlz->mutex);
+    if ((vlz->count >= VLZ_DEPTH) || (v4l2c->format != vlz->format) ||
+	(v4l2c->width != vlz->width) || (v4l2c->height != vlz->height)) {
+	vlz->dropped++;
+	Tcl_MutexUnlock(&vlz->mutex);
+	return;
+    }
+    if (v4l2c->vbufs[v4l2c->bufrdy].length < vlz->rawSize) {
+	vlz->errors++;
+	Tcl_MutexUnlock(&vlz->mutex);
+	return;
+    }
+    q = &vlz->queue[(vlz->head + vlz->count) % VLZ_DEPTH];
+    Tcl_MutexUnlock(&vlz->mutex);
+    /* single plane formats, pack lines padded by the driver */
+    src = (unsigned char *) v4l2c->vbufs[v4l2c->bufrdy].start;
+    rowLen = vlz->rawSize / vlz->height;
+    stride = FrameStride(v4l2c, rowLen);
+    if (stride == rowLen) {
+	memcpy(q->raw, src, vlz->rawSize);
+    } else {
+	for (y = 0; y < vlz->height; y++) {
+	    memcpy(q->raw + y * rowLen, src + y * stride, rowLen);
+	}
+    }
+    q->sequence = v4l2c->rdySeq;
+    q->time = v4l2c->rdyTime;
+    Tcl_MutexLock(&vlz->mutex);
+    vlz->count++;
+    if (vlz->nthreads > 0) {
+	Tcl_ConditionNotify(&vlz->cond);
+    } else {
+	vlz->claimed++;
+	Tcl_MutexUnlock(&vlz->mutex);
+	VlzEncode(vlz, q);
+	Tcl_MutexLock(&vlz->mutex);
+	q->done = 1;
+	VlzFlush(vlz);
+    }
+    Tcl_MutexUnlock(&vlz->mutex);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzStart, VlzStop --
+ *
+ *	Start writing the frames of a capture device losslessly
+ *	coded to a VLZ file, or stop it after pending frames are
+ *	written.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+VlzStop(V4L2C *v4l2c)
+{
+    VVLZW *vlz = v4l2c->vlz;
+    int i;
+
+    if (vlz == NULL) {
+	return;
+    }
+#ifdef TCL_THREADS
+    if (vlz->nthreads > 0) {
+	int result;
+
+	Tcl_MutexLock(&vlz->mutex);
+	vlz->stop = 1;
+	Tcl_ConditionNotify(&vlz->cond);
+	Tcl_MutexUnlock(&vlz->mutex);
+	for (i = 0; i < vlz->nthreads; i++) {
+	    Tcl_JoinThread(vlz->threads[i], &result);
+	}
+    }
+    Tcl_ConditionFinalize(&vlz->cond);
+#endif
+    Tcl_MutexFinalize(&vlz->mutex);
+    close(vlz->fd);
+    for (i = 0; i < VLZ_DEPTH; i++) {
+	if (vlz->queue[i].raw != NULL) {
+	    ckfree(vlz->queue[i].raw);
+	}
+	if (vlz->queue[i].tmp != NULL) {
+	    ckfree(vlz->queue[i].tmp);
+	}
+	if (vlz->queue[i].enc != NULL) {
+	    ckfree(vlz->queue[i].enc);
+	}
+    }
+    Tcl_DStringFree(&vlz->path);
+    ckfree((char *) vlz);
+    v4l2c->vlz = NULL;
+}
+
+static int
+VlzStart(Tcl_Interp *interp, V4L2C *v4l2c, const char *path)
+{
+    VVLZW *vlz;
+    unsigned char header[VLZ_HDRSIZE], *p;
+    int i, np, wide, pw[3], rawSize, encSize, tmpSize;
+
+    np = VlzPlanes(v4l2c->format, v4l2c->width, v4l2c->height, pw, &wide,
+		   &rawSize);
+    if (np == 0) {
+	Tcl_SetResult(interp, "unsupported pixel format", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if ((v4l2c->width <= 0) || (v4l2c->height <= 0)) {
+	Tcl_SetResult(interp, "unknown frame size", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    VlzStop(v4l2c);
+    vlz = (VVLZW *) ckalloc(sizeof (VVLZW));
+    memset(vlz, 0, sizeof (VVLZW));
+    Tcl_DStringInit(&vlz->path);
+    Tcl_DStringAppend(&vlz->path, path, -1);
+    vlz->format = v4l2c->format;
+    vlz->width = v4l2c->width;
+    vlz->height = v4l2c->height;
+    vlz->rawSize = rawSize;
+    /* planes, for YUYV plus interleaved chroma */
+    tmpSize = (np > 1) ? vlz->width * vlz->height * 3 : 0;
+    /* worst case: all blocks with full width */
+    encSize = VLZ_FRAMEHDR;
+    for (i = 0; i < np; i++) {
+	encSize += 4 + vlz->height * ((pw[i] + 15) / 16) * (wide ? 33 : 17);
+    }
+    for (i = 0; i < VLZ_DEPTH; i++) {
+	vlz->queue[i].raw = attemptckalloc(vlz->rawSize);
+	vlz->queue[i].enc = attemptckalloc(encSize);
+	if (tmpSize > 0) {
+	    vlz->queue[i].tmp = attemptckalloc(tmpSize);
+	}
+	if ((vlz->queue[i].raw == NULL) || (vlz->queue[i].enc == NULL) ||
+	    ((tmpSize > 0) && (vlz->queue[i].tmp == NULL))) {
+	    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    goto error;
+	}
+    }
+    vlz->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (vlz->fd < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error opening \"%s\": %s", path,
+				       Tcl_PosixError(interp)));
+	goto error;
+    }
+    memset(header, 0, sizeof (header));
+    p = AviFcc(header, "V4L2");
+    p = AviFcc(p, "VLZ1");
+    p = AviPut32(p, vlz->format);
+    p = AviPut32(p, vlz->width);
+    p = AviPut32(p, vlz->height);
+    AviPut32(p, (v4l2c->fps > 0) ? v4l2c->fps : 15);
+    if (Y4MWrite(vlz->fd, header, VLZ_HDRSIZE) < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error writing \"%s\": %s", path,
+				       Tcl_PosixError(interp)));
+	close(vlz->fd);
+	goto error;
+    }
+#ifdef TCL_THREADS
+    {
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+	ncpu = (ncpu > VLZ_MAXTHREADS) ? VLZ_MAXTHREADS :
+	    (ncpu < 1) ? 1 : ncpu;
+	for (i = 0; i < ncpu; i++) {
+	    if (Tcl_CreateThread(&vlz->threads[vlz->nthreads], VlzThread,
+				 (ClientData) vlz, TCL_THREAD_STACK_DEFAULT,
+				 TCL_THREAD_JOINABLE) == TCL_OK) {
+		vlz->nthreads++;
+	    }
+	}
+    }
+#endif
+    v4l2c->vlz = vlz;
+    return TCL_OK;
+
+error:
+    for (i = 0; i < VLZ_DEPTH; i++) {
+	if (vlz->queue[i].raw != NULL) {
+	    ckfree(vlz->queue[i].raw);
+	}
+	if (vlz->queue[i].tmp != NULL) {
+	    ckfree(vlz->queue[i].tmp);
+	}
+	if (vlz->queue[i].enc != NULL) {
+	    ckfree(vlz->queue[i].enc);
+	}
+    }
+    Tcl_DStringFree(&vlz->path);
+    ckfree((char *) vlz);
+    return TCL_ERROR;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzOpen, VlzClose --
+ *
+ *	Open a VLZ file for reading and locate its frames; a frame
+ *	truncated at the end is ignored. Returns NULL with a message
+ *	in the interpreter on error. VlzClose releases the reader.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+VlzClose(VVLZR *vlr)
+{
+    close(vlr->fd);
+    if (vlr->offsets != NULL) {
+	ckfree((char *) vlr->offsets);
+    }
+    if (vlr->enc != NULL) {
+	ckfree(vlr->enc);
+    }
+    if (vlr->tmp != NULL) {
+	ckfree(vlr->tmp);
+    }
+    ckfree((char *) vlr);
+}
+
+static VVLZR *
+VlzOpen(Tcl_Interp *interp, const char *path)
+{
+    VVLZR *vlr;
+    unsigned char hdr[VLZ_HDRSIZE];
+    struct stat st;
+    Tcl_WideInt pos;
+    int fd, wide, pw[3], maxFrames = 0;
+    unsigned int len;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error opening \"%s\": %s", path,
+				       Tcl_PosixError(interp)));
+	return NULL;
+    }
+    if ((read(fd, hdr, VLZ_HDRSIZE) != VLZ_HDRSIZE) ||
+	(memcmp(hdr, "V4L2VLZ1", 8) != 0) || (fstat(fd, &st) < 0)) {
+	close(fd);
+	Tcl_SetResult(interp, "not a VLZ file", TCL_STATIC);
+	return NULL;
+    }
+    vlr = (VVLZR *) ckalloc(sizeof (VVLZR));
+    memset(vlr, 0, sizeof (VVLZR));
+    vlr->fd = fd;
+    vlr->format = VlzGet32(hdr + 8);
+    vlr->width = VlzGet32(hdr + 12);
+    vlr->height = VlzGet32(hdr + 16);
+    vlr->fps = VlzGet32(hdr + 20);
+    if ((vlr->width <= 0) || (vlr->height <= 0) ||
+	(vlr->width > 16384) || (vlr->height > 16384) ||
+	(VlzPlanes(vlr->format, vlr->width, vlr->height, pw, &wide,
+		   &vlr->rawSize) == 0)) {
+	VlzClose(vlr);
+	Tcl_SetResult(interp, "unsupported VLZ file", TCL_STATIC);
+	return NULL;
+    }
+    if (pw[1] < pw[0]) {
+	vlr->tmp = attemptckalloc(vlr->width * vlr->height * 3);
+    } else {
+	vlr->tmp = attemptckalloc(vlr->rawSize);
+    }
+    if (vlr->tmp == NULL) {
+	VlzClose(vlr);
+	Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	return NULL;
+    }
+    pos = VLZ_HDRSIZE;
+    while (pos + VLZ_FRAMEHDR <= st.st_size) {
+	if ((pread(fd, hdr, VLZ_FRAMEHDR, (off_t) pos) != VLZ_FRAMEHDR) ||
+	    (memcmp(hdr, "VLZF", 4) != 0)) {
+	    break;
+	}
+	len = VlzGet32(hdr + 4);
+	if (pos + VLZ_FRAMEHDR + len > st.st_size) {
+	    break;
+	}
+	if (vlr->nframes >= maxFrames) {
+	    maxFrames = maxFrames ? maxFrames * 2 : 1024;
+	    vlr->offsets = (Tcl_WideInt *)
+		ckrealloc((char *) vlr->offsets,
+			  maxFrames * sizeof (Tcl_WideInt));
+	}
+	vlr->offsets[vlr->nframes++] = pos;
+	if (len + VLZ_FRAMEHDR > vlr->encLen) {
+	    vlr->encLen = len + VLZ_FRAMEHDR;
+	}
+	pos += VLZ_FRAMEHDR + len;
+    }
+    if (vlr->encLen > 0) {
+	vlr->enc = attemptckalloc(vlr->encLen);
+	if (vlr->enc == NULL) {
+	    VlzClose(vlr);
+	    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    return NULL;
+	}
+    }
+    return vlr;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzRead --
+ *
+ *	Read and decode the next frame into raw in the recorded
+ *	pixel format. Returns 1 on success, 0 at end of file, or -1
+ *	with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+VlzRead(VVLZR *vlr, unsigned char *raw, unsigned int *seqPtr,
+	double *timePtr)
+{
+    unsigned char *p, *end, *planes[3];
+    int i, np, wide, pw[3], n = vlr->width * vlr->height;
+    unsigned int len;
+    Tcl_WideInt off;
+
+    if (vlr->pos >= vlr->nframes) {
+	return 0;
+    }
+    off = vlr->offsets[vlr->pos];
+    if (pread(vlr->fd, vlr->enc, VLZ_FRAMEHDR, (off_t) off) != VLZ_FRAMEHDR) {
+	return -1;
+    }
+    len = VlzGet32(vlr->enc + 4);
+    if (pread(vlr->fd, vlr->enc + VLZ_FRAMEHDR, len,
+	      (off_t) off + VLZ_FRAMEHDR) != len) {
+	errno = EIO;
+	return -1;
+    }
+    *seqPtr = VlzGet32(vlr->enc + 8);
+    *timePtr = (double) ((Tcl_WideInt) VlzGet32(vlr->enc + 16) |
+			 ((Tcl_WideInt) VlzGet32(vlr->enc + 20) << 32)) /
+	1000000.0;
+    np = VlzPlanes(vlr->format, vlr->width, vlr->height, pw, &wide, &i);
+    planes[0] = vlr->tmp;
+    planes[1] = vlr->tmp + n;
+    planes[2] = vlr->tmp + 2 * n;
+    p = vlr->enc + VLZ_FRAMEHDR;
+    end = p + len;
+    for (i = 0; i < np; i++) {
+	if (end - p < 4) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	len = VlzGet32(p);
+	p += 4;
+	if (len > end - p) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	if (wide) {
+	    if (VlzDecode16(p, len, pw[i], vlr->height,
+			    (unsigned short *) planes[i]) < 0) {
+		return -1;
+	    }
+	} else if (VlzDecode8(p, len, pw[i], vlr->height, planes[i]) < 0) {
+	    return -1;
+	}
+	p += len;
+    }
+    switch (vlr->format) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+	for (i = 0; i < n / 2; i++) {
+	    raw[0] = planes[0][2 * i];
+	    raw[1] = planes[1][i];
+	    raw[2] = planes[0][2 * i + 1];
+	    raw[3] = planes[2][i];
+	    raw += 4;
+	}
+	break;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+	for (i = 0; i < n; i++) {
+	    raw[1] = planes[0][i];
+	    raw[0] = planes[1][i] + planes[0][i];
+	    raw[2] = planes[2][i] + planes[0][i];
+	    raw += 3;
+	}
+	break;
+    default:
+	memcpy(raw, vlr->tmp, vlr->rawSize);
+	break;
+    }
+    vlr->pos++;
+    return 1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * VlzCmd --
+ *
+ *	Implements "v4l2 vlz": open, info, read, seek, and close of
+ *	VLZ files written by "v4l2 record".
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+VlzCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    Tcl_HashEntry *hPtr;
+    VVLZR *vlr;
+    int command, isNew, n;
+
+    static const char *vlzNames[] = {
+	"close", "info", "open", "read", "seek", NULL
+    };
+    enum vlzCode {
+	VLZ_close, VLZ_info, VLZ_open, VLZ_read, VLZ_seek
+    };
+
+    if (objc < 4) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option arg ...");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], vlzNames, "option", 0,
+			    &command) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (command == VLZ_open) {
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "file");
+	    return TCL_ERROR;
+	}
+	vlr = VlzOpen(interp, Tcl_GetString(objv[3]));
+	if (vlr == NULL) {
+	    return TCL_ERROR;
+	}
+	sprintf(vlr->vlzId, "vlz%d", v4l2i->vlzCount++);
+	hPtr = Tcl_CreateHashEntry(&v4l2i->vlz, vlr->vlzId, &isNew);
+	Tcl_SetHashValue(hPtr, (ClientData) vlr);
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(vlr->vlzId, -1));
+	return TCL_OK;
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->vlz, Tcl_GetString(objv[3]));
+    if (hPtr == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("VLZ reader \"%s\" not found",
+			  Tcl_GetString(objv[3])));
+	return TCL_ERROR;
+    }
+    vlr = (VVLZR *) Tcl_GetHashValue(hPtr);
+    switch ((enum vlzCode) command) {
+    case VLZ_close:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "vlzid");
+	    return TCL_ERROR;
+	}
+	Tcl_DeleteHashEntry(hPtr);
+	VlzClose(vlr);
+	break;
+    case VLZ_info: {
+	Tcl_Obj *list[10];
+	char fcbuf[8];
+
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "vlzid");
+	    return TCL_ERROR;
+	}
+	list[0] = Tcl_NewStringObj("width", -1);
+	list[1] = Tcl_NewIntObj(vlr->width);
+	list[2] = Tcl_NewStringObj("height", -1);
+	list[3] = Tcl_NewIntObj(vlr->height);
+	list[4] = Tcl_NewStringObj("fps", -1);
+	list[5] = Tcl_NewIntObj(vlr->fps);
+	list[6] = Tcl_NewStringObj("format", -1);
+	list[7] = Tcl_NewStringObj(fourcc_str(vlr->format, fcbuf) + 1, -1);
+	list[8] = Tcl_NewStringObj("frames", -1);
+	list[9] = Tcl_NewIntObj(vlr->nframes);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(10, list));
+	break;
+    }
+    case VLZ_seek:
+	if (objc != 5) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "vlzid frame");
+	    return TCL_ERROR;
+	}
+	if (Tcl_GetIntFromObj(interp, objv[4], &n) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if ((n < 0) || (n > vlr->nframes)) {
+	    Tcl_SetResult(interp, "frame out of range", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	vlr->pos = n;
+	break;
+    case VLZ_read: {
+	Tcl_Obj *list[6];
+	unsigned int seq = 0;
+	double time = 0;
+
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "vlzid");
+	    return TCL_ERROR;
+	}
+	list[1] = Tcl_NewByteArrayObj(NULL, 0);
+	Tcl_IncrRefCount(list[1]);
+	n = VlzRead(vlr, Tcl_SetByteArrayLength(list[1], vlr->rawSize),
+		    &seq, &time);
+	if (n <= 0) {
+	    Tcl_DecrRefCount(list[1]);
+	    if (n < 0) {
+		Tcl_SetObjResult(interp,
+				 Tcl_ObjPrintf("error reading frame: %s",
+					       Tcl_PosixError(interp)));
+		return TCL_ERROR;
+	    }
+	    break;
+	}
+	list[0] = Tcl_NewStringObj("data", -1);
+	list[2] = Tcl_NewStringObj("timestamp", -1);
+	list[3] = Tcl_NewDoubleObj(time);
+	list[4] = Tcl_NewStringObj("sequence", -1);
+	list[5] = Tcl_NewWideIntObj(seq);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(6, list));
+	Tcl_DecrRefCount(list[1]);
+	break;
+    }
+    default:
+	break;
+    }
+    return TCL_OK;
+}
+
+#ifdef USE_MJPEG
+/*
+ *-------------------------------------------------------------------------
+ *
+ * JpegFrame --
+ *
+ *	Compress the last ready frame of a capture device to JPEG,
+ *	decimated by scale. Unrotated YUYV and YVYU frames are fed as
+ *	raw 4:2:2 data and grey frames as is, stepping lines by the
+ *	driver's bytes per line, everything else goes through an RGB
+ *	image block. The output buffer is kept with the compressor
+ *	and grown when libjpeg had to switch to its own. Returns a byte
+ *	array or NULL with errno set on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+JpegFrame(V4L2C *v4l2c, int quality, int scale)
+{
+    struct VJPEG *enc;
+    Tk_PhotoImageBlock blk;
+    unsigned char *src, *toFree = NULL, *mem, *p, *q, *dst;
+    unsigned long memLen;
+    JSAMPROW rows[3][8];
+    JSAMPARRAY planes[3];
+    int x, y, i, h, ow, oh, pad, uOff, length, stride = 0;
+    /* volatile as live across setjmp() */
+    volatile int w, space;
+    Tcl_Obj *volatile result = NULL;
+
+    src = (unsigned char *) v4l2c->vbufs[v4l2c->bufrdy].start;
+    length = v4l2c->rdyUsed;
+    if ((length <= 0) || (length > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	length = v4l2c->vbufs[v4l2c->bufrdy].length;
+    }
+    w = v4l2c->width;
+    h = v4l2c->height;
+    space = JCS_RGB;
+    if ((v4l2c->rotate == 0) && ((v4l2c->mirror & 3) == 0)) {
+	if (((v4l2c->format == V4L2_PIX_FMT_YUYV) ||
+	     (v4l2c->format == V4L2_PIX_FMT_YVYU)) && (length >= w * h * 2)) {
+	    space = JCS_YCbCr;
+	    stride = FrameStride(v4l2c, w * 2);
+	} else if ((v4l2c->format == V4L2_PIX_FMT_GREY) &&
+		   (length >= w * h)) {
+	    space = JCS_GRAYSCALE;
+	    stride = FrameStride(v4l2c, w);
+	}
+    }
+    if (space == JCS_RGB) {
+	if (FrameBlock(v4l2c, &blk, &toFree) < 0) {
+	    return NULL;
+	}
+	OrientBlock(&blk, v4l2c->rotate, v4l2c->mirror);
+	w = blk.width;
+	h = blk.height;
+    }
+    ow = (w / scale > 0) ? w / scale : 1;
+    oh = (h / scale > 0) ? h / scale : 1;
+    /* luma rows padded to the 16 pixel MCU width */
+    pad = (ow + 15) & ~15;
+    enc = JpegSetup(v4l2c, space, quality);
+    if ((enc == NULL) ||
+	(JpegLine(enc, (space == JCS_YCbCr) ? 16 * pad : 3 * ow) < 0)) {
+	errno = ENOMEM;
+	goto done;
+    }
+    mem = enc->out;
+    memLen = enc->outLen;
+    if (setjmp(enc->jerr.jmp)) {
+	jpeg_abort_compress(&enc->cinfo);
+	if (mem != enc->out) {
+	    free(mem);
+	}
+	errno = EIO;
+	goto done;
+    }
+    enc->cinfo.image_width = ow;
+    enc->cinfo.image_height = oh;
+    jpeg_mem_dest(&enc->cinfo, &mem, &memLen);
+    jpeg_start_compress(&enc->cinfo, TRUE);
+    if (space == JCS_YCbCr) {
+	uOff = (v4l2c->format == V4L2_PIX_FMT_YVYU) ? 3 : 1;
+	for (i = 0; i < 8; i++) {
+	    rows[0][i] = enc->line + i * pad;
+	    rows[1][i] = enc->line + 8 * pad + i * (pad / 2);
+	    rows[2][i] = enc->line + 12 * pad + i * (pad / 2);
+	}
+	planes[0] = rows[0];
+	planes[1] = rows[1];
+	planes[2] = rows[2];
+	for (y = 0; y < oh; y += 8) {
+	    for (i = 0; i < 8; i++) {
+		if (y + i >= oh) {
+		    /* repeat last row to fill the MCU row */
+		    memcpy(rows[0][i], rows[0][i - 1], pad);
+		    memcpy(rows[1][i], rows[1][i - 1], pad / 2);
+		    memcpy(rows[2][i], rows[2][i - 1], pad / 2);
+		    continue;
+		}
+		p = src + (y + i) * scale * stride;
+		dst = rows[0][i];
+		for (x = 0; x < ow; x++) {
+		    dst[x] = p[x * scale * 2];
+		}
+		memset(dst + ow, dst[ow - 1], pad - ow);
+		dst = rows[1][i];
+		q = rows[2][i];
+		for (x = 0; 2 * x < ow; x++) {
+		    dst[x] = p[x * scale * 4 + uOff];
+		    q[x] = p[x * scale * 4 + 4 - uOff];
+		}
+		memset(dst + x, dst[x - 1], pad / 2 - x);
+		memset(q + x, q[x - 1], pad / 2 - x);
+	    }
+	    jpeg_write_raw_data(&enc->cinfo, planes, 8);
+	}
+    } else if (space == JCS_GRAYSCALE) {
+	for (y = 0; y < oh; y++) {
+	    p = src + y * scale * stride;
+	    if (scale == 1) {
+		rows[0][0] = p;
+	    } else {
+		for (x = 0; x < ow; x++) {
+		    enc->line[x] = p[x * scale];
+		}
+		rows[0][0] = enc->line;
+	    }
+	    jpeg_write_scanlines(&enc->cinfo, rows[0], 1);
+	}
+    } else {
+	rows[0][0] = enc->line;
+	for (y = 0; y < oh; y++) {
+	    p = blk.pixelPtr + y * scale * blk.pitch;
+	    dst = enc->line;
+	    for (x = 0; x < ow; x++) {
+		dst[0] = p[blk.offset[0]];
+		dst[1] = p[blk.offset[1]];
+		dst[2] = p[blk.offset[2]];
+		dst += 3;
+		p += scale * blk.pixelSize;
+	    }
+	    jpeg_write_scanlines(&enc->cinfo, rows[0], 1);
+	}
+    }
+    jpeg_finish_compress(&enc->cinfo);
+    result = Tcl_NewByteArrayObj(mem, memLen);
+    if (mem != enc->out) {
+	/* libjpeg switched to its own buffer, grow ours */
+	free(mem);
+	if (enc->out != NULL) {
+	    ckfree(enc->out);
+	}
+	enc->outLen = memLen + memLen / 4;
+	enc->out = attemptckalloc(enc->outLen);
+	if (enc->out == NULL) {
+	    enc->outLen = 0;
+	}
+    }
+done:
+    if (toFree != NULL) {
+	ckfree(toFree);
+    }
+    return result;
+}
+#endif
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * JpegCmd --
+ *
+ *	Implements "v4l2 jpeg": the last ready frame of a capture
+ *	device as JPEG data. Frames of MJPEG devices are returned as
+ *	delivered by the driver, other formats are compressed with the
+ *	compressor kept with the device.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+JpegCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    Tcl_HashEntry *hPtr;
+    V4L2C *v4l2c;
+    Tcl_Obj *data;
+    int i, length, quality = JPEG_QUALITY, scale = 1;
+
+    if ((objc < 3) || (objc % 2 == 0)) {
+	Tcl_WrongNumArgs(interp, 2, objv,
+			 "devid ?-quality q? ?-scale s?");
+	return TCL_ERROR;
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+    if (hPtr == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("device \"%s\" not found", Tcl_GetString(objv[2])));
+	return TCL_ERROR;
+    }
+    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+    for (i = 3; i < objc; i += 2) {
+	char *opt = Tcl_GetString(objv[i]);
+
+	if (strcmp(opt, "-quality") == 0) {
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &quality) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(opt, "-scale") == 0) {
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &scale) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("bad option \"%s\": must be -quality "
+			      "or -scale", opt));
+	    return TCL_ERROR;
+	}
+    }
+    if ((quality < 1) || (quality > 100)) {
+	Tcl_SetResult(interp, "quality must be in 1..100", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if ((scale < 1) || (scale > 16)) {
+	Tcl_SetResult(interp, "scale must be in 1..16", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (IdleWakeup(v4l2c) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (v4l2c->bufrdy < 0) {
+	return TCL_OK;
+    }
+    if (v4l2c->format == V4L2_PIX_FMT_MJPEG) {
+	/* already JPEG, hand out as is */
+	length = v4l2c->rdyUsed;
+	if ((length <= 0) ||
+	    (length > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	    length = v4l2c->vbufs[v4l2c->bufrdy].length;
+	}
+	data = Tcl_NewByteArrayObj(v4l2c->vbufs[v4l2c->bufrdy].start, length);
+    } else if (IsCoded(v4l2c->format)) {
+	Tcl_SetResult(interp, "compressed format, use \"v4l2 packet\"",
+		      TCL_STATIC);
+	return TCL_ERROR;
+    } else {
+#ifdef USE_MJPEG
+	data = JpegFrame(v4l2c, quality, scale);
+	if (data == NULL) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("error encoding JPEG: %s",
+			      Tcl_PosixError(interp)));
+	    return TCL_ERROR;
+	}
+#else
+	Tcl_SetResult(interp, "JPEG support not available", TCL_STATIC);
+	return TCL_ERROR;
+#endif
+    }
+    Tcl_SetObjResult(interp, data);
+    if (!v4l2c->bufdone) {
+	v4l2c->bufdone = 1;
+	v4l2c->counters[1] += 1;
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * HttpRelease, HttpMask, HttpDrop --
+ *
+ *	Helpers of the MJPEG over HTTP server: release a reference to
+ *	a part, update the events of a client's file handler to its
+ *	pending output, and close a client.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#define HTTP_RESPONSE							\
+    "HTTP/1.0 200 OK\r\n"						\
+    "Connection: close\r\n"						\
+    "Cache-Control: no-cache, no-store\r\n"				\
+    "Pragma: no-cache\r\n"						\
+    "Content-Type: multipart/x-mixed-replace; boundary="		\
+    HTTP_BOUNDARY "\r\n\r\n"
+
+static void	HttpClientEvent(ClientData clientData, int mask);
+
+static void
+HttpRelease(VHTTPP *part)
+{
+    if (--part->refCount <= 0) {
+	ckfree((char *) part);
+    }
+}
+
+static void
+HttpMask(VHTTPC *c)
+{
+    int mask = TCL_READABLE;
+
+    if (c->streaming &&
+	((c->hdrOff < (int) sizeof (HTTP_RESPONSE) - 1) ||
+	 (c->part != NULL))) {
+	mask |= TCL_WRITABLE;
+    }
+    if (mask != c->mask) {
+	Tcl_CreateFileHandler(c->fd, mask, HttpClientEvent, (ClientData) c);
+	c->mask = mask;
+    }
+}
+
+static void
+HttpDrop(VHTTPC *c)
+{
+    VHTTP *http = c->http;
+    int i;
+
+    for (i = 0; i < http->nclients; i++) {
+	if (http->clients[i] == c) {
+	    http->clients[i] = http->clients[--http->nclients];
+	    break;
+	}
+    }
+    if (c->mask) {
+	Tcl_DeleteFileHandler(c->fd);
+    }
+    close(c->fd);
+    if (c->part != NULL) {
+	HttpRelease(c->part);
+    }
+    ckfree((char *) c);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * HttpSend --
+ *
+ *	Send pending response header and part of a client, gathered
+ *	in one non-blocking call, until done or the socket is full.
+ *	Returns -1 with errno set when the client is gone.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+HttpSend(VHTTPC *c)
+{
+    VHTTP *http = c->http;
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t n;
+    int k, niov, hdrLen = sizeof (HTTP_RESPONSE) - 1;
+
+    while (1) {
+	niov = 0;
+	if (c->hdrOff < hdrLen) {
+	    iov[niov].iov_base = (char *) HTTP_RESPONSE + c->hdrOff;
+	    iov[niov].iov_len = hdrLen - c->hdrOff;
+	    niov++;
+	}
+	if (c->part != NULL) {
+	    iov[niov].iov_base = c->part->data + c->partOff;
+	    iov[niov].iov_len = c->part->length - c->partOff;
+	    niov++;
+	}
+	if (niov == 0) {
+	    return 0;
+	}
+	memset(&msg, 0, sizeof (msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+	n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+		return 0;
+	    }
+	    return -1;
+	}
+	http->bytes += n;
+	if (c->hdrOff < hdrLen) {
+	    k = (n < hdrLen - c->hdrOff) ? n : hdrLen - c->hdrOff;
+	    c->hdrOff += k;
+	    n -= k;
+	}
+	if (c->part != NULL) {
+	    c->partOff += n;
+	    if (c->partOff >= c->part->length) {
+		HttpRelease(c->part);
+		c->part = NULL;
+		http->sent++;
+	    }
+	}
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * HttpClientEvent, HttpAccept --
+ *
+ *	File handlers of the MJPEG over HTTP server. A client starts
+ *	streaming once the empty line ending its request was read, any
+ *	request is answered with the stream. Further input is ignored
+ *	up to end of file. Connections beyond the client limit are
+ *	closed right away.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+HttpClientEvent(ClientData clientData, int mask)
+{
+    VHTTPC *c = (VHTTPC *) clientData;
+    char buf[512];
+    ssize_t n;
+
+    if (mask & TCL_READABLE) {
+	if (c->streaming) {
+	    n = read(c->fd, buf, sizeof (buf));
+	} else {
+	    n = read(c->fd, c->req + c->reqLen, HTTP_REQSIZE - 1 - c->reqLen);
+	}
+	if ((n == 0) ||
+	    ((n < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+	    HttpDrop(c);
+	    return;
+	}
+	if (!c->streaming && (n > 0)) {
+	    c->reqLen += n;
+	    c->req[c->reqLen] = '\0';
+	    if ((strstr(c->req, "\r\n\r\n") != NULL) ||
+		(strstr(c->req, "\n\n") != NULL)) {
+		c->streaming = 1;
+		mask |= TCL_WRITABLE;
+	    } else if (c->reqLen >= HTTP_REQSIZE - 1) {
+		HttpDrop(c);
+		return;
+	    }
+	}
+    }
+    if ((mask & TCL_WRITABLE) && c->streaming && (HttpSend(c) < 0)) {
+	HttpDrop(c);
+	return;
+    }
+    HttpMask(c);
+}
+
+static void
+HttpAccept(ClientData clientData, int mask)
+{
+    VHTTP *http = (VHTTP *) clientData;
+    VHTTPC *c;
+    int fd;
+
+    fd = accept(http->fd, NULL, NULL);
+    if (fd < 0) {
+	return;
+    }
+    if (http->nclients >= http->maxClients) {
+	close(fd);
+	return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c = (VHTTPC *) attemptckalloc(sizeof (VHTTPC));
+    if (c == NULL) {
+	close(fd);
+	return;
+    }
+    memset(c, 0, sizeof (VHTTPC));
+    c->http = http;
+    c->fd = fd;
+    http->clients[http->nclients++] = c;
+    HttpMask(c);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * HttpFrame --
+ *
+ *	Called for each captured frame of a device with an MJPEG over
+ *	HTTP server. Compresses the frame once, or takes it as is from
+ *	MJPEG devices, and hands the part to all idle clients. Busy
+ *	clients skip it. Nothing is compressed when no client is idle.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+HttpFrame(V4L2C *v4l2c)
+{
+    VHTTP *http = v4l2c->http;
+    VHTTPC *c;
+    VHTTPP *part;
+    Tcl_Obj *obj = NULL;
+    unsigned char *data;
+    char hdr[128];
+    int i, length, hdrLen, idle = 0;
+
+    for (i = 0; i < http->nclients; i++) {
+	c = http->clients[i];
+	if (c->streaming) {
+	    if (c->part == NULL) {
+		idle++;
+	    } else {
+		http->dropped++;
+	    }
+	}
+    }
+    if (idle == 0) {
+	return;
+    }
+    if (v4l2c->format == V4L2_PIX_FMT_MJPEG) {
+	data = (unsigned char *) v4l2c->vbufs[v4l2c->bufrdy].start;
+	length = v4l2c->rdyUsed;
+	if ((length <= 0) ||
+	    (length > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	    length = v4l2c->vbufs[v4l2c->bufrdy].length;
+	}
+    } else {
+#ifdef USE_MJPEG
+	if (!IsCoded(v4l2c->format)) {
+	    obj = JpegFrame(v4l2c, http->quality, http->scale);
+	}
+#endif
+	if (obj == NULL) {
+	    http->errors++;
+	    return;
+	}
+	Tcl_IncrRefCount(obj);
+	data = Tcl_GetByteArrayFromObj(obj, &length);
+    }
+    hdrLen = sprintf(hdr, "--%s\r\nContent-Type: image/jpeg\r\n"
+		     "Content-Length: %d\r\n\r\n", HTTP_BOUNDARY, length);
+    part = (VHTTPP *) attemptckalloc(sizeof (VHTTPP) + hdrLen + length + 2);
+    if (part == NULL) {
+	http->errors++;
+	goto done;
+    }
+    part->refCount = 1;
+    part->length = hdrLen + length + 2;
+    memcpy(part->data, hdr, hdrLen);
+    memcpy(part->data + hdrLen, data, length);
+    memcpy(part->data + hdrLen + length, "\r\n", 2);
+    http->frames++;
+    /* backwards, HttpDrop moves the last client into the gap */
+    for (i = http->nclients - 1; i >= 0; i--) {
+	c = http->clients[i];
+	if (!c->streaming || (c->part != NULL)) {
+	    continue;
+	}
+	part->refCount++;
+	c->part = part;
+	c->partOff = 0;
+	if (HttpSend(c) < 0) {
+	    HttpDrop(c);
+	} else {
+	    HttpMask(c);
+	}
+    }
+    HttpRelease(part);
+    /* counts as consumed for the idle policy */
+    Tcl_GetTime(&v4l2c->lastFetch);
+done:
+    if (obj != NULL) {
+	Tcl_DecrRefCount(obj);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * HttpStop, HttpStart --
+ *
+ *	Stop and start the MJPEG over HTTP server of a capture device.
+ *	The server listens on the given IPv4 address and port, port
+ *	zero picks a free one. HttpStart leaves the port number in the
+ *	interpreter result.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+HttpStop(V4L2C *v4l2c)
+{
+    VHTTP *http = v4l2c->http;
+
+    if (http == NULL) {
+	return;
+    }
+    while (http->nclients > 0) {
+	HttpDrop(http->clients[0]);
+    }
+    Tcl_DeleteFileHandler(http->fd);
+    close(http->fd);
+    ckfree((char *) http);
+    v4l2c->http = NULL;
+}
+
+static int
+HttpStart(Tcl_Interp *interp, V4L2C *v4l2c, int port, const char *address,
+	  int quality, int scale, int maxClients)
+{
+    VHTTP *http;
+    struct sockaddr_in sa;
+    socklen_t saLen;
+    int fd, on = 1;
+
+    memset(&sa, 0, sizeof (sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((address != NULL) && (inet_pton(AF_INET, address, &sa.sin_addr) != 1)) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("invalid address \"%s\"", address));
+	return TCL_ERROR;
+    }
+    HttpStop(v4l2c);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+	goto error;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+    saLen = sizeof (sa);
+    if ((bind(fd, (struct sockaddr *) &sa, sizeof (sa)) < 0) ||
+	(listen(fd, 8) < 0) ||
+	(getsockname(fd, (struct sockaddr *) &sa, &saLen) < 0)) {
+	goto error;
+    }
+    http = (VHTTP *) ckalloc(sizeof (VHTTP));
+    memset(http, 0, sizeof (VHTTP));
+    http->v4l2c = v4l2c;
+    http->fd = fd;
+    http->port = ntohs(sa.sin_port);
+    http->quality = quality;
+    http->scale = scale;
+    http->maxClients = maxClients;
+    v4l2c->http = http;
+    Tcl_CreateFileHandler(fd, TCL_READABLE, HttpAccept, (ClientData) http);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(http->port));
+    return TCL_OK;
+
+error:
+    Tcl_SetObjResult(interp,
+	Tcl_ObjPrintf("error starting server: %s", Tcl_PosixError(interp)));
+    if (fd >= 0) {
+	close(fd);
+    }
+    return TCL_ERROR;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * HttpdCmd --
+ *
+ *	Implements "v4l2 httpd": start, stop, and info of the MJPEG
+ *	over HTTP server of a capture device.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+HttpdCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    Tcl_HashEntry *hPtr;
+    V4L2C *v4l2c;
+    VHTTP *http;
+    const char *address = NULL;
+    int i, command, port, quality = JPEG_QUALITY, scale = 1;
+    int maxClients = 8;
+
+    static const char *httpNames[] = {
+	"info", "start", "stop", NULL
+    };
+    enum httpCode {
+	HTTP_info, HTTP_start, HTTP_stop
+    };
+
+    if (objc < 4) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option devid ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], httpNames, "option", 0,
+			    &command) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[3]));
+    if (hPtr == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("device \"%s\" not found", Tcl_GetString(objv[3])));
+	return TCL_ERROR;
+    }
+    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+    http = v4l2c->http;
+
+    switch ((enum httpCode) command) {
+
+    case HTTP_start:
+	if ((objc < 5) || (objc % 2 == 0)) {
+	    Tcl_WrongNumArgs(interp, 3, objv,
+			     "devid port ?-address a? ?-clients n? "
+			     "?-quality q? ?-scale s?");
+	    return TCL_ERROR;
+	}
+	if (Tcl_GetIntFromObj(interp, objv[4], &port) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	for (i = 5; i < objc; i += 2) {
+	    char *opt = Tcl_GetString(objv[i]);
+
+	    if (strcmp(opt, "-address") == 0) {
+		address = Tcl_GetString(objv[i + 1]);
+	    } else if (strcmp(opt, "-clients") == 0) {
+		if (Tcl_GetIntFromObj(interp, objv[i + 1], &maxClients)
+		    != TCL_OK) {
+		    return TCL_ERROR;
+		}
+	    } else if (strcmp(opt, "-quality") == 0) {
+		if (Tcl_GetIntFromObj(interp, objv[i + 1], &quality)
+		    != TCL_OK) {
+		    return TCL_ERROR;
+		}
+	    } else if (strcmp(opt, "-scale") == 0) {
+		if (Tcl_GetIntFromObj(interp, objv[i + 1], &scale)
+		    != TCL_OK) {
+		    return TCL_ERROR;
+		}
+	    } else {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("bad option \"%s\": must be -address, "
+				  "-clients, -quality, or -scale", opt));
+		return TCL_ERROR;
+	    }
+	}
+	if ((port < 0) || (port > 65535)) {
+	    Tcl_SetResult(interp, "invalid port number", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if ((maxClients < 1) || (maxClients > HTTP_MAXCLIENTS)) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("clients must be in 1..%d", HTTP_MAXCLIENTS));
+	    return TCL_ERROR;
+	}
+	if ((quality < 1) || (quality > 100)) {
+	    Tcl_SetResult(interp, "quality must be in 1..100", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if ((scale < 1) || (scale > 16)) {
+	    Tcl_SetResult(interp, "scale must be in 1..16", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if (v4l2c->isLoopDev) {
+	    Tcl_SetResult(interp, "not a capture device", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if ((v4l2c->format != V4L2_PIX_FMT_MJPEG) &&
+	    IsCoded(v4l2c->format)) {
+	    Tcl_SetResult(interp, "unsupported pixel format", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+#ifndef USE_MJPEG
+	if (v4l2c->format != V4L2_PIX_FMT_MJPEG) {
+	    Tcl_SetResult(interp, "JPEG support not available", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+#endif
+	return HttpStart(interp, v4l2c, port, address, quality, scale,
+			 maxClients);
+
+    case HTTP_stop:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "devid");
+	    return TCL_ERROR;
+	}
+	HttpStop(v4l2c);
+	break;
+
+    case HTTP_info: {
+	Tcl_Obj *list[14];
+
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "devid");
+	    return TCL_ERROR;
+	}
+	if (http == NULL) {
+	    break;
+	}
+	list[0] = Tcl_NewStringObj("port", -1);
+	list[1] = Tcl_NewIntObj(http->port);
+	list[2] = Tcl_NewStringObj("clients", -1);
+	list[3] = Tcl_NewIntObj(http->nclients);
+	list[4] = Tcl_NewStringObj("frames", -1);
+	list[5] = Tcl_NewWideIntObj(http->frames);
+	list[6] = Tcl_NewStringObj("sent", -1);
+	list[7] = Tcl_NewWideIntObj(http->sent);
+	list[8] = Tcl_NewStringObj("dropped", -1);
+	list[9] = Tcl_NewWideIntObj(http->dropped);
+	list[10] = Tcl_NewStringObj("errors", -1);
+	list[11] = Tcl_NewWideIntObj(http->errors);
+	list[12] = Tcl_NewStringObj("bytes", -1);
+	list[13] = Tcl_NewWideIntObj(http->bytes);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(14, list));
+	break;
+    }
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RecordCmd --
+ *
+ *	Implements "v4l2 record": start, stop, info, and dump of the
+ *	pre-trigger ring recorder of a capture device.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+RecordCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    Tcl_HashEntry *hPtr;
+    V4L2C *v4l2c;
+    VREC *rec;
+    int command, n;
+
+    static const char *recNames[] = {
+	"dump", "info", "start", "stop", NULL
+    };
+    enum recCode {
+	REC_dump, REC_info, REC_start, REC_stop
+    };
+
+    if (objc < 4) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option devid ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], recNames, "option", 0,
+			    &command) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[3]));
+    if (hPtr == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("device \"%s\" not found", Tcl_GetString(objv[3])));
+	return TCL_ERROR;
+    }
+    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+    rec = v4l2c->rec;
+    switch ((enum recCode) command) {
+    case REC_start: {
+	double seconds;
+	Tcl_WideInt size = 0;
+	const char *path;
+
+	if ((objc != 5) && (objc != 6)) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "devid seconds|file ?bytes?");
+	    return TCL_ERROR;
+	}
+	if (v4l2c->isLoopDev) {
+	    Tcl_SetResult(interp, "not a capture device", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	path = Tcl_GetString(objv[4]);
+	n = strlen(path);
+	if ((n > 4) && ((strcmp(path + n - 4, ".y4m") == 0) ||
+			(strcmp(path + n - 4, ".avi") == 0) ||
+			(strcmp(path + n - 4, ".vlz") == 0))) {
+	    if (objc != 5) {
+		Tcl_WrongNumArgs(interp, 3, objv, "devid file");
+		return TCL_ERROR;
+	    }
+	    /* one file per device */
+	    Y4MStop(v4l2c);
+	    AviStop(v4l2c);
+	    VlzStop(v4l2c);
+	    if (path[n - 3] == 'y') {
+		return Y4MStart(interp, v4l2c, path);
+	    } else if (path[n - 3] == 'a') {
+		return AviStart(interp, v4l2c, path);
+	    }
+	    return VlzStart(interp, v4l2c, path);
+	}
+	if (Tcl_GetDoubleFromObj(interp, objv[4], &seconds) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if ((objc > 5) &&
+	    (Tcl_GetWideIntFromObj(interp, objv[5], &size) != TCL_OK)) {
+	    return TCL_ERROR;
+	}
+	if ((seconds <= 0) || (seconds > 3600) || (size < 0) ||
+	    (size > REC_MAXSIZE)) {
+	    Tcl_SetResult(interp, "invalid time span or size", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if (size == 0) {
+	    /* room for the time span at 30 fps in the device's format */
+	    size = (Tcl_WideInt) (seconds * 30) *
+		FrameSize(v4l2c->format, v4l2c->width, v4l2c->height);
+	    if ((size <= 0) || (size > REC_MAXSIZE)) {
+		size = REC_MAXSIZE;
+	    }
+	}
+	RecordFree(v4l2c);
+	rec = (VREC *) ckalloc(sizeof (VREC));
+	memset(rec, 0, sizeof (VREC));
+	rec->seconds = seconds;
+	/* arena is allocated and grown by RecordFrame */
+	rec->arenaMax = size;
+	rec->maxEnts = seconds * REC_MAXFPS + 16;
+	rec->ents = (VRECENT *) attemptckalloc(rec->maxEnts *
+					       sizeof (VRECENT));
+	if (rec->ents == NULL) {
+	    ckfree((char *) rec);
+	    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	rec->format = v4l2c->format;
+	rec->width = v4l2c->width;
+	rec->height = v4l2c->height;
+	v4l2c->rec = rec;
+	break;
+    }
+    case REC_stop:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "devid");
+	    return TCL_ERROR;
+	}
+	RecordFree(v4l2c);
+	Y4MStop(v4l2c);
+	AviStop(v4l2c);
+	VlzStop(v4l2c);
+	break;
+    case REC_info:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "devid");
+	    return TCL_ERROR;
+	}
+	if ((rec != NULL) || (v4l2c->y4m != NULL) || (v4l2c->avi != NULL) ||
+	    (v4l2c->vlz != NULL)) {
+	    Tcl_Obj *list[22];
+	    double span = 0;
+
+	    n = 0;
+	    if (v4l2c->y4m != NULL) {
+		VY4MW *y4m = v4l2c->y4m;
+
+		Tcl_MutexLock(&y4m->mutex);
+		list[12] = Tcl_NewStringObj("file", -1);
+		list[13] = Tcl_NewStringObj(Tcl_DStringValue(&y4m->path), -1);
+		list[14] = Tcl_NewStringObj("written", -1);
+		list[15] = Tcl_NewWideIntObj(y4m->written);
+		list[16] = Tcl_NewStringObj("skipped", -1);
+		list[17] = Tcl_NewWideIntObj(y4m->dropped);
+		list[18] = Tcl_NewStringObj("errors", -1);
+		list[19] = Tcl_NewWideIntObj(y4m->errors);
+		Tcl_MutexUnlock(&y4m->mutex);
+		n = 8;
+	    } else if (v4l2c->avi != NULL) {
+		VAVIW *avi = v4l2c->avi;
+
+		Tcl_MutexLock(&avi->mutex);
+		list[12] = Tcl_NewStringObj("file", -1);
+		list[13] = Tcl_NewStringObj(Tcl_DStringValue(&avi->path), -1);
+		list[14] = Tcl_NewStringObj("written", -1);
+		list[15] = Tcl_NewWideIntObj(avi->written);
+		list[16] = Tcl_NewStringObj("skipped", -1);
+		list[17] = Tcl_NewWideIntObj(avi->dropped);
+		list[18] = Tcl_NewStringObj("errors", -1);
+		list[19] = Tcl_NewWideIntObj(avi->errors);
+		Tcl_MutexUnlock(&avi->mutex);
+		n = 8;
+	    } else if (v4l2c->vlz != NULL) {
+		VVLZW *vlz = v4l2c->vlz;
+
+		Tcl_MutexLock(&vlz->mutex);
+		list[12] = Tcl_NewStringObj("file", -1);
+		list[13] = Tcl_NewStringObj(Tcl_DStringValue(&vlz->path), -1);
+		list[14] = Tcl_NewStringObj("written", -1);
+		list[15] = Tcl_NewWideIntObj(vlz->written);
+		list[16] = Tcl_NewStringObj("skipped", -1);
+		list[17] = Tcl_NewWideIntObj(vlz->dropped);
+		list[18] = Tcl_NewStringObj("errors", -1);
+		list[19] = Tcl_NewWideIntObj(vlz->errors);
+		list[20] = Tcl_NewStringObj("bytes", -1);
+		list[21] = Tcl_NewWideIntObj(vlz->bytes);
+		Tcl_MutexUnlock(&vlz->mutex);
+		n = 10;
+	    }
+	    if (rec == NULL) {
+		Tcl_SetObjResult(interp, Tcl_NewListObj(n, list + 12));
+		break;
+	    }
+
+	    if (rec->count > 0) {
+		span = rec->ents[(rec->first + rec->count - 1) %
+				 rec->maxEnts].time -
+		    rec->ents[rec->first].time;
+	    }
+	    list[0] = Tcl_NewStringObj("seconds", -1);
+	    list[1] = Tcl_NewDoubleObj(rec->seconds);
+	    list[2] = Tcl_NewStringObj("bytes", -1);
+	    list[3] = Tcl_NewWideIntObj(rec->arenaSize);
+	    list[4] = Tcl_NewStringObj("count", -1);
+	    list[5] = Tcl_NewIntObj(rec->count);
+	    list[6] = Tcl_NewStringObj("span", -1);
+	    list[7] = Tcl_NewDoubleObj(span);
+	    list[8] = Tcl_NewStringObj("frames", -1);
+	    list[9] = Tcl_NewWideIntObj(rec->frames);
+	    list[10] = Tcl_NewStringObj("dropped", -1);
+	    list[11] = Tcl_NewWideIntObj(rec->dropped);
+	    Tcl_SetObjResult(interp, Tcl_NewListObj(12 + n, list));
+	}
+	break;
+    case REC_dump:
+	if (objc != 5) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "devid path");
+	    return TCL_ERROR;
+	}
+	if (rec == NULL) {
+	    Tcl_SetResult(interp, "not recording", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	n = RecordDump(rec, Tcl_GetString(objv[4]));
+	if (n < 0) {
+	    Tcl_SetObjResult(interp,
+			     Tcl_ObjPrintf("error writing \"%s\": %s",
+					   Tcl_GetString(objv[4]),
+					   Tcl_PosixError(interp)));
+	    return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(n));
+	break;
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * SnapshotReady --
+ *
+ *	Deliver the frame of an asynchronous snapshot: the frame is
+ *	retrieved as byte array, the preview settings are restored,
+ *	and the snapshot callback is invoked with the device id and
+ *	the image or the word "error" appended.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+SnapshotReady(V4L2C *v4l2c, struct v4l2_buffer *vbuf)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    Tcl_Obj *cmd, *img;
+    int ret;
+
+    cmd = v4l2c->snapCmd;
+    v4l2c->snapCmd = NULL;
+    Tcl_Preserve((ClientData) interp);
+    if ((TakeBuffer(v4l2c, vbuf) == TCL_OK) &&
+	(GetImage(NULL, v4l2c, 0, NULL) == TCL_OK)) {
+	img = Tcl_GetObjResult(interp);
     } else {
-	unsigned char *rawPtr = NULL;
-	int rawSize, pixelSize;
-	Tcl_Obj *list[4];
+	img = Tcl_NewStringObj("error", -1);
+    }
+    Tcl_IncrRefCount(img);
+    Tcl_ResetResult(interp);
+    EndSnapshot(v4l2c);
+    if (cmd != NULL) {
+	Tcl_Obj *cmdObj = Tcl_DuplicateObj(cmd);
+
+	Tcl_IncrRefCount(cmdObj);
+	Tcl_ListObjAppendElement(NULL, cmdObj,
+				 Tcl_NewStringObj(v4l2c->devId, -1));
+	Tcl_ListObjAppendElement(NULL, cmdObj, img);
+	ret = Tcl_EvalObjEx(interp, cmdObj, TCL_EVAL_GLOBAL);
+	if (ret != TCL_OK) {
+	    Tcl_AddErrorInfo(interp, "\n    (v4l2 snapshot handler)");
+	    Tcl_BackgroundException(interp, ret);
+	}
+	Tcl_DecrRefCount(cmdObj);
+	Tcl_DecrRefCount(cmd);
+    }
+    Tcl_DecrRefCount(img);
+    Tcl_Release((ClientData) interp);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * WaitSnapshot --
+ *
+ *	Wait for the frame of a synchronous snapshot, skipping
+ *	warm-up frames, and leave it as byte array in the interpreter
+ *	result. The preview settings are restored afterwards.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	switch (v4l2c->format) {
-	case V4L2_PIX_FMT_YUYV:
-	case V4L2_PIX_FMT_YVYU:
-	    rgbToFree = ConvertFromYUV(v4l2c->vbufs[v4l2c->bufrdy].start,
-				       v4l2c->width, v4l2c->height,
-				       v4l2c->format == V4L2_PIX_FMT_YVYU);
-	    if (rgbToFree == NULL) {
-		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
-		result = TCL_ERROR;
-		goto done;
+static int
+WaitSnapshot(V4L2C *v4l2c)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    struct v4l2_buffer vbuf;
+    Tcl_Obj *img;
+    int ret;
+
+    do {
+	if (WaitBuffer(v4l2c, &vbuf, SNAPSHOT_TIMEOUT) < 0) {
+	    goto error;
+	}
+    } while (SnapshotWarmup(v4l2c, &vbuf));
+    if (TakeBuffer(v4l2c, &vbuf) != TCL_OK) {
+error:
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error capturing snapshot: %s",
+				       Tcl_PosixError(interp)));
+	ret = TCL_ERROR;
+	goto done;
+    }
+    ret = GetImage(NULL, v4l2c, 0, NULL);
+done:
+    img = Tcl_GetObjResult(interp);
+    Tcl_IncrRefCount(img);
+    if (EndSnapshot(v4l2c) != TCL_OK) {
+	if (ret == TCL_OK) {
+	    Tcl_DecrRefCount(img);
+	    return TCL_ERROR;
+	}
+    }
+    Tcl_SetObjResult(interp, img);
+    Tcl_DecrRefCount(img);
+    return ret;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Burst --
+ *
+ *	Capture a number of consecutive frames synchronously. All
+ *	destination buffers are allocated up front, each frame is
+ *	copied into its buffer and the frame buffer requeued
+ *	at once, without evaluating Tcl code in between. When the
+ *	device was switched by BeginSnapshot, warm-up frames are
+ *	skipped and the previous settings restored afterwards.
+ *	The result is a list of the frame size followed by a list
+ *	of timestamp, sequence number, and data for each frame.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+Burst(V4L2C *v4l2c, int count, int snap)
+{
+    Tcl_Interp *interp = v4l2c->interp;
+    struct v4l2_buffer vbuf;
+    struct {
+	unsigned char *ptr;
+	size_t used;
+	double time;
+	unsigned int sequence;
+    } *frames;
+    Tcl_Obj *list, *r[3];
+    size_t length, used;
+    int i, n, ret = TCL_ERROR;
+    char buffer[64], fcbuf[8];
+
+    frames = (void *) attemptckalloc(count * sizeof (*frames));
+    if (frames == NULL) {
+	goto nomem;
+    }
+    memset(frames, 0, count * sizeof (*frames));
+    length = 0;
+    for (i = 0; i < v4l2c->nvbufs; i++) {
+	if (v4l2c->vbufs[i].length > length) {
+	    length = v4l2c->vbufs[i].length;
+	}
+    }
+    for (i = 0; i < count; i++) {
+	frames[i].ptr = (unsigned char *) attemptckalloc(length);
+	if (frames[i].ptr == NULL) {
+	    goto nomem;
+	}
+    }
+    n = 0;
+    while (n < count) {
+	if (WaitBuffer(v4l2c, &vbuf, SNAPSHOT_TIMEOUT) < 0) {
+	    goto error;
+	}
+	if (snap && SnapshotWarmup(v4l2c, &vbuf)) {
+	    continue;
+	}
+	used = vbuf.bytesused;
+	if ((used == 0) || (used > v4l2c->vbufs[vbuf.index].length)) {
+	    used = v4l2c->vbufs[vbuf.index].length;
+	}
+	memcpy(frames[n].ptr, v4l2c->vbufs[vbuf.index].start, used);
+	frames[n].used = used;
+	frames[n].time = vbuf.timestamp.tv_sec +
+	    vbuf.timestamp.tv_usec / 1000000.0;
+	frames[n].sequence = vbuf.sequence;
+	if (DoIoctl(v4l2c->fd, VIDIOC_QBUF, &vbuf) < 0) {
+	    goto error;
+	}
+	v4l2c->counters[0] += 1;
+	n++;
+    }
+    list = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < count; i++) {
+	r[0] = Tcl_NewDoubleObj(frames[i].time);
+	r[1] = Tcl_NewWideIntObj(frames[i].sequence);
+	r[2] = Tcl_NewByteArrayObj(frames[i].ptr, frames[i].used);
+	ckfree((char *) frames[i].ptr);
+	frames[i].ptr = NULL;
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewListObj(3, r));
+    }
+    sprintf(buffer, "%dx%d%s", v4l2c->width, v4l2c->height,
+	    fourcc_str(v4l2c->format, fcbuf));
+    r[0] = Tcl_NewStringObj(buffer, -1);
+    r[1] = list;
+    Tcl_SetObjResult(interp, Tcl_NewListObj(2, r));
+    ret = TCL_OK;
+    goto done;
+nomem:
+    Tcl_SetResult(interp, "out of memory for burst", TCL_STATIC);
+    goto done;
+error:
+    Tcl_SetObjResult(interp,
+		     Tcl_ObjPrintf("error capturing burst: %s",
+				   Tcl_PosixError(interp)));
+done:
+    if (frames != NULL) {
+	for (i = 0; i < count; i++) {
+	    if (frames[i].ptr != NULL) {
+		ckfree((char *) frames[i].ptr);
+	    }
+	}
+	ckfree((char *) frames);
+    }
+    if (snap) {
+	Tcl_Obj *res = Tcl_GetObjResult(interp);
+
+	Tcl_IncrRefCount(res);
+	if ((EndSnapshot(v4l2c) != TCL_OK) && (ret == TCL_OK)) {
+	    ret = TCL_ERROR;
+	} else {
+	    Tcl_SetObjResult(interp, res);
+	}
+	Tcl_DecrRefCount(res);
+    }
+    return ret;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * M2MRelease --
+ *
+ *	Stop streaming on both queues of a M2M device and release
+ *	its buffers.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+M2MRelease(V4L2M *v4l2m)
+{
+    struct v4l2_requestbuffers req;
+    int type;
+
+    if (v4l2m->streaming) {
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	DoIoctl(v4l2m->fd, VIDIOC_STREAMOFF, &type);
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	DoIoctl(v4l2m->fd, VIDIOC_STREAMOFF, &type);
+	v4l2m->streaming = 0;
+    }
+    if (v4l2m->inBuf.start != NULL) {
+	munmap(v4l2m->inBuf.start, v4l2m->inBuf.length);
+	v4l2m->inBuf.start = NULL;
+    }
+    if (v4l2m->outBuf.start != NULL) {
+	munmap(v4l2m->outBuf.start, v4l2m->outBuf.length);
+	v4l2m->outBuf.start = NULL;
+    }
+    if (v4l2m->inMemory) {
+	memset(&req, 0, sizeof (req));
+	req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	req.memory = v4l2m->inMemory;
+	DoIoctl(v4l2m->fd, VIDIOC_REQBUFS, &req);
+	memset(&req, 0, sizeof (req));
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	DoIoctl(v4l2m->fd, VIDIOC_REQBUFS, &req);
+	v4l2m->inMemory = 0;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * M2MSetup --
+ *
+ *	Request and map one buffer on each queue of a configured
+ *	M2M device and start streaming. Source frames are either
+ *	copied into a mmap()ed buffer or, with V4L2_MEMORY_DMABUF,
+ *	passed as buffers exported by the capture device.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+M2MSetup(Tcl_Interp *interp, V4L2M *v4l2m, int memory)
+{
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    int type;
+
+    M2MRelease(v4l2m);
+    memset(&req, 0, sizeof (req));
+    req.count = 1;
+    req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    req.memory = memory;
+    if (DoIoctl(v4l2m->fd, VIDIOC_REQBUFS, &req) < 0) {
+	goto error;
+    }
+    v4l2m->inMemory = memory;
+    if (memory == V4L2_MEMORY_MMAP) {
+	memset(&buf, 0, sizeof (buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = 0;
+	if (DoIoctl(v4l2m->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+	    goto error;
+	}
+	v4l2m->inBuf.length = buf.length;
+	v4l2m->inBuf.start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, v4l2m->fd, buf.m.offset);
+	if (v4l2m->inBuf.start == MAP_FAILED) {
+	    v4l2m->inBuf.start = NULL;
+	    goto error;
+	}
+    }
+    memset(&req, 0, sizeof (req));
+    req.count = 1;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (DoIoctl(v4l2m->fd, VIDIOC_REQBUFS, &req) < 0) {
+	goto error;
+    }
+    memset(&buf, 0, sizeof (buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = 0;
+    if (DoIoctl(v4l2m->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+	goto error;
+    }
+    v4l2m->outBuf.length = buf.length;
+    v4l2m->outBuf.start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, v4l2m->fd, buf.m.offset);
+    if (v4l2m->outBuf.start == MAP_FAILED) {
+	v4l2m->outBuf.start = NULL;
+	goto error;
+    }
+    type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    if (DoIoctl(v4l2m->fd, VIDIOC_STREAMON, &type) < 0) {
+	goto error;
+    }
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (DoIoctl(v4l2m->fd, VIDIOC_STREAMON, &type) < 0) {
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	DoIoctl(v4l2m->fd, VIDIOC_STREAMOFF, &type);
+	goto error;
+    }
+    v4l2m->streaming = 1;
+    return TCL_OK;
+
+error:
+    if (interp != NULL) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error setting up buffers: %s",
+				       Tcl_PosixError(interp)));
+    }
+    M2MRelease(v4l2m);
+    return TCL_ERROR;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * M2MConfigure --
+ *
+ *	Set source and result formats of a M2M device. The formats
+ *	finally chosen by the driver are kept.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+M2MConfigure(Tcl_Interp *interp, V4L2M *v4l2m, int inWidth, int inHeight,
+	     int inFormat, int outWidth, int outHeight, int outFormat)
+{
+    struct v4l2_format fmt;
+
+    M2MRelease(v4l2m);
+    memset(&fmt, 0, sizeof (fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    fmt.fmt.pix.width = inWidth;
+    fmt.fmt.pix.height = inHeight;
+    fmt.fmt.pix.pixelformat = inFormat;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (DoIoctl(v4l2m->fd, VIDIOC_S_FMT, &fmt) < 0) {
+	goto error;
+    }
+    v4l2m->inWidth = fmt.fmt.pix.width;
+    v4l2m->inHeight = fmt.fmt.pix.height;
+    v4l2m->inFormat = fmt.fmt.pix.pixelformat;
+    memset(&fmt, 0, sizeof (fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = outWidth;
+    fmt.fmt.pix.height = outHeight;
+    fmt.fmt.pix.pixelformat = outFormat;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (DoIoctl(v4l2m->fd, VIDIOC_S_FMT, &fmt) < 0) {
+	goto error;
+    }
+    v4l2m->outWidth = fmt.fmt.pix.width;
+    v4l2m->outHeight = fmt.fmt.pix.height;
+    v4l2m->outFormat = fmt.fmt.pix.pixelformat;
+    return M2MSetup(interp, v4l2m, V4L2_MEMORY_MMAP);
+
+error:
+    Tcl_SetObjResult(interp,
+		     Tcl_ObjPrintf("error setting format: %s",
+				   Tcl_PosixError(interp)));
+    return TCL_ERROR;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * CaptureDmaBuf --
+ *
+ *	Return a DMABUF file descriptor for a frame buffer of a capture
+ *	device or -1. The buffer is exported on first use and the
+ *	descriptor kept until the buffers are released. Formats emulated
+ *	by libv4l2 are never exported, since the driver's buffer holds
+ *	the frame before libv4l2's conversion.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+CaptureDmaBuf(V4L2C *v4l2c, int index)
+{
+#ifdef VIDIOC_EXPBUF
+    struct v4l2_exportbuffer xbuf;
+    struct v4l2_fmtdesc fmt;
+    int i;
+
+    if (v4l2c->dmaFormat != v4l2c->format) {
+	v4l2c->dmaFormat = v4l2c->format;
+	v4l2c->dmaEmulated = 0;
+	for (i = 0; ; i++) {
+	    memset(&fmt, 0, sizeof (fmt));
+	    fmt.index = i;
+	    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	    if (DoIoctl(v4l2c->fd, VIDIOC_ENUM_FMT, &fmt) < 0) {
+		break;
+	    }
+	    if (fmt.pixelformat == v4l2c->format) {
+		v4l2c->dmaEmulated =
+		    (fmt.flags & V4L2_FMT_FLAG_EMULATED) != 0;
+		break;
+	    }
+	}
+    }
+    if (v4l2c->dmaEmulated) {
+	return -1;
+    }
+    if (v4l2c->dmaFds[index] == 0) {
+	memset(&xbuf, 0, sizeof (xbuf));
+	xbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	xbuf.index = index;
+	xbuf.flags = O_RDONLY | O_CLOEXEC;
+	if (DoIoctl(v4l2c->fd, VIDIOC_EXPBUF, &xbuf) == 0) {
+	    v4l2c->dmaFds[index] = xbuf.fd + 1;
+	} else {
+	    v4l2c->dmaFds[index] = -1;
+	}
+    }
+    return (v4l2c->dmaFds[index] > 0) ? v4l2c->dmaFds[index] - 1 : -1;
+#else
+    return -1;
+#endif
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * M2MConvert --
+ *
+ *	Run one frame through a M2M device. The source is either
+ *	a byte array or, when v4l2c is given, the last ready frame
+ *	buffer of a capture device which is passed as DMABUF if
+ *	possible. The result is left as list of width, height,
+ *	fourcc, and data in the interpreter.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+M2MConvert(Tcl_Interp *interp, V4L2M *v4l2m, V4L2C *v4l2c, Tcl_Obj *data)
+{
+    struct v4l2_buffer ibuf, obuf;
+    struct pollfd pfd;
+    unsigned char *src;
+    int length, n, dmafd = -1, inDone = 0, outDone = 0;
+    char fcbuf[8];
+    Tcl_Obj *list[4];
+
+    if (!v4l2m->streaming) {
+	Tcl_SetResult(interp, "m2m device not configured", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    memset(&ibuf, 0, sizeof (ibuf));
+    ibuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    ibuf.index = 0;
+    ibuf.field = V4L2_FIELD_NONE;
+    if (v4l2c != NULL) {
+	if ((v4l2c->bufrdy < 0) || (v4l2c->running <= 0)) {
+	    Tcl_SetResult(interp, "no frame available", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if ((v4l2c->format != v4l2m->inFormat) ||
+	    (v4l2c->width != v4l2m->inWidth) ||
+	    (v4l2c->height != v4l2m->inHeight)) {
+	    Tcl_SetResult(interp, "frame format mismatch", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	src = (unsigned char *) v4l2c->vbufs[v4l2c->bufrdy].start;
+	length = v4l2c->rdyUsed;
+	if ((length <= 0) || (length > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	    length = v4l2c->vbufs[v4l2c->bufrdy].length;
+	}
+	dmafd = CaptureDmaBuf(v4l2c, v4l2c->bufrdy);
+	if ((dmafd >= 0) && (v4l2m->inMemory != V4L2_MEMORY_DMABUF) &&
+	    (M2MSetup(NULL, v4l2m, V4L2_MEMORY_DMABUF) != TCL_OK)) {
+	    /* no DMABUF support, copy from now on */
+	    dmafd = -1;
+	    if (M2MSetup(interp, v4l2m, V4L2_MEMORY_MMAP) != TCL_OK) {
+		return TCL_ERROR;
 	    }
-	    rawSize = v4l2c->width * v4l2c->height * 3;
-	    pixelSize = 3;
-	    rawPtr = rgbToFree;
-	    break;
-	case V4L2_PIX_FMT_RGB32:
-	case V4L2_PIX_FMT_BGR32:
-	    rawSize = v4l2c->width * v4l2c->height * 4;
-	    pixelSize = 4;
-	    break;
-	case V4L2_PIX_FMT_RGB24:
-	case V4L2_PIX_FMT_BGR24:
-	default:
-	    rawSize = v4l2c->width * v4l2c->height * 3;
-	    pixelSize = 3;
-	    break;
-#ifdef USE_MJPEG
-	case V4L2_PIX_FMT_MJPEG:
-	    rgbToFree = ConvertFromMJPEG(v4l2c->vbufs[v4l2c->bufrdy].start,
-					 v4l2c->vbufs[v4l2c->bufrdy].length,
-					 v4l2c->width, v4l2c->height);
-	    if (rgbToFree == V4L2_MJPEG_FAILED) {
-		rgbToFree = NULL;
-		Tcl_SetResult(interp, "conversion from jpeg failed",
-			      TCL_STATIC);
-		result = TCL_ERROR;
-		goto done;
+	}
+    } else {
+	src = Tcl_GetByteArrayFromObj(data, &length);
+    }
+    if (dmafd >= 0) {
+	ibuf.memory = V4L2_MEMORY_DMABUF;
+	ibuf.m.fd = dmafd;
+	ibuf.length = v4l2c->vbufs[v4l2c->bufrdy].length;
+	ibuf.bytesused = length;
+    } else {
+	if ((v4l2m->inMemory != V4L2_MEMORY_MMAP) &&
+	    (M2MSetup(interp, v4l2m, V4L2_MEMORY_MMAP) != TCL_OK)) {
+	    return TCL_ERROR;
+	}
+	if (length > (int) v4l2m->inBuf.length) {
+	    length = v4l2m->inBuf.length;
+	}
+	memcpy(v4l2m->inBuf.start, src, length);
+	ibuf.memory = V4L2_MEMORY_MMAP;
+	ibuf.bytesused = length;
+    }
+    memset(&obuf, 0, sizeof (obuf));
+    obuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    obuf.memory = V4L2_MEMORY_MMAP;
+    obuf.index = 0;
+    if ((DoIoctl(v4l2m->fd, VIDIOC_QBUF, &obuf) < 0) ||
+	(DoIoctl(v4l2m->fd, VIDIOC_QBUF, &ibuf) < 0)) {
+	goto error;
+    }
+    while (!inDone || !outDone) {
+	pfd.fd = v4l2m->fd;
+	pfd.events = POLLIN | POLLOUT;
+	pfd.revents = 0;
+	n = poll(&pfd, 1, M2M_TIMEOUT);
+	if ((n < 0) && (errno == EINTR)) {
+	    continue;
+	}
+	if (n <= 0) {
+	    if (n == 0) {
+		errno = ETIMEDOUT;
 	    }
-	    if (rgbToFree == NULL) {
-		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
-		result = TCL_ERROR;
-		goto done;
+	    goto error;
+	}
+	if (!inDone && (pfd.revents & POLLOUT)) {
+	    ibuf.index = 0;
+	    if (DoIoctl(v4l2m->fd, VIDIOC_DQBUF, &ibuf) == 0) {
+		inDone = 1;
+	    } else if (errno != EAGAIN) {
+		goto error;
 	    }
-	    rawSize = v4l2c->width * v4l2c->height * 3;
-	    pixelSize = 3;
-	    rawPtr = rgbToFree;
-	    break;
-#endif
-	case V4L2_PIX_FMT_GREY:
-	    rawSize = v4l2c->width * v4l2c->height;
-	    pixelSize = 1;
-	    break;
-#ifdef V4L2_PIX_FMT_Y10
-	case V4L2_PIX_FMT_Y10:
-	    rawSize = v4l2c->width * v4l2c->height * 2;
-	    pixelSize = 2;
-	    break;
-#endif
-#ifdef V4L2_PIX_FMT_Y16
-	case V4L2_PIX_FMT_Y16:
-	    rawSize = v4l2c->width * v4l2c->height * 2;
-	    pixelSize = 2;
-	    break;
-#endif
 	}
-	if (rawPtr == NULL) {
-	    rawPtr = v4l2c->vbufs[v4l2c->bufrdy].start;
+	if (!outDone && (pfd.revents & POLLIN)) {
+	    if (DoIoctl(v4l2m->fd, VIDIOC_DQBUF, &obuf) == 0) {
+		outDone = 1;
+	    } else if (errno != EAGAIN) {
+		goto error;
+	    }
+	}
+	if (pfd.revents & POLLERR) {
+	    errno = EIO;
+	    goto error;
 	}
+    }
+    length = obuf.bytesused;
+    if ((length <= 0) || (length > (int) v4l2m->outBuf.length)) {
+	length = v4l2m->outBuf.length;
+    }
+    list[0] = Tcl_NewIntObj(v4l2m->outWidth);
+    list[1] = Tcl_NewIntObj(v4l2m->outHeight);
+    list[2] = Tcl_NewStringObj(fourcc_str(v4l2m->outFormat, fcbuf) + 1, -1);
+    list[3] = Tcl_NewByteArrayObj(v4l2m->outBuf.start, length);
+    Tcl_SetObjResult(interp, Tcl_NewListObj(4, list));
+    return TCL_OK;
 
-	if ((flags & 0x07) && (pixelSize >= 3)) {
-	    int x, y, w0, w1, w2;
-	    unsigned char *src0, *src1, *src2, *dst;
+error:
+    Tcl_SetObjResult(interp,
+		     Tcl_ObjPrintf("error converting frame: %s",
+				   Tcl_PosixError(interp)));
+    /* get queues into a defined state */
+    M2MSetup(NULL, v4l2m, V4L2_MEMORY_MMAP);
+    return TCL_ERROR;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * M2MCmd --
+ *
+ *	Subcommands of "v4l2 m2m": open, configure, convert, close.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	    toFree = attemptckalloc(v4l2c->width * v4l2c->height);
-	    if (toFree == NULL) {
-		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
-		result = TCL_ERROR;
-		goto done;
-	    }
-	    dst = toFree;
-	    switch (flags & 0x07) {
-	    case 1:	/* blue */
-		switch (v4l2c->format) {
-		case V4L2_PIX_FMT_RGB32:
-		case V4L2_PIX_FMT_RGB24:
-		case V4L2_PIX_FMT_YUYV:
-		case V4L2_PIX_FMT_YVYU:
-		default:
-		    src0 = rawPtr + 2;
-		    break;
-		case V4L2_PIX_FMT_BGR32:
-		case V4L2_PIX_FMT_BGR24:
-		    src0 = rawPtr + 0;
-		    break;
-		}
-		goto rawOne;
-	    case 2:	/* green */
-		src0 = rawPtr + 1;
-		goto rawOne;
-	    case 4:	/* red */
-		switch (v4l2c->format) {
-		case V4L2_PIX_FMT_RGB32:
-		case V4L2_PIX_FMT_RGB24:
-		case V4L2_PIX_FMT_YUYV:
-		case V4L2_PIX_FMT_YVYU:
-		default:
-		    src0 = rawPtr + 0;
-		    break;
-		case V4L2_PIX_FMT_BGR32:
-		case V4L2_PIX_FMT_BGR24:
-		    src0 = rawPtr + 2;
-		    break;
-		}
-	    rawOne:
-		for (y = 0; y < v4l2c->height; y++) {
-		    unsigned char *src = src0 + v4l2c->width * y;
+static int
+M2MCmd(V4L2I *v4l2i, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    V4L2M *v4l2m;
+    V4L2C *v4l2c = NULL;
+    Tcl_HashEntry *hPtr;
+    int command, isNew;
 
-		    for (x = 0; x < v4l2c->width; x++) {
-			*dst++ = *src;
-			src += pixelSize;
-		    }
-		}
-		break;
-	    case 3:	/* blue + green */
-		switch (v4l2c->format) {
-		case V4L2_PIX_FMT_RGB32:
-		case V4L2_PIX_FMT_RGB24:
-		case V4L2_PIX_FMT_YUYV:
-		case V4L2_PIX_FMT_YVYU:
-		default:
-		    src0 = rawPtr + 2;
-		    src1 = rawPtr + 1;
-		    break;
-		case V4L2_PIX_FMT_BGR32:
-		case V4L2_PIX_FMT_BGR24:
-		    src0 = rawPtr + 0;
-		    src1 = rawPtr + 1;
-		    break;
-		}
-		w0 = 162;
-		w1 = 837;
-		goto rawTwo;
-	    case 5:	/* blue + red */
-		switch (v4l2c->format) {
-		case V4L2_PIX_FMT_RGB32:
-		case V4L2_PIX_FMT_RGB24:
-		case V4L2_PIX_FMT_YUYV:
-		case V4L2_PIX_FMT_YVYU:
-		default:
-		    src0 = rawPtr + 2;
-		    src1 = rawPtr + 0;
-		    break;
-		case V4L2_PIX_FMT_BGR32:
-		case V4L2_PIX_FMT_BGR24:
-		    src0 = rawPtr + 0;
-		    src1 = rawPtr + 2;
-		    break;
-		}
-		w0 = 276;
-		w1 = 723;
-		goto rawTwo;
-	    case 6:	/* green + red */
-		switch (v4l2c->format) {
-		case V4L2_PIX_FMT_RGB32:
-		case V4L2_PIX_FMT_RGB24:
-		case V4L2_PIX_FMT_YUYV:
-		case V4L2_PIX_FMT_YVYU:
-		default:
-		    src0 = rawPtr + 1;
-		    src1 = rawPtr + 0;
-		    break;
-		case V4L2_PIX_FMT_BGR32:
-		case V4L2_PIX_FMT_BGR24:
-		    src0 = rawPtr + 1;
-		    src1 = rawPtr + 2;
-		    break;
-		}
-		w0 = 662;
-		w1 = 337;
-	    rawTwo:
-		for (y = 0; y < v4l2c->height; y++) {
-		    unsigned char *srcA = src0 + v4l2c->width * y;
-		    unsigned char *srcB = src1 + v4l2c->width * y;
+    static const char *m2mNames[] = {
+	"close", "configure", "convert", "open", NULL
+    };
+    enum m2mCode {
+	M2M_close, M2M_configure, M2M_convert, M2M_open
+    };
 
-		    for (x = 0; x < v4l2c->width; x++) {
-			*dst++ = (w0 * srcA[0] + w1 * srcB[0]) / 1000;
-			srcA += pixelSize;
-			srcB += pixelSize;
-		    }
-		}
-		break;
-	    case 7:	/* all */
-		switch (v4l2c->format) {
-		case V4L2_PIX_FMT_RGB32:
-		case V4L2_PIX_FMT_RGB24:
-		case V4L2_PIX_FMT_YUYV:
-		case V4L2_PIX_FMT_YVYU:
-		default:
-		    src0 = rawPtr + 2;
-		    src1 = rawPtr + 1;
-		    src2 = rawPtr + 0;
-		    break;
-		case V4L2_PIX_FMT_BGR32:
-		case V4L2_PIX_FMT_BGR24:
-		    src0 = rawPtr + 0;
-		    src1 = rawPtr + 1;
-		    src2 = rawPtr + 2;
-		    break;
-		}
-		w0 = 114;
-		w1 = 587;
-		w2 = 299;
-		for (y = 0; y < v4l2c->height; y++) {
-		    unsigned char *srcA = src0 + v4l2c->width * y;
-		    unsigned char *srcB = src1 + v4l2c->width * y;
-		    unsigned char *srcC = src2 + v4l2c->width * y;
+    if (objc < 4) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option arg ...");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], m2mNames, "option", 0,
+			    &command) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (command == M2M_open) {
+	struct v4l2_capability cap;
+	char *devName;
+	int fd, caps;
 
-		    for (x = 0; x < v4l2c->width; x++) {
-			*dst++ =
-			    (w0 * srcA[0] + w1 * srcB[0] + w2 * srcC[0]) / 1000;
-			srcA += pixelSize;
-			srcB += pixelSize;
-			srcC += pixelSize;
-		    }
-		}
-		break;
-	    }
-	    rawPtr = toFree;
-	    rawSize = v4l2c->width * v4l2c->height;
-	    pixelSize = 1;
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "device");
+	    return TCL_ERROR;
+	}
+	devName = Tcl_GetString(objv[3]);
+	fd = open(devName, O_RDWR | O_NONBLOCK, 0);
+	if (fd < 0) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("error while opening \"%s\": %s",
+			      devName, Tcl_PosixError(interp)));
+	    return TCL_ERROR;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	caps = QueryCaps(fd, &cap);
+#ifdef V4L2_CAP_VIDEO_M2M
+	if ((caps < 0) || !(caps & V4L2_CAP_VIDEO_M2M))
+#else
+	if ((caps < 0) || !(caps & V4L2_CAP_VIDEO_CAPTURE) ||
+	    !(caps & V4L2_CAP_VIDEO_OUTPUT))
+#endif
+	{
+	    close(fd);
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("\"%s\" is not a m2m device", devName));
+	    return TCL_ERROR;
 	}
-
-	list[0] = Tcl_NewIntObj(v4l2c->width);
-	list[1] = Tcl_NewIntObj(v4l2c->height);
-	list[2] = Tcl_NewIntObj(pixelSize);
-	list[3] = Tcl_NewByteArrayObj(rawPtr, rawSize);
-	Tcl_SetObjResult(interp, Tcl_NewListObj(4, list));
-	done = 1;
+	v4l2m = (V4L2M *) ckalloc(sizeof (V4L2M));
+	memset(v4l2m, 0, sizeof (V4L2M));
+	v4l2m->fd = fd;
+	Tcl_DStringInit(&v4l2m->devName);
+	Tcl_DStringAppend(&v4l2m->devName, devName, -1);
+	sprintf(v4l2m->m2mId, "m2m%d", v4l2i->m2mCount++);
+	hPtr = Tcl_CreateHashEntry(&v4l2i->m2m, v4l2m->m2mId, &isNew);
+	Tcl_SetHashValue(hPtr, (ClientData) v4l2m);
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(v4l2m->m2mId, -1));
+	return TCL_OK;
     }
-done:
-    if (toFree != NULL) {
-	ckfree(toFree);
+    hPtr = Tcl_FindHashEntry(&v4l2i->m2m, Tcl_GetString(objv[3]));
+    if (hPtr == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("m2m device \"%s\" not found",
+			  Tcl_GetString(objv[3])));
+	return TCL_ERROR;
     }
-    if (rgbToFree != NULL) {
-	ckfree(rgbToFree);
+    v4l2m = (V4L2M *) Tcl_GetHashValue(hPtr);
+    switch ((enum m2mCode) command) {
+    case M2M_close:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "m2mid");
+	    return TCL_ERROR;
+	}
+	Tcl_DeleteHashEntry(hPtr);
+	M2MRelease(v4l2m);
+	close(v4l2m->fd);
+	Tcl_DStringFree(&v4l2m->devName);
+	ckfree((char *) v4l2m);
+	break;
+    case M2M_configure: {
+	int inW, inH, inF, outW, outH, outF;
+	char buffer[128], fcbuf[2][8];
+
+	if ((objc != 4) && (objc != 6)) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "m2mid ?insize outsize?");
+	    return TCL_ERROR;
+	}
+	if (objc > 4) {
+	    if (!ParseFrameSize(Tcl_GetString(objv[4]), &inW, &inH, &inF) ||
+		!ParseFrameSize(Tcl_GetString(objv[5]), &outW, &outH,
+				&outF) || !inF || !outF) {
+		Tcl_SetResult(interp, "invalid frame size", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (M2MConfigure(interp, v4l2m, inW, inH, inF, outW, outH, outF)
+		!= TCL_OK) {
+		return TCL_ERROR;
+	    }
+	}
+	sprintf(buffer, "%dx%d%s %dx%d%s", v4l2m->inWidth, v4l2m->inHeight,
+		fourcc_str(v4l2m->inFormat, fcbuf[0]), v4l2m->outWidth,
+		v4l2m->outHeight, fourcc_str(v4l2m->outFormat, fcbuf[1]));
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(buffer, -1));
+	break;
     }
-    if (done && !v4l2c->bufdone) {
-	v4l2c->bufdone = 1;
-	v4l2c->counters[1] += 1;
+    case M2M_convert:
+	if (objc != 5) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "m2mid devid|bytearray");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[4]));
+	if (hPtr != NULL) {
+	    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	}
+	return M2MConvert(interp, v4l2m, v4l2c, objv[4]);
+    default:
+	break;
     }
-    return result;
+    return TCL_OK;
 }
 
 /*
@@ -2429,102 +12688,669 @@ DataToPhoto(V4L2I *v4l2i, Tcl_Interp *interp,
 	block.offset[2] = 2;
 	block.offset[3] = 4;
     }
-    block.width = width;
-    block.height = height;
-    block.pitch = width * bpp;
-    block.pixelPtr = data;
-    mirror = (mirx ? 1 : 0) | (miry ? 2 : 0);
-    rot = rot % 360;
-    if (rot < 45) {
-	rot = 0;
-    } else if (rot < 135) {
-	rot = 90;
-    } else if (rot < 225) {
-	rot = 180;
-    } else if (rot < 315) {
-	rot = 270;
-    } else {
-	rot = 0;
+    block.width = width;
+    block.height = height;
+    block.pitch = width * bpp;
+    block.pixelPtr = data;
+    mirror = (mirx ? 1 : 0) | (miry ? 2 : 0);
+    rot = rot % 360;
+    if (rot < 45) {
+	rot = 0;
+    } else if (rot < 135) {
+	rot = 90;
+    } else if (rot < 225) {
+	rot = 180;
+    } else if (rot < 315) {
+	rot = 270;
+    } else {
+	rot = 0;
+    }
+    if ((mirror & 3) == 3) {
+	rot = (rot + 180) % 360;
+    }
+    switch (rot) {
+    case 270:	/* = 90 CW */
+	block.pitch = block.pixelSize;
+	block.pixelPtr += width * block.pixelSize * (height - 1);
+	block.pixelSize *= -width;
+	block.offset[3] = block.pixelSize + 1;	/* no alpha */
+	block.width = height;
+	block.height = width;
+	break;
+    case 180:	/* = 180 CW */
+	block.pitch = -block.pitch;
+	block.pixelPtr += (width * height - 1) * block.pixelSize;
+	block.pixelSize = -block.pixelSize;
+	block.offset[3] = block.pixelSize + 1;	/* no alpha */
+	break;
+    case 90:	/* = 270 CW */
+	block.pitch = -block.pixelSize;
+	block.pixelPtr += (width - 1) * block.pixelSize;
+	block.pixelSize *= width;
+	block.offset[3] = block.pixelSize + 1;	/* no alpha */
+	block.width = height;
+	block.height = width;
+	break;
+    }
+    if ((mirror & 3) == 2) {
+	/* mirror in X */
+	block.pixelPtr += (block.width - 1) * block.pixelSize;
+	block.pixelSize = -block.pixelSize;
+	block.offset[3] = block.pixelSize + 1;      /* no alpha */
+    }
+    if ((mirror & 3) == 1) {
+	/* mirror in Y */
+	block.pixelPtr += block.pitch * (block.height - 1);
+	block.pitch = -block.pitch;
+    }
+    if (Tk_PhotoExpand(interp, photo, block.width, block.height) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (Tk_PhotoPutBlock(interp, photo, &block, 0, 0, block.width,
+			 block.height, TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * IsLoopDevice --
+ *
+ *	Determine if device is a loopback device.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifdef linux
+static int
+IsLoopDevice(const char *devName)
+{
+    const char *p;
+    int rc;
+    Tcl_DString ds;
+
+    p = strrchr(devName, '/');
+    if ((p != NULL) && p[1]) {
+	devName = p + 1;
+    }
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, "/sys/devices/virtual/video4linux/", -1);
+    Tcl_DStringAppend(&ds, devName, -1);
+    Tcl_DStringAppend(&ds, "/format", -1);
+    rc = access(Tcl_DStringValue(&ds), R_OK);
+    Tcl_DStringFree(&ds);
+    return (rc == 0);
+}
+#endif
+
+#ifdef linux
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ProbeDevice --
+ *
+ *	Return the capabilities of a device node, using the cache
+ *	of the device monitor. Returns -1 when the node cannot be
+ *	opened (yet), which is not cached.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+ProbeDevice(V4L2I *v4l2i, const char *devName)
+{
+    Tcl_HashEntry *hPtr;
+    struct v4l2_capability cap;
+    int fd, caps, isNew;
+
+    hPtr = Tcl_FindHashEntry(&v4l2i->vcaps, devName);
+    if (hPtr != NULL) {
+	return (int) (long) Tcl_GetHashValue(hPtr);
+    }
+    /* read-only is sufficient for VIDIOC_QUERYCAP */
+    fd = open(devName, O_RDONLY | O_NONBLOCK, 0);
+    if (fd < 0) {
+	return -1;
+    }
+    caps = QueryCaps(fd, &cap);
+    close(fd);
+    if (caps < 0) {
+	caps = 0;
+    }
+    hPtr = Tcl_CreateHashEntry(&v4l2i->vcaps, devName, &isNew);
+    Tcl_SetHashValue(hPtr, (ClientData) (long) caps);
+    return caps;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * InotifyEvents, InotifyMonitor --
+ *
+ *	File handler for inotify events on /dev and /dev/v4l/by-id,
+ *	used when udev is unavailable. The events are handed to all
+ *	interpreters sharing the watch. New video nodes are probed
+ *	once for capture capability; the table of devices is updated
+ *	and the listen callback command is invoked. Nodes which are
+ *	not yet accessible are retried on attribute changes.
+ *	InotifyEvents returns true when a new node was probed.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+InotifyEvents(V4L2I *v4l2i, VINOTIFY *ino, char *buf, int n)
+{
+    struct inotify_event *ev;
+    Tcl_HashEntry *hPtr;
+    Tcl_DString ds;
+    char *p, *devName;
+    int caps, isNew, probed = 0, reattach = 0;
+
+    Tcl_DStringInit(&ds);
+    for (p = buf; p < buf + n; p += sizeof (*ev) + ev->len) {
+	ev = (struct inotify_event *) p;
+	if (ev->wd == ino->wdById) {
+	    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+		reattach = 1;
+	    }
+	    continue;
+	}
+	if ((ev->wd != ino->wdDev) || (ev->len == 0) ||
+	    (strncmp(ev->name, "video", 5) != 0)) {
+	    continue;
+	}
+	Tcl_DStringSetLength(&ds, 0);
+	Tcl_DStringAppend(&ds, "/dev/", -1);
+	Tcl_DStringAppend(&ds, ev->name, -1);
+	devName = Tcl_DStringValue(&ds);
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+	    ForgetDevice(v4l2i, devName);
+	    hPtr = Tcl_FindHashEntry(&v4l2i->vdevs, devName);
+	    if (hPtr != NULL) {
+		Tcl_DeleteHashEntry(hPtr);
+		ListenCallback(v4l2i, "remove", devName);
+	    }
+	    CheckDetach(v4l2i, devName);
+	    continue;
+	}
+	if (Tcl_FindHashEntry(&v4l2i->vdevs, devName) != NULL) {
+	    continue;
+	}
+	caps = ProbeDevice(v4l2i, devName);
+	if (caps < 0) {
+	    /* not accessible yet */
+	    continue;
+	}
+	probed = 1;
+	reattach = 1;
+	if (caps & V4L2_CAP_VIDEO_CAPTURE) {
+	    hPtr = Tcl_CreateHashEntry(&v4l2i->vdevs, devName, &isNew);
+	    Tcl_SetHashValue(hPtr, (ClientData)
+			     Tcl_GetHashKey(&v4l2i->vdevs, hPtr));
+	    ListenCallback(v4l2i, "add", devName);
+	}
+    }
+    Tcl_DStringFree(&ds);
+    if (reattach) {
+	CheckReattach(v4l2i);
+    }
+    return probed;
+}
+
+static void
+InotifyMonitor(ClientData clientData, int mask)
+{
+    VINOTIFY *ino = (VINOTIFY *) clientData;
+    union {
+	struct inotify_event ev;
+	char buf[4096];
+    } u;
+    struct inotify_event *ev;
+    V4L2I **users;
+    char *p;
+    int i, k, n, nusers, probed = 0;
+
+    if (!(mask & TCL_READABLE)) {
+	return;
+    }
+    n = read(ino->fd, u.buf, sizeof (u.buf));
+    if (n <= 0) {
+	return;
+    }
+    /* callbacks may delete interpreters, even the last user */
+    Tcl_Preserve((ClientData) ino);
+    nusers = ino->nusers;
+    users = (V4L2I **) ckalloc(nusers * sizeof (V4L2I *) + 1);
+    memcpy(users, ino->users, nusers * sizeof (V4L2I *));
+    for (i = 0; i < nusers; i++) {
+	for (k = 0; k < ino->nusers; k++) {
+	    if (ino->users[k] == users[i]) {
+		probed |= InotifyEvents(users[i], ino, u.buf, n);
+		break;
+	    }
+	}
+    }
+    ckfree((char *) users);
+    if (ino->nusers > 0) {
+	for (p = u.buf; p < u.buf + n; p += sizeof (*ev) + ev->len) {
+	    ev = (struct inotify_event *) p;
+	    if ((ev->wd == ino->wdById) && (ev->mask & IN_IGNORED)) {
+		ino->wdById = -1;
+	    }
+	}
+	if (probed && (ino->wdById < 0)) {
+	    ino->wdById = inotify_add_watch(ino->fd, "/dev/v4l/by-id",
+					    IN_CREATE | IN_MOVED_TO);
+	}
+    }
+    Tcl_Release((ClientData) ino);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * InotifyInit, InotifyRelease --
+ *
+ *	Attach an interpreter to the inotify watch of its thread,
+ *	which is created on first use, and detach it again. Video
+ *	nodes already present are not probed here, but when the
+ *	list of devices is first asked for, see InotifyScan.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+InotifyInit(V4L2I *v4l2i)
+{
+    VINOTIFY **inoPtr, *ino;
+    int fd;
+
+    v4l2i->inotify = NULL;
+    v4l2i->inotifyFd = -1;
+    v4l2i->scanned = 0;
+    inoPtr = (VINOTIFY **)
+	Tcl_GetThreadData(&inotifyKey, sizeof (VINOTIFY *));
+    ino = *inoPtr;
+    if (ino == NULL) {
+	fd = inotify_init();
+	if (fd < 0) {
+	    return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	ino = (VINOTIFY *) ckalloc(sizeof (VINOTIFY));
+	memset(ino, 0, sizeof (VINOTIFY));
+	ino->fd = fd;
+	ino->wdDev = inotify_add_watch(fd, "/dev",
+				       IN_CREATE | IN_DELETE | IN_ATTRIB |
+				       IN_MOVED_TO | IN_MOVED_FROM);
+	if (ino->wdDev < 0) {
+	    close(fd);
+	    ckfree((char *) ino);
+	    return;
+	}
+	ino->wdById = inotify_add_watch(fd, "/dev/v4l/by-id",
+					IN_CREATE | IN_MOVED_TO);
+	Tcl_CreateFileHandler(fd, TCL_READABLE, InotifyMonitor,
+			      (ClientData) ino);
+	*inoPtr = ino;
+    }
+    ino->users = (V4L2I **) ckrealloc((char *) ino->users,
+				      (ino->nusers + 1) * sizeof (V4L2I *));
+    ino->users[ino->nusers++] = v4l2i;
+    v4l2i->inotify = ino;
+    v4l2i->inotifyFd = ino->fd;
+}
+
+static void
+InotifyRelease(V4L2I *v4l2i)
+{
+    VINOTIFY **inoPtr, *ino = v4l2i->inotify;
+    int i;
+
+    if (ino == NULL) {
+	return;
+    }
+    v4l2i->inotify = NULL;
+    v4l2i->inotifyFd = -1;
+    for (i = 0; i < ino->nusers; i++) {
+	if (ino->users[i] == v4l2i) {
+	    ino->users[i] = ino->users[--ino->nusers];
+	    break;
+	}
+    }
+    if (ino->nusers > 0) {
+	return;
+    }
+    inoPtr = (VINOTIFY **)
+	Tcl_GetThreadData(&inotifyKey, sizeof (VINOTIFY *));
+    if (*inoPtr == ino) {
+	*inoPtr = NULL;
+    }
+    Tcl_DeleteFileHandler(ino->fd);
+    close(ino->fd);
+    ckfree((char *) ino->users);
+    ino->users = NULL;
+    Tcl_EventuallyFree((ClientData) ino, TCL_DYNAMIC);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * InotifyScan --
+ *
+ *	Probe the video nodes present in /dev once for capture
+ *	capability and enter them into the table of devices.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+InotifyScan(V4L2I *v4l2i)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_DString ds;
+    struct dirent *ent;
+    DIR *dir;
+    int caps, isNew;
+
+    if (v4l2i->scanned) {
+	return;
+    }
+    v4l2i->scanned = 1;
+    dir = opendir("/dev");
+    if (dir == NULL) {
+	return;
     }
-    if ((mirror & 3) == 3) {
-	rot = (rot + 180) % 360;
+    Tcl_DStringInit(&ds);
+    while ((ent = readdir(dir)) != NULL) {
+	if (strncmp(ent->d_name, "video", 5) != 0) {
+	    continue;
+	}
+	Tcl_DStringSetLength(&ds, 0);
+	Tcl_DStringAppend(&ds, "/dev/", -1);
+	Tcl_DStringAppend(&ds, ent->d_name, -1);
+	caps = ProbeDevice(v4l2i, Tcl_DStringValue(&ds));
+	if ((caps > 0) && (caps & V4L2_CAP_VIDEO_CAPTURE)) {
+	    hPtr = Tcl_CreateHashEntry(&v4l2i->vdevs, Tcl_DStringValue(&ds),
+				       &isNew);
+	    Tcl_SetHashValue(hPtr, (ClientData)
+			     Tcl_GetHashKey(&v4l2i->vdevs, hPtr));
+	}
     }
-    switch (rot) {
-    case 270:	/* = 90 CW */
-	block.pitch = block.pixelSize;
-	block.pixelPtr += width * block.pixelSize * (height - 1);
-	block.pixelSize *= -width;
-	block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	block.width = height;
-	block.height = width;
-	break;
-    case 180:	/* = 180 CW */
-	block.pitch = -block.pitch;
-	block.pixelPtr += (width * height - 1) * block.pixelSize;
-	block.pixelSize = -block.pixelSize;
-	block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	break;
-    case 90:	/* = 270 CW */
-	block.pitch = -block.pixelSize;
-	block.pixelPtr += (width - 1) * block.pixelSize;
-	block.pixelSize *= width;
-	block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	block.width = height;
-	block.height = width;
+    Tcl_DStringFree(&ds);
+    closedir(dir);
+}
+#endif
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ProbeFrameRates, ProbeInfo --
+ *
+ *	Gather driver information, capabilities, and the natively
+ *	supported pixel formats with their frame sizes and rates
+ *	of a device without setting up a capture session. Results
+ *	are cached per device node until the node changes.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifdef VIDIOC_ENUM_FRAMEINTERVALS
+static Tcl_Obj *
+ProbeFrameRates(int fd, unsigned int format, int width, int height)
+{
+    Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+    struct v4l2_frmivalenum qfiv;
+    char buffer[64];
+    int i;
+
+    for (i = 0; i >= 0; i++) {
+	memset(&qfiv, 0, sizeof (qfiv));
+	qfiv.index = i;
+	qfiv.pixel_format = format;
+	qfiv.width = width;
+	qfiv.height = height;
+	if (DoIoctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &qfiv) < 0) {
+	    break;
+	}
+	if (qfiv.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+	    if (qfiv.discrete.numerator > 0) {
+		Tcl_ListObjAppendElement(NULL, list,
+		    Tcl_NewIntObj(qfiv.discrete.denominator /
+				  qfiv.discrete.numerator));
+	    }
+	    continue;
+	}
+	/* stepwise or continuous: "+"min and "+"max frame rate */
+	if ((qfiv.stepwise.max.numerator > 0) &&
+	    (qfiv.stepwise.min.numerator > 0)) {
+	    sprintf(buffer, "+%d", qfiv.stepwise.max.denominator /
+		    qfiv.stepwise.max.numerator);
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewStringObj(buffer, -1));
+	    sprintf(buffer, "+%d", qfiv.stepwise.min.denominator /
+		    qfiv.stepwise.min.numerator);
+	    Tcl_ListObjAppendElement(NULL, list,
+				     Tcl_NewStringObj(buffer, -1));
+	}
 	break;
     }
-    if ((mirror & 3) == 2) {
-	/* mirror in X */
-	block.pixelPtr += (block.width - 1) * block.pixelSize;
-	block.pixelSize = -block.pixelSize;
-	block.offset[3] = block.pixelSize + 1;      /* no alpha */
+    return list;
+}
+#endif
+
+static int
+ProbeInfo(V4L2I *v4l2i, Tcl_Interp *interp, const char *devName)
+{
+    static const struct {
+	unsigned int cap;
+	const char *name;
+    } capNames[] = {
+	{ V4L2_CAP_VIDEO_CAPTURE, "video-capture" },
+	{ V4L2_CAP_VIDEO_OUTPUT, "video-output" },
+	{ V4L2_CAP_VIDEO_OVERLAY, "video-overlay" },
+#ifdef V4L2_CAP_VIDEO_CAPTURE_MPLANE
+	{ V4L2_CAP_VIDEO_CAPTURE_MPLANE, "video-capture-mplane" },
+	{ V4L2_CAP_VIDEO_OUTPUT_MPLANE, "video-output-mplane" },
+#endif
+#ifdef V4L2_CAP_VIDEO_M2M
+	{ V4L2_CAP_VIDEO_M2M, "video-m2m" },
+#endif
+#ifdef V4L2_CAP_VIDEO_M2M_MPLANE
+	{ V4L2_CAP_VIDEO_M2M_MPLANE, "video-m2m-mplane" },
+#endif
+#ifdef V4L2_CAP_META_CAPTURE
+	{ V4L2_CAP_META_CAPTURE, "meta-capture" },
+#endif
+	{ V4L2_CAP_VBI_CAPTURE, "vbi-capture" },
+	{ V4L2_CAP_TUNER, "tuner" },
+	{ V4L2_CAP_AUDIO, "audio" },
+	{ V4L2_CAP_READWRITE, "readwrite" },
+	{ V4L2_CAP_STREAMING, "streaming" },
+	{ 0, NULL }
+    };
+    Tcl_HashEntry *hPtr;
+    VPROBE *vprobe;
+    struct stat sb;
+    struct v4l2_capability cap;
+    struct v4l2_fmtdesc fdesc;
+    Tcl_Obj *info, *caps, *fmts, *sizes;
+    char buffer[128], fcbuf[8];
+    int fd, i, k, capBits, isNew;
+
+    if (stat(devName, &sb) < 0) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("error while checking \"%s\": %s",
+			  devName, Tcl_PosixError(interp)));
+	return TCL_ERROR;
     }
-    if ((mirror & 3) == 1) {
-	/* mirror in Y */
-	block.pixelPtr += block.pitch * (block.height - 1);
-	block.pitch = -block.pitch;
+    hPtr = Tcl_FindHashEntry(&v4l2i->probes, devName);
+    if (hPtr != NULL) {
+	vprobe = (VPROBE *) Tcl_GetHashValue(hPtr);
+	if ((vprobe->rdev == sb.st_rdev) && (vprobe->ctime == sb.st_ctime)) {
+	    Tcl_SetObjResult(interp, vprobe->info);
+	    return TCL_OK;
+	}
+	ForgetDevice(v4l2i, devName);
     }
-    if (Tk_PhotoExpand(interp, photo, block.width, block.height) != TCL_OK) {
+    fd = open(devName, O_RDWR | O_NONBLOCK, 0);
+    if (fd < 0) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("error while opening \"%s\": %s",
+			  devName, Tcl_PosixError(interp)));
 	return TCL_ERROR;
     }
-    if (Tk_PhotoPutBlock(interp, photo, &block, 0, 0, block.width,
-			 block.height, TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    capBits = QueryCaps(fd, &cap);
+    if (capBits < 0) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("error querying capabilities: %s",
+			  Tcl_PosixError(interp)));
+	close(fd);
 	return TCL_ERROR;
     }
+    cap.driver[sizeof (cap.driver) - 1] = '\0';
+    cap.card[sizeof (cap.card) - 1] = '\0';
+    info = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("driver", -1));
+    Tcl_ListObjAppendElement(NULL, info,
+			     Tcl_NewStringObj((char *) cap.driver, -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("card", -1));
+    Tcl_ListObjAppendElement(NULL, info,
+			     Tcl_NewStringObj((char *) cap.card, -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("bus-info", -1));
+    Tcl_ListObjAppendElement(NULL, info,
+			     Tcl_NewStringObj((char *) cap.bus_info, -1));
+    sprintf(buffer, "%d.%d.%d", (cap.version >> 16) & 0xFF,
+	    (cap.version >> 8) & 0xFF, cap.version & 0xFF);
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("version", -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(buffer, -1));
+    caps = Tcl_NewListObj(0, NULL);
+    for (i = 0; capNames[i].name != NULL; i++) {
+	if (capBits & capNames[i].cap) {
+	    Tcl_ListObjAppendElement(NULL, caps,
+				     Tcl_NewStringObj(capNames[i].name, -1));
+	}
+    }
+    Tcl_ListObjAppendElement(NULL, info,
+			     Tcl_NewStringObj("capabilities", -1));
+    Tcl_ListObjAppendElement(NULL, info, caps);
+    fmts = Tcl_NewListObj(0, NULL);
+    for (i = 0; (capBits & V4L2_CAP_VIDEO_CAPTURE) && (i >= 0); i++) {
+	memset(&fdesc, 0, sizeof (fdesc));
+	fdesc.index = i;
+	fdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (DoIoctl(fd, VIDIOC_ENUM_FMT, &fdesc) < 0) {
+	    break;
+	}
+	if (fdesc.pixelformat == 0) {
+	    continue;
+	}
+	/* fourcc without leading "@" */
+	Tcl_ListObjAppendElement(NULL, fmts,
+	    Tcl_NewStringObj(fourcc_str(fdesc.pixelformat, fcbuf) + 1, -1));
+	sizes = Tcl_NewListObj(0, NULL);
+#ifdef VIDIOC_ENUM_FRAMESIZES
+	for (k = 0; k >= 0; k++) {
+	    struct v4l2_frmsizeenum qfsz;
+
+	    memset(&qfsz, 0, sizeof (qfsz));
+	    qfsz.index = k;
+	    qfsz.pixel_format = fdesc.pixelformat;
+	    if (DoIoctl(fd, VIDIOC_ENUM_FRAMESIZES, &qfsz) < 0) {
+		break;
+	    }
+	    if (qfsz.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+		sprintf(buffer, "%dx%d", qfsz.discrete.width,
+			qfsz.discrete.height);
+		Tcl_ListObjAppendElement(NULL, sizes,
+					 Tcl_NewStringObj(buffer, -1));
+#ifdef VIDIOC_ENUM_FRAMEINTERVALS
+		Tcl_ListObjAppendElement(NULL, sizes,
+		    ProbeFrameRates(fd, fdesc.pixelformat,
+				    qfsz.discrete.width,
+				    qfsz.discrete.height));
+#else
+		Tcl_ListObjAppendElement(NULL, sizes, Tcl_NewObj());
+#endif
+		continue;
+	    }
+	    /* stepwise or continuous: "+"min and "+"max frame size */
+	    sprintf(buffer, "+%dx%d", qfsz.stepwise.min_width,
+		    qfsz.stepwise.min_height);
+	    Tcl_ListObjAppendElement(NULL, sizes,
+				     Tcl_NewStringObj(buffer, -1));
+#ifdef VIDIOC_ENUM_FRAMEINTERVALS
+	    Tcl_ListObjAppendElement(NULL, sizes,
+		ProbeFrameRates(fd, fdesc.pixelformat,
+				qfsz.stepwise.min_width,
+				qfsz.stepwise.min_height));
+#else
+	    Tcl_ListObjAppendElement(NULL, sizes, Tcl_NewObj());
+#endif
+	    sprintf(buffer, "+%dx%d", qfsz.stepwise.max_width,
+		    qfsz.stepwise.max_height);
+	    Tcl_ListObjAppendElement(NULL, sizes,
+				     Tcl_NewStringObj(buffer, -1));
+#ifdef VIDIOC_ENUM_FRAMEINTERVALS
+	    Tcl_ListObjAppendElement(NULL, sizes,
+		ProbeFrameRates(fd, fdesc.pixelformat,
+				qfsz.stepwise.max_width,
+				qfsz.stepwise.max_height));
+#else
+	    Tcl_ListObjAppendElement(NULL, sizes, Tcl_NewObj());
+#endif
+	    break;
+	}
+#endif
+	Tcl_ListObjAppendElement(NULL, fmts, sizes);
+    }
+    close(fd);
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("formats", -1));
+    Tcl_ListObjAppendElement(NULL, info, fmts);
+    vprobe = (VPROBE *) ckalloc(sizeof (VPROBE));
+    vprobe->rdev = sb.st_rdev;
+    vprobe->ctime = sb.st_ctime;
+    vprobe->info = info;
+    Tcl_IncrRefCount(info);
+    hPtr = Tcl_CreateHashEntry(&v4l2i->probes, devName, &isNew);
+    Tcl_SetHashValue(hPtr, (ClientData) vprobe);
+    hPtr = Tcl_CreateHashEntry(&v4l2i->vcaps, devName, &isNew);
+    Tcl_SetHashValue(hPtr, (ClientData) (long) capBits);
+    Tcl_SetObjResult(interp, info);
     return TCL_OK;
 }
 
 /*
  *-------------------------------------------------------------------------
  *
- * IsLoopDevice --
+ * DeviceMonitor --
  *
- *	Determine if device is a loopback device.
+ *	Return true when the table of devices is kept current by
+ *	udev or inotify.
  *
  *-------------------------------------------------------------------------
  */
 
-#ifdef linux
 static int
-IsLoopDevice(const char *devName)
+DeviceMonitor(V4L2I *v4l2i)
 {
-    const char *p;
-    int rc;
-    Tcl_DString ds;
-
-    p = strrchr(devName, '/');
-    if ((p != NULL) && p[1]) {
-	devName = p + 1;
+#ifdef HAVE_LIBUDEV
+    if (v4l2i->udevMon != NULL) {
+	return 1;
     }
-    Tcl_DStringInit(&ds);
-    Tcl_DStringAppend(&ds, "/sys/devices/virtual/video4linux/", -1);
-    Tcl_DStringAppend(&ds, devName, -1);
-    Tcl_DStringAppend(&ds, "/format", -1);
-    rc = access(Tcl_DStringValue(&ds), R_OK);
-    Tcl_DStringFree(&ds);
-    return (rc == 0);
-}
 #endif
+#ifdef linux
+    if (v4l2i->inotifyFd >= 0) {
+	return 1;
+    }
+#endif
+    return 0;
+}
 
 /*
  *-------------------------------------------------------------------------
@@ -2549,21 +13375,96 @@ V4l2ObjCmdDeleted(ClientData clientData)
     while (hPtr != NULL) {
 	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
 	StopCapture(v4l2c);
+	ForwardUnlink(v4l2c);
+	PaceStop(v4l2c);
+	LoopRelease(v4l2c);
+	StagesFree(v4l2c);
+	RecordFree(v4l2c);
+	Y4MStop(v4l2c);
+	AviStop(v4l2c);
+	VlzStop(v4l2c);
+	HttpStop(v4l2c);
+#ifdef USE_MJPEG
+	EncodeJPEGFree(v4l2c);
+#endif
 	v4l2_close(v4l2c->fd);
 	v4l2c->fd = -1;
+	if (v4l2c->reattachTimer != NULL) {
+	    Tcl_DeleteTimerHandler(v4l2c->reattachTimer);
+	}
 	InitControls(v4l2c);	/* release */
 	Tcl_DeleteHashTable(&v4l2c->ctrl);
 	Tcl_DeleteHashTable(&v4l2c->nctrl);
 	Tcl_DStringFree(&v4l2c->devName);
+	Tcl_DStringFree(&v4l2c->devKey);
+	Tcl_DStringFree(&v4l2c->metaName);
+	if (v4l2c->metaFd >= 0) {
+	    close(v4l2c->metaFd);
+	}
+	if (v4l2c->evCmd != NULL) {
+	    Tcl_DecrRefCount(v4l2c->evCmd);
+	}
 	Tcl_DStringFree(&v4l2c->cbCmd);
 	ckfree((char *) v4l2c);
 	hPtr = Tcl_NextHashEntry(&search);
     }
     Tcl_DeleteHashTable(&v4l2i->v4l2c);
-#ifdef HAVE_LIBUDEV
+    hPtr = Tcl_FirstHashEntry(&v4l2i->m2m, &search);
+    while (hPtr != NULL) {
+	V4L2M *v4l2m = (V4L2M *) Tcl_GetHashValue(hPtr);
+
+	M2MRelease(v4l2m);
+	close(v4l2m->fd);
+	Tcl_DStringFree(&v4l2m->devName);
+	ckfree((char *) v4l2m);
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&v4l2i->m2m);
+    hPtr = Tcl_FirstHashEntry(&v4l2i->mosaics, &search);
+    while (hPtr != NULL) {
+	VMOSAIC *mosaic = (VMOSAIC *) Tcl_GetHashValue(hPtr);
+
+	MosaicFree(mosaic);
+	Tcl_DStringFree(&mosaic->target);
+	ckfree(mosaic->canvas);
+	ckfree((char *) mosaic);
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&v4l2i->mosaics);
+    hPtr = Tcl_FirstHashEntry(&v4l2i->y4m, &search);
+    while (hPtr != NULL) {
+	VY4MR *y4r = (VY4MR *) Tcl_GetHashValue(hPtr);
+
+	close(y4r->fd);
+	ckfree(y4r->buf);
+	ckfree((char *) y4r);
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&v4l2i->y4m);
+    hPtr = Tcl_FirstHashEntry(&v4l2i->vlz, &search);
+    while (hPtr != NULL) {
+	VlzClose((VVLZR *) Tcl_GetHashValue(hPtr));
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&v4l2i->vlz);
+    PoolFree(v4l2i);
     v4l2i->interp = NULL;
     Tcl_DStringFree(&v4l2i->cbCmd);
     Tcl_DeleteHashTable(&v4l2i->vdevs);
+    hPtr = Tcl_FirstHashEntry(&v4l2i->probes, &search);
+    while (hPtr != NULL) {
+	VPROBE *vprobe = (VPROBE *) Tcl_GetHashValue(hPtr);
+
+	Tcl_DecrRefCount(vprobe->info);
+	ckfree((char *) vprobe);
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&v4l2i->probes);
+    Tcl_DeleteHashTable(&v4l2i->vcaps);
+#ifdef linux
+    InotifyRelease(v4l2i);
+#endif
+#ifdef HAVE_LIBUDEV
     if (v4l2i->udevMon != NULL) {
 	Tcl_DeleteFileHandler(udev_monitor_get_fd(v4l2i->udevMon));
 	udev_monitor_unref(v4l2i->udevMon);
@@ -2603,18 +13504,25 @@ V4l2ObjCmd(ClientData clientData, Tcl_Interp *interp,
     int ret = TCL_OK, command;
 
     static const char *cmdNames[] = {
-	"close", "counters", "devices", "greyimage", "greyshift",
-	"image", "info", "isloopback", "listen", "loopback",
-	"mbcopy", "mcopy", "mirror", "open", "orientation",
-	"parameters", "start", "state", "stop", "tophoto", "write",
-	"writephoto", NULL
+	"burst", "chromakey", "close", "counters", "devices", "events",
+	"forward", "greyimage", "greyshift", "httpd", "idle", "image",
+	"info", "isloopback", "jpeg", "listen", "loopback", "m2m", "mbcopy",
+	"mcopy", "metadata", "mirror", "mosaic", "open", "orientation",
+	"overlay", "pace", "packet", "parameters", "pause", "probe",
+	"reattach", "record", "resume", "snapshot", "start", "state",
+	"stereo", "stop", "timestamp", "tophoto", "vlz", "write",
+	"writephoto", "y4m", NULL
     };
     enum cmdCode {
-	CMD_close, CMD_counters, CMD_devices, CMD_greyimage, CMD_greyshift,
-	CMD_image, CMD_info, CMD_isloopback, CMD_listen, CMD_loopback,
-	CMD_mbcopy, CMD_mcopy, CMD_mirror, CMD_open, CMD_orientation,
-	CMD_parameters,	CMD_start, CMD_state, CMD_stop, CMD_tophoto, CMD_write,
-	CMD_writephoto
+	CMD_burst, CMD_chromakey, CMD_close, CMD_counters, CMD_devices,
+	CMD_events, CMD_forward, CMD_greyimage, CMD_greyshift, CMD_httpd,
+	CMD_idle, CMD_image, CMD_info, CMD_isloopback, CMD_jpeg, CMD_listen,
+	CMD_loopback, CMD_m2m, CMD_mbcopy, CMD_mcopy, CMD_metadata,
+	CMD_mirror, CMD_mosaic, CMD_open, CMD_orientation, CMD_overlay,
+	CMD_pace, CMD_packet, CMD_parameters, CMD_pause, CMD_probe,
+	CMD_reattach, CMD_record, CMD_resume, CMD_snapshot, CMD_start,
+	CMD_state, CMD_stereo, CMD_stop, CMD_timestamp, CMD_tophoto,
+	CMD_vlz, CMD_write, CMD_writephoto, CMD_y4m
     };
 
     if (objc < 2) {
@@ -2628,6 +13536,59 @@ V4l2ObjCmd(ClientData clientData, Tcl_Interp *interp,
 
     switch ((enum cmdCode) command) {
 
+    case CMD_burst: {
+	int count, width, height, format;
+	static const char *burstOpts[] = { "-format", NULL };
+	int opt;
+
+	if ((objc != 4) && (objc != 6)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid count ?-format size?");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (Tcl_GetIntFromObj(interp, objv[3], &count) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if ((count <= 0) || (count > BURST_MAXCOUNT)) {
+	    Tcl_SetResult(interp, "invalid frame count", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if (v4l2c->snapshot) {
+	    Tcl_SetResult(interp, "snapshot in progress", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if (objc > 4) {
+	    if (Tcl_GetIndexFromObj(interp, objv[4], burstOpts, "option", 0,
+				    &opt) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (!ParseFrameSize(Tcl_GetString(objv[5]), &width, &height,
+				&format)) {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("invalid frame size \"%s\"",
+				  Tcl_GetString(objv[5])));
+		return TCL_ERROR;
+	    }
+	} else if ((v4l2c->running > 0) && !v4l2c->paused && !v4l2c->idle) {
+	    /* capturing, take frames as they come */
+	    ret = Burst(v4l2c, count, 0);
+	    break;
+	} else {
+	    width = v4l2c->width;
+	    height = v4l2c->height;
+	    format = v4l2c->wantFormat;
+	}
+	if (BeginSnapshot(v4l2c, width, height, format) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	ret = Burst(v4l2c, count, 1);
+	break;
+    }
+
     case CMD_close:
 	if (objc != 3) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "devid");
@@ -2638,12 +13599,36 @@ V4l2ObjCmd(ClientData clientData, Tcl_Interp *interp,
 	    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
 	    Tcl_DeleteHashEntry(hPtr);
 	    StopCapture(v4l2c);
+	    ForwardUnlink(v4l2c);
+	    KeyUnlink(v4l2i, v4l2c);
+	    StagesFree(v4l2c);
+	    RecordFree(v4l2c);
+	    Y4MStop(v4l2c);
+	    AviStop(v4l2c);
+	    VlzStop(v4l2c);
+	    HttpStop(v4l2c);
+	    PaceStop(v4l2c);
+	    LoopRelease(v4l2c);
+#ifdef USE_MJPEG
+	    EncodeJPEGFree(v4l2c);
+#endif
 	    v4l2_close(v4l2c->fd);
 	    v4l2c->fd = -1;
+	    if (v4l2c->reattachTimer != NULL) {
+		Tcl_DeleteTimerHandler(v4l2c->reattachTimer);
+	    }
 	    InitControls(v4l2c);	/* release */
 	    Tcl_DeleteHashTable(&v4l2c->ctrl);
 	    Tcl_DeleteHashTable(&v4l2c->nctrl);
 	    Tcl_DStringFree(&v4l2c->devName);
+	    Tcl_DStringFree(&v4l2c->devKey);
+	    Tcl_DStringFree(&v4l2c->metaName);
+	    if (v4l2c->metaFd >= 0) {
+		close(v4l2c->metaFd);
+	    }
+	    if (v4l2c->evCmd != NULL) {
+		Tcl_DecrRefCount(v4l2c->evCmd);
+	    }
 	    Tcl_DStringFree(&v4l2c->cbCmd);
 	    ckfree((char *) v4l2c);
 	} else {
@@ -2678,11 +13663,15 @@ devNotFound:
 	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
 	    return TCL_ERROR;
 	}
-#ifdef HAVE_LIBUDEV
-	if (v4l2i->udevMon != NULL) {
+	if (DeviceMonitor(v4l2i)) {
 	    Tcl_Obj *list = Tcl_NewListObj(0, NULL);
 	    Tcl_HashSearch search;
 
+#ifdef linux
+	    if (v4l2i->inotify != NULL) {
+		InotifyScan(v4l2i);
+	    }
+#endif
 	    hPtr = Tcl_FirstHashEntry(&v4l2i->vdevs, &search);
 	    while (hPtr != NULL) {
 		Tcl_ListObjAppendElement(NULL, list,
@@ -2690,15 +13679,38 @@ devNotFound:
 		hPtr = Tcl_NextHashEntry(&search);
 	    }
 	    Tcl_SetObjResult(interp, list);
-	} else
-#endif
-	{
+	} else {
 	    ret = Tcl_EvalEx(interp,
 			     "glob -nocomplain -types {c l s} /dev/video*",
 			     -1, TCL_EVAL_GLOBAL);
 	}
 	break;
 
+    case CMD_events:
+	if ((objc < 3) || (objc > 4)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?callback?");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (objc > 3) {
+	    if (v4l2c->evCmd != NULL) {
+		Tcl_DecrRefCount(v4l2c->evCmd);
+		v4l2c->evCmd = NULL;
+	    }
+	    if (Tcl_GetString(objv[3])[0] != '\0') {
+		v4l2c->evCmd = objv[3];
+		Tcl_IncrRefCount(v4l2c->evCmd);
+	    }
+	}
+	if (v4l2c->evCmd != NULL) {
+	    Tcl_SetObjResult(interp, v4l2c->evCmd);
+	}
+	break;
+
     case CMD_greyimage:
 	if ((objc < 4) || (objc > 5)) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "devid mask ?photoImage?");
@@ -2747,7 +13759,51 @@ devNotFound:
 		Tcl_SetIntObj(Tcl_GetObjResult(interp), v4l2c->greyshift);
 	    }
 	} else {
-	    goto devNotFound;
+	    goto devNotFound;
+	}
+	break;
+
+    case CMD_idle:
+	if ((objc < 3) || (objc > 5)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?seconds ?fps??");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (objc > 3) {
+	    double seconds;
+	    int fps = 0;
+
+	    if (Tcl_GetDoubleFromObj(interp, objv[3], &seconds) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if ((objc > 4) &&
+		(Tcl_GetIntFromObj(interp, objv[4], &fps) != TCL_OK)) {
+		return TCL_ERROR;
+	    }
+	    if ((seconds < 0) || (fps < 0) || (fps >= 200)) {
+		Tcl_SetResult(interp, "invalid idle parameters", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if ((fps > 0) && (v4l2c->fps > 0) &&
+		(fps >= (v4l2c->idle ? v4l2c->activeFps : v4l2c->fps))) {
+		Tcl_SetResult(interp, "idle frame rate must be below "
+			      "frame rate", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    /* changing the policy wakes up the device first */
+	    ret = IdleWakeup(v4l2c);
+	    v4l2c->idleTime = seconds;
+	    v4l2c->idleFps = fps;
+	} else {
+	    Tcl_Obj *list[2];
+
+	    list[0] = Tcl_NewDoubleObj(v4l2c->idleTime);
+	    list[1] = Tcl_NewIntObj(v4l2c->idleFps);
+	    Tcl_SetObjResult(interp, Tcl_NewListObj(2, list));
 	}
 	break;
 
@@ -2816,20 +13872,24 @@ devNotFound:
 	    Tcl_WrongNumArgs(interp, 2, objv, "?cmd?");
 	    return TCL_ERROR;
 	}
-#ifdef HAVE_LIBUDEV
-	if (v4l2i->udevMon != NULL) {
+	if (DeviceMonitor(v4l2i)) {
 	    if (objc == 2) {
 		Tcl_DStringSetLength(&v4l2i->cbCmd, v4l2i->cbCmdLen);
 		Tcl_SetObjResult(interp,
 			Tcl_NewStringObj(Tcl_DStringValue(&v4l2i->cbCmd),
 					 Tcl_DStringLength(&v4l2i->cbCmd)));
 	    } else {
+#ifdef linux
+		/* known nodes are needed to report removals */
+		if (v4l2i->inotify != NULL) {
+		    InotifyScan(v4l2i);
+		}
+#endif
 		Tcl_DStringSetLength(&v4l2i->cbCmd, 0);
 		Tcl_DStringAppend(&v4l2i->cbCmd, Tcl_GetString(objv[2]), -1);
 		v4l2i->cbCmdLen = Tcl_DStringLength(&v4l2i->cbCmd);
 	    }
 	}
-#endif
 	break;
 
     case CMD_loopback: {
@@ -2900,6 +13960,10 @@ devNotFound:
 
 	    i = 0;
 	    p = Tcl_GetString(objv[3]);
+	    if (strcmp(p, "I420") == 0) {
+		/* common alias of YU12 */
+		p = "YU12";
+	    }
 	    memset(fcbuf, ' ', 4);
 	    while (i < 4) {
 		if (p[i] == '\0') {
@@ -3020,6 +14084,266 @@ devNotFound:
 #endif
 	break;
     }
+    case CMD_packet: {
+	Tcl_Obj *list[10];
+	char fcbuf[8];
+	int length, keyframe;
+
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (IdleWakeup(v4l2c) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (v4l2c->bufrdy < 0) {
+	    break;
+	}
+	length = v4l2c->rdyUsed;
+	if ((length <= 0) || (length > v4l2c->vbufs[v4l2c->bufrdy].length)) {
+	    length = v4l2c->vbufs[v4l2c->bufrdy].length;
+	}
+	/* MJPEG frames are all intra coded */
+	keyframe = (v4l2c->format != V4L2_PIX_FMT_H264) ||
+	    (v4l2c->rdyFlags & V4L2_BUF_FLAG_KEYFRAME);
+	list[0] = Tcl_NewStringObj("data", -1);
+	list[1] = Tcl_NewByteArrayObj(v4l2c->vbufs[v4l2c->bufrdy].start,
+				      length);
+	list[2] = Tcl_NewStringObj("keyframe", -1);
+	list[3] = Tcl_NewBooleanObj(keyframe);
+	list[4] = Tcl_NewStringObj("timestamp", -1);
+	list[5] = Tcl_NewDoubleObj(v4l2c->rdyTime);
+	list[6] = Tcl_NewStringObj("sequence", -1);
+	list[7] = Tcl_NewWideIntObj(v4l2c->rdySeq);
+	list[8] = Tcl_NewStringObj("format", -1);
+	list[9] = Tcl_NewStringObj(fourcc_str(v4l2c->format, fcbuf) + 1, -1);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(10, list));
+	if (!v4l2c->bufdone) {
+	    v4l2c->bufdone = 1;
+	    v4l2c->counters[1] += 1;
+	}
+	break;
+    }
+
+    case CMD_pace: {
+	VPACE *pace;
+	double fps = 0;
+	int depth = 2;
+
+	if ((objc < 3) || (objc > 5)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?fps ?depth??");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (!v4l2c->isLoopDev) {
+	    Tcl_SetResult(interp, "not a loop device", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if (objc > 3) {
+	    char *p = Tcl_GetString(objv[3]);
+	    int num, den = 1;
+
+	    if (strcmp(p, "off") == 0) {
+		PaceStop(v4l2c);
+		break;
+	    }
+	    if ((strcmp(p, "auto") != 0) &&
+		((sscanf(p, "%d/%d", &num, &den) < 1) ||
+		 (num <= 0) || (den <= 0))) {
+		Tcl_SetResult(interp, "invalid frame rate parameter",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (strcmp(p, "auto") != 0) {
+		fps = (double) num / den;
+	    }
+	    if ((objc > 4) &&
+		(Tcl_GetIntFromObj(interp, objv[4], &depth) != TCL_OK)) {
+		return TCL_ERROR;
+	    }
+	    if ((depth < 1) || (depth > PACE_MAXDEPTH)) {
+		Tcl_SetResult(interp, "invalid queue depth", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    PaceStop(v4l2c);
+	    if (PaceStart(interp, v4l2c, fps, depth) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	}
+	pace = v4l2c->pace;
+	if (pace != NULL) {
+	    Tcl_Obj *list[14];
+
+	    Tcl_MutexLock(&pace->mutex);
+	    list[0] = Tcl_NewStringObj("fps", -1);
+	    list[1] = Tcl_NewDoubleObj(pace->fps);
+	    list[2] = Tcl_NewStringObj("depth", -1);
+	    list[3] = Tcl_NewIntObj(pace->depth);
+	    list[4] = Tcl_NewStringObj("emitted", -1);
+	    list[5] = Tcl_NewWideIntObj(pace->emitted);
+	    list[6] = Tcl_NewStringObj("repeated", -1);
+	    list[7] = Tcl_NewWideIntObj(pace->repeated);
+	    list[8] = Tcl_NewStringObj("dropped", -1);
+	    list[9] = Tcl_NewWideIntObj(pace->dropped);
+	    list[10] = Tcl_NewStringObj("late", -1);
+	    list[11] = Tcl_NewWideIntObj(pace->late);
+	    list[12] = Tcl_NewStringObj("errors", -1);
+	    list[13] = Tcl_NewWideIntObj(pace->errors);
+	    Tcl_MutexUnlock(&pace->mutex);
+	    Tcl_SetObjResult(interp, Tcl_NewListObj(14, list));
+	}
+	break;
+    }
+
+    case CMD_forward: {
+	V4L2C *dst;
+	int i, rot = -1, mirror = -1;
+
+	if ((objc < 3) || (objc % 2 == 0)) {
+	    Tcl_WrongNumArgs(interp, 2, objv,
+			     "devid ?loopdevid? ?-rotate degrees? "
+			     "?-mirror {x y}?");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (objc == 3) {
+	    Tcl_Obj *list[6];
+
+	    if (v4l2c->fwdDst != NULL) {
+		list[0] = Tcl_NewStringObj("target", -1);
+		list[1] = Tcl_NewStringObj(v4l2c->fwdDst->devId, -1);
+		list[2] = Tcl_NewStringObj("frames", -1);
+		list[3] = Tcl_NewWideIntObj(v4l2c->fwdFrames);
+		list[4] = Tcl_NewStringObj("errors", -1);
+		list[5] = Tcl_NewWideIntObj(v4l2c->fwdErrors);
+		Tcl_SetObjResult(interp, Tcl_NewListObj(6, list));
+	    }
+	    break;
+	}
+	if (Tcl_GetString(objv[3])[0] == '\0') {
+	    if (v4l2c->fwdDst != NULL) {
+		v4l2c->fwdDst->fwdSrc = NULL;
+		v4l2c->fwdDst = NULL;
+	    }
+	    break;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[3]));
+	if (hPtr == NULL) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("device \"%s\" not found",
+			      Tcl_GetString(objv[3])));
+	    return TCL_ERROR;
+	}
+	dst = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (!dst->isLoopDev || (dst == v4l2c)) {
+	    Tcl_SetResult(interp, "not a loop device", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if ((dst->fwdSrc != NULL) && (dst->fwdSrc != v4l2c)) {
+	    Tcl_SetResult(interp, "loop device already fed", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	for (i = 4; i < objc; i += 2) {
+	    char *opt = Tcl_GetString(objv[i]);
+
+	    if (strcmp(opt, "-rotate") == 0) {
+		if (Tcl_GetIntFromObj(interp, objv[i + 1], &rot) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		if ((rot % 90) != 0) {
+		    Tcl_SetResult(interp, "unsupported rotation",
+				  TCL_STATIC);
+		    return TCL_ERROR;
+		}
+		rot = ((rot % 360) + 360) % 360;
+	    } else if (strcmp(opt, "-mirror") == 0) {
+		Tcl_Obj **elems;
+		int nelems, x, y;
+
+		if ((Tcl_ListObjGetElements(interp, objv[i + 1], &nelems,
+					    &elems) != TCL_OK)) {
+		    return TCL_ERROR;
+		}
+		if ((nelems != 2) ||
+		    (Tcl_GetBooleanFromObj(interp, elems[0], &x) != TCL_OK) ||
+		    (Tcl_GetBooleanFromObj(interp, elems[1], &y) != TCL_OK)) {
+		    Tcl_SetResult(interp, "expected list of two booleans",
+				  TCL_STATIC);
+		    return TCL_ERROR;
+		}
+		mirror = (x ? 1 : 0) | (y ? 2 : 0);
+	    } else {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("bad option \"%s\": must be -mirror or "
+				  "-rotate", opt));
+		return TCL_ERROR;
+	    }
+	}
+	if (v4l2c->fwdDst != NULL) {
+	    v4l2c->fwdDst->fwdSrc = NULL;
+	}
+	v4l2c->fwdDst = dst;
+	dst->fwdSrc = v4l2c;
+	v4l2c->fwdRotate = rot;
+	v4l2c->fwdMirror = mirror;
+	v4l2c->fwdFrames = 0;
+	v4l2c->fwdErrors = 0;
+	break;
+    }
+
+    case CMD_chromakey:
+	ret = KeyCmd(v4l2i, interp, objc, objv);
+	break;
+
+    case CMD_overlay:
+	ret = OverlayCmd(v4l2i, interp, objc, objv);
+	break;
+
+    case CMD_record:
+	ret = RecordCmd(v4l2i, interp, objc, objv);
+	break;
+
+    case CMD_y4m:
+	ret = Y4MCmd(v4l2i, interp, objc, objv);
+	break;
+
+    case CMD_vlz:
+	ret = VlzCmd(v4l2i, interp, objc, objv);
+	break;
+
+    case CMD_httpd:
+	ret = HttpdCmd(v4l2i, interp, objc, objv);
+	break;
+
+    case CMD_jpeg:
+	ret = JpegCmd(v4l2i, interp, objc, objv);
+	break;
+
+    case CMD_stereo:
+	ret = StereoCmd(v4l2i, interp, objc, objv);
+	break;
+
+    case CMD_mosaic:
+	ret = MosaicCmd(v4l2i, interp, objc, objv);
+	break;
+
+    case CMD_m2m:
+	ret = M2MCmd(v4l2i, interp, objc, objv);
+	break;
+
     case CMD_mbcopy: {
 	int mask0, mask, i, srcLen, dstLen;
 	unsigned char *src, *dst;
@@ -3166,6 +14490,25 @@ devNotFound:
 	break;
     }
 
+    case CMD_metadata:
+	if ((objc < 3) || (objc > 4)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?device?");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if ((objc > 3) &&
+	    (MetaOpen(v4l2c, Tcl_GetString(objv[3])) != TCL_OK)) {
+	    return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp,
+		Tcl_NewStringObj(Tcl_DStringValue(&v4l2c->metaName),
+				 Tcl_DStringLength(&v4l2c->metaName)));
+	break;
+
     case CMD_mirror: {
 	int x, y;
 
@@ -3303,6 +14646,7 @@ devNotFound:
 	v4l2c->mirror = 0;
 	v4l2c->rotate = 0;
 	v4l2c->bufrdy = -1;
+	v4l2c->metaFd = -1;
 	v4l2c->width = fmt.fmt.pix.width;
 	if (v4l2c->width < 0) {
 	    v4l2c->width = 640;
@@ -3315,6 +14659,8 @@ devNotFound:
 	v4l2c->interp = interp;
 	Tcl_DStringInit(&v4l2c->devName);
 	Tcl_DStringAppend(&v4l2c->devName, devName, -1);
+	Tcl_DStringInit(&v4l2c->devKey);
+	Tcl_DStringInit(&v4l2c->metaName);
 	Tcl_DStringInit(&v4l2c->cbCmd);
 	Tcl_DStringAppend(&v4l2c->cbCmd, Tcl_GetString(objv[3]), -1);
 	v4l2c->cbCmdLen = Tcl_DStringLength(&v4l2c->cbCmd);
@@ -3402,6 +14748,107 @@ devNotFound:
 	}
 	break;
 
+    case CMD_pause:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr != NULL) {
+	    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	    ret = PauseCapture(v4l2c);
+	    IdleCancel(v4l2c);
+	} else {
+	    goto devNotFound;
+	}
+	break;
+
+    case CMD_probe:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "device");
+	    return TCL_ERROR;
+	}
+	ret = ProbeInfo(v4l2i, interp, Tcl_GetString(objv[2]));
+	break;
+
+    case CMD_reattach: {
+	int flag;
+
+	if ((objc < 3) || (objc > 4)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?bool?");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (objc > 3) {
+	    if (Tcl_GetBooleanFromObj(interp, objv[3], &flag) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (flag && !v4l2c->reattach && !v4l2c->detached) {
+		DeviceKey(v4l2c);
+	    }
+	    v4l2c->reattach = flag;
+	}
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(v4l2c->reattach));
+	break;
+    }
+
+    case CMD_resume:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr != NULL) {
+	    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	    ret = IdleWakeup(v4l2c);
+	    if (ret == TCL_OK) {
+		ret = ResumeCapture(v4l2c);
+	    }
+	} else {
+	    goto devNotFound;
+	}
+	break;
+
+    case CMD_snapshot: {
+	int width, height, format;
+
+	if ((objc < 4) || (objc > 5)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid size ?callback?");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	if (v4l2c->snapshot) {
+	    Tcl_SetResult(interp, "snapshot in progress", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if (!ParseFrameSize(Tcl_GetString(objv[3]), &width, &height,
+			    &format)) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("invalid frame size \"%s\"",
+			      Tcl_GetString(objv[3])));
+	    return TCL_ERROR;
+	}
+	if (BeginSnapshot(v4l2c, width, height, format) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (objc > 4) {
+	    v4l2c->snapCmd = objv[4];
+	    Tcl_IncrRefCount(v4l2c->snapCmd);
+	    v4l2c->snapshot = 1;
+	} else {
+	    ret = WaitSnapshot(v4l2c);
+	}
+	break;
+    }
+
     case CMD_start:
 	if (objc != 3) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "devid");
@@ -3424,8 +14871,10 @@ devNotFound:
 	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
 	if (hPtr != NULL) {
 	    v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
-	    Tcl_SetResult(interp, (v4l2c->running < 0) ? "error" :
-			  (v4l2c->running ? "capture" : "stopped"),
+	    Tcl_SetResult(interp, v4l2c->detached ? "detached" :
+			  (v4l2c->running < 0) ? "error" :
+			  (v4l2c->running ? (v4l2c->paused ? "paused" :
+					     "capture") : "stopped"),
 			  TCL_STATIC);
 	} else {
 	    goto devNotFound;
@@ -3446,6 +14895,19 @@ devNotFound:
 	}
 	break;
 
+    case CMD_timestamp:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&v4l2i->v4l2c, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	v4l2c = (V4L2C *) Tcl_GetHashValue(hPtr);
+	ret = FrameTime(v4l2c);
+	break;
+
     case CMD_tophoto:
 	if (DataToPhoto(v4l2i, interp, objc, objv) != TCL_OK) {
 	    return TCL_ERROR;
@@ -3453,8 +14915,8 @@ devNotFound:
 	break;
 
     case CMD_write: {
-	unsigned char *data, *toFree = NULL;
-	int length, n;
+	unsigned char *data, *out, *toFree = NULL;
+	int length, n, how, index, outLen;
 
 	if (objc != 4) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "devid bytearray");
@@ -3477,9 +14939,14 @@ devNotFound:
 	    Tcl_SetResult(interp, "unsupported width or height", TCL_STATIC);
 	    return TCL_ERROR;
 	}
-	if ((v4l2c->loopFormat == V4L2_PIX_FMT_YUYV) ||
-	    (v4l2c->loopFormat == V4L2_PIX_FMT_YVYU) ||
-	    (v4l2c->loopFormat == V4L2_PIX_FMT_GREY)) {
+	how = LoopBegin(v4l2c, &out, &outLen, &index);
+	if (how < 0) {
+	    goto writeError;
+	}
+	if ((v4l2c->loopFormat != V4L2_PIX_FMT_RGB32) &&
+	    (v4l2c->loopFormat != V4L2_PIX_FMT_BGR32) &&
+	    (v4l2c->loopFormat != V4L2_PIX_FMT_RGB24) &&
+	    (v4l2c->loopFormat != V4L2_PIX_FMT_BGR24)) {
 	    Tk_PhotoImageBlock block;
 
 	    block.offset[0] = 0;
@@ -3503,22 +14970,49 @@ devNotFound:
 	    if ((v4l2c->loopFormat == V4L2_PIX_FMT_GREY) &&
 		(block.pixelSize == 1)) {
 		data = block.pixelPtr;
+	    } else if ((v4l2c->loopFormat != V4L2_PIX_FMT_YUYV) &&
+		       (v4l2c->loopFormat != V4L2_PIX_FMT_YVYU)) {
+		data = out;
+		n = outLen;
+		if ((out == NULL) || (outLen < LoopFrameSize(v4l2c))) {
+		    n = block.width * block.height * 4;
+		    data = toFree = attemptckalloc(n);
+		}
+		if (data == NULL) {
+		    errno = ENOMEM;
+		}
+		length = (data == NULL) ? 0 :
+		    ConvertBlock(v4l2c, &block, data, n);
+		if (length <= 0) {
+		    Tcl_SetObjResult(interp,
+				     Tcl_ObjPrintf("conversion failed: %s",
+						   Tcl_PosixError(interp)));
+		    LoopEnd(v4l2c, how, index, out, outLen, NULL, 0);
+		    if (toFree != NULL) {
+			ckfree(toFree);
+		    }
+		    return TCL_ERROR;
+		}
 	    } else {
-		toFree = ConvertToYUV(&block,
-				      v4l2c->loopFormat == V4L2_PIX_FMT_YVYU,
-				      &length);
-		if (toFree == NULL) {
+		data = ConvertToYUV(&block,
+				    v4l2c->loopFormat == V4L2_PIX_FMT_YVYU,
+				    out, &length);
+		if (data == NULL) {
+		    LoopEnd(v4l2c, how, index, out, outLen, NULL, 0);
 		    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
 		    return TCL_ERROR;
 		}
-		data = toFree;
+		if (out == NULL) {
+		    toFree = data;
+		}
 	    }
 	}
-	n = write(v4l2c->fd, data, length);
+	n = LoopEnd(v4l2c, how, index, out, outLen, data, length);
 	if (toFree != NULL) {
 	    ckfree(toFree);
 	}
 	if (n == -1) {
+writeError:
 	    Tcl_SetObjResult(interp,
 			 Tcl_ObjPrintf("write error: %s",
 				       Tcl_PosixError(interp)));
@@ -3531,8 +15025,8 @@ devNotFound:
 	char *name;
 	Tk_PhotoHandle ph;
 	Tk_PhotoImageBlock block;
-	int length, n;
-	unsigned char *toFree = NULL;
+	int length, n, how, index, outLen;
+	unsigned char *data, *out, *toFree = NULL;
 
 	if (objc != 4) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "devid photo");
@@ -3570,30 +15064,54 @@ devNotFound:
 	    return TCL_ERROR;
 	}
 	length = block.pitch * block.height * block.pixelSize;
+	how = LoopBegin(v4l2c, &out, &outLen, &index);
+	if (how < 0) {
+	    goto photoError;
+	}
 	if ((v4l2c->loopFormat == V4L2_PIX_FMT_YUYV) ||
 	    (v4l2c->loopFormat == V4L2_PIX_FMT_YVYU)) {
-	    toFree =
+	    data =
 		ConvertToYUV(&block, v4l2c->loopFormat == V4L2_PIX_FMT_YVYU,
-			     &length);
-	    if (toFree == NULL) {
-		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
-		return TCL_ERROR;
-	    }
-	    n = write(v4l2c->fd, toFree, length);
+			     out, &length);
 	} else if (v4l2c->loopFormat == V4L2_PIX_FMT_GREY) {
-	    toFree = ConvertToGREY(&block, &length);
-	    if (toFree == NULL) {
-		Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    data = ConvertToGREY(&block, out, &length);
+	} else if ((v4l2c->loopFormat == V4L2_PIX_FMT_NV12) ||
+		   (v4l2c->loopFormat == V4L2_PIX_FMT_YUV420) ||
+		   (v4l2c->loopFormat == V4L2_PIX_FMT_MJPEG)) {
+	    data = out;
+	    n = outLen;
+	    if ((out == NULL) || (outLen < LoopFrameSize(v4l2c))) {
+		n = block.width * block.height * 4;
+		data = attemptckalloc(n);
+	    }
+	    length = (data == NULL) ? 0 : ConvertBlock(v4l2c, &block, data, n);
+	    if ((length <= 0) && (data != NULL)) {
+		Tcl_SetObjResult(interp,
+				 Tcl_ObjPrintf("conversion failed: %s",
+					       Tcl_PosixError(interp)));
+		if (data != out) {
+		    ckfree(data);
+		}
+		LoopEnd(v4l2c, how, index, out, outLen, NULL, 0);
 		return TCL_ERROR;
 	    }
-	    n = write(v4l2c->fd, toFree, length);
 	} else {
-	    n = write(v4l2c->fd, block.pixelPtr, length);
+	    data = block.pixelPtr;
+	}
+	if (data == NULL) {
+	    LoopEnd(v4l2c, how, index, out, outLen, NULL, 0);
+	    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    return TCL_ERROR;
 	}
+	if ((data != out) && (data != block.pixelPtr)) {
+	    toFree = data;
+	}
+	n = LoopEnd(v4l2c, how, index, out, outLen, data, length);
 	if (toFree != NULL) {
 	    ckfree(toFree);
 	}
 	if (n == -1) {
+photoError:
 	    Tcl_SetObjResult(interp, Tcl_ObjPrintf("write error: %s",
 						   Tcl_PosixError(interp)));
 	    return TCL_ERROR;
@@ -3749,12 +15267,22 @@ doInit:
     memset(v4l2i, 0, sizeof (V4L2I));
     v4l2i->idCount = 0;
     Tcl_InitHashTable(&v4l2i->v4l2c, TCL_STRING_KEYS);
-#ifdef HAVE_LIBUDEV
-    /* setup udev */
     v4l2i->interp = interp;
     Tcl_InitHashTable(&v4l2i->vdevs, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&v4l2i->vcaps, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&v4l2i->probes, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&v4l2i->m2m, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&v4l2i->mosaics, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&v4l2i->y4m, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&v4l2i->vlz, TCL_STRING_KEYS);
     Tcl_DStringInit(&v4l2i->cbCmd);
     v4l2i->cbCmdLen = 0;
+#ifdef linux
+    v4l2i->inotifyFd = -1;
+    v4l2i->inotify = NULL;
+#endif
+#ifdef HAVE_LIBUDEV
+    /* setup udev */
     v4l2i->udev = (libudev == NULL) ? NULL : udev_new();
     if (v4l2i->udev != NULL) {
 	v4l2i->udevMon = udev_monitor_new_from_netlink(v4l2i->udev, "udev");
@@ -3809,6 +15337,15 @@ doInit:
 endUdevInit:
     ;
 #endif
+#ifdef linux
+#ifdef HAVE_LIBUDEV
+    if (v4l2i->udevMon == NULL)
+#endif
+    {
+	/* no udev, fall back to inotify */
+	InotifyInit(v4l2i);
+    }
+#endif
 
     Tcl_CreateObjCommand(interp, "v4l2", V4l2ObjCmd,
 			 (ClientData) v4l2i, V4l2ObjCmdDeleted);